@@ -31,6 +31,9 @@
 #include <stdint.h>
 #include <terark/stdtypes.hpp>
 #include <terark/num_to_str.hpp>
+#include <terark/db/db_segment.hpp>
+#include <terark/db/bg_scheduler.hpp>
+#include <terark/db/row_cache.hpp>
 
 //using namespace terark;
 using terark::string_appender;
@@ -97,7 +100,7 @@ static std::string escape(terark::fstring x) {
     , BOOST_CURRENT_FUNCTION, cmp \
     , m_posKey.size(), escape(m_posKey).c_str() \
     , m_key.size(), escape(m_key).c_str() \
-    , m_val.size(), escape(m_val).c_str() \
+    , m_val.size(), escape(m_val.data()).c_str() \
     )
 
 #else
@@ -282,6 +285,13 @@ DB::Open(const Options &options, const std::string &name, leveldb::DB** dbptr) {
 		fprintf(stderr, "ERROR: not exists: %s\n", metaPath.string().c_str());
 		return Status::InvalidArgument("dbmeta.json is missing", dbdir.string());
 	}
+	if (options.block_cache) {
+		// the row cache is process wide, the last opened db sets its size
+		auto cache = dynamic_cast<CacheImpl*>(options.block_cache);
+		if (cache) {
+			terark::db::RowCache::instance().setCapacity(cache->capacity_);
+		}
+	}
 	try {
 		*dbptr = new DbImpl(dbdir);
 		return Status::OK();
@@ -415,24 +425,84 @@ Status
 DbImpl::Get(const ReadOptions& options, const Slice& key, std::string* value) {
   terark::db::DbContext* ctx = GetDbContext();
   assert(NULL != ctx);
-  ctx->indexSearchExact(0, key, &ctx->exactMatchRecIdvec);
+  // reuse ctx->userBuf as the decoding buffer, the pinned value is
+  // copied to *value only once
+  terark::db::PinnedValue pinned;
+  pinned.m_buf.swap(ctx->userBuf);
+  Status s = GetPinned(options, key, &pinned);
+  if (s.ok()) {
+	  value->assign(pinned.data().data(), pinned.size());
+  }
+  pinned.m_buf.swap(ctx->userBuf);
+  return s;
+}
+
+Status
+DbImpl::GetPinned(const ReadOptions& options, const Slice& key,
+				  terark::db::PinnedValue* value) {
+  terark::db::DbContext* ctx = GetDbContext();
+  assert(NULL != ctx);
+  terark::db::TableSnapshot* snap = NULL;
+  if (options.snapshot) {
+	  snap = static_cast<const SnapshotImpl*>(options.snapshot)->GetTableSnapshot();
+	  snap->indexSearchExact(0, key, &ctx->exactMatchRecIdvec, ctx);
+  }
+  else {
+	  ctx->indexSearchExact(0, key, &ctx->exactMatchRecIdvec);
+  }
   if (!ctx->exactMatchRecIdvec.empty()) {
 	  auto recId = ctx->exactMatchRecIdvec[0];
 	  try {
-		  ctx->selectOneColgroup(recId, 1, &ctx->userBuf);
-	//	  fprintf(stderr
-	//		, "DEBUG: recId=%lld, colgroup[1]={size=%zd, content=%.*s}\n"
-	//		, recId, ctx->userBuf.size(), (int)ctx->userBuf.size(), ctx->userBuf.data());
-		  value->resize(0);
-		  value->append((char*)ctx->userBuf.data(), ctx->userBuf.size());
+		  if (snap)
+			  snap->selectOneColgroupPinned(recId, 1, value, ctx);
+		  else
+			  m_tab->selectOneColgroupPinned(recId, 1, value, ctx);
 		  return Status::OK();
 	  }
 	  catch (const std::exception&) {
 	  }
   }
+  value->reset();
   return Status::NotFound(key);
 }
 
+std::vector<Status>
+DbImpl::MultiGet(const ReadOptions& options, const std::vector<Slice>& keys,
+				 std::vector<std::string>* values) {
+  std::vector<Status> ret(keys.size());
+  values->resize(keys.size());
+  if (options.snapshot) {
+	  // TableSnapshot has no batched search
+	  for (size_t i = 0; i < keys.size(); ++i) {
+		  ret[i] = Get(options, keys[i], &(*values)[i]);
+	  }
+	  return ret;
+  }
+  terark::db::DbContext* ctx = GetDbContext();
+  assert(NULL != ctx);
+  terark::valvec<terark::fstring> fkeys(keys.size(), terark::valvec_reserve());
+  for (size_t i = 0; i < keys.size(); ++i) {
+	  fkeys.push_back(terark::fstring(keys[i].data(), keys[i].size()));
+  }
+  terark::valvec<terark::valvec<long long> > recIdvecs;
+  ctx->indexSearchExactBatch(0, fkeys.data(), fkeys.size(), &recIdvecs);
+  for (size_t i = 0; i < keys.size(); ++i) {
+	  if (!recIdvecs[i].empty()) {
+		  try {
+			  m_tab->selectOneColgroup(recIdvecs[i][0], 1, &ctx->userBuf, ctx);
+			  (*values)[i].assign((const char*)ctx->userBuf.data(), ctx->userBuf.size());
+			  ret[i] = Status::OK();
+			  continue;
+		  }
+		  catch (const std::exception&) {
+		  }
+	  }
+	  (*values)[i].clear();
+	  ret[i] = Status::NotFound(keys[i]);
+  }
+  return ret;
+}
+
 #if HAVE_BASHOLEVELDB
 // If the database contains an entry for "key" store the
 // corresponding value in *value and return OK.
@@ -473,11 +543,15 @@ err:
 // The returned iterator should be deleted before this db is deleted.
 Iterator*
 DbImpl::NewIterator(const ReadOptions& options) {
+	if (options.snapshot) {
+		auto si = static_cast<const SnapshotImpl*>(options.snapshot);
+		return new IteratorImpl(m_tab.get(), si->GetTableSnapshot());
+	}
 	return new IteratorImpl(m_tab.get());
 }
 
 SnapshotImpl::SnapshotImpl(DbImpl *db) :
-    Snapshot(), db_(db), context_(db->NewContext()), status_(Status::OK())
+    Snapshot(), db_(db), m_snap(db->m_tab->createSnapshot()), status_(Status::OK())
 {
 }
 
@@ -486,8 +560,7 @@ SnapshotImpl::SnapshotImpl(DbImpl *db) :
 // state.  The caller must call ReleaseSnapshot(result) when the
 // snapshot is no longer needed.
 const Snapshot* DbImpl::GetSnapshot() {
-  THROW_STD(invalid_argument, "terark-db-leveldb-api doesn't support snapshot");
-  return NULL;
+  return new SnapshotImpl(this);
 }
 
 // Release a previously acquired snapshot.  The caller must not
@@ -495,16 +568,10 @@ const Snapshot* DbImpl::GetSnapshot() {
 void
 DbImpl::ReleaseSnapshot(const Snapshot* snapshot)
 {
-  THROW_STD(invalid_argument, "terark-db-leveldb-api doesn't support snapshot");
   SnapshotImpl *si =
     static_cast<SnapshotImpl*>(const_cast<Snapshot*>(snapshot));
-  if (si != NULL) {
-    // We started a transaction: we could commit it here, but it will be rolled
-    // back automatically by closing the session, which we have to do anyway.
-    int ret = si->GetContext()->Close();
-    TERARK_RT_assert(ret == 0, std::logic_error);
-    delete si;
-  }
+  // iterators created with this snapshot hold their own reference
+  delete si;
 }
 
 // DB implementations can export properties about their state
@@ -521,10 +588,112 @@ DbImpl::ReleaseSnapshot(const Snapshot* snapshot)
 //     about the internal operation of the DB.
 //  "leveldb.sstables" - returns a multi-line string that describes all
 //     of the sstables that make up the db contents.
+//  "leveldb.terark-stats" - returns json of read counters and latency,
+//     merge policy and background tasks.
+//
+// Segments are mapped to levels: writable segments are level 0,
+// readonly(compressed) segments are level 1.
 bool
 DbImpl::GetProperty(const Slice& property, std::string* value)
 {
-  /* Not supported */
+  using namespace terark::db;
+  Slice in = property;
+  Slice prefix("leveldb.");
+  if (!in.starts_with(prefix)) return false;
+  in.remove_prefix(prefix.size());
+
+  SegArrayVersionPtr ver = m_tab->getSegArrayVersion();
+  const terark::valvec<ReadableSegmentPtr>& segs = ver->m_segments;
+  if (in.starts_with("num-files-at-level")) {
+    in.remove_prefix(strlen("num-files-at-level"));
+    std::string strLevel(in.data(), in.size());
+    char* endp = NULL;
+    long level = strtol(strLevel.c_str(), &endp, 10);
+    if (strLevel.empty() || *endp || level < 0) {
+      return false;
+    }
+    size_t num = 0;
+    for (size_t i = 0; i < segs.size(); ++i) {
+      bool isReadonly = segs[i]->getReadonlySegment() != NULL;
+      num += (isReadonly ? 1 : 0) == level;
+    }
+    value->assign(std::to_string(num));
+    return true;
+  }
+  else if (in == "stats") {
+    string_appender<> buf;
+    long long sumRows = 0, sumDel = 0, sumStore = 0, sumInflate = 0;
+    buf << "                         Segments\n";
+    buf << "Idx Level       Rows    Deleted DelRatio  Storage(MB)  Inflate(MB)\n";
+    buf << "------------------------------------------------------------------\n";
+    for (size_t i = 0; i < segs.size(); ++i) {
+      const ReadableSegment* seg = segs[i].get();
+      long long rows = seg->m_isDel.size();
+      long long dels = seg->m_delcnt; // no lock, may be a bit stale
+      long long store = seg->totalStorageSize();
+      long long inflate = seg->dataInflateSize();
+      char line[160];
+      snprintf(line, sizeof(line), "%3zd %5d %10lld %10lld %8.4f %12.3f %12.3f\n"
+        , i, seg->getReadonlySegment() ? 1 : 0, rows, dels
+        , rows ? double(dels) / rows : 0.0, store / 1048576.0, inflate / 1048576.0);
+      buf << line;
+      sumRows += rows;
+      sumDel += dels;
+      sumStore += store;
+      sumInflate += inflate;
+    }
+    char line[160];
+    snprintf(line, sizeof(line), "Sum %5s %10lld %10lld %8.4f %12.3f %12.3f\n"
+      , "", sumRows, sumDel, sumRows ? double(sumDel) / sumRows : 0.0
+      , sumStore / 1048576.0, sumInflate / 1048576.0);
+    buf << line;
+    BgScheduler::Stats bg = BgScheduler::instance().getStats();
+    static const char* priNames[] = { "flush", "compress", "merge" };
+    buf << "\n                         Background\n";
+    buf << "Task        Queued  Running   Finished     Failed\n";
+    buf << "--------------------------------------------------\n";
+    for (size_t i = 0; i < BgTask::PriorityNum; ++i) {
+      const BgScheduler::PriorityStats& ps = bg.pri[i];
+      snprintf(line, sizeof(line), "%-10s %7zd %8zd %10lld %10lld\n"
+        , priNames[i], ps.queued, ps.running, ps.finished, ps.failed);
+      buf << line;
+    }
+    RowCache::Stats rc = RowCache::instance().getStats();
+    unsigned long long lookups = rc.hits + rc.misses;
+    buf << "\n                         Row Cache\n";
+    buf << "Capacity(MB)  Used(MB)    Entries       Hits     Misses HitRatio\n";
+    buf << "----------------------------------------------------------------\n";
+    snprintf(line, sizeof(line), "%12.3f %9.3f %10zd %10lld %10lld %8.4f\n"
+      , rc.capacity / 1048576.0, rc.usedBytes / 1048576.0, rc.entries
+      , rc.hits, rc.misses, lookups ? double(rc.hits) / lookups : 0.0);
+    buf << line;
+    value->assign(buf.data(), buf.size());
+    return true;
+  }
+  else if (in == "terark-stats") {
+    string_appender<> buf;
+    buf << "{\"reads\":" << m_tab->getStatsJson()
+        << ",\"merge\":" << m_tab->getMergeStatsJson()
+        << ",\"background\":" << BgScheduler::instance().getStatsJson()
+        << "}";
+    value->assign(buf.data(), buf.size());
+    return true;
+  }
+  else if (in == "sstables") {
+    string_appender<> buf;
+    for (size_t i = 0; i < segs.size(); ++i) {
+      const ReadableSegment* seg = segs[i].get();
+      char line[64];
+      snprintf(line, sizeof(line), "--- level %d ---\n %zd: "
+        , seg->getReadonlySegment() ? 1 : 0, i);
+      buf << line << seg->m_segDir.string();
+      snprintf(line, sizeof(line), " rows=%zd size=%lld\n"
+        , seg->m_isDel.size(), seg->totalStorageSize());
+      buf << line;
+    }
+    value->assign(buf.data(), buf.size());
+    return true;
+  }
   return false;
 }
 
@@ -539,11 +708,16 @@ DbImpl::GetProperty(const Slice& property, std::string* value)
 void
 DbImpl::GetApproximateSizes(const Range* range, int n, uint64_t* sizes)
 {
-  int i;
-
-  /* XXX Not supported */
-  for (i = 0; i < n; i++)
-    sizes[i] = 1;
+  terark::db::DbContext* ctx = GetDbContext();
+  for (int i = 0; i < n; i++) {
+    terark::fstring beg(range[i].start.data(), range[i].start.size());
+    terark::fstring end(range[i].limit.data(), range[i].limit.size());
+    if (!end.empty() && !(beg < end)) {
+      sizes[i] = 0;
+      continue;
+    }
+    sizes[i] = uint64_t(m_tab->indexApproximateSize(0, beg, end, ctx));
+  }
 }
 
 // Compact the underlying storage for the key range [*begin,*end].
@@ -582,17 +756,10 @@ OperationContext* DbImpl::GetContext() {
 	return new OperationContext(m_tab.get(), GetDbContext());
 }
 
-OperationContext* DbImpl::GetContext(const ReadOptions &options) {
-  if (options.snapshot == NULL) {
-    return GetContext();
-  }
-  THROW_STD(invalid_argument,
-    "terark-db-leveldb-api doesn't support snapshot, "
-    "ReadOptions.snapshot should alsway be NULL"
-    );
-  auto si = static_cast<const SnapshotImpl*>(options.snapshot);
-  assert(si->GetStatus().ok());
-  return si->GetContext();
+// OperationContext is for writing, reads with options.snapshot are
+// served by SnapshotImpl::GetTableSnapshot()
+OperationContext* DbImpl::GetContext(const ReadOptions &) {
+  return GetContext();
 }
 
 terark::db::DbContext* DbImpl::GetDbContext() {
@@ -621,9 +788,11 @@ terark::db::DbContext* DbImpl::GetDbContext() {
 std::atomic<size_t> g_iterLiveCnt;
 std::atomic<size_t> g_iterCreatedCnt;
 
-IteratorImpl::IteratorImpl(terark::db::CompositeTable *db) {
+IteratorImpl::IteratorImpl(terark::db::CompositeTable *db,
+                           const terark::db::TableSnapshot *snap) {
 	m_tab = db;
 	m_ctx = db->createDbContext();
+	m_snap = const_cast<terark::db::TableSnapshot*>(snap);
 	m_recId = -1;
 	m_valid = false;
 	m_direction = Direction::forward;
@@ -642,11 +811,27 @@ IteratorImpl::~IteratorImpl() {
 	g_iterLiveCnt--;
 }
 
+terark::db::IndexIteratorPtr IteratorImpl::newIndexIter(bool forward) const {
+	if (m_snap) {
+		return forward ? m_snap->createIndexIterForward(0)
+					   : m_snap->createIndexIterBackward(0);
+	}
+	return forward ? m_tab->createIndexIterForward(0)
+				   : m_tab->createIndexIterBackward(0);
+}
+
+void IteratorImpl::selectValue() {
+	if (m_snap)
+		m_snap->selectOneColgroupPinned(m_recId, 1, &m_val, m_ctx.get());
+	else
+		m_tab->selectOneColgroupPinned(m_recId, 1, &m_val, m_ctx.get());
+}
+
 void IteratorImpl::iterIncrement() {
 	m_valid = m_iter->increment(&m_recId, &m_key);
 	while (m_valid) {
 		try {
-			m_tab->selectOneColgroup(m_recId, 1, &m_val, m_ctx.get());
+			selectValue();
 			break;
 		}
 		catch (const std::exception& ex) {
@@ -666,11 +851,11 @@ IteratorImpl::SeekToFirst() {
 		m_direction = Direction::forward;
 	}
 	if (!m_iter) {
-		m_iter = m_tab->createIndexIterForward(0);
+		m_iter = newIndexIter(true);
 	}
 	m_iter->reset();
 	iterIncrement();
-	TRACE_KEY_VAL(m_key, m_val);
+	TRACE_KEY_VAL(m_key, m_val.data());
 }
 
 // Position at the last key in the source.  The iterator is
@@ -682,11 +867,11 @@ IteratorImpl::SeekToLast() {
 		m_direction = Direction::backward;
 	}
 	if (!m_iter) {
-		m_iter = m_tab->createIndexIterBackward(0);
+		m_iter = newIndexIter(false);
 	}
 	m_iter->reset();
 	iterIncrement();
-	TRACE_KEY_VAL(m_key, m_val);
+	TRACE_KEY_VAL(m_key, m_val.data());
 }
 
 // Position at the first key in the source that at or past target
@@ -696,13 +881,13 @@ void
 IteratorImpl::Seek(const Slice& target) {
 	if (Direction::backward == m_direction) {
 		if (!m_iter) {
-			m_iter = m_tab->createIndexIterBackward(0);
+			m_iter = newIndexIter(false);
 		}
 	//	fprintf(stderr, "DEBUG: %s: direction=backward\n", BOOST_CURRENT_FUNCTION);
 	}
 	else {
 		if (!m_iter) {
-			m_iter = m_tab->createIndexIterForward(0);
+			m_iter = newIndexIter(true);
 		}
 	//	fprintf(stderr, "DEBUG: %s: direction=forward\n", BOOST_CURRENT_FUNCTION);
 	}
@@ -711,10 +896,10 @@ IteratorImpl::Seek(const Slice& target) {
 		m_valid = false;
 	}
 	else {
-		m_tab->selectOneColgroup(m_recId, 1, &m_val, m_ctx.get());
+		selectValue();
 		m_valid = true;
 	}
-	TRACE_KEY_VAL(m_key, m_val);
+	TRACE_KEY_VAL(m_key, m_val.data());
 }
 
 // Moves to the next entry in the source.  After this call, Valid() is
@@ -726,10 +911,10 @@ IteratorImpl::Next() {
 	assert(m_iter != nullptr);
 	if (Direction::forward == m_direction) {
 		iterIncrement();
-		TRACE_KEY_VAL(m_key, m_val);
+		TRACE_KEY_VAL(m_key, m_val.data());
 	}
 	else {
-		m_iter = m_tab->createIndexIterForward(0);
+		m_iter = newIndexIter(true);
 		m_direction = Direction::forward;
 		m_posKey.swap(m_key);
 		int cmp = m_iter->seekLowerBound(m_posKey, &m_recId, &m_key);
@@ -739,12 +924,12 @@ IteratorImpl::Next() {
 		}
 		else if (0 == cmp) {
 			iterIncrement();
-			TRACE_KEY_VAL(m_key, m_val);
+			TRACE_KEY_VAL(m_key, m_val.data());
 		}
 		else try {
-			m_tab->selectOneColgroup(m_recId, 1, &m_val, m_ctx.get());
+			selectValue();
 			m_valid = true;
-			TRACE_KEY_VAL(m_key, m_val);
+			TRACE_KEY_VAL(m_key, m_val.data());
 		}
 		catch (const std::exception& ex) {
 			fprintf(stderr, "ERROR: %s: what=%s\n", BOOST_CURRENT_FUNCTION, ex.what());
@@ -762,10 +947,10 @@ IteratorImpl::Prev() {
 	assert(m_iter != nullptr);
 	if (Direction::backward == m_direction) {
 		iterIncrement();
-		TRACE_KEY_VAL(m_key, m_val);
+		TRACE_KEY_VAL(m_key, m_val.data());
 	}
 	else {
-		m_iter = m_tab->createIndexIterBackward(0);
+		m_iter = newIndexIter(false);
 		m_direction = Direction::backward;
 		m_posKey.swap(m_key);
 		int cmp = m_iter->seekLowerBound(m_posKey, &m_recId, &m_key);
@@ -775,12 +960,12 @@ IteratorImpl::Prev() {
 		}
 		else if (0 == cmp) {
 			iterIncrement();
-			TRACE_KEY_VAL(m_key, m_val);
+			TRACE_KEY_VAL(m_key, m_val.data());
 		}
 		else try {
-			m_tab->selectOneColgroup(m_recId, 1, &m_val, m_ctx.get());
+			selectValue();
 			m_valid = true;
-			TRACE_KEY_VAL(m_key, m_val);
+			TRACE_KEY_VAL(m_key, m_val.data());
 		}
 		catch (const std::exception& ex) {
 			fprintf(stderr, "ERROR: %s: what=%s\n", BOOST_CURRENT_FUNCTION, ex.what());
@@ -143,6 +143,8 @@ private:
 #endif
 };
 
+// Entries are not cached here, DB::Open applies capacity_ to the process
+// wide terark::db::RowCache, which caches decompressed rows.
 class CacheImpl : public Cache {
 public:
   CacheImpl(size_t capacity) : Cache(), capacity_(capacity) {}
@@ -179,7 +181,8 @@ class ColumnFamilyHandleImpl : public ColumnFamilyHandle {
 
 class IteratorImpl : public Iterator {
 public:
-  IteratorImpl(terark::db::CompositeTable *db);
+  IteratorImpl(terark::db::CompositeTable *db,
+               const terark::db::TableSnapshot *snap = NULL);
   virtual ~IteratorImpl();
 
   // An iterator is either positioned at a key/value pair, or
@@ -200,8 +203,10 @@ public:
     return Slice((char*)m_key.data(), m_key.size());
   }
 
+  // value is pinned in the mmap of readonly segment if possible,
+  // it is valid until the iterator is moved or deleted
   virtual Slice value() const {
-	    return Slice((char*)m_val.data(), m_val.size());
+	    return Slice(m_val.data().data(), m_val.size());
   }
 
   virtual Status status() const {
@@ -210,12 +215,16 @@ public:
 
 private:
   void iterIncrement();
+  terark::db::IndexIteratorPtr newIndexIter(bool forward) const;
+  void selectValue();
   terark::db::CompositeTable*  m_tab;
   terark::db::DbContextPtr     m_ctx;
+  terark::db::TableSnapshotPtr m_snap; // NULL: read the newest data
   terark::db::IndexIteratorPtr m_iter;
   long long m_recId;
   terark::valvec<unsigned char> m_posKey;
-  terark::valvec<unsigned char> m_key, m_val;
+  terark::valvec<unsigned char> m_key;
+  terark::db::PinnedValue m_val;
   Status m_status;
   bool m_valid;
 //bool m_isPositioned;
@@ -236,14 +245,13 @@ friend class DbImpl;
 friend class IteratorImpl;
 public:
   SnapshotImpl(DbImpl *db);
-  virtual ~SnapshotImpl() { delete context_; }
+  virtual ~SnapshotImpl() {}
 protected:
-  OperationContext *GetContext() const { return context_; }
+  terark::db::TableSnapshot* GetTableSnapshot() const { return m_snap.get(); }
   Status GetStatus() const { return status_; }
-  Status SetupTransaction();
 private:
   DbImpl *db_;
-  OperationContext *context_;
+  terark::db::TableSnapshotPtr m_snap;
   Status status_;
 };
 
@@ -258,6 +266,20 @@ public:
   Status Write(const WriteOptions& options, WriteBatch* updates) override;
   Status Get(const ReadOptions& options, const Slice& key, std::string* value) override;
 
+  // Same as Get, but like rocksdb's PinnableSlice, value->data() points into
+  // the mmap of a readonly segment when the value is stored uncompressed,
+  // else it is decoded into value->m_buf. value->data() is valid until value
+  // is reset, reused or destroyed, the db must outlive value.
+  Status GetPinned(const ReadOptions& options, const Slice& key,
+                   terark::db::PinnedValue* value);
+
+  // Batched Get, like rocksdb's MultiGet, (*values)[i] is the value of
+  // keys[i] if the i'th returned status is ok(). Keys are sorted and probed
+  // segment by segment by CompositeTable::indexSearchExactBatch.
+  std::vector<Status> MultiGet(const ReadOptions& options,
+                               const std::vector<Slice>& keys,
+                               std::vector<std::string>* values);
+
 #if HAVE_BASHOLEVELDB
   virtual Status Get(const ReadOptions& options, const Slice& key, Value* value);
 #endif
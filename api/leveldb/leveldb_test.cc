@@ -26,11 +26,200 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <iostream>
 #include "leveldb_terark.h"
 
 using namespace std;
 
+static void testMultiGet(leveldb::DB* db) {
+  cout << "MultiGet tests" << endl;
+  DbImpl* dbImpl = static_cast<DbImpl*>(db);
+  std::vector<leveldb::Slice> keys;
+  keys.push_back("key3");
+  keys.push_back("nokey");
+  keys.push_back("key");
+  keys.push_back("key3"); // duplicate keys return duplicate values
+  std::vector<std::string> values;
+  std::vector<leveldb::Status> st =
+      dbImpl->MultiGet(leveldb::ReadOptions(), keys, &values);
+  assert(st.size() == keys.size());
+  assert(values.size() == keys.size());
+  assert(st[0].ok() && values[0] == "value3");
+  assert(st[1].IsNotFound());
+  assert(st[2].ok() && values[2] == "value");
+  assert(st[3].ok() && values[3] == "value3");
+  for (size_t i = 0; i < keys.size(); ++i) {
+    std::string value;
+    leveldb::Status s = db->Get(leveldb::ReadOptions(), keys[i], &value);
+    assert(s.ok() == st[i].ok());
+    assert(!s.ok() || value == values[i]);
+  }
+}
+
+static void testProperties(leveldb::DB* db) {
+  cout << "GetProperty/GetApproximateSizes tests" << endl;
+  DbImpl* dbImpl = static_cast<DbImpl*>(db);
+  std::string value;
+  assert(db->GetProperty("leveldb.stats", &value));
+  assert(value.find("Segments") != std::string::npos);
+  assert(value.find("Background") != std::string::npos);
+  assert(db->GetProperty("leveldb.sstables", &value));
+  assert(!value.empty());
+  assert(db->GetProperty("leveldb.terark-stats", &value));
+  assert(value.size() >= 2 && value[0] == '{' && value[value.size()-1] == '}');
+  size_t segNum = dbImpl->m_tab->getSegNum();
+  size_t levelSum = 0;
+  for (int level = 0; level < 2; ++level) {
+    char name[64];
+    snprintf(name, sizeof(name), "leveldb.num-files-at-level%d", level);
+    assert(db->GetProperty(name, &value));
+    levelSum += strtoul(value.c_str(), NULL, 10);
+  }
+  assert(levelSum == segNum);
+  assert(!db->GetProperty("leveldb.num-files-at-level", &value));
+  assert(!db->GetProperty("leveldb.num-files-at-levelx", &value));
+  assert(!db->GetProperty("leveldb.no-such-property", &value));
+  assert(!db->GetProperty("stats", &value));
+
+  leveldb::Range ranges[3];
+  ranges[0] = leveldb::Range("key", "key4");
+  ranges[1] = leveldb::Range("key4", "key"); // reversed range is empty
+  ranges[2] = leveldb::Range("zzz0", "zzz9"); // no key in range
+  uint64_t sizes[3];
+  db->GetApproximateSizes(ranges, 3, sizes);
+  assert(sizes[1] == 0);
+  assert(sizes[2] <= sizes[0]);
+}
+
+// pinned value must be same as the copied value, and stay valid until it is
+// reset, even if the key is overwritten
+static void testGetPinned(leveldb::DB* db) {
+  cout << "GetPinned tests" << endl;
+  DbImpl* dbImpl = static_cast<DbImpl*>(db);
+  leveldb::Status s;
+  std::string value;
+  terark::db::PinnedValue pinned;
+  s = dbImpl->GetPinned(leveldb::ReadOptions(), "key2", &pinned);
+  assert(s.ok());
+  s = db->Get(leveldb::ReadOptions(), "key2", &value);
+  assert(s.ok());
+  assert(std::string(pinned.data().data(), pinned.size()) == value);
+  assert(value == "value2");
+  s = db->Put(leveldb::WriteOptions(), "key2", "value2-new");
+  assert(s.ok());
+  assert(std::string(pinned.data().data(), pinned.size()) == "value2");
+  s = dbImpl->GetPinned(leveldb::ReadOptions(), "key2", &pinned);
+  assert(s.ok());
+  assert(std::string(pinned.data().data(), pinned.size()) == "value2-new");
+  s = dbImpl->GetPinned(leveldb::ReadOptions(), "nokey", &pinned);
+  assert(s.IsNotFound());
+  assert(pinned.size() == 0);
+  s = db->Put(leveldb::WriteOptions(), "key2", "value2");
+  assert(s.ok());
+}
+
+static std::string scanAll(leveldb::DB* db, const leveldb::Snapshot* snap,
+                           bool forward) {
+  leveldb::ReadOptions read_options;
+  read_options.snapshot = snap;
+  leveldb::Iterator* iter = db->NewIterator(read_options);
+  std::string res;
+  if (forward) {
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next())
+      res += iter->key().ToString() + "=" + iter->value().ToString() + ";";
+  } else {
+    for (iter->SeekToLast(); iter->Valid(); iter->Prev())
+      res += iter->key().ToString() + "=" + iter->value().ToString() + ";";
+  }
+  delete iter;
+  return res;
+}
+
+// writes after GetSnapshot, include overwrite, delete and re-insert of the
+// same key, must be invisible to the snapshot, and creating snapshots must
+// not create new segments
+static void testSnapshot(leveldb::DB* db) {
+  cout << "Snapshot tests" << endl;
+  DbImpl* dbImpl = static_cast<DbImpl*>(db);
+  leveldb::WriteOptions wopt;
+  leveldb::Status s;
+  s = db->Put(wopt, "snap1", "a1");
+  s = db->Put(wopt, "snap2", "a2");
+  s = db->Put(wopt, "snap3", "a3");
+  assert(s.ok());
+  const std::string before = scanAll(db, NULL, true);
+  const std::string beforeBack = scanAll(db, NULL, false);
+  size_t segNum = dbImpl->m_tab->getSegNum();
+  const leveldb::Snapshot* snap = db->GetSnapshot();
+  for (int i = 0; i < 100; ++i) {
+    db->ReleaseSnapshot(db->GetSnapshot());
+  }
+  assert(dbImpl->m_tab->getSegNum() == segNum);
+
+  s = db->Put(wopt, "snap1", "b1"); // overwrite
+  assert(s.ok());
+  s = db->Delete(wopt, "snap2");
+  assert(s.ok());
+  s = db->Delete(wopt, "snap3");
+  s = db->Put(wopt, "snap3", "b3"); // re-insert deleted key
+  assert(s.ok());
+  s = db->Put(wopt, "snap4", "b4"); // new key
+  leveldb::WriteBatch batch;
+  batch.Put("snap1", "c1");
+  batch.Delete("snap3");
+  batch.Put("snap5", "c5");
+  s = db->Write(wopt, &batch);
+  assert(s.ok());
+
+  leveldb::ReadOptions ropt;
+  ropt.snapshot = snap;
+  std::string value;
+  s = db->Get(ropt, "snap1", &value);
+  assert(s.ok() && value == "a1");
+  s = db->Get(ropt, "snap2", &value);
+  assert(s.ok() && value == "a2");
+  s = db->Get(ropt, "snap3", &value);
+  assert(s.ok() && value == "a3");
+  s = db->Get(ropt, "snap4", &value);
+  assert(s.IsNotFound());
+  s = db->Get(ropt, "snap5", &value);
+  assert(s.IsNotFound());
+  assert(scanAll(db, snap, true) == before);
+  assert(scanAll(db, snap, false) == beforeBack);
+
+  leveldb::Iterator* iter = db->NewIterator(ropt);
+  iter->Seek("snap2");
+  assert(iter->Valid() && iter->key().ToString() == "snap2");
+  assert(iter->value().ToString() == "a2");
+  iter->Next();
+  assert(iter->Valid() && iter->key().ToString() == "snap3");
+  iter->Seek("snap4");
+  assert(!iter->Valid());
+  delete iter;
+
+  s = db->Get(leveldb::ReadOptions(), "snap1", &value);
+  assert(s.ok() && value == "c1");
+  s = db->Get(leveldb::ReadOptions(), "snap2", &value);
+  assert(s.IsNotFound());
+  s = db->Get(leveldb::ReadOptions(), "snap3", &value);
+  assert(s.IsNotFound());
+  s = db->Get(leveldb::ReadOptions(), "snap5", &value);
+  assert(s.ok() && value == "c5");
+  assert(dbImpl->m_tab->getSegNum() == segNum);
+
+  db->ReleaseSnapshot(snap);
+  s = db->Put(wopt, "snap2", "d2");
+  s = db->Get(leveldb::ReadOptions(), "snap2", &value);
+  assert(s.ok() && value == "d2");
+  db->Delete(wopt, "snap1");
+  db->Delete(wopt, "snap2");
+  db->Delete(wopt, "snap4");
+  db->Delete(wopt, "snap5");
+  assert(scanAll(db, NULL, true).find("snap") == std::string::npos);
+}
+
 extern "C" int main() {
   leveldb::DB* db;
   leveldb::Options options;
@@ -44,6 +233,11 @@ extern "C" int main() {
   s = db->Put(leveldb::WriteOptions(), "key4", "value4");
   assert(s.ok());
 
+  testMultiGet(db);
+  testProperties(db);
+  testGetPinned(db);
+  testSnapshot(db);
+
 #ifdef	HAVE_HYPERLEVELDB
   leveldb::ReplayIterator* replay_start;
   leveldb::ReplayIterator* replay_ts;
@@ -54,6 +54,13 @@ Status TerarkDbGlobalOptions::add(moe::OptionSection* options) {
                                         moe::Int,
                                         "maximum amount of memory to allocate for cache; "
                                         "defaults to 1/2 of physical RAM").validRange(1, 10000);
+    terarkDbOptions.addOptionChaining("storage.terarkDb.engineConfig.rowCacheSizeMB",
+                                        "terarkDbRowCacheSizeMB",
+                                        moe::Int,
+                                        "maximum amount of memory for decompressed rows of "
+                                        "readonly segments; 0 means env TerarkDB_RowCacheSize")
+        .validRange(0, 10000000)
+        .setDefault(moe::Value(0));
     terarkDbOptions.addOptionChaining(
                           "storage.terarkDb.engineConfig.statisticsLogDelaySecs",
                           "terarkDbStatisticsLogDelaySecs",
@@ -114,6 +121,10 @@ Status TerarkDbGlobalOptions::store(const moe::Environment& params,
         terarkDbGlobalOptions.cacheSizeGB =
             params["storage.terarkDb.engineConfig.cacheSizeGB"].as<int>();
     }
+    if (params.count("storage.terarkDb.engineConfig.rowCacheSizeMB")) {
+        terarkDbGlobalOptions.rowCacheSizeMB =
+            params["storage.terarkDb.engineConfig.rowCacheSizeMB"].as<int>();
+    }
     if (params.count("storage.syncPeriodSecs")) {
         terarkDbGlobalOptions.checkpointDelaySecs =
             static_cast<size_t>(params["storage.syncPeriodSecs"].as<double>());
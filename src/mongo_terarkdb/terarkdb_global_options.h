@@ -41,6 +41,7 @@ class TerarkDbGlobalOptions {
 public:
     TerarkDbGlobalOptions()
         : cacheSizeGB(0),
+          rowCacheSizeMB(0),
           checkpointDelaySecs(0),
           statisticsLogDelaySecs(0),
           directoryForIndexes(false),
@@ -51,6 +52,7 @@ public:
     Status store(const moe::Environment& params, const std::vector<std::string>& args);
 
     size_t cacheSizeGB;
+    size_t rowCacheSizeMB;
     size_t checkpointDelaySecs;
     size_t statisticsLogDelaySecs;
     std::string journalCompressor;
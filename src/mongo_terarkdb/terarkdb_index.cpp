@@ -53,6 +53,7 @@
 #include "mongo/util/fail_point.h"
 #include "mongo/util/log.h"
 #include "mongo/util/mongoutils/str.h"
+#include <terark/util/fstrvec.hpp>
 
 #define TRACING_ENABLED TERARK_IF_DEBUG(1, 0)
 
@@ -522,6 +523,10 @@ protected:
  * duplicate ids and insert them all together. This is necessary since bulk cursors can only
  * append data.
  */
+// MongoDB passes keys in sorted order, so dup keys of a unique index are
+// adjacent. Keys are inserted in batches, one table lock per batch, keys
+// of rows in readonly segments are skipped by indexInsertBatch, because
+// readonly segments have built all indices when they were created.
 class TerarkDbIndex::BulkBuilder : public SortedDataBuilderInterface {
 public:
     BulkBuilder(TerarkDbIndex* idx, OperationContext* txn, bool dupsAllowed)
@@ -537,15 +542,23 @@ public:
             if (!s.isOK())
                 return s;
         }
-		if (_idx->insertIndexKey(newKey, id, &m_td)) {
-	        return Status::OK();
-		} else {
-			return Status(ErrorCodes::DuplicateKey,
-				"Dup key in TerarkDbIndex::BulkBuilder");
+		encodeIndexKey(*_idx->getIndexSchema(), newKey, &m_td.m_buf);
+		if (!_dupsAllowed && m_recNum &&
+				terark::fstring(m_td.m_buf) == terark::fstring(m_prevKey)) {
+			return _idx->dupKeyError(newKey);
+		}
+		m_prevKey.assign(m_td.m_buf);
+		m_keys.push_back(terark::fstring(m_td.m_buf));
+		m_recIds.push_back(id.repr() - 1);
+		m_recNum++;
+		if (m_recIds.size() >= BatchSize) {
+			return flush();
 		}
+		return Status::OK();
     }
 
     void commit(bool mayInterrupt) override {
+		uassertStatusOK(flush());
         // TODO do we still need this?
         // this is bizarre, but required as part of the contract
         WriteUnitOfWork uow(_txn);
@@ -553,10 +566,37 @@ public:
     }
 
 private:
+	static const size_t BatchSize = 4096;
+
+	Status flush() {
+		if (m_recIds.empty()) {
+			return Status::OK();
+		}
+		m_keyRefs.resize_no_init(m_keys.size());
+		for (size_t i = 0; i < m_keys.size(); ++i) {
+			m_keyRefs[i] = m_keys[i];
+		}
+		CompositeTable* tab = _idx->m_table->m_tab.get();
+		size_t failed = tab->indexInsertBatch(_idx->m_indexId,
+			m_keyRefs.data(), m_recIds.data(), m_recIds.size(), &*m_td.m_dbCtx);
+		m_keys.erase_all();
+		m_recIds.erase_all();
+		if (failed) {
+			return Status(ErrorCodes::DuplicateKey,
+				"Dup key in TerarkDbIndex::BulkBuilder");
+		}
+		return Status::OK();
+	}
+
     TerarkDbIndex*      const _idx;
     OperationContext* const _txn;
 	TableThreadData  m_td;
     const bool _dupsAllowed;
+	long long m_recNum = 0;
+	terark::valvec<unsigned char> m_prevKey;
+	terark::fstrvec m_keys;
+	terark::valvec<terark::fstring> m_keyRefs;
+	terark::valvec<long long> m_recIds;
 };
 
 TerarkDbIndexUnique::TerarkDbIndexUnique(ThreadSafeTable* tab,
@@ -38,106 +38,122 @@
 #include "mongo/db/operation_context_noop.h"
 #include "mongo/db/storage/sorted_data_interface_test_harness.h"
 #include "terarkdb_index.h"
-#include "terarkdb_record_store.h"
 #include "terarkdb_recovery_unit.h"
-#include "terarkdb_session_cache.h"
 #include "mongo/stdx/memory.h"
 #include "mongo/unittest/temp_dir.h"
 #include "mongo/unittest/unittest.h"
+#include <terark/io/FileStream.hpp>
 
 namespace mongo { namespace terarkdb {
 
 using std::string;
 
+// terark tables are defined by dbmeta.json, each SortedDataInterface gets
+// its own table which has just one index on field "a"
 class MyHarnessHelper final : public HarnessHelper {
 public:
-    MyHarnessHelper() : _dbpath("wt_test"), _conn(NULL) {
-        const char* config = "create,cache_size=1G,";
-        int ret = terarkdb_open(_dbpath.path().c_str(), NULL, config, &_conn);
-        invariantTerarkDbOK(ret);
-
-        _sessionCache = new TerarkDbSessionCache(_conn);
-    }
-
-    ~MyHarnessHelper() final {
-        delete _sessionCache;
-        _conn->close(_conn, NULL);
-    }
+    MyHarnessHelper() : _dbpath("terarkdb_index_test"), _tableNum(0) {}
 
     std::unique_ptr<SortedDataInterface> newSortedDataInterface(bool unique) final {
-        std::string ns = "test.wt";
+        std::string ns = "test.terarkdb";
         OperationContextNoop txn(newRecoveryUnit().release());
 
         BSONObj spec = BSON("key" << BSON("a" << 1) << "name"
                                   << "testIndex"
-                                  << "ns" << ns);
-
+                                  << "ns" << ns
+                                  << "unique" << unique);
         IndexDescriptor desc(NULL, "", spec);
 
-        StatusWith<std::string> result =
-            TerarkDbIndex::generateCreateString(kTerarkDbEngineName, "", "", desc);
-        ASSERT_OK(result.getStatus());
-
-        string uri = "table:" + ns;
-        invariantTerarkDbOK(TerarkDbIndex::Create(&txn, uri, result.getValue()));
+        fs::path tabDir = fs::path(_dbpath.path()) / ("tab" + std::to_string(_tableNum++));
+        fs::create_directories(tabDir);
+        std::string dbmeta =
+            "{\n"
+            "  \"RowSchema\": {\n"
+            "    \"columns\": {\n"
+            "      \"a\": { \"type\": \"sint32\", \"mongoType\": \"int\" }\n"
+            "    }\n"
+            "  },\n"
+            "  \"TableIndex\": [\n"
+            "    { \"fields\": \"a\", \"ordered\": true, \"unique\": "
+            + std::string(unique ? "true" : "false") + " }\n"
+            "  ]\n"
+            "}\n";
+        {
+            terark::FileStream fp((tabDir / "dbmeta.json").string().c_str(), "w");
+            fp.ensureWrite(dbmeta.data(), dbmeta.size());
+        }
+        _tables.push_back(new ThreadSafeTable(tabDir));
+        ThreadSafeTable* tab = _tables.back().get();
 
         if (unique)
-            return stdx::make_unique<TerarkDbIndexUnique>(&txn, uri, &desc);
-        return stdx::make_unique<TerarkDbIndexStandard>(&txn, uri, &desc);
+            return stdx::make_unique<TerarkDbIndexUnique>(tab, &txn, &desc);
+        return stdx::make_unique<TerarkDbIndexStandard>(tab, &txn, &desc);
     }
 
     std::unique_ptr<RecoveryUnit> newRecoveryUnit() final {
-        return stdx::make_unique<TerarkDbRecoveryUnit>(_sessionCache);
+        return stdx::make_unique<TerarkDbRecoveryUnit>();
     }
 
 private:
     unittest::TempDir _dbpath;
-    TerarkDb_CONNECTION* _conn;
-    TerarkDbSessionCache* _sessionCache;
+    size_t _tableNum;
+    std::vector<ThreadSafeTablePtr> _tables;
 };
 
 std::unique_ptr<HarnessHelper> newHarnessHelper() {
     return stdx::make_unique<MyHarnessHelper>();
 }
 
-TEST(TerarkDbIndexTest, GenerateCreateStringEmptyDocument) {
-    BSONObj spec = fromjson("{}");
-    StatusWith<std::string> result = TerarkDbIndex::parseIndexOptions(spec);
-    ASSERT_OK(result.getStatus());
-    ASSERT_EQ(result.getValue(), "");  // "," would also be valid.
-}
-
-TEST(TerarkDbIndexTest, GenerateCreateStringUnknownField) {
-    BSONObj spec = fromjson("{unknownField: 1}");
-    StatusWith<std::string> result = TerarkDbIndex::parseIndexOptions(spec);
-    const Status& status = result.getStatus();
-    ASSERT_NOT_OK(status);
-    ASSERT_EQUALS(ErrorCodes::InvalidOptions, status);
-}
-
-TEST(TerarkDbIndexTest, GenerateCreateStringNonStringConfig) {
-    BSONObj spec = fromjson("{configString: 12345}");
-    StatusWith<std::string> result = TerarkDbIndex::parseIndexOptions(spec);
-    const Status& status = result.getStatus();
-    ASSERT_NOT_OK(status);
-    ASSERT_EQUALS(ErrorCodes::TypeMismatch, status);
-}
-
-TEST(TerarkDbIndexTest, GenerateCreateStringEmptyConfigString) {
-    BSONObj spec = fromjson("{configString: ''}");
-    StatusWith<std::string> result = TerarkDbIndex::parseIndexOptions(spec);
-    ASSERT_OK(result.getStatus());
-    ASSERT_EQ(result.getValue(), ",");  // "" would also be valid.
-}
-
-TEST(TerarkDbIndexTest, GenerateCreateStringInvalidConfigStringOption) {
-    BSONObj spec = fromjson("{configString: 'abc=def'}");
-    ASSERT_EQ(TerarkDbIndex::parseIndexOptions(spec), ErrorCodes::BadValue);
+// BulkBuilder inserts keys in batches of 4096, keys of all batches must be
+// found, an adjacent duplicate of a unique index is rejected at once
+TEST(TerarkDbIndexTest, BulkBuilderBatchesUnique) {
+    const std::unique_ptr<HarnessHelper> harnessHelper(newHarnessHelper());
+    const std::unique_ptr<SortedDataInterface> sorted(
+        harnessHelper->newSortedDataInterface(true));
+    const int keyNum = 10000; // more than 2 batches
+    {
+        const std::unique_ptr<OperationContext> opCtx(harnessHelper->newOperationContext());
+        const std::unique_ptr<SortedDataBuilderInterface> builder(
+            sorted->getBulkBuilder(opCtx.get(), false));
+        for (int i = 0; i < keyNum; ++i) {
+            ASSERT_OK(builder->addKey(BSON("" << i), RecordId(1, i + 1)));
+        }
+        ASSERT_EQUALS(ErrorCodes::DuplicateKey,
+                      builder->addKey(BSON("" << keyNum - 1), RecordId(2, 1)));
+        builder->commit(false);
+    }
+    {
+        const std::unique_ptr<OperationContext> opCtx(harnessHelper->newOperationContext());
+        ASSERT_EQUALS(keyNum, sorted->numEntries(opCtx.get()));
+        auto cursor = sorted->newCursor(opCtx.get());
+        for (int i = 0; i < keyNum; i += 997) {
+            auto entry = cursor->seek(BSON("" << i), true);
+            ASSERT(entry);
+            ASSERT_EQ(entry->loc, RecordId(1, i + 1));
+        }
+    }
 }
 
-TEST(TerarkDbIndexTest, GenerateCreateStringValidConfigStringOption) {
-    BSONObj spec = fromjson("{configString: 'prefix_compression=true'}");
-    ASSERT_EQ(TerarkDbIndex::parseIndexOptions(spec), std::string("prefix_compression=true,"));
+TEST(TerarkDbIndexTest, BulkBuilderBatchesStandard) {
+    const std::unique_ptr<HarnessHelper> harnessHelper(newHarnessHelper());
+    const std::unique_ptr<SortedDataInterface> sorted(
+        harnessHelper->newSortedDataInterface(false));
+    const int keyNum = 5000;
+    {
+        const std::unique_ptr<OperationContext> opCtx(harnessHelper->newOperationContext());
+        const std::unique_ptr<SortedDataBuilderInterface> builder(
+            sorted->getBulkBuilder(opCtx.get(), true));
+        for (int i = 0; i < keyNum; ++i) {
+            // each key has 2 record ids
+            ASSERT_OK(builder->addKey(BSON("" << i), RecordId(1, 2*i + 1)));
+            ASSERT_OK(builder->addKey(BSON("" << i), RecordId(1, 2*i + 2)));
+        }
+        builder->commit(false);
+    }
+    {
+        const std::unique_ptr<OperationContext> opCtx(harnessHelper->newOperationContext());
+        ASSERT_EQUALS(2 * keyNum, sorted->numEntries(opCtx.get()));
+    }
 }
 
 } } // namespace mongo::terarkdb
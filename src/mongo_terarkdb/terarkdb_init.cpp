@@ -53,6 +53,7 @@
 #include "terarkdb_server_status.h"
 #include "mongo/db/storage/storage_options.h"
 #include "mongo/util/log.h"
+#include <terark/db/row_cache.hpp>
 
 namespace mongo { namespace terarkdb {
 
@@ -82,6 +83,10 @@ public:
                     cacheSizeGB = 1;
             }
         }
+        if (terarkDbGlobalOptions.rowCacheSizeMB) {
+            terark::db::RowCache::instance().setCapacity(
+                size_t(terarkDbGlobalOptions.rowCacheSizeMB) << 20);
+        }
         TerarkDbKVEngine* kv = new TerarkDbKVEngine(params.dbpath,
 												terarkDbGlobalOptions.engineConfig,
 												cacheSizeGB,
@@ -52,6 +52,7 @@
 #include "mongo/db/client.h"
 #include "mongo/db/concurrency/write_conflict_exception.h"
 #include "mongo/db/index/index_descriptor.h"
+#include "mongo/db/json.h"
 #include "mongo/db/service_context.h"
 #include "terarkdb_customization_hooks.h"
 #include "terarkdb_global_options.h"
@@ -72,6 +73,9 @@
 //#include "mongo/db/storage/wiredtiger/wiredtiger_recovery_unit.h"
 #include "mongo/db/storage/kv/kv_catalog.h"
 #include <terark/io/FileStream.hpp>
+#include <terark/db/bg_scheduler.hpp>
+#include <terark/db/write_ahead_log.hpp>
+#include <terark/db/row_cache.hpp>
 
 #if !defined(__has_feature)
 #define __has_feature(x) 0
@@ -167,6 +171,11 @@ TerarkDbKVEngine::TerarkDbKVEngine(const std::string& path,
 			_sizeStorer.fillCache();
         }
     }
+	if (durable) {
+		// must be opened before any table, tables replay it on open
+		terark::db::WriteAheadLog::openGlobal(m_pathTerark / "wal",
+				terark::db::WriteAheadLog::Options::fromEnv());
+	}
 //	CompositeTable::setCompressionThreadsNum(4);
 }
 
@@ -180,6 +189,7 @@ void TerarkDbKVEngine::cleanShutdown() {
 	std::lock_guard<std::mutex> lock(m_mutex);
     m_tables.clear();
 	CompositeTable::safeStopAndWaitForFlush();
+	terark::db::WriteAheadLog::closeGlobal();
 }
 
 void TerarkDbKVEngine::setJournalListener(JournalListener* jl) {
@@ -247,6 +257,32 @@ int TerarkDbKVEngine::flushAllFiles(bool sync) {
     return 1;
 }
 
+void TerarkDbKVEngine::appendStats(BSONObjBuilder& bob) const {
+	std::vector<std::pair<std::string, CompositeTablePtr> > tabCopy;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tables.for_each([&](const TableMap::value_type& x) {
+			if (x.second)
+				tabCopy.emplace_back(x.first.str(), x.second->m_tab);
+		});
+	}
+	bob.append("background",
+			   fromjson(terark::db::BgScheduler::instance().getStatsJson()));
+	if (auto wal = terark::db::WriteAheadLog::global()) {
+		bob.append("wal", fromjson(wal->getStatsJson()));
+	}
+	bob.append("rowCache",
+			   fromjson(terark::db::RowCache::instance().getStatsJson()));
+	BSONObjBuilder tabsBob(bob.subobjStart("tables"));
+	for (auto& x : tabCopy) {
+		BSONObjBuilder tabBob(tabsBob.subobjStart(x.first));
+		tabBob.append("reads", fromjson(x.second->getStatsJson()));
+		tabBob.append("merge", fromjson(x.second->getMergeStatsJson()));
+		tabBob.done();
+	}
+	tabsBob.done();
+}
+
 Status TerarkDbKVEngine::beginBackup(OperationContext* txn) {
     invariant(!_backupSession);
 	m_wtEngine->beginBackup(txn);
@@ -278,13 +314,14 @@ TerarkDbKVEngine::createRecordStore(OperationContext* opCtx,
 	if (ident == "_mdb_catalog") {
 		return m_wtEngine->createRecordStore(opCtx, ns, ident, options);
 	}
+	if (options.capped && NamespaceString::oplog(ns)) {
+		return createCappedRecordStore(opCtx, ns, ident, options);
+	}
 	if (NamespaceString(ns).isOnInternalDb()) {
 		return m_wtEngine->createRecordStore(opCtx, ns, ident, options);
 	}
     if (options.capped) {
-		// now don't use TerarkDbRecordStoreCapped
-		// use TerarkDbRecordStoreCapped when we need hook some virtual functions
-		return m_wtEngine->createRecordStore(opCtx, ns, ident, options);
+		return createCappedRecordStore(opCtx, ns, ident, options);
     }
 /*
 	StatusWith<std::string> result =
@@ -331,6 +368,36 @@ TerarkDbKVEngine::createRecordStore(OperationContext* opCtx,
 	return Status::OK();
 }
 
+// capped collections(including the oplog) use a built in schema, the
+// table is created on demand, no terarkCreateColl(...) is required
+Status
+TerarkDbKVEngine::createCappedRecordStore(OperationContext* opCtx,
+										  StringData ns,
+										  StringData ident,
+										  const CollectionOptions& options) {
+	if (m_wtEngine->hasIdent(opCtx, ident)) {
+		// created by an older version, which stored capped collections
+		// in wiredtiger, keep using it
+		return m_wtEngine->createRecordStore(opCtx, ns, ident, options);
+	}
+	auto tabDir = m_pathTerarkTables / nsToTableDir(ns);
+    LOG(2)	<< "TerarkDbKVEngine::createCappedRecordStore: ns:" << ns
+			<< ", tabDir=" << tabDir.string();
+	if (!fs::exists(tabDir)) {
+		fs::create_directories(tabDir);
+		std::string dbmetaFile = (tabDir / "dbmeta.json").string();
+		std::string dbmetaData = TerarkDbRecordStoreCapped::
+			createDbMetaJson(cappedMaxSize(options));
+		terark::FileStream fp(dbmetaFile.c_str(), "w");
+		fp.ensureWrite(dbmetaData.c_str(), dbmetaData.size());
+	}
+	return Status::OK();
+}
+
+int64_t TerarkDbKVEngine::cappedMaxSize(const CollectionOptions& options) {
+	return options.cappedSize ? options.cappedSize : 4096;
+}
+
 RecordStore*
 TerarkDbKVEngine::getRecordStore(OperationContext* opCtx,
 							   StringData ns,
@@ -339,18 +406,19 @@ TerarkDbKVEngine::getRecordStore(OperationContext* opCtx,
 	if (ident == "_mdb_catalog") {
 		return m_wtEngine->getRecordStore(opCtx, ns, ident, options);
 	}
-	if (NamespaceString(ns).isOnInternalDb()) {
+	const bool isTerarkCapped = options.capped &&
+		(NamespaceString::oplog(ns) || !NamespaceString(ns).isOnInternalDb());
+	if (!isTerarkCapped && NamespaceString(ns).isOnInternalDb()) {
 		return m_wtEngine->getRecordStore(opCtx, ns, ident, options);
 	}
-    if (options.capped) {
-		// now don't use TerarkDbRecordStoreCapped
-		// use TerarkDbRecordStoreCapped when we need hook some virtual functions
-		// const bool ephemeral = false;
-		return m_wtEngine->getRecordStore(opCtx, ns, ident, options);
-    }
 
 	auto tabDir = m_pathTerarkTables / nsToTableDir(ns);
 	if (!fs::exists(tabDir)) {
+		if (isTerarkCapped && m_wtEngine->hasIdent(opCtx, ident)) {
+			// capped collections and the oplog of an older version are
+			// in wiredtiger, they are not converted
+			return m_wtEngine->getRecordStore(opCtx, ns, ident, options);
+		}
 		return NULL;
 	}
 	std::lock_guard<std::mutex> lock(m_mutex);
@@ -358,6 +426,12 @@ TerarkDbKVEngine::getRecordStore(OperationContext* opCtx,
 	if (tab == nullptr) {
 		tab = new ThreadSafeTable(tabDir);
 	}
+	if (isTerarkCapped) {
+		return new TerarkDbRecordStoreCapped(opCtx, ns, ident, &*tab,
+				cappedMaxSize(options),
+				options.cappedMaxDocs ? options.cappedMaxDocs : -1,
+				NULL);
+	}
     return new TerarkDbRecordStore(opCtx, ns, ident, &*tab, NULL);
 }
 
@@ -369,9 +443,8 @@ TerarkDbKVEngine::createSortedDataInterface(OperationContext* opCtx,
 		return m_wtEngine->createSortedDataInterface(opCtx, ident, desc);
 	}
     if (desc->getCollection()->isCapped()) {
-		// now don't use TerarkDbRecordStoreCapped
-		// use TerarkDbRecordStoreCapped when we need hook some virtual functions
-		// const bool ephemeral = false;
+		// TerarkDbRecordStoreCapped has a built in schema, the indices
+		// are in wiredtiger, capped callback removes the index entries
 		return m_wtEngine->createSortedDataInterface(opCtx, ident, desc);
     }
 
@@ -420,9 +493,6 @@ TerarkDbKVEngine::getSortedDataInterface(OperationContext* opCtx,
 		return m_wtEngine->getSortedDataInterface(opCtx, ident, desc);
 	}
     if (desc->getCollection()->isCapped()) {
-		// now don't use TerarkDbRecordStoreCapped
-		// use TerarkDbRecordStoreCapped when we need hook some virtual functions
-		// const bool ephemeral = false;
 		return m_wtEngine->getSortedDataInterface(opCtx, ident, desc);
     }
 	const string tableNS = desc->getCollection()->ns().toString();
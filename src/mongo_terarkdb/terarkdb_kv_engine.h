@@ -125,15 +125,24 @@ public:
     // held by this class
     int reconfigure(const char* str);
 
+    // stats of background tasks and each terark table, for serverStatus
+    void appendStats(BSONObjBuilder& bob) const;
+
 	const KVCatalog* m_fuckKVCatalog;
 
 private:
+    Status createCappedRecordStore(OperationContext* opCtx,
+                                   StringData ns,
+                                   StringData ident,
+                                   const CollectionOptions& options);
+    static int64_t cappedMaxSize(const CollectionOptions& options);
+
 //  std::unique_ptr<WiredTigerSessionCache> _sessionCache;
     std::string _path;
     fs::path m_pathTerark;
     fs::path m_pathTerarkTables;
 
-    // for: 1. capped collection
+    // for: 1. indices of capped collections
     //      2. metadata(use wiredtiger)
     //      3. ephemeral table/index, ephemeral will use WiredTigerKVEngine
     fs::path m_pathWt;
@@ -84,6 +84,9 @@ static_assert(kCurrentRecordStoreVersion >= kMinimumRecordStoreVersion,
 static_assert(kCurrentRecordStoreVersion <= kMaximumRecordStoreVersion,
               "kCurrentRecordStoreVersion <= kMaximumRecordStoreVersion");
 
+// getManyCursors splits segments larger than this
+static const size_t kMaxRowsPerScanCursor = 1 << 20;
+
 }  // namespace
 
 //MONGO_FP_DECLARE(TerarkDbWriteConflictException);
@@ -92,13 +95,22 @@ class TerarkDbRecordStore::Cursor final : public SeekableRecordCursor {
 public:
     Cursor(OperationContext* txn, const TerarkDbRecordStore& rs, bool forward = true)
         : _rs(rs),
-          _txn(txn) {
+          _txn(txn),
+          _forward(forward) {
+		CompositeTable* tab = rs.m_table->m_tab.get();
+    	m_ctx = tab->createDbContext();
+    	createStoreIter();
+    }
+
+    // scan record ids [beg, end) in one segment, for getManyCursors
+    Cursor(OperationContext* txn, const TerarkDbRecordStore& rs, llong beg, llong end)
+        : _rs(rs),
+          _txn(txn),
+          _rangeBeg(beg),
+          _rangeEnd(end) {
 		CompositeTable* tab = rs.m_table->m_tab.get();
     	m_ctx = tab->createDbContext();
-    	if (forward)
-    		_cursor = tab->createStoreIterForward(m_ctx.get());
-    	else
-    		_cursor = tab->createStoreIterBackward(m_ctx.get());
+    	createStoreIter();
     }
 
     boost::optional<Record> next() final {
@@ -182,11 +194,27 @@ public:
 
     void reattachToOperationContext(OperationContext* txn) final {
         _txn = txn;
+        // the iterator is dropped on detach, restore() will seek it to
+        // _lastReturnedId, range cursors keep their range
+        createStoreIter();
     }
 
 private:
+    void createStoreIter() {
+		CompositeTable* tab = _rs.m_table->m_tab.get();
+		if (_rangeBeg >= 0)
+			_cursor = tab->createStoreIterRange(_rangeBeg, _rangeEnd, m_ctx.get());
+		else if (_forward)
+			_cursor = tab->createStoreIterForward(m_ctx.get());
+		else
+			_cursor = tab->createStoreIterBackward(m_ctx.get());
+    }
+
     const TerarkDbRecordStore& _rs;
     OperationContext* _txn;
+    const bool _forward = true;
+    const llong _rangeBeg = -1; // -1 if not a range cursor
+    const llong _rangeEnd = -1;
     bool _skipNextAdvance = false;
     bool _eof = false;
 	SchemaRecordCoder m_coder;
@@ -437,10 +465,20 @@ std::unique_ptr<RecordCursor> TerarkDbRecordStore::getRandomCursor(OperationCont
     return nullptr;
 }
 
+// One cursor per segment, large segments are split by record id, cursors
+// can be consumed concurrently, such as by parallelCollectionScan
 std::vector<std::unique_ptr<RecordCursor>>
 TerarkDbRecordStore::getManyCursors(OperationContext* txn) const {
-    std::vector<std::unique_ptr<RecordCursor>> cursors(1);
-    cursors[0] = stdx::make_unique<Cursor>(txn, *this, /*forward=*/true);
+	CompositeTable* tab = m_table->m_tab.get();
+	auto ranges = tab->getStoreScanRanges(kMaxRowsPerScanCursor);
+    std::vector<std::unique_ptr<RecordCursor>> cursors;
+    cursors.reserve(ranges.size());
+    for (auto& r : ranges) {
+    	cursors.push_back(stdx::make_unique<Cursor>(txn, *this, r.first, r.second));
+    }
+    if (cursors.empty()) {
+    	cursors.push_back(stdx::make_unique<Cursor>(txn, *this, /*forward=*/true));
+    }
     return cursors;
 }
 
@@ -50,13 +50,14 @@
 #include "mongo/db/operation_context.h"
 #include "mongo/db/service_context.h"
 #include "mongo/db/storage/oplog_hack.h"
+#include "mongo/db/storage/recovery_unit.h"
+#include "mongo/platform/random.h"
 #include "terarkdb_customization_hooks.h"
 #include "terarkdb_global_options.h"
 //#include "terarkdb_kv_engine.h"
 //#include "terarkdb_record_store_oplog_stones.h"
 //#include "terarkdb_recovery_unit.h"
 //#include "terarkdb_session_cache.h"
-#include "terarkdb_size_storer.h"
 //#include "terarkdb_util.h"
 #include "mongo/stdx/memory.h"
 #include "mongo/util/assert_util.h"
@@ -65,132 +66,529 @@
 #include "mongo/util/mongoutils/str.h"
 #include "mongo/util/scopeguard.h"
 #include "mongo/util/time_support.h"
-
-#include "mongo/db/storage/wiredtiger/wiredtiger_record_store.h"
+#include <terark/db/db_segment.hpp>
 
 namespace mongo { namespace terarkdb {
 
 using std::unique_ptr;
 using std::string;
 
+namespace {
+
+// number of segments a capped table is split into, the oldest frozen
+// segment is dropped as a whole when the table exceeds cappedMaxSize
+static const int64_t kSegmentsPerCappedTable = 10;
+static const int64_t kMinCappedSegmentSize = 1 << 20;
+
+inline fstring ridKey(const llong& rid) {
+	return fstring((const char*)&rid, sizeof(rid));
+}
+
+inline llong ridOfKey(const terark::valvec<unsigned char>& key) {
+	invariant(key.size() == sizeof(llong));
+	llong rid;
+	memcpy(&rid, key.data(), sizeof(rid));
+	return rid;
+}
+
+// row is {rid, doc}, rid is fixed len, doc is the last column
+inline RecordData rowToRecordData(const terark::valvec<unsigned char>& row) {
+	invariant(row.size() >= sizeof(llong));
+	int len = int(row.size() - sizeof(llong));
+	SharedBuffer sbuf = SharedBuffer::allocate(len);
+	memcpy(sbuf.get(), row.data() + sizeof(llong), len);
+	return RecordData(sbuf, len);
+}
+
+// Deleted rows are not counted, the data size of a segment is estimated
+// by its live row ratio, deleted rows free their space when purged
+struct CappedUsage {
+	llong rows = 0;
+	llong bytes = 0;
+};
+CappedUsage getCappedUsageNoLock(const CompositeTable* tab) {
+	CappedUsage usage;
+	for (size_t i = 0; i < tab->getSegNum(); ++i) {
+		auto seg = tab->getSegmentPtr(i);
+		llong rows = seg->m_isDel.size();
+		llong live = rows - seg->m_delcnt;
+		if (live > 0) {
+			usage.rows  += live;
+			usage.bytes += seg->dataInflateSize() * live / rows;
+		}
+	}
+	return usage;
+}
+CappedUsage getCappedUsage(const CompositeTable* tab) {
+	terark::db::MyRwLock lock(tab->m_rwMutex, false);
+	return getCappedUsageNoLock(tab);
+}
+
+// estimated doc bytes of n rows of seg, the rid column is excluded
+llong segDocBytes(const terark::db::ReadableSegment* seg, llong n) {
+	llong rows = seg->m_isDel.size();
+	if (rows == 0)
+		return 0;
+	llong avg = seg->dataInflateSize() / rows - llong(sizeof(llong));
+	return std::max<llong>(avg, 0) * n;
+}
+
+}  // namespace
+
 class TerarkDbRecordStoreCapped::Cursor final : public SeekableRecordCursor {
 public:
     Cursor(OperationContext* txn, const TerarkDbRecordStoreCapped& rs, bool forward)
-        : m_rs(rs)
-		, m_wtCursor(rs.m_wiredtigerCappedStore->getCursor(txn, forward))
-	{}
+        : m_rs(rs), m_txn(txn), m_forward(forward) {
+		CompositeTable* tab = rs.m_table->m_tab.get();
+		m_ctx = tab->createDbContext();
+		if (forward)
+			m_iter = tab->createIndexIterForward(rs.m_ridIndexId);
+		else
+			m_iter = tab->createIndexIterBackward(rs.m_ridIndexId);
+	}
 
     boost::optional<Record> next() final {
-		return m_wtCursor->next();
+		if (m_eof)
+			return {};
+		llong recIdx;
+		if (!m_iter->increment(&recIdx, &m_keyBuf)) {
+			m_eof = true;
+			return {};
+		}
+		llong rid = ridOfKey(m_keyBuf);
+		if (m_forward && m_rs.isCappedHidden(rid)) {
+			m_eof = true; // don't read over an uncommitted record
+			return {};
+		}
+		return readRecord(recIdx, RecordId(rid));
     }
 
     boost::optional<Record> seekExact(const RecordId& id) final {
-		return m_wtCursor->seekExact(id);
+		llong recIdx;
+		llong rid = id.repr();
+		if (m_iter->seekLowerBound(ridKey(rid), &recIdx, &m_keyBuf) != 0 ||
+				(m_forward && m_rs.isCappedHidden(rid))) {
+			m_eof = true;
+			return {};
+		}
+		m_eof = false;
+		return readRecord(recIdx, id);
     }
 
     void save() final {
-		return m_wtCursor->save();
+		m_iter->reset();
     }
 
     void saveUnpositioned() final {
-		return m_wtCursor->saveUnpositioned();
+		save();
+		m_eof = true;
+    }
+
+    bool restore() final {
+		// If we've hit EOF, then this iterator is done and need not be restored.
+		if (m_eof || m_lastReturnedId.isNull())
+			return true;
+		llong recIdx;
+		llong rid = m_lastReturnedId.repr();
+		// the iterator is positioned after lastReturnedId in both directions
+		if (m_iter->seekLowerBound(ridKey(rid), &recIdx, &m_keyBuf) == 0)
+			return true;
+		// the record was deleted by capped truncation, must error out so
+		// that consumers don't silently get 'holes' when scanning
+		return false;
+    }
+
+    void detachFromOperationContext() final {
+		m_txn = nullptr;
+    }
+
+    void reattachToOperationContext(OperationContext* txn) final {
+		m_txn = txn;
+    }
+
+private:
+	boost::optional<Record> readRecord(llong recIdx, const RecordId& id) {
+		CompositeTable* tab = m_rs.m_table->m_tab.get();
+		tab->getValue(recIdx, &m_recBuf, m_ctx.get());
+		m_lastReturnedId = id;
+		return {{id, rowToRecordData(m_recBuf)}};
+	}
+
+    const TerarkDbRecordStoreCapped& m_rs;
+    OperationContext* m_txn;
+    const bool m_forward;
+    bool m_eof = false;
+    terark::db::DbContextPtr m_ctx;
+    terark::db::IndexIteratorPtr m_iter;
+    terark::valvec<unsigned char> m_keyBuf;
+    terark::valvec<unsigned char> m_recBuf;
+    RecordId m_lastReturnedId;
+};
+
+// Each next() returns the first record whose RecordId >= a random RecordId
+// between the min and max RecordId, RecordIds of capped collections are
+// dense and oplog RecordIds(optime) are nearly uniform in time
+class TerarkDbRecordStoreCapped::RandomCursor final : public RecordCursor {
+public:
+    RandomCursor(OperationContext* txn, const TerarkDbRecordStoreCapped& rs)
+        : m_rs(rs), m_txn(txn), m_random(curTimeMicros64()) {
+		CompositeTable* tab = rs.m_table->m_tab.get();
+		m_ctx = tab->createDbContext();
+		m_fwdIter = tab->createIndexIterForward(rs.m_ridIndexId);
+		m_bwdIter = tab->createIndexIterBackward(rs.m_ridIndexId);
+	}
+
+    boost::optional<Record> next() final {
+		llong recIdx;
+		m_fwdIter->reset();
+		m_bwdIter->reset();
+		if (!m_fwdIter->increment(&recIdx, &m_keyBuf))
+			return {};
+		const llong minRid = ridOfKey(m_keyBuf);
+		const llong minRecIdx = recIdx;
+		if (!m_bwdIter->increment(&recIdx, &m_keyBuf))
+			return {};
+		const llong maxRid = ridOfKey(m_keyBuf);
+		uint64_t span = uint64_t(maxRid - minRid) + 1;
+		llong rid = minRid + llong(uint64_t(m_random.nextInt64()) % span);
+		if (m_fwdIter->seekLowerBound(ridKey(rid), &recIdx, &m_keyBuf) < 0) {
+			recIdx = minRecIdx; // the max record was just deleted
+			rid = minRid;
+		} else {
+			rid = ridOfKey(m_keyBuf);
+		}
+		if (m_rs.isCappedHidden(rid)) {
+			if (m_rs.isCappedHidden(minRid))
+				return {};
+			recIdx = minRecIdx;
+			rid = minRid;
+		}
+		CompositeTable* tab = m_rs.m_table->m_tab.get();
+		tab->getValue(recIdx, &m_recBuf, m_ctx.get());
+		return {{RecordId(rid), rowToRecordData(m_recBuf)}};
+    }
+
+    void save() final {
+		m_fwdIter->reset();
+		m_bwdIter->reset();
     }
 
     bool restore() final {
-		return m_wtCursor->restore();
+		return true;
     }
 
     void detachFromOperationContext() final {
-		m_wtCursor->detachFromOperationContext();
+		m_txn = nullptr;
     }
 
     void reattachToOperationContext(OperationContext* txn) final {
-        m_wtCursor->reattachToOperationContext(txn);
+		m_txn = txn;
     }
 
 private:
     const TerarkDbRecordStoreCapped& m_rs;
-	std::unique_ptr<SeekableRecordCursor> m_wtCursor;
+    OperationContext* m_txn;
+    PseudoRandom m_random;
+    terark::db::DbContextPtr m_ctx;
+    terark::db::IndexIteratorPtr m_fwdIter;
+    terark::db::IndexIteratorPtr m_bwdIter;
+    terark::valvec<unsigned char> m_keyBuf;
+    terark::valvec<unsigned char> m_recBuf;
+};
+
+// Changes registered to the RecoveryUnit, rollback undoes the write.
+// Capped deletes done by an insert are not undone: records over the cap
+// are dropped no matter whether the insert is committed.
+class TerarkDbRecordStoreCapped::InsertChange final : public RecoveryUnit::Change {
+public:
+	InsertChange(TerarkDbRecordStoreCapped* rs, llong rid, int len)
+		: m_rs(rs), m_rid(rid), m_len(len) {}
+	void commit() final {}
+	void rollback() final {
+		llong recIdx;
+		if (!m_rs->findRecIdx(RecordId(m_rid), &recIdx))
+			return; // has been deleted by capped delete
+		auto& td = m_rs->myThreadData();
+		m_rs->m_table->m_tab->removeRow(recIdx, &*td.m_dbCtx);
+		m_rs->changeNumRecordsAndDataSize(-1, -m_len);
+	}
+private:
+	TerarkDbRecordStoreCapped* m_rs;
+	llong m_rid;
+	int   m_len;
 };
 
+class TerarkDbRecordStoreCapped::RemoveChange final : public RecoveryUnit::Change {
+public:
+	RemoveChange(TerarkDbRecordStoreCapped* rs, terark::valvec<unsigned char>& row)
+		: m_rs(rs) { m_row.swap(row); }
+	void commit() final {}
+	void rollback() final {
+		auto& td = m_rs->myThreadData();
+		llong recIdx = m_rs->m_table->m_tab->insertRow(m_row, &*td.m_dbCtx);
+		invariant(recIdx >= 0);
+		m_rs->changeNumRecordsAndDataSize(1, m_row.size() - sizeof(llong));
+	}
+private:
+	TerarkDbRecordStoreCapped* m_rs;
+	terark::valvec<unsigned char> m_row; // {rid, doc}
+};
+
+class TerarkDbRecordStoreCapped::UpdateChange final : public RecoveryUnit::Change {
+public:
+	UpdateChange(TerarkDbRecordStoreCapped* rs, llong rid,
+				 terark::valvec<unsigned char>& oldRow, long long sizeDiff)
+		: m_rs(rs), m_rid(rid), m_sizeDiff(sizeDiff) { m_oldRow.swap(oldRow); }
+	void commit() final {}
+	void rollback() final {
+		llong recIdx;
+		if (!m_rs->findRecIdx(RecordId(m_rid), &recIdx))
+			return;
+		auto& td = m_rs->myThreadData();
+		m_rs->m_table->m_tab->updateRow(recIdx, m_oldRow, &*td.m_dbCtx);
+		m_rs->changeNumRecordsAndDataSize(0, -m_sizeDiff);
+	}
+private:
+	TerarkDbRecordStoreCapped* m_rs;
+	llong m_rid;
+	long long m_sizeDiff;
+	terark::valvec<unsigned char> m_oldRow;
+};
+
+// the RecordId is visible to cursors when the unit of work is finished
+class TerarkDbRecordStoreCapped::UncommittedRidChange final
+	: public RecoveryUnit::Change {
+public:
+	UncommittedRidChange(TerarkDbRecordStoreCapped* rs, llong rid)
+		: m_rs(rs), m_rid(rid) {}
+	void commit() final { remove(); }
+	void rollback() final { remove(); }
+private:
+	void remove() {
+		stdx::lock_guard<stdx::mutex> lock(m_rs->m_uncommittedRidsMutex);
+		m_rs->m_uncommittedRids.erase(m_rid);
+	}
+	TerarkDbRecordStoreCapped* m_rs;
+	llong m_rid;
+};
+
+std::string
+TerarkDbRecordStoreCapped::createDbMetaJson(int64_t cappedMaxSize) {
+	int64_t segSize = std::max(cappedMaxSize / kSegmentsPerCappedTable,
+							   kMinCappedSegmentSize);
+	str::stream ss;
+	ss << "{\n";
+	ss << "  \"RowSchema\": {\n";
+	ss << "    \"columns\": {\n";
+	ss << "      \"rid\": { \"type\": \"sint64\" },\n";
+	ss << "      \"doc\": { \"type\": \"binary\" }\n";
+	ss << "    }\n";
+	ss << "  },\n";
+	ss << "  \"MaxWrSegSize\": " << segSize << ",\n";
+	ss << "  \"UsePermanentRecordId\": true,\n";
+	ss << "  \"TableIndex\": [\n";
+	ss << "    { \"fields\": \"rid\", \"ordered\": true }\n";
+	ss << "  ]\n";
+	ss << "}\n";
+	return ss;
+}
+
 TerarkDbRecordStoreCapped::TerarkDbRecordStoreCapped(OperationContext* ctx,
 												 StringData ns,
-												 StringData uri,
-												 int64_t cappedMaxSize,
-												 int64_t cappedMaxDocs,
-												 CappedCallback* cappedCallback,
-												 WiredTigerSizeStorer* sizeStorer)
+												 StringData ident,
+												 ThreadSafeTable* tab,
+												 int64_t cappedMaxSize,
+												 int64_t cappedMaxDocs,
+												 CappedCallback* cappedCallback)
 	: RecordStore(ns)
+	, m_table(tab)
+	, _ident(ident.toString())
+	, m_isOplog(NamespaceString::oplog(ns))
+	, m_cappedMaxSize(cappedMaxSize)
+	, m_cappedMaxDocs(cappedMaxDocs)
+	, m_cappedCallback(cappedCallback)
 {
-	const bool ephemeral = false;
-	const bool isCapped = true;
-	m_wiredtigerCappedStore.reset(
-		new WiredTigerRecordStore(ctx, ns, uri,
-				kWiredTigerEngineName, isCapped, ephemeral,
-                cappedMaxSize, cappedMaxDocs, cappedCallback, sizeStorer));
+	invariant(m_cappedMaxSize > 0);
+	invariant(m_cappedMaxDocs == -1 || m_cappedMaxDocs > 0);
+	CompositeTable* t = tab->m_tab.get();
+	m_ridIndexId = t->getIndexId("rid");
+	if (m_ridIndexId >= t->getIndexNum()) {
+		severe() << "TerarkDbRecordStoreCapped: ns = " << ns
+				 << ", table is not a capped table: " << t->getDir().string();
+		fassertFailedNoTrace(40101);
+	}
+	llong maxRid = 0;
+	{
+		terark::db::IndexIteratorPtr iter = t->createIndexIterBackward(m_ridIndexId);
+		terark::valvec<unsigned char> key;
+		llong recIdx;
+		if (iter->increment(&recIdx, &key))
+			maxRid = ridOfKey(key);
+	}
+	m_nextRid.store(maxRid + 1);
+	CappedUsage usage = getCappedUsage(t);
+	m_numRecords.store(usage.rows);
+	m_dataSize.store(std::max<llong>(usage.bytes - usage.rows * sizeof(llong), 0));
 }
 
 TerarkDbRecordStoreCapped::~TerarkDbRecordStoreCapped() {
+	m_table->m_tab->flush();
     LOG(1) << "~TerarkDbRecordStoreCapped for: " << ns();
 }
 
 const char* TerarkDbRecordStoreCapped::name() const {
-    return m_wiredtigerCappedStore->name();
+    return kTerarkDbEngineName.c_str();
 }
 
 long long TerarkDbRecordStoreCapped::dataSize(OperationContext* txn) const {
-    return m_wiredtigerCappedStore->dataSize(txn);
+    return std::max<long long>(m_dataSize.load(), 0);
 }
 
 long long TerarkDbRecordStoreCapped::numRecords(OperationContext* txn) const {
-    return m_wiredtigerCappedStore->numRecords(txn);
+    return std::max<long long>(m_numRecords.load(), 0);
+}
+
+void
+TerarkDbRecordStoreCapped::changeNumRecordsAndDataSize(long long numDiff,
+													   long long sizeDiff) {
+	m_numRecords.addAndFetch(numDiff);
+	m_dataSize.addAndFetch(sizeDiff);
+}
+
+void TerarkDbRecordStoreCapped::addUncommittedRid(OperationContext* txn, llong rid) {
+	{
+		stdx::lock_guard<stdx::mutex> lock(m_uncommittedRidsMutex);
+		if (!m_uncommittedRids.insert(rid).second)
+			return; // registered by oplogDiskLocRegister
+	}
+	txn->recoveryUnit()->registerChange(new UncommittedRidChange(this, rid));
+}
+
+bool TerarkDbRecordStoreCapped::isCappedHidden(llong rid) const {
+	stdx::lock_guard<stdx::mutex> lock(m_uncommittedRidsMutex);
+	return !m_uncommittedRids.empty() && rid >= *m_uncommittedRids.begin();
 }
 
 bool TerarkDbRecordStoreCapped::isCapped() const {
-	invariant(m_wiredtigerCappedStore->isCapped());
     return true;
 }
 
 int64_t TerarkDbRecordStoreCapped::storageSize(OperationContext* txn,
 									   BSONObjBuilder* extraInfo,
 									   int infoLevel) const {
-	return m_wiredtigerCappedStore->storageSize(txn, extraInfo, infoLevel);
+	return m_table->m_tab->dataStorageSize();
+}
+
+// The rid index is only maintained by this table itself, not by mongo index
+// interfaces, so DbContext must sync index on insert/update/remove
+TableThreadData& TerarkDbRecordStoreCapped::myThreadData() const {
+	auto& td = m_table->getMyThreadData();
+	td.m_dbCtx->syncIndex = true;
+	return td;
+}
+
+bool TerarkDbRecordStoreCapped::findRecIdx(const RecordId& id, llong* recIdx)
+const {
+	if (id.isNull())
+		return false;
+	llong rid = id.repr();
+	auto& td = myThreadData();
+	terark::valvec<llong> recIdvec;
+	m_table->m_tab->indexSearchExact(m_ridIndexId, ridKey(rid), &recIdvec, &*td.m_dbCtx);
+	if (recIdvec.empty())
+		return false;
+	*recIdx = recIdvec[0]; // RecordId is unique, the index needn't check it
+	return true;
 }
 
 RecordData
 TerarkDbRecordStoreCapped::dataFor(OperationContext* txn, const RecordId& id)
 const {
-	return m_wiredtigerCappedStore->dataFor(txn, id);
+	return RecordStore::dataFor(txn, id);
 }
 
 bool TerarkDbRecordStoreCapped::findRecord(OperationContext* txn,
 								   const RecordId& id,
 								   RecordData* out) const {
-	return m_wiredtigerCappedStore->findRecord(txn, id, out);
+	llong recIdx;
+	if (!findRecIdx(id, &recIdx))
+		return false;
+	auto& td = myThreadData();
+	m_table->m_tab->getValue(recIdx, &td.m_buf, &*td.m_dbCtx);
+	*out = rowToRecordData(td.m_buf);
+	return true;
 }
 
 void TerarkDbRecordStoreCapped::deleteRecord(OperationContext* txn, const RecordId& id) {
-	m_wiredtigerCappedStore->deleteRecord(txn, id);
+	llong recIdx;
+	if (!findRecIdx(id, &recIdx))
+		return;
+	CompositeTable* tab = m_table->m_tab.get();
+	auto& td = myThreadData();
+	terark::valvec<unsigned char> row;
+	tab->getValue(recIdx, &row, &*td.m_dbCtx);
+	tab->removeRow(recIdx, &*td.m_dbCtx);
+	changeNumRecordsAndDataSize(-1, -llong(row.size() - sizeof(llong)));
+	txn->recoveryUnit()->registerChange(new RemoveChange(this, row));
+}
+
+StatusWith<RecordId>
+TerarkDbRecordStoreCapped::nextRecordId(const char* data, int len) {
+	if (m_isOplog) {
+		return oploghack::extractKey(data, len);
+	}
+	return {RecordId(m_nextRid.fetchAndAdd(1))};
 }
 
 Status TerarkDbRecordStoreCapped::insertRecords(OperationContext* txn,
 										std::vector<Record>* records,
 										bool enforceQuota) {
-	return m_wiredtigerCappedStore->insertRecords(txn, records, enforceQuota);
+	for (Record& rec : *records) {
+		auto res = insertRecord(txn, rec.data.data(), rec.data.size(), enforceQuota);
+		if (!res.isOK())
+			return res.getStatus();
+		rec.id = res.getValue();
+	}
+	return Status::OK();
 }
 
 StatusWith<RecordId> TerarkDbRecordStoreCapped::insertRecord(OperationContext* txn,
 													 const char* data,
 													 int len,
 													 bool enforceQuota) {
-	return m_wiredtigerCappedStore->insertRecord(txn, data, len, enforceQuota);
+	if (len > m_cappedMaxSize) {
+		return {ErrorCodes::BadValue, "object to insert exceeds cappedMaxSize"};
+	}
+	auto ridStatus = nextRecordId(data, len);
+	if (!ridStatus.isOK())
+		return ridStatus;
+	llong rid = ridStatus.getValue().repr();
+	CompositeTable* tab = m_table->m_tab.get();
+	auto& td = myThreadData();
+	td.m_buf.erase_all();
+	td.m_buf.append((const unsigned char*)&rid, sizeof(rid));
+	td.m_buf.append((const unsigned char*)data, len);
+	llong recIdx = tab->insertRow(td.m_buf, &*td.m_dbCtx);
+	if (recIdx < 0) {
+		return {ErrorCodes::InternalError, "insertRow failed: " + td.m_dbCtx->errMsg};
+	}
+	addUncommittedRid(txn, rid);
+	txn->recoveryUnit()->registerChange(new InsertChange(this, rid, len));
+	changeNumRecordsAndDataSize(1, len);
+	cappedDeleteAsNeeded(txn);
+	return ridStatus;
 }
 
 StatusWith<RecordId>
 TerarkDbRecordStoreCapped::insertRecord(OperationContext* txn,
 									  const DocWriter* doc,
 									  bool enforceQuota) {
-	return m_wiredtigerCappedStore->insertRecord(txn, doc, enforceQuota);
+    const int len = doc->documentSize();
+
+    std::unique_ptr<char[]> buf(new char[len]);
+    doc->writeDocument(buf.get());
+
+    return insertRecord(txn, buf.get(), len, enforceQuota);
 }
 
 Status
@@ -200,8 +598,37 @@ TerarkDbRecordStoreCapped::updateRecord(OperationContext* txn,
 									  int len,
 									  bool enforceQuota,
 									  UpdateNotifier* notifier) {
-	return m_wiredtigerCappedStore->
-		updateRecord(txn, id, data, len, enforceQuota, notifier);
+	llong recIdx;
+	if (!findRecIdx(id, &recIdx)) {
+		return {ErrorCodes::InvalidIdField, "record id is not found"};
+	}
+	CompositeTable* tab = m_table->m_tab.get();
+	if (m_isOplog) {
+		// an oplog entry moved to the writable segment would outlive the
+		// segment it belongs to, then cappedDropOldestSegments leaves a hole
+		terark::db::MyRwLock lock(tab->m_rwMutex, false);
+		size_t segIdx = tab->getSegmentIndexOfRecordIdNoLock(recIdx);
+		if (tab->getSegmentPtr(segIdx)->m_isFreezed) {
+			return {ErrorCodes::IllegalOperation,
+					"oplog entry in frozen segment can not be updated"};
+		}
+	}
+	llong rid = id.repr();
+	auto& td = myThreadData();
+	terark::valvec<unsigned char> oldRow;
+	tab->getValue(recIdx, &oldRow, &*td.m_dbCtx);
+	td.m_buf.erase_all();
+	td.m_buf.append((const unsigned char*)&rid, sizeof(rid));
+	td.m_buf.append((const unsigned char*)data, len);
+	// a row of a frozen segment is moved to the writable segment, recIdx
+	// is changed but rid is not, readers always find the row by rid index
+	llong newRecIdx = tab->updateRow(recIdx, td.m_buf, &*td.m_dbCtx);
+	invariant(newRecIdx >= 0);
+	long long sizeDiff = len - llong(oldRow.size() - sizeof(llong));
+	changeNumRecordsAndDataSize(0, sizeDiff);
+	txn->recoveryUnit()->registerChange(
+		new UpdateChange(this, rid, oldRow, sizeDiff));
+	return Status::OK();
 }
 
 bool TerarkDbRecordStoreCapped::updateWithDamagesSupported() const {
@@ -218,6 +645,89 @@ StatusWith<RecordData> TerarkDbRecordStoreCapped::updateWithDamages(
     MONGO_UNREACHABLE;
 }
 
+void TerarkDbRecordStoreCapped::setCappedCallback(CappedCallback* cb) {
+	stdx::lock_guard<stdx::mutex> lock(m_cappedCallbackMutex);
+	m_cappedCallback = cb;
+}
+
+bool TerarkDbRecordStoreCapped::cappedAndNeedDelete() const {
+	if (m_dataSize.load() > m_cappedMaxSize)
+		return true;
+	if (m_cappedMaxDocs != -1 && m_numRecords.load() > m_cappedMaxDocs)
+		return true;
+	return false;
+}
+
+void TerarkDbRecordStoreCapped::cappedDeleteAsNeeded(OperationContext* txn) {
+	if (!cappedAndNeedDelete())
+		return;
+	// another thread is deleting, it will catch up with this insert
+	stdx::unique_lock<stdx::mutex> lock(m_cappedDeleterMutex, stdx::try_to_lock);
+	if (!lock)
+		return;
+	if (m_isOplog)
+		cappedDropOldestSegments();
+	else
+		cappedDeleteOldestRecords(txn);
+}
+
+// The oplog has no indices on it and nobody needs to be notified about the
+// deleted records, so the oldest frozen segments are dropped as a whole,
+// just like oplog stones. cappedMaxSize bytes are always kept, the writable
+// segment is never dropped.
+void TerarkDbRecordStoreCapped::cappedDropOldestSegments() {
+	CompositeTable* tab = m_table->m_tab.get();
+	terark::valvec<terark::db::ReadableSegmentPtr> dropSegs;
+	{
+		terark::db::MyRwLock lock(tab->m_rwMutex, false);
+		llong dataSize = m_dataSize.load();
+		for (size_t i = 0; i < tab->getSegNum(); ++i) {
+			auto seg = tab->getSegmentPtr(i);
+			if (!seg->m_isFreezed)
+				break;
+			llong live = llong(seg->m_isDel.size()) - llong(seg->m_delcnt);
+			if (live == 0)
+				continue;
+			llong bytes = segDocBytes(seg, live);
+			if (dataSize - bytes < m_cappedMaxSize)
+				break;
+			dataSize -= bytes;
+			dropSegs.push_back(seg);
+		}
+	}
+	for (auto& seg : dropSegs) {
+		llong rows = tab->removeSegmentRows(seg.get());
+		changeNumRecordsAndDataSize(-rows, -segDocBytes(seg.get(), rows));
+		LOG(1) << "TerarkDbRecordStoreCapped: " << ns() << ": dropped "
+			   << rows << " records of " << seg->m_segDir.string();
+	}
+}
+
+// Indices of non-oplog capped collections are not in this table, so records
+// are deleted one by one and the capped callback deletes the index entries
+void TerarkDbRecordStoreCapped::cappedDeleteOldestRecords(OperationContext* txn) {
+	CompositeTable* tab = m_table->m_tab.get();
+	auto& td = myThreadData();
+	terark::db::IndexIteratorPtr iter = tab->createIndexIterForward(m_ridIndexId);
+	terark::valvec<unsigned char> key, row;
+	llong recIdx;
+	while (cappedAndNeedDelete() && iter->increment(&recIdx, &key)) {
+		RecordId id(ridOfKey(key));
+		if (isCappedHidden(id.repr()))
+			break; // never delete uncommitted records
+		tab->getValue(recIdx, &row, &*td.m_dbCtx);
+		{
+			stdx::lock_guard<stdx::mutex> lock(m_cappedCallbackMutex);
+			if (m_cappedCallback) {
+				uassertStatusOK(m_cappedCallback->
+					aboutToDeleteCapped(txn, id, rowToRecordData(row)));
+			}
+		}
+		tab->removeRow(recIdx, &*td.m_dbCtx);
+		changeNumRecordsAndDataSize(-1, -llong(row.size() - sizeof(llong)));
+	}
+}
+
 std::unique_ptr<SeekableRecordCursor>
 TerarkDbRecordStoreCapped::getCursor(OperationContext* txn, bool forward) const {
     return stdx::make_unique<Cursor>(txn, *this, forward);
@@ -225,31 +735,37 @@ TerarkDbRecordStoreCapped::getCursor(OperationContext* txn, bool forward) const
 
 std::unique_ptr<RecordCursor>
 TerarkDbRecordStoreCapped::getRandomCursor(OperationContext* txn) const {
-    return m_wiredtigerCappedStore->getRandomCursor(txn);
+    return stdx::make_unique<RandomCursor>(txn, *this);
 }
 
 std::vector<std::unique_ptr<RecordCursor>>
 TerarkDbRecordStoreCapped::getManyCursors(OperationContext* txn) const {
-	return m_wiredtigerCappedStore->getManyCursors(txn);
+    std::vector<std::unique_ptr<RecordCursor>> cursors(1);
+    cursors[0] = stdx::make_unique<Cursor>(txn, *this, /*forward=*/true);
+    return cursors;
 }
 
 Status TerarkDbRecordStoreCapped::truncate(OperationContext* txn) {
-	return m_wiredtigerCappedStore->truncate(txn);
+	m_table->m_tab->clear();
+	m_numRecords.store(0);
+	m_dataSize.store(0);
+	return Status::OK();
 }
 
 bool TerarkDbRecordStoreCapped::compactSupported() const {
-	return m_wiredtigerCappedStore->compactSupported();
+	return false;
 }
 
 bool TerarkDbRecordStoreCapped::compactsInPlace() const {
-	return m_wiredtigerCappedStore->compactsInPlace();
+	return false;
 }
 
 Status TerarkDbRecordStoreCapped::compact(OperationContext* txn,
 										RecordStoreCompactAdaptor* adaptor,
 										const CompactOptions* options,
 										CompactStats* stats) {
-	return m_wiredtigerCappedStore->compact(txn, adaptor, options, stats);
+	return {ErrorCodes::CommandNotSupported,
+			"compact is not supported on capped collections"};
 }
 
 Status TerarkDbRecordStoreCapped::validate(OperationContext* txn,
@@ -258,47 +774,138 @@ Status TerarkDbRecordStoreCapped::validate(OperationContext* txn,
 										 ValidateAdaptor* adaptor,
 										 ValidateResults* results,
 										 BSONObjBuilder* output) {
-	return m_wiredtigerCappedStore->
-		validate(txn, full, scanData, adaptor, results, output);
+	// scan the rid index: RecordIds must be ascending and unique, and the
+	// rid column of each row must be the same as its rid index key
+	CompositeTable* tab = m_table->m_tab.get();
+	auto& td = myThreadData();
+	terark::db::IndexIteratorPtr iter = tab->createIndexIterForward(m_ridIndexId);
+	terark::valvec<unsigned char> key, row;
+	llong recIdx, prevRid = 0;
+	long long nrecords = 0, dataSizeTotal = 0, nInvalid = 0;
+	while (iter->increment(&recIdx, &key)) {
+		llong rid = ridOfKey(key);
+		if (nrecords && rid <= prevRid) {
+			results->valid = false;
+			results->errors.push_back(str::stream()
+				<< "RecordId " << rid << " is not greater than " << prevRid);
+		}
+		prevRid = rid;
+		nrecords++;
+		tab->getValue(recIdx, &row, &*td.m_dbCtx);
+		if (row.size() < sizeof(llong) ||
+				memcmp(row.data(), key.data(), sizeof(llong)) != 0) {
+			results->valid = false;
+			results->errors.push_back(str::stream()
+				<< "rid index key mismatch for RecordId " << rid);
+			nInvalid++;
+			continue;
+		}
+		size_t dataSize = row.size() - sizeof(llong);
+		if (full && scanData) {
+			Status status = adaptor->validate(rowToRecordData(row), &dataSize);
+			if (!status.isOK()) {
+				results->valid = false;
+				nInvalid++;
+			}
+		}
+		dataSizeTotal += dataSize;
+	}
+	if (nInvalid) {
+		results->errors.push_back(str::stream()
+			<< "detected " << nInvalid << " invalid documents");
+	}
+	if (full && results->valid) {
+		// running counters are estimated after dropping segments
+		m_numRecords.store(nrecords);
+		m_dataSize.store(dataSizeTotal);
+	}
+	output->append("nInvalidDocuments", nInvalid);
+	output->appendNumber("nrecords", nrecords);
+	return Status::OK();
 }
 
 void TerarkDbRecordStoreCapped::appendCustomStats(OperationContext* txn,
 												BSONObjBuilder* result,
 												double scale) const {
-    return m_wiredtigerCappedStore->appendCustomStats(txn, result, scale);
+	result->appendBool("capped", true);
+	result->appendIntOrLL("max", m_cappedMaxDocs);
+	result->appendIntOrLL("maxSize", static_cast<long long>(m_cappedMaxSize / scale));
+	result->appendIntOrLL("segments", m_table->m_tab->getSegNum());
 }
 
 Status
 TerarkDbRecordStoreCapped::touch(OperationContext* txn, BSONObjBuilder* output)
 const {
-	return m_wiredtigerCappedStore->touch(txn, output);
+	return Status::OK();
 }
 
 void TerarkDbRecordStoreCapped::updateStatsAfterRepair(OperationContext* txn,
 											   long long numRecords,
 											   long long dataSize) {
-	return m_wiredtigerCappedStore->
-		updateStatsAfterRepair(txn, numRecords, dataSize);
+	m_numRecords.store(numRecords);
+	m_dataSize.store(dataSize);
 }
 
+// Delete records after end(or from end when inclusive) in descending order,
+// used by rollback, the records are almost always in the writable segment
 void TerarkDbRecordStoreCapped::temp_cappedTruncateAfter(OperationContext* txn,
 												 RecordId end,
 												 bool inclusive) {
-	return m_wiredtigerCappedStore->
-		temp_cappedTruncateAfter(txn, end, inclusive);
+	CompositeTable* tab = m_table->m_tab.get();
+	auto& td = myThreadData();
+	terark::db::IndexIteratorPtr iter = tab->createIndexIterBackward(m_ridIndexId);
+	terark::valvec<unsigned char> key, row;
+	llong recIdx;
+	while (iter->increment(&recIdx, &key)) {
+		RecordId id(ridOfKey(key));
+		if (id < end || (id == end && !inclusive))
+			break;
+		tab->getValue(recIdx, &row, &*td.m_dbCtx);
+		{
+			stdx::lock_guard<stdx::mutex> lock(m_cappedCallbackMutex);
+			if (m_cappedCallback) {
+				uassertStatusOK(m_cappedCallback->
+					aboutToDeleteCapped(txn, id, rowToRecordData(row)));
+			}
+		}
+		tab->removeRow(recIdx, &*td.m_dbCtx);
+		changeNumRecordsAndDataSize(-1, -llong(row.size() - sizeof(llong)));
+	}
+	if (!m_isOplog) {
+		llong maxRid = 0;
+		iter->reset();
+		if (iter->increment(&recIdx, &key))
+			maxRid = ridOfKey(key);
+		m_nextRid.store(maxRid + 1);
+	}
 }
 
+// Seek the rid index backward: the greatest RecordId <= startingPosition
 boost::optional<RecordId>
 TerarkDbRecordStoreCapped::oplogStartHack(OperationContext* txn,
 										const RecordId& startingPosition) const {
-	return m_wiredtigerCappedStore->oplogStartHack(txn, startingPosition);
+	if (!m_isOplog)
+		return boost::none;
+	CompositeTable* tab = m_table->m_tab.get();
+	terark::db::IndexIteratorPtr iter = tab->createIndexIterBackward(m_ridIndexId);
+	terark::valvec<unsigned char> key;
+	llong recIdx;
+	llong rid = startingPosition.repr();
+	if (iter->seekLowerBound(ridKey(rid), &recIdx, &key) < 0)
+		return RecordId(); // all records are greater than startingPosition
+	return RecordId(ridOfKey(key));
 }
 
 Status
 TerarkDbRecordStoreCapped::oplogDiskLocRegister(OperationContext* txn,
 											  const Timestamp& opTime) {
-	return m_wiredtigerCappedStore->oplogDiskLocRegister(txn, opTime);
+	// the RecordId of the optime is hidden until the unit of work is
+	// finished, readers of the oplog stop before this hole
+	StatusWith<RecordId> id = oploghack::keyForOptime(opTime);
+	if (!id.isOK())
+		return id.getStatus();
+	addUncommittedRid(txn, id.getValue().repr());
+	return Status::OK();
 }
 
-
 } } // namespace mongo::terarkdb
@@ -43,25 +43,28 @@
 #include "mongo/stdx/mutex.h"
 #include "mongo/util/concurrency/synchronization.h"
 #include "mongo/util/fail_point_service.h"
-#include "terarkdb_size_storer.h"
-
-namespace mongo {
-	class WiredTigerSizeStorer;
-}
 
 namespace mongo { namespace terarkdb {
 
-class TerarkDbKVEngine;
-
 class TerarkDbRecordStoreCapped : public RecordStore {
 public:
+    /**
+     * dbmeta.json of a capped table, the schema is built in:
+     *     rid: RecordId, ordered index, oplog RecordId is the optime
+     *     doc: the bson document
+     * MaxWrSegSize is derived from cappedMaxSize, so the oplog is split into
+     * about kSegmentsPerCappedTable segments, they play the role of oplog
+     * "stones": truncation drops the oldest frozen segments as a whole.
+     */
+    static std::string createDbMetaJson(int64_t cappedMaxSize);
+
     TerarkDbRecordStoreCapped(OperationContext* ctx,
 							StringData ns,
-							StringData uri,
-							int64_t cappedMaxSize,
-							int64_t cappedMaxDocs,
-							CappedCallback* cappedCallback,
-							WiredTigerSizeStorer* sizeStorer);
+							StringData ident,
+							ThreadSafeTable* tab,
+							int64_t cappedMaxSize,
+							int64_t cappedMaxDocs,
+							CappedCallback* cappedCallback);
 
     virtual ~TerarkDbRecordStoreCapped();
 
@@ -157,11 +160,48 @@ public:
                                 long long numRecords,
                                 long long dataSize) override;
 
-	TerarkDbKVEngine* m_terarkEngine;
-	std::unique_ptr<RecordStore> m_wiredtigerCappedStore;
+    void setCappedCallback(CappedCallback* cb) override;
+
+    ThreadSafeTablePtr m_table;
 
 private:
     class Cursor;
+    class RandomCursor;
+    class InsertChange;
+    class RemoveChange;
+    class UpdateChange;
+    class UncommittedRidChange;
+
+    TableThreadData& myThreadData() const;
+    bool findRecIdx(const RecordId& id, llong* recIdx) const;
+    StatusWith<RecordId> nextRecordId(const char* data, int len);
+    void cappedDeleteAsNeeded(OperationContext* txn);
+    void cappedDropOldestSegments();
+    void cappedDeleteOldestRecords(OperationContext* txn);
+    bool cappedAndNeedDelete() const;
+    void changeNumRecordsAndDataSize(long long numDiff, long long sizeDiff);
+
+    // RecordIds which are inserted(or registered by oplogDiskLocRegister)
+    // but not committed yet, forward cursors stop at the lowest one, so
+    // readers never skip a hole which is filled later
+    void addUncommittedRid(OperationContext* txn, llong rid);
+    bool isCappedHidden(llong rid) const;
+
+    const std::string _ident;
+    const bool m_isOplog;
+    const int64_t m_cappedMaxSize;
+    const int64_t m_cappedMaxDocs;
+    size_t m_ridIndexId;
+    AtomicInt64 m_nextRid; // used by non-oplog capped collections
+    // Running record count and doc bytes, set by scanning segments when
+    // opened, then maintained by each insert/update/delete
+    AtomicInt64 m_numRecords;
+    AtomicInt64 m_dataSize;
+    mutable stdx::mutex m_uncommittedRidsMutex;
+    std::set<llong> m_uncommittedRids;
+    stdx::mutex m_cappedDeleterMutex; // one capped deleter at a time
+    stdx::mutex m_cappedCallbackMutex;
+    CappedCallback* m_cappedCallback;
 };
 
 // TerarkDb failpoint to throw write conflict exceptions randomly
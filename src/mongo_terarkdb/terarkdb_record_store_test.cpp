@@ -40,13 +40,16 @@
 #include "mongo/db/json.h"
 #include "mongo/db/operation_context_noop.h"
 #include "mongo/db/storage/record_store_test_harness.h"
+#include "mongo/db/storage/recovery_unit_noop.h"
 #include "terarkdb_recovery_unit.h"
 #include "terarkdb_record_store.h"
+#include "terarkdb_record_store_capped.h"
 #include "terarkdb_record_store_oplog_stones.h"
 #include "terarkdb_session_cache.h"
 #include "terarkdb_size_storer.h"
 #include "mongo/unittest/temp_dir.h"
 #include "mongo/unittest/unittest.h"
+#include <terark/io/FileStream.hpp>
 
 namespace mongo { namespace terarkdb {
 
@@ -1442,4 +1445,225 @@ TEST(TerarkDbRecordStoreTest, OplogStones_AscendingOrder) {
     }
 }
 
+namespace {
+
+// TerarkDbRecordStoreCapped on a new table in a temp dir
+class CappedHarness {
+public:
+    CappedHarness(StringData ns, int64_t cappedMaxSize, int64_t cappedMaxDocs)
+        : _dbpath("terark_capped_test") {
+        fs::path tabDir = fs::path(_dbpath.path()) / "capped";
+        fs::create_directories(tabDir);
+        {
+            std::string meta = TerarkDbRecordStoreCapped::createDbMetaJson(cappedMaxSize);
+            terark::FileStream fp((tabDir / "dbmeta.json").string().c_str(), "w");
+            fp.ensureWrite(meta.data(), meta.size());
+        }
+        unique_ptr<OperationContext> opCtx(newOperationContext());
+        rs.reset(new TerarkDbRecordStoreCapped(opCtx.get(), ns, "collection-capped",
+                                               new ThreadSafeTable(tabDir),
+                                               cappedMaxSize, cappedMaxDocs, NULL));
+    }
+
+    unique_ptr<OperationContext> newOperationContext() {
+        return stdx::make_unique<OperationContextNoop>(new RecoveryUnitNoop());
+    }
+
+    RecordId insert(OperationContext* txn, const std::string& data) {
+        StatusWith<RecordId> res =
+            rs->insertRecord(txn, data.c_str(), data.size() + 1, false);
+        ASSERT_OK(res.getStatus());
+        return res.getValue();
+    }
+
+    RecordId insertOplog(OperationContext* txn, Timestamp opTime) {
+        ASSERT_OK(rs->oplogDiskLocRegister(txn, opTime));
+        BSONObj obj = BSON("ts" << opTime);
+        StatusWith<RecordId> res = rs->insertRecord(txn, obj.objdata(), obj.objsize(), false);
+        ASSERT_OK(res.getStatus());
+        return res.getValue();
+    }
+
+    std::vector<RecordId> scan(bool forward = true) {
+        unique_ptr<OperationContext> opCtx(newOperationContext());
+        std::vector<RecordId> ids;
+        auto cursor = rs->getCursor(opCtx.get(), forward);
+        while (auto record = cursor->next()) {
+            ids.push_back(record->id);
+        }
+        return ids;
+    }
+
+    unittest::TempDir _dbpath;
+    unique_ptr<TerarkDbRecordStoreCapped> rs;
+};
+
+}  // namespace
+
+// old records are deleted by cappedMaxDocs and cappedMaxSize, the running
+// numRecords/dataSize match a full validate
+TEST(TerarkDbRecordStoreCappedTest, Rollover) {
+    CappedHarness h("a.capped", 10000, 10);
+    const std::string doc(99, 'x'); // 100 bytes with '\0'
+    RecordId last;
+    for (int i = 0; i < 100; ++i) {
+        unique_ptr<OperationContext> opCtx(h.newOperationContext());
+        WriteUnitOfWork uow(opCtx.get());
+        last = h.insert(opCtx.get(), doc);
+        uow.commit();
+    }
+    ASSERT_EQUALS(10, h.rs->numRecords(NULL));
+    ASSERT_EQUALS(1000, h.rs->dataSize(NULL));
+    std::vector<RecordId> ids = h.scan();
+    ASSERT_EQUALS(10U, ids.size());
+    ASSERT_EQ(last, ids.back());
+    ASSERT_EQ(RecordId(last.repr() - 9), ids.front());
+
+    unique_ptr<OperationContext> opCtx(h.newOperationContext());
+    ValidateResults results;
+    BSONObjBuilder output;
+    ASSERT_OK(h.rs->validate(opCtx.get(), true, false, NULL, &results, &output));
+    ASSERT(results.valid);
+    ASSERT_EQUALS(10, output.obj().getIntField("nrecords"));
+    ASSERT_EQUALS(10, h.rs->numRecords(NULL));
+    ASSERT_EQUALS(1000, h.rs->dataSize(NULL));
+}
+
+TEST(TerarkDbRecordStoreCappedTest, RolloverBySize) {
+    CappedHarness h("a.capped", 10000, -1);
+    const std::string doc(999, 'x');
+    for (int i = 0; i < 50; ++i) {
+        unique_ptr<OperationContext> opCtx(h.newOperationContext());
+        WriteUnitOfWork uow(opCtx.get());
+        h.insert(opCtx.get(), doc);
+        uow.commit();
+    }
+    ASSERT_LTE(h.rs->dataSize(NULL), 10000);
+    ASSERT_EQUALS(10, h.rs->numRecords(NULL));
+    ASSERT_EQUALS(10U, h.scan().size());
+}
+
+// insert, update and delete are undone when the unit of work is rolled back
+TEST(TerarkDbRecordStoreCappedTest, Rollback) {
+    CappedHarness h("a.capped", 100000, -1);
+    RecordId id1, id2;
+    {
+        unique_ptr<OperationContext> opCtx(h.newOperationContext());
+        WriteUnitOfWork uow(opCtx.get());
+        id1 = h.insert(opCtx.get(), "aaa");
+        id2 = h.insert(opCtx.get(), "bbb");
+        uow.commit();
+    }
+    {
+        unique_ptr<OperationContext> opCtx(h.newOperationContext());
+        WriteUnitOfWork uow(opCtx.get());
+        h.insert(opCtx.get(), "ccc");
+        ASSERT_OK(h.rs->updateRecord(opCtx.get(), id2, "BBB", 4, false, NULL));
+        h.rs->deleteRecord(opCtx.get(), id1);
+        ASSERT_EQUALS(2, h.rs->numRecords(NULL));
+        // not committed
+    }
+    ASSERT_EQUALS(2, h.rs->numRecords(NULL));
+    ASSERT_EQUALS(8, h.rs->dataSize(NULL));
+    std::vector<RecordId> ids = h.scan();
+    ASSERT_EQUALS(2U, ids.size());
+    ASSERT_EQ(id1, ids[0]);
+    ASSERT_EQ(id2, ids[1]);
+    unique_ptr<OperationContext> opCtx(h.newOperationContext());
+    ASSERT_EQUALS(std::string("aaa"), h.rs->dataFor(opCtx.get(), id1).data());
+    ASSERT_EQUALS(std::string("bbb"), h.rs->dataFor(opCtx.get(), id2).data());
+}
+
+// temp_cappedTruncateAfter is used by replication rollback
+TEST(TerarkDbRecordStoreCappedTest, TruncateAfter) {
+    CappedHarness h("a.capped", 100000, -1);
+    std::vector<RecordId> inserted;
+    for (int i = 0; i < 10; ++i) {
+        unique_ptr<OperationContext> opCtx(h.newOperationContext());
+        WriteUnitOfWork uow(opCtx.get());
+        inserted.push_back(h.insert(opCtx.get(), "doc"));
+        uow.commit();
+    }
+    {
+        unique_ptr<OperationContext> opCtx(h.newOperationContext());
+        h.rs->temp_cappedTruncateAfter(opCtx.get(), inserted[5], false);
+    }
+    ASSERT_EQUALS(6, h.rs->numRecords(NULL));
+    ASSERT_EQ(inserted[5], h.scan().back());
+    {
+        unique_ptr<OperationContext> opCtx(h.newOperationContext());
+        h.rs->temp_cappedTruncateAfter(opCtx.get(), inserted[3], true);
+    }
+    ASSERT_EQUALS(3, h.rs->numRecords(NULL));
+    ASSERT_EQ(inserted[2], h.scan().back());
+    {
+        // the RecordId sequence restarts after the max RecordId
+        unique_ptr<OperationContext> opCtx(h.newOperationContext());
+        WriteUnitOfWork uow(opCtx.get());
+        ASSERT_EQ(inserted[3], h.insert(opCtx.get(), "doc"));
+        uow.commit();
+    }
+}
+
+// forward cursors of the oplog stop before a registered but not committed
+// optime, the hole disappears on commit or rollback
+TEST(TerarkDbRecordStoreCappedTest, OplogHoles) {
+    CappedHarness h("local.oplog.rs", 100000, -1);
+    {
+        unique_ptr<OperationContext> opCtx(h.newOperationContext());
+        WriteUnitOfWork uow(opCtx.get());
+        h.insertOplog(opCtx.get(), Timestamp(1, 1));
+        uow.commit();
+    }
+    unique_ptr<OperationContext> t1(h.newOperationContext());
+    unique_ptr<WriteUnitOfWork> w1(new WriteUnitOfWork(t1.get()));
+    ASSERT_OK(h.rs->oplogDiskLocRegister(t1.get(), Timestamp(1, 2)));
+    RecordId id3;
+    {
+        unique_ptr<OperationContext> t2(h.newOperationContext());
+        WriteUnitOfWork w2(t2.get());
+        id3 = h.insertOplog(t2.get(), Timestamp(1, 3));
+        w2.commit();
+    }
+    ASSERT_EQUALS(1U, h.scan().size()); // Timestamp(1,3) is after the hole
+    ASSERT_EQUALS(2U, h.scan(false).size());
+    w1.reset(); // rollback
+    std::vector<RecordId> ids = h.scan();
+    ASSERT_EQUALS(2U, ids.size());
+    ASSERT_EQ(id3, ids.back());
+
+    unique_ptr<OperationContext> opCtx(h.newOperationContext());
+    ASSERT_EQ(id3, h.rs->oplogStartHack(opCtx.get(), RecordId(2, 0)).get());
+    ASSERT_EQ(RecordId(), h.rs->oplogStartHack(opCtx.get(), RecordId(0, 1)).get());
+}
+
+TEST(TerarkDbRecordStoreCappedTest, RandomCursor) {
+    CappedHarness h("a.capped", 100000, -1);
+    {
+        unique_ptr<OperationContext> opCtx(h.newOperationContext());
+        auto cursor = h.rs->getRandomCursor(opCtx.get());
+        ASSERT(cursor);
+        ASSERT(!cursor->next());
+    }
+    std::set<RecordId> inserted;
+    {
+        unique_ptr<OperationContext> opCtx(h.newOperationContext());
+        WriteUnitOfWork uow(opCtx.get());
+        for (int i = 0; i < 100; ++i)
+            inserted.insert(h.insert(opCtx.get(), "doc"));
+        uow.commit();
+    }
+    unique_ptr<OperationContext> opCtx(h.newOperationContext());
+    auto cursor = h.rs->getRandomCursor(opCtx.get());
+    std::set<RecordId> seen;
+    for (int i = 0; i < 200; ++i) {
+        auto record = cursor->next();
+        ASSERT(record);
+        ASSERT(inserted.count(record->id));
+        ASSERT_EQUALS(std::string("doc"), record->data.data());
+        seen.insert(record->id);
+    }
+    ASSERT_GT(seen.size(), 1U);
+}
+
 } } // namespace mongo::terarkdb
@@ -65,6 +65,7 @@ TerarkDbServerStatusSection::generateSection(OperationContext* txn,
     BSONObjBuilder bob;
 
 //    TerarkDbRecoveryUnit::appendGlobalStats(bob);
+    _engine->appendStats(bob);
 
     return bob.obj();
 }
@@ -84,6 +84,21 @@ const {
 	val->append(m_store + offset0, offset1 - offset0);
 }
 
+bool
+RandomReadAppendonlyStore::getValuePinned(llong id, fstring* val, DbContext*)
+const {
+	assert(id >= 0);
+	llong rows = llong(m_index->rowsNum);
+	if (id >= rows) {
+		THROW_STD(out_of_range, "id = %lld, rows = %lld", id, rows);
+	}
+	uint64_t offset0 = m_index->getOffset(id+0);
+	uint64_t offset1 = m_index->getOffset(id+1);
+	TERARK_RT_assert(offset0 <= offset1, std::logic_error);
+	*val = fstring((const char*)m_store + offset0, offset1 - offset0);
+	return true;
+}
+
 StoreIterator* RandomReadAppendonlyStore::createStoreIterForward(DbContext* ctx) const {
 	return nullptr;
 }
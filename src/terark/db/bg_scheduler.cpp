@@ -0,0 +1,464 @@
+#include "bg_scheduler.hpp"
+#include <terark/util/profiling.hpp>
+#include <boost/filesystem.hpp>
+#include <terark/num_to_str.hpp>
+#include <algorithm>
+#include <chrono>
+#include "json.hpp"
+
+namespace terark { namespace db {
+
+static profiling g_bgpf;
+
+BgTask::BgTask(Priority pri, const void* owner)
+  : m_priority(pri), m_owner(owner) {
+	assert(pri < PriorityNum);
+	m_enqueueTime = 0;
+}
+BgTask::~BgTask() {
+}
+
+class BgScheduler::Worker {
+public:
+	std::thread thr;
+	const bool isFlushPool;
+	bool retire;
+	explicit Worker(bool isFlush) : isFlushPool(isFlush), retire(false) {}
+};
+
+static size_t getEnvThreadNum(const char* envName, size_t defaultNum) {
+	size_t n = std::thread::hardware_concurrency();
+	if (const char* env = getenv(envName)) {
+		n = std::min<size_t>(n, atoi(env));
+	}
+	else {
+		n = std::min<size_t>(n, defaultNum);
+	}
+	return std::max<size_t>(n, 1);
+}
+
+BgScheduler& BgScheduler::instance() {
+	static BgScheduler sched;
+	return sched;
+}
+
+BgScheduler::BgScheduler() {
+	m_flushThreadNum = getEnvThreadNum("TerarkDB_FlushThreadsNum", 1);
+	m_compressThreadNum = getEnvThreadNum("TerarkDB_CompressionThreadsNum", 4);
+	m_started = false;
+	m_stopping = false;
+	m_drainAll = false;
+	memset(m_stats, 0, sizeof(m_stats));
+	m_rateLimit = 0;
+	if (const char* env = getenv("TerarkDB_BgWriteBytesPerSec")) {
+		m_rateLimit = atoll(env);
+	}
+	m_tokens = 0;
+	m_lastRefill = g_bgpf.now();
+	m_throttledBytes = 0;
+	m_throttledMs = 0;
+	m_memBudget = 0;
+	if (const char* env = getenv("TerarkDB_BgMemBudget")) {
+		m_memBudget = atoll(env);
+	}
+	m_memUsed = 0;
+	m_memWaits = 0;
+	m_memWaitMs = 0;
+}
+
+BgScheduler::~BgScheduler() {
+	if (m_started && !m_stopping)
+		stopAndWait(false);
+}
+
+void BgScheduler::startThreadsInLock() {
+	assert(!m_started);
+	m_started = true;
+	adjustThreadsInLock(true, m_flushThreadNum);
+	adjustThreadsInLock(false, m_compressThreadNum);
+}
+
+void BgScheduler::adjustThreadsInLock(bool isFlushPool, size_t n) {
+	joinRetiredInLock();
+	auto& workers = isFlushPool ? m_flushWorkers : m_compressWorkers;
+	size_t active = 0;
+	for (Worker* w : workers) {
+		if (!w->retire) {
+			if (active < n)
+				active++;
+			else
+				w->retire = true;
+		}
+	}
+	for (; active < n; ++active) {
+		Worker* w = new Worker(isFlushPool);
+		w->thr = std::thread(&BgScheduler::threadProc, this, w);
+		workers.push_back(w);
+	}
+	m_cond.notify_all();
+}
+
+// a retired worker moves itself to m_retiredWorkers just before its thread
+// exits without taking m_mutex again, so join in lock does not dead lock
+void BgScheduler::joinRetiredInLock() {
+	for (Worker* w : m_retiredWorkers) {
+		w->thr.join();
+		delete w;
+	}
+	m_retiredWorkers.clear();
+}
+
+void BgScheduler::setFlushThreadNum(size_t n) {
+	n = std::max<size_t>(n, 1); // flush must always make progress
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_flushThreadNum = n;
+	if (m_started && !m_stopping)
+		adjustThreadsInLock(true, n);
+}
+
+void BgScheduler::setCompressThreadNum(size_t n) {
+	n = std::max<size_t>(n, 1);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_compressThreadNum = n;
+	if (m_started && !m_stopping)
+		adjustThreadsInLock(false, n);
+}
+
+size_t BgScheduler::getFlushThreadNum() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_flushThreadNum;
+}
+
+size_t BgScheduler::getCompressThreadNum() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_compressThreadNum;
+}
+
+bool BgScheduler::submit(BgTask* task) {
+	BgTaskPtr holder(task);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_stopping) {
+		// while draining, tasks generated by running tasks are accepted
+		if (!m_drainAll && task->m_priority != BgTask::Flush)
+			return false;
+		if (m_flushWorkers.empty() && m_compressWorkers.empty())
+			return false;
+	}
+	if (!m_started) {
+		startThreadsInLock();
+	}
+	task->m_enqueueTime = g_bgpf.now();
+	auto& pq = m_queues[task->m_priority];
+	auto iter = std::find_if(pq.owners.begin(), pq.owners.end(),
+		[task](const OwnerQueue& x) { return x.owner == task->m_owner; });
+	if (pq.owners.end() == iter) {
+		pq.owners.push_back(OwnerQueue());
+		pq.owners.back().owner = task->m_owner;
+		pq.owners.back().tasks.push_back(holder);
+	}
+	else {
+		iter->tasks.push_back(holder);
+	}
+	pq.size++;
+	m_stats[task->m_priority].queued++;
+	m_stats[task->m_priority].submitted++;
+	m_cond.notify_all();
+	return true;
+}
+
+BgTaskPtr BgScheduler::popTaskInLock(bool isFlushPool) {
+	size_t priEnd = isFlushPool ? BgTask::Flush + 1 : BgTask::PriorityNum;
+	for (size_t pri = 0; pri < priEnd; ++pri) {
+		if (m_stopping && !m_drainAll && pri != BgTask::Flush)
+			break;
+		if (pri != BgTask::Flush && m_memBudget > 0 && m_memUsed >= m_memBudget)
+			break; // back pressure, the task would wait in acquireMem
+		auto& pq = m_queues[pri];
+		for (size_t i = 0; i < pq.owners.size(); ++i) {
+			auto& oq = pq.owners[i];
+			if (BgTask::Flush == pri &&
+				m_runningFlushOwners.end() != std::find(
+					m_runningFlushOwners.begin(),
+					m_runningFlushOwners.end(), oq.owner)) {
+				continue; // keep flush order of one owner
+			}
+			BgTaskPtr t = oq.tasks.front();
+			oq.tasks.pop_front();
+			// move this owner to tail: round robin
+			OwnerQueue moved;
+			moved.owner = oq.owner;
+			moved.tasks.swap(oq.tasks);
+			pq.owners.erase(pq.owners.begin() + i);
+			if (!moved.tasks.empty()) {
+				pq.owners.push_back(OwnerQueue());
+				pq.owners.back().owner = moved.owner;
+				pq.owners.back().tasks.swap(moved.tasks);
+			}
+			pq.size--;
+			m_stats[pri].queued--;
+			if (BgTask::Flush == pri)
+				m_runningFlushOwners.push_back(t->m_owner);
+			return t;
+		}
+	}
+	return nullptr;
+}
+
+void BgScheduler::threadProc(Worker* w) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		if (w->retire) {
+			// if stopAndWait has taken w, it joins w
+			auto& workers = w->isFlushPool ? m_flushWorkers : m_compressWorkers;
+			auto iter = std::find(workers.begin(), workers.end(), w);
+			if (workers.end() != iter) {
+				workers.erase(iter);
+				m_retiredWorkers.push_back(w);
+			}
+			break;
+		}
+		BgTaskPtr t = popTaskInLock(w->isFlushPool);
+		if (!t) {
+			if (m_stopping) {
+				bool hasRunning = false;
+				for (auto& s : m_stats) hasRunning |= s.running > 0;
+				bool hasQueued = m_queues[BgTask::Flush].size > 0;
+				if (m_drainAll) {
+					for (auto& pq : m_queues) hasQueued |= pq.size > 0;
+				}
+				// running tasks may generate new tasks
+				if (!hasQueued && !hasRunning)
+					break;
+			}
+			m_cond.wait_for(lock, std::chrono::milliseconds(100));
+			continue;
+		}
+		auto& st = m_stats[t->m_priority];
+		st.running++;
+		lock.unlock();
+		long long t0 = g_bgpf.now();
+		bool ok = true;
+		try {
+			t->execute();
+		}
+		catch (const std::exception& ex) {
+			ok = false;
+			fprintf(stderr, "ERROR: background task(priority=%d) failed: %s\n"
+				, int(t->m_priority), ex.what());
+		}
+		catch (...) {
+			ok = false;
+			fprintf(stderr, "ERROR: background task(priority=%d) failed: unknown exception\n"
+				, int(t->m_priority));
+		}
+		long long t1 = g_bgpf.now();
+		lock.lock();
+		double waitMs = g_bgpf.mf(t->m_enqueueTime, t0);
+		double runMs = g_bgpf.mf(t0, t1);
+		st.running--;
+		st.finished++;
+		st.failed += ok ? 0 : 1;
+		st.sumWaitMs += waitMs;
+		st.sumRunMs += runMs;
+		st.maxWaitMs = std::max(st.maxWaitMs, waitMs);
+		st.maxRunMs = std::max(st.maxRunMs, runMs);
+		if (BgTask::Flush == t->m_priority) {
+			auto& rfo = m_runningFlushOwners;
+			auto iter = std::find(rfo.begin(), rfo.end(), t->m_owner);
+			assert(rfo.end() != iter);
+			rfo.erase_i(iter - rfo.begin(), 1);
+		}
+		t.reset();
+		m_cond.notify_all();
+	}
+}
+
+void BgScheduler::stopAndWait(bool drainAll) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_stopping) {
+			return;
+		}
+		m_stopping = true;
+		m_drainAll = drainAll;
+		m_cond.notify_all();
+	}
+	for (;;) {
+		std::deque<Worker*> workers;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			workers.insert(workers.end(), m_flushWorkers.begin(), m_flushWorkers.end());
+			workers.insert(workers.end(), m_compressWorkers.begin(), m_compressWorkers.end());
+			workers.insert(workers.end(), m_retiredWorkers.begin(), m_retiredWorkers.end());
+			m_flushWorkers.clear();
+			m_compressWorkers.clear();
+			m_retiredWorkers.clear();
+		}
+		if (workers.empty())
+			break;
+		for (Worker* w : workers) {
+			w->thr.join();
+			delete w;
+		}
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	size_t discarded = 0;
+	for (auto& pq : m_queues) {
+		discarded += pq.size;
+		pq.owners.clear();
+		pq.size = 0;
+	}
+	for (auto& s : m_stats) {
+		s.queued = 0;
+	}
+	fprintf(stderr, "INFO: background threads completed, discarded tasks = %zd\n"
+		, discarded);
+}
+
+void BgScheduler::setRateLimit(long long bytesPerSec) {
+	std::lock_guard<std::mutex> lock(m_rateMutex);
+	m_rateLimit = bytesPerSec;
+	m_tokens = 0;
+	m_lastRefill = g_bgpf.now();
+}
+
+long long BgScheduler::getRateLimit() const {
+	std::lock_guard<std::mutex> lock(m_rateMutex);
+	return m_rateLimit;
+}
+
+// token bucket, bucket capacity is one second of rate limit
+void BgScheduler::throttle(size_t bytes) {
+	long long waitNs;
+	{
+		std::lock_guard<std::mutex> lock(m_rateMutex);
+		if (m_rateLimit <= 0) {
+			return;
+		}
+		long long now = g_bgpf.now();
+		double rate = double(m_rateLimit);
+		m_tokens = std::min(rate, m_tokens + g_bgpf.sf(m_lastRefill, now) * rate);
+		m_lastRefill = now;
+		m_tokens -= bytes;
+		if (m_tokens >= 0) {
+			return;
+		}
+		waitNs = (long long)(-m_tokens / rate * 1e9);
+		m_throttledBytes += bytes;
+		m_throttledMs += waitNs / 1e6;
+	}
+	std::this_thread::sleep_for(std::chrono::nanoseconds(waitNs));
+}
+
+void throttleWrittenFiles(const boost::filesystem::path& dir) {
+	namespace fs = boost::filesystem;
+	if (BgScheduler::instance().getRateLimit() <= 0) {
+		return;
+	}
+	size_t bytes = 0;
+	for (fs::recursive_directory_iterator iter(dir), end; iter != end; ++iter) {
+		const fs::path& fpath = iter->path();
+		if (fs::is_regular_file(fpath) && fs::hard_link_count(fpath) == 1) {
+			bytes += size_t(fs::file_size(fpath));
+		}
+	}
+	BgScheduler::instance().throttle(bytes);
+}
+
+void BgScheduler::setMemBudget(long long bytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_memBudget = bytes;
+	m_memCond.notify_all();
+	m_cond.notify_all();
+}
+
+long long BgScheduler::getMemBudget() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_memBudget;
+}
+
+size_t BgScheduler::acquireMem(size_t bytes) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_memBudget <= 0) {
+		m_memUsed += bytes;
+		return bytes;
+	}
+	bytes = std::min<size_t>(bytes, size_t(m_memBudget));
+	if (m_memUsed > 0 && m_memUsed + llong(bytes) > m_memBudget) {
+		long long t0 = g_bgpf.now();
+		m_memWaits++;
+		m_memCond.wait(lock, [&]() {
+			return m_memBudget <= 0 || 0 == m_memUsed ||
+				   m_memUsed + llong(bytes) <= m_memBudget;
+		});
+		m_memWaitMs += g_bgpf.mf(t0, g_bgpf.now());
+	}
+	m_memUsed += bytes;
+	return bytes;
+}
+
+void BgScheduler::releaseMem(size_t acquired) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	assert(m_memUsed >= llong(acquired));
+	m_memUsed -= acquired;
+	m_memCond.notify_all();
+	m_cond.notify_all();
+}
+
+size_t BgScheduler::capWorkMem(size_t workMem) const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_memBudget > 0)
+		return std::min<size_t>(workMem, size_t(m_memBudget));
+	return workMem;
+}
+
+BgScheduler::Stats BgScheduler::getStats() const {
+	Stats s;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		memcpy(s.pri, m_stats, sizeof(m_stats));
+		s.flushThreads = m_flushThreadNum;
+		s.compressThreads = m_compressThreadNum;
+		s.memBudget = m_memBudget;
+		s.memUsed = m_memUsed;
+		s.memWaits = m_memWaits;
+		s.memWaitMs = m_memWaitMs;
+	}
+	auto self = const_cast<BgScheduler*>(this);
+	std::lock_guard<std::mutex> lock(self->m_rateMutex);
+	s.rateLimitBytesPerSec = m_rateLimit;
+	s.throttledBytes = m_throttledBytes;
+	s.throttledMs = m_throttledMs;
+	return s;
+}
+
+std::string BgScheduler::getStatsJson() const {
+	static const char* priNames[] = { "flush", "compress", "merge" };
+	Stats s = getStats();
+	json js;
+	for (size_t i = 0; i < BgTask::PriorityNum; ++i) {
+		const PriorityStats& p = s.pri[i];
+		json& jp = js[priNames[i]];
+		jp["queued"] = p.queued;
+		jp["running"] = p.running;
+		jp["submitted"] = p.submitted;
+		jp["finished"] = p.finished;
+		jp["failed"] = p.failed;
+		jp["avgWaitMs"] = p.finished ? p.sumWaitMs / p.finished : 0.0;
+		jp["maxWaitMs"] = p.maxWaitMs;
+		jp["avgRunMs"] = p.finished ? p.sumRunMs / p.finished : 0.0;
+		jp["maxRunMs"] = p.maxRunMs;
+	}
+	js["flushThreads"] = s.flushThreads;
+	js["compressThreads"] = s.compressThreads;
+	js["rateLimitBytesPerSec"] = s.rateLimitBytesPerSec;
+	js["throttledBytes"] = s.throttledBytes;
+	js["throttledMs"] = s.throttledMs;
+	js["memBudget"] = s.memBudget;
+	js["memUsed"] = s.memUsed;
+	js["memWaits"] = s.memWaits;
+	js["memWaitMs"] = s.memWaitMs;
+	return js.dump();
+}
+
+} } // namespace terark::db
@@ -0,0 +1,195 @@
+#ifndef __terark_db_bg_scheduler_hpp__
+#define __terark_db_bg_scheduler_hpp__
+
+#include "db_conf.hpp"
+#include <boost/filesystem/path.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace terark { namespace db {
+
+class TERARK_DB_DLL BgTask : public RefCounter {
+public:
+	// smaller value is more urgent
+	enum Priority {
+		Flush,    // freeze and flush writable segment
+		Compress, // convert writable segment to readonly segment
+		Merge,    // merge segments and purge deleted records
+		PriorityNum
+	};
+	///@param owner tasks of the same owner(the table) are fairly scheduled
+	///             with tasks of other owners in the same priority
+	BgTask(Priority pri, const void* owner);
+	~BgTask();
+	virtual void execute() = 0;
+
+	const Priority   m_priority;
+	const void*const m_owner;
+	long long        m_enqueueTime;
+};
+typedef boost::intrusive_ptr<BgTask> BgTaskPtr;
+
+// Background job scheduler shared by all tables.
+//
+// Flush threads only run Flush tasks, so flushes never queue behind a long
+// compress or merge. Compress threads run the most urgent task available:
+// Flush > Compress > Merge. In each priority, owners are served round robin,
+// so a table with many queued tasks does not starve other tables.
+// Flush tasks of one owner run one at a time, in submission order.
+//
+// Background writers call throttle(bytes) with bytes written to disk to
+// honor the bytes/sec limit.
+//
+// Builders of readonly segments(compress, merge, purge) hold their working
+// memory from a memory budget shared by all tables, acquireMem blocks until
+// the budget is available. When the budget is exhausted, Compress and Merge
+// tasks are not started, only Flush tasks are.
+class TERARK_DB_DLL BgScheduler {
+	TERARK_DB_NON_COPYABLE_CLASS(BgScheduler);
+public:
+	struct PriorityStats {
+		size_t    queued;   // current queue depth
+		size_t    running;
+		long long submitted;
+		long long finished;
+		long long failed;
+		double    sumWaitMs;
+		double    maxWaitMs;
+		double    sumRunMs;
+		double    maxRunMs;
+	};
+	struct Stats {
+		PriorityStats pri[BgTask::PriorityNum];
+		size_t    flushThreads;
+		size_t    compressThreads;
+		long long rateLimitBytesPerSec;
+		long long throttledBytes;
+		double    throttledMs;
+		long long memBudget;
+		long long memUsed;
+		long long memWaits;
+		double    memWaitMs;
+	};
+
+	static BgScheduler& instance();
+
+	BgScheduler();
+	~BgScheduler();
+
+	///@returns false if the scheduler is stopping, task is discarded
+	bool submit(BgTask* task);
+
+	void setFlushThreadNum(size_t n);
+	void setCompressThreadNum(size_t n);
+	size_t getFlushThreadNum() const;
+	size_t getCompressThreadNum() const;
+
+	///@param bytesPerSec <= 0 means unlimited
+	void setRateLimit(long long bytesPerSec);
+	long long getRateLimit() const;
+	void throttle(size_t bytes);
+
+	///@param bytes <= 0 means unlimited
+	void setMemBudget(long long bytes);
+	long long getMemBudget() const;
+	///@returns acquired bytes, which is min(bytes, budget), it should be
+	///         passed to releaseMem. A request larger than the budget is
+	///         granted when no memory is held by others
+	size_t acquireMem(size_t bytes);
+	void releaseMem(size_t acquired);
+	///@returns min(workMem, budget), for sizing parts of a build
+	size_t capWorkMem(size_t workMem) const;
+
+	Stats getStats() const;
+	std::string getStatsJson() const;
+
+	///@param drainAll if false, only queued Flush tasks are executed,
+	///                other queued tasks are discarded
+	void stopAndWait(bool drainAll);
+	bool isStopping() const { return m_stopping.load(std::memory_order_relaxed); }
+
+private:
+	typedef std::deque<BgTaskPtr> TaskQueue;
+	struct OwnerQueue {
+		const void* owner;
+		TaskQueue   tasks;
+	};
+	struct PriorityQueue {
+		std::deque<OwnerQueue> owners; // round robin
+		size_t size = 0;
+	};
+	class Worker;
+
+	void startThreadsInLock();
+	void adjustThreadsInLock(bool isFlushPool, size_t n);
+	void joinRetiredInLock();
+	BgTaskPtr popTaskInLock(bool isFlushPool);
+	void threadProc(Worker* w);
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_cond;
+	PriorityQueue m_queues[BgTask::PriorityNum];
+	valvec<const void*> m_runningFlushOwners;
+	std::deque<Worker*> m_flushWorkers;
+	std::deque<Worker*> m_compressWorkers;
+	std::deque<Worker*> m_retiredWorkers; // exited, to be joined
+	size_t m_flushThreadNum;
+	size_t m_compressThreadNum;
+	bool   m_started;
+	std::atomic<bool> m_stopping;
+	bool   m_drainAll;
+	PriorityStats m_stats[BgTask::PriorityNum];
+
+	// token bucket of rate limiter
+	mutable std::mutex m_rateMutex;
+	long long  m_rateLimit;
+	double     m_tokens;
+	long long  m_lastRefill;
+	long long  m_throttledBytes;
+	double     m_throttledMs;
+
+	// memory budget, guarded by m_mutex
+	std::condition_variable m_memCond;
+	long long  m_memBudget;
+	long long  m_memUsed;
+	long long  m_memWaits;
+	double     m_memWaitMs;
+};
+
+// charge sizes of files in dir(recursive) to BgScheduler::throttle, files
+// which have more than one hard link are reused, not written
+void throttleWrittenFiles(const boost::filesystem::path& dir);
+
+// accumulate small writes of a background task, pass them to
+// BgScheduler::throttle in chunks to avoid locking on each record
+class BgWriteThrottle {
+	size_t m_pending;
+public:
+	static const size_t ChunkSize = 1024 * 1024;
+	BgWriteThrottle() : m_pending(0) {}
+	void add(size_t bytes) {
+		m_pending += bytes;
+		if (terark_unlikely(m_pending >= ChunkSize)) {
+			BgScheduler::instance().throttle(m_pending);
+			m_pending = 0;
+		}
+	}
+};
+
+// hold memory of BgScheduler memory budget in current scope
+class BgMemGuard {
+	size_t m_acquired;
+public:
+	explicit BgMemGuard(size_t bytes)
+		: m_acquired(BgScheduler::instance().acquireMem(bytes)) {}
+	~BgMemGuard() { BgScheduler::instance().releaseMem(m_acquired); }
+	BgMemGuard(const BgMemGuard&) = delete;
+	BgMemGuard& operator=(const BgMemGuard&) = delete;
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_bg_scheduler_hpp__
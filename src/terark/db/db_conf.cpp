@@ -6,9 +6,14 @@
 //#include <terark/io/StreamBuffer.hpp>
 #include <terark/io/var_int.hpp>
 #include <terark/num_to_str.hpp>
-//#include <terark/util/sortable_strvec.hpp>
+#include <terark/util/sortable_strvec.hpp>
 #include <terark/util/linebuf.hpp>
 #include <string.h>
+#include <math.h>
+#if defined(__SSSE3__) || defined(__AVX__)
+	#include <tmmintrin.h>
+	#define TERARK_DB_LEX_SIMD 1
+#endif
 #include "json.hpp"
 #include <boost/algorithm/string/join.hpp>
 //#include <boost/multiprecision/cpp_int.hpp>
@@ -153,6 +158,7 @@ Schema::Schema() {
 //	m_isPrimary = false;
 	m_isUnique  = false;
 	m_dictZipSampleRatio = 0.0;
+	m_keyFilterBitsPerKey = 0.0;
 	m_canEncodeToLexByteComparable = false;
 	m_needEncodeToLexByteComparable = false;
 	m_useFastZip = false;
@@ -168,10 +174,182 @@ Schema::Schema() {
 	m_nltNestLevel = DEFAULT_nltNestLevel;
 	m_lastVarLenCol = 0;
 	m_restFixLenSum = 0;
+	m_hasLexMasks = false;
 }
 Schema::~Schema() {
 }
 
+// TerarkDB_SchemaCompileRuns=0 disables fixed runs and projection runs,
+// all columns are then handled by the per column interpreter
+static bool isSchemaRunsEnabled() {
+	if (const char* env = getenv("TerarkDB_SchemaCompileRuns")) {
+		return atoi(env) != 0;
+	}
+	return true;
+}
+
+void Schema::compileFixedRuns() {
+	size_t colnum = m_columnsMeta.end_i();
+	m_fixedRuns.erase_all();
+	m_fixedRunOps.erase_all();
+	m_colFixedRun.erase_all();
+	m_colFixedRun.resize(colnum, 0);
+	m_colRunElem.erase_all();
+	m_colRunElem.resize(colnum);
+	if (!isSchemaRunsEnabled())
+		return;
+	for (size_t i = 0; i < colnum; ) {
+		FixedRun run;
+		run.len = 0;
+		run.opBeg = uint32_t(m_fixedRunOps.size());
+		size_t j = i;
+		for (; j < colnum; ++j) {
+			const ColumnMeta& colmeta = m_columnsMeta.val(j);
+			FixedRunOp op;
+			op.offset = run.len;
+			op.len = colmeta.fixedLen;
+			op.type = colmeta.type;
+			bool inRun = true;
+			switch (colmeta.type) {
+			default: // var len columns, Uint128, Sint128, Float128
+				inRun = false;
+				break;
+			case ColumnType::Uint08:
+			case ColumnType::Uuid:
+			case ColumnType::Fixed:
+				op.type = ColumnType::Fixed;
+				break;
+			case ColumnType::Sint08 :
+			case ColumnType::Uint16 :
+			case ColumnType::Sint16 :
+			case ColumnType::Uint32 :
+			case ColumnType::Sint32 :
+			case ColumnType::Uint64 :
+			case ColumnType::Sint64 :
+			case ColumnType::Float32:
+			case ColumnType::Float64:
+				break;
+			}
+			if (!inRun)
+				break;
+			assert(op.len > 0);
+			m_colRunElem[j] = ColumnVec::Elem(run.len, colmeta.fixedLen);
+			run.len += colmeta.fixedLen;
+			if (ColumnType::Fixed == op.type &&
+					m_fixedRunOps.size() > run.opBeg &&
+					ColumnType::Fixed == m_fixedRunOps.back().type) {
+				m_fixedRunOps.back().len += op.len; // fused binary columns
+			}
+			else {
+				m_fixedRunOps.push_back(op);
+			}
+		}
+		if (j > i) {
+			run.colEnd = uint32_t(j);
+			run.opEnd = uint32_t(m_fixedRunOps.size());
+			m_fixedRuns.push_back(run);
+			m_colFixedRun[i] = uint32_t(m_fixedRuns.size());
+			i = j;
+		}
+		else {
+			i = j + 1;
+		}
+	}
+}
+
+void Schema::compileProjRuns() {
+	size_t colnum = m_columnsMeta.end_i();
+	m_projRuns.erase_all();
+	m_colProjRun.erase_all();
+	if (nullptr == m_parent)
+		return;
+	m_colProjRun.resize(colnum, 0);
+	if (!isSchemaRunsEnabled())
+		return;
+	for (size_t i = 0; i < colnum; ) {
+		ProjRun run;
+		run.len = m_columnsMeta.val(i).fixedLen;
+		size_t j = i + 1;
+		if (run.len) {
+			for (; j < colnum; ++j) {
+				size_t fixlen = m_columnsMeta.val(j).fixedLen;
+				if (0 == fixlen || m_proj[j] != m_proj[j-1] + 1)
+					break;
+				run.len += uint32_t(fixlen);
+			}
+		}
+		if (j - i >= 2) {
+			run.colEnd = uint32_t(j);
+			m_projRuns.push_back(run);
+			m_colProjRun[i] = uint32_t(m_projRuns.size());
+		}
+		i = j;
+	}
+}
+
+void Schema::compileLexMasks() {
+	m_hasLexMasks = false;
+#if defined(TERARK_DB_LEX_SIMD) // masks are for little endian
+	m_lexChunks.erase_all();
+	if (0 == m_fixedLen || m_fixedRuns.size() != 1 ||
+			m_fixedRuns[0].colEnd != m_columnsMeta.end_i()) {
+		return;
+	}
+	const FixedRun& run = m_fixedRuns[0];
+	for (size_t k = run.opBeg; k < run.opEnd; ++k) {
+		const FixedRunOp& op = m_fixedRunOps[k];
+		switch (op.type) {
+		default: // Fixed: Uint08, Uuid and Fixed are unchanged
+			continue;
+		case ColumnType::Sint08:
+		case ColumnType::Sint16:
+		case ColumnType::Sint32:
+		case ColumnType::Sint64:
+		case ColumnType::Float32:
+		case ColumnType::Float64:
+		case ColumnType::Uint16:
+		case ColumnType::Uint32:
+		case ColumnType::Uint64:
+			break;
+		}
+		if (m_lexChunks.empty() ||
+				m_lexChunks.back().offset + 16 < op.offset + op.len) {
+			LexChunk* c = m_lexChunks.grow_no_init(1);
+			c->offset = op.offset;
+			for (size_t i = 0; i < 16; ++i)
+				c->shuffle[i] = byte(i);
+			memset(c->encXor, 0, sizeof(c->encXor));
+			memset(c->decXor, 0, sizeof(c->decXor));
+		}
+		LexChunk& c = m_lexChunks.back();
+		const size_t off = op.offset - c.offset, len = op.len;
+		switch (op.type) {
+		default:
+			break;
+		case ColumnType::Sint08:
+			c.encXor[off] = c.decXor[off] = 0x80;
+			break;
+		case ColumnType::Sint16:
+		case ColumnType::Sint32:
+		case ColumnType::Sint64:
+		case ColumnType::Float32:
+		case ColumnType::Float64:
+			// encode flips sign bit then swaps, decode swaps then flips
+			c.encXor[off] = 0x80;
+			c.decXor[off + len - 1] = 0x80;
+			// fall through
+		case ColumnType::Uint16:
+		case ColumnType::Uint32:
+		case ColumnType::Uint64:
+			for (size_t j = 0; j < len; ++j)
+				c.shuffle[off + j] = byte(off + len - 1 - j);
+			break;
+		}
+	}
+	m_hasLexMasks = true;
+#endif
+}
+
 void Schema::compile(const Schema* parent) {
 	assert(!m_columnsMeta.empty());
 	if (m_isCompiled)
@@ -196,6 +374,9 @@ void Schema::compile(const Schema* parent) {
 			TERARK_RT_assert(colmeta.fixedLen > 0, std::invalid_argument);
 		}
 	}
+	compileFixedRuns();
+	compileProjRuns();
+	compileLexMasks();
 #if 0 // TODO:
 	// theoretically, m_lastVarLenCol can be "last non-binary col",
 	// StrZero and TwoStrZero are non-binary col, it need reverse scan to
@@ -260,7 +441,24 @@ void Schema::parseRowAppend(fstring row, size_t start, ColumnVec* columns) const
 
 #define CHECK_CURR_LAST(len) CHECK_CURR_LAST3(curr, last, len)
 	size_t colnum = m_columnsMeta.end_i();
+	const uint32_t* colFixedRun = m_colFixedRun.data();
+	assert(m_colFixedRun.size() == colnum);
 	for (size_t i = 0; i < colnum; ++i) {
+		if (uint32_t runIdx = colFixedRun[i]) {
+			const FixedRun& run = m_fixedRuns[runIdx-1];
+			CHECK_CURR_LAST(run.len);
+			const size_t runpos = curr - base;
+			const size_t runcols = run.colEnd - i;
+			const ColumnVec::Elem* src = m_colRunElem.data() + i;
+			ColumnVec::Elem* dst = columns->m_cols.grow_no_init(runcols);
+			for (size_t j = 0; j < runcols; ++j) {
+				dst[j].pos = uint32_t(runpos + src[j].pos);
+				dst[j].len = src[j].len;
+			}
+			curr += run.len;
+			i = run.colEnd - 1;
+			continue;
+		}
 #ifndef NDEBUG
 		const fstring colname = m_columnsMeta.key(i);
 #endif
@@ -619,9 +817,24 @@ const {
 	assert(m_parent->columnNum() == parentCols.size());
 	myRowData->erase_all();
 	size_t colnum = m_proj.size();
+	const uint32_t* colProjRun = m_colProjRun.data();
+	assert(m_colProjRun.size() == colnum);
 	for(size_t i = 0; i < colnum; ++i) {
 		size_t j = m_proj[i];
 		assert(j < parentCols.size());
+		if (uint32_t runIdx = colProjRun[i]) {
+			const ProjRun& run = m_projRuns[runIdx-1];
+			const ColumnVec::Elem* e = parentCols.m_cols.data() + j;
+			const size_t runcols = run.colEnd - i;
+			size_t pos = e[0].pos, end = pos;
+			for (size_t k = 0; k < runcols && e[k].pos == end; ++k)
+				end += e[k].len;
+			if (end - pos == run.len) {
+				myRowData->append(parentCols.m_base + pos, run.len);
+				i = run.colEnd - 1;
+				continue;
+			}
+		}
 		const ColumnMeta& colmeta = m_columnsMeta.val(i);
 		const fstring& coldata = parentCols[j];
 		switch (colmeta.type) {
@@ -726,6 +939,7 @@ void Schema::byteLexDecode(valvec<byte>& indexKey) const {
 	byteLexDecode(indexKey.data(), indexKey.size());
 }
 struct EncodeOffsetCoding {
+	static const bool IsEncode = true;
 	template<class Integer>
 	static Integer convert(Integer x) {
 		x ^= Integer(1) << (sizeof(Integer)*8 - 1);
@@ -734,6 +948,7 @@ struct EncodeOffsetCoding {
 	}
 };
 struct DecodeOffsetCoding {
+	static const bool IsEncode = false;
 	template<class Integer>
 	static Integer convert(Integer x) {
 		BYTE_SWAP_IF_LITTLE_ENDIAN(x);
@@ -748,6 +963,13 @@ void Schema::byteLexDecode(byte* data, size_t size) const {
 	byteLexConvert<DecodeOffsetCoding>(data, size);
 }
 
+template<class Uint>
+static inline void ByteSwapInPlace(byte* p) {
+	Uint x = unaligned_load<Uint>(p);
+	BYTE_SWAP_IF_LITTLE_ENDIAN(x);
+	unaligned_save(p, x);
+}
+
 template<class Converter>
 void Schema::byteLexConvert(byte* data, size_t size) const {
 	assert(size_t(-1) != m_fixedLen);
@@ -755,7 +977,41 @@ void Schema::byteLexConvert(byte* data, size_t size) const {
 	byte* curr = data;
 	byte* last = data + size;
 	size_t colnum = m_columnsMeta.end_i();
+	const uint32_t* colFixedRun = m_colFixedRun.data();
+	assert(m_colFixedRun.size() == colnum);
 	for (size_t i = 0; i < colnum; ++i) {
+		if (uint32_t runIdx = colFixedRun[i]) {
+			const FixedRun& run = m_fixedRuns[runIdx-1];
+			CHECK_CURR_LAST(run.len);
+			for (size_t k = run.opBeg; k < run.opEnd; ++k) {
+				const FixedRunOp& op = m_fixedRunOps[k];
+				byte* p = curr + op.offset;
+				switch (op.type) {
+				default: // Fixed: Uint08, Uuid and Fixed need no convert
+					break;
+				case ColumnType::Sint08:
+					p[0] ^= 1 << 7;
+					break;
+				case ColumnType::Uint16: ByteSwapInPlace<uint16_t>(p); break;
+				case ColumnType::Uint32: ByteSwapInPlace<uint32_t>(p); break;
+				case ColumnType::Uint64: ByteSwapInPlace<uint64_t>(p); break;
+				case ColumnType::Sint16:
+					unaligned_save(p, Converter::convert(unaligned_load<uint16_t>(p)));
+					break;
+				case ColumnType::Sint32:
+				case ColumnType::Float32:
+					unaligned_save(p, Converter::convert(unaligned_load<uint32_t>(p)));
+					break;
+				case ColumnType::Sint64:
+				case ColumnType::Float64:
+					unaligned_save(p, Converter::convert(unaligned_load<uint64_t>(p)));
+					break;
+				}
+			}
+			curr += run.len;
+			i = run.colEnd - 1;
+			continue;
+		}
 		const ColumnMeta& colmeta = m_columnsMeta.val(i);
 		switch (colmeta.type) {
 		default:
@@ -902,6 +1158,52 @@ void Schema::byteLexConvert(byte* data, size_t size) const {
 	}
 }
 
+template<class Converter>
+void Schema::byteLexConvertFixedBatch(byte* data, size_t rows) const {
+	assert(m_fixedLen > 0 && size_t(-1) != m_fixedLen);
+	const size_t fixlen = m_fixedLen;
+	size_t i = 0;
+#if defined(TERARK_DB_LEX_SIMD)
+	if (m_hasLexMasks && m_lexChunks.empty()) {
+		return; // no column needs convert
+	}
+	if (m_hasLexMasks && fixlen * rows >= m_lexChunks.back().offset + 16) {
+		// 16 bytes are loaded and stored for each chunk, bytes after the
+		// chunk are shuffled to themselves and xor'ed by 0, chunks and rows
+		// are converted in order, so the store never clobbers an unconverted
+		// chunk. The last rows whose last chunk can not load 16 bytes are
+		// done by scalar code
+		const LexChunk* chunks = m_lexChunks.data();
+		const size_t nChunks = m_lexChunks.size();
+		const size_t lastOffset = m_lexChunks.back().offset;
+		const size_t simdRows = (fixlen * rows - lastOffset - 16) / fixlen + 1;
+		for (; i < simdRows; ++i) {
+			byte* row = data + fixlen * i;
+			for (size_t j = 0; j < nChunks; ++j) {
+				const LexChunk& c = chunks[j];
+				const byte* xorMask = Converter::IsEncode ? c.encXor : c.decXor;
+				__m128i  shuf = _mm_loadu_si128((const __m128i*)c.shuffle);
+				__m128i  xmsk = _mm_loadu_si128((const __m128i*)xorMask);
+				__m128i* p = (__m128i*)(row + c.offset);
+				__m128i  x = _mm_loadu_si128(p);
+				x = _mm_xor_si128(_mm_shuffle_epi8(x, shuf), xmsk);
+				_mm_storeu_si128(p, x);
+			}
+		}
+	}
+#endif
+	for (; i < rows; ++i) {
+		byteLexConvert<Converter>(data + fixlen * i, fixlen);
+	}
+}
+
+void Schema::byteLexEncodeFixedBatch(byte* data, size_t rows) const {
+	byteLexConvertFixedBatch<EncodeOffsetCoding>(data, rows);
+}
+void Schema::byteLexDecodeFixedBatch(byte* data, size_t rows) const {
+	byteLexConvertFixedBatch<DecodeOffsetCoding>(data, rows);
+}
+
 size_t
 Schema::parseDelimText(char delim, fstring text, valvec<byte>* row)
 const {
@@ -1399,6 +1701,8 @@ int Schema::compareData(fstring x, fstring y) const {
 	}
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
+	// fixed runs are not used here: a compare is mostly decided by the
+	// first column, where a run only adds an indirection
 	size_t colnum = m_columnsMeta.end_i();
 	for (size_t i = 0; i < colnum; ++i) {
 		const ColumnMeta& colmeta = m_columnsMeta.val(i);
@@ -1772,13 +2076,20 @@ bool SchemaSet::Equal::operator()(const SchemaPtr& x, fstring y) const {
 const llong  DEFAULT_compressingWorkMemSize = 2LL * 1024 * 1024 * 1024;
 const llong  DEFAULT_maxWritingSegmentSize  = 3LL * 1024 * 1024 * 1024;
 const size_t DEFAULT_minMergeSegNum         = TERARK_IF_DEBUG(2, 5);
+const size_t DEFAULT_maxMergeSegNum         = 0; // unlimited
+const size_t DEFAULT_maxReadonlySegNum      = 0; // no readAmp trigger
+const double DEFAULT_mergeSizeRatio         = 4.0;
 const double DEFAULT_purgeDeleteThreshold   = 0.20;
 
 SchemaConfig::SchemaConfig() {
 	m_compressingWorkMemSize = DEFAULT_compressingWorkMemSize;
 	m_maxWritingSegmentSize = DEFAULT_maxWritingSegmentSize;
 	m_minMergeSegNum = DEFAULT_minMergeSegNum;
+	m_maxMergeSegNum = DEFAULT_maxMergeSegNum;
+	m_maxReadonlySegNum = DEFAULT_maxReadonlySegNum;
+	m_mergeSizeRatio = DEFAULT_mergeSizeRatio;
 	m_purgeDeleteThreshold = DEFAULT_purgeDeleteThreshold;
+	m_mergePolicy = "Default";
 	m_usePermanentRecordId = false;
 }
 SchemaConfig::~SchemaConfig() {
@@ -2411,6 +2722,18 @@ if (colgroupsIter != meta.end()) {
 		meta, "MinMergeSegNum", DEFAULT_minMergeSegNum);
 	m_purgeDeleteThreshold = getJsonValue(
 		meta, "PurgeDeleteThreshold", DEFAULT_purgeDeleteThreshold);
+	m_mergePolicy = getJsonValue(meta, "MergePolicy", std::string("Default"));
+	m_writableSegmentClass = getJsonValue(meta, "WritableSegmentClass", std::string());
+	m_maxMergeSegNum = getJsonValue(
+		meta, "MaxMergeSegNum", DEFAULT_maxMergeSegNum);
+	m_maxReadonlySegNum = getJsonValue(
+		meta, "MaxReadonlySegNum", DEFAULT_maxReadonlySegNum);
+	m_mergeSizeRatio = getJsonValue(
+		meta, "MergeSizeRatio", DEFAULT_mergeSizeRatio);
+	if (m_mergeSizeRatio < 1.0) {
+		THROW_STD(invalid_argument, "MergeSizeRatio = %f must be >= 1.0",
+			m_mergeSizeRatio);
+	}
 
 	// PermanentRecordId means record id will not be changed by table reload
 	m_usePermanentRecordId = getJsonValue(meta, "UsePermanentRecordId", false);
@@ -2463,6 +2786,22 @@ if (colgroupsIter != meta.end()) {
 		indexSchema->m_rankSelectClass = getJsonValue(index, "rs", 512);
 		indexSchema->m_nltNestLevel = (byte)limitInBound(
 			getJsonValue(index, "nltNestLevel", DEFAULT_nltNestLevel), 1u, 20u);
+		// keyFilterFpRate takes precedence over keyFilterBitsPerKey
+		double fpRate = getJsonValue(index, "keyFilterFpRate", 0.0);
+		if (fpRate > 0) {
+			if (fpRate >= 1) {
+				THROW_STD(invalid_argument,
+					"index %s: keyFilterFpRate = %f must be in (0, 1)",
+					indexSchema->m_name.c_str(), fpRate);
+			}
+			// bitsPerKey = -ln(fpRate) / ln(2)^2
+			const double ln2 = 0.69314718055994531;
+			indexSchema->m_keyFilterBitsPerKey = float(-log(fpRate) / (ln2 * ln2));
+		}
+		else {
+			indexSchema->m_keyFilterBitsPerKey = limitInBound(
+				getJsonValue(index, "keyFilterBitsPerKey", float(0)), 0.0f, 64.0f);
+		}
 
 /*
 		if (indexSchema->m_isPrimary) {
@@ -199,6 +199,11 @@ namespace terark { namespace db {
 		void byteLexEncode(byte* data, size_t size) const;
 		void byteLexDecode(byte* data, size_t size) const;
 
+		// convert all keys of a fixed len key array in one pass,
+		// as FixedLenKeyIndex::build
+		void byteLexEncodeFixedBatch(byte* data, size_t rows) const;
+		void byteLexDecodeFixedBatch(byte* data, size_t rows) const;
+
 		size_t parseDelimText(char delim, fstring text, valvec<byte>* row) const;
 
 		std::string toJsonStr(fstring row) const;
@@ -242,6 +247,7 @@ namespace terark { namespace db {
 		int    m_sufarrMinFreq;
 		int    m_rankSelectClass;
 		float  m_dictZipSampleRatio;
+		float  m_keyFilterBitsPerKey; // 0 means no key filter, just for index
 		byte   m_nltNestLevel;
 
 		bool   m_isCompiled: 1;
@@ -266,9 +272,58 @@ namespace terark { namespace db {
 		size_t computeFixedRowLen() const; // return 0 if RowLen is not fixed
 		template<class Converter>
 		void byteLexConvert(byte* data, size_t size) const;
+		template<class Converter>
+		void byteLexConvertFixedBatch(byte* data, size_t rows) const;
+		void compileFixedRuns();
+		void compileProjRuns();
+		void compileLexMasks();
+
+		// Adjacent fixed length columns are compiled into runs, a run is
+		// parsed and lex-converted with one bounds check. Adjacent binary
+		// columns in a run(Uint08, Uuid, Fixed) are fused into one op.
+		// Other columns and compareData use the per column interpreter.
+		struct FixedRunOp {
+			uint32_t   offset; // relative to run start
+			uint32_t   len;
+			ColumnType type;   // Fixed for fused binary columns
+		};
+		struct FixedRun {
+			uint32_t colEnd; // columns of the run are [firstColumn, colEnd)
+			uint32_t len;    // sum of fixedLen of the columns
+			uint32_t opBeg;  // ops of the run are m_fixedRunOps[opBeg, opEnd)
+			uint32_t opEnd;
+		};
 
 	protected:
 		size_t m_fixedLen;
+		valvec<FixedRun>   m_fixedRuns;
+		valvec<FixedRunOp> m_fixedRunOps;
+		valvec<uint32_t>   m_colFixedRun; // run idx+1 if col starts a run
+		valvec<ColumnVec::Elem> m_colRunElem; // col pos relative to its run
+
+		// Adjacent fixed length columns which are also adjacent in parent
+		// schema, selectParent appends them by one memcpy when they are
+		// adjacent in the parent row(it is the case of a parsed row)
+		struct ProjRun {
+			uint32_t colEnd; // columns of the run are [firstColumn, colEnd)
+			uint32_t len;    // sum of fixedLen of the columns
+		};
+		valvec<ProjRun>  m_projRuns;
+		valvec<uint32_t> m_colProjRun; // run idx+1 if col starts a run
+
+		// If the whole row is one fixed run, the columns to be converted
+		// are split into chunks of at most 16 bytes which never cut a
+		// column, lex encode/decode of a chunk is a byte shuffle and a xor:
+		//   out = shuffle(in, shuffle) ^ encXor (or decXor)
+		// which is done by SSSE3 pshufb for each chunk in batch convert
+		struct LexChunk {
+			uint32_t offset; // in the row
+			byte shuffle[16];
+			byte encXor[16];
+			byte decXor[16];
+		};
+		bool m_hasLexMasks;
+		valvec<LexChunk> m_lexChunks;
 	/*
 	// Backlog: select from multiple tables
 		struct ColumnLink {
@@ -458,7 +513,12 @@ namespace terark { namespace db {
 		llong    m_compressingWorkMemSize;
 		llong    m_maxWritingSegmentSize;
 		size_t   m_minMergeSegNum;
+		size_t   m_maxMergeSegNum; // 0 is unlimited
+		size_t   m_maxReadonlySegNum; // 0 disables the readAmp trigger
+		double   m_mergeSizeRatio;
 		double   m_purgeDeleteThreshold;
+		std::string m_mergePolicy; // see MergePolicy
+		std::string m_writableSegmentClass; // "mem", "mock", default wiredtiger
 		std::string m_tableClass;
 		bool     m_usePermanentRecordId;
 
@@ -80,15 +80,18 @@ DbContext::DbContext(const CompositeTable* tab)
 	m_wrSegPtr = tab->m_wrSeg.get();
 	if (m_wrSegPtr) {
 		m_transaction.reset(m_wrSegPtr->createTransaction());
+		m_transaction->m_walSegUid = m_wrSegPtr->m_walSegUid;
 	}
 	m_rowNumVec.assign(tab->m_rowNumVec);
+	m_segLocator.build(m_rowNumVec.data(), segNum);
 	segArrayUpdateSeq = tab->m_segArrayUpdateSeq;
 	syncIndex = true;
 	isUpsertOverwritten = 0;
 	TERARK_RT_assert(tab->getSegArrayUpdateSeq() == oldtab_segArrayUpdateSeq,
 					 std::logic_error);
 	g_dbCtxLiveCnt++;
-	g_dbCtxCreatedCnt++;
+	statsShard = uint32_t(g_dbCtxCreatedCnt++ % TableStats::ShardNum);
+	statsTick = 0;
 #if !defined(NDEBUG)
 	fprintf(stderr, "DEBUG: DbContext live count = %zd, created = %zd\n"
 		, g_dbCtxLiveCnt.load(), g_dbCtxCreatedCnt.load());
@@ -106,30 +109,40 @@ DbContext::~DbContext() {
 	g_dbCtxLiveCnt--;
 }
 
+// must be called in lock tab->m_rwMutex, the current version is kept alive
+// by the lock
 void DbContext::doSyncSegCtxNoLock(const CompositeTable* tab) {
 	assert(tab == m_tab);
 	assert(this->segArrayUpdateSeq < tab->getSegArrayUpdateSeq());
-	size_t indexNum = tab->getIndexNum();
-	size_t oldtab_segArrayUpdateSeq = tab->getSegArrayUpdateSeq();
+	const SegArrayVersion* ver = tab->m_segArrayVersion.load();
+	assert(ver->m_segArrayUpdateSeq == tab->getSegArrayUpdateSeq());
+	doSyncSegCtx(ver);
+	m_rowNumVec.back() = tab->m_rowNumVec.back();
+}
+
+void DbContext::doSyncSegCtx(const SegArrayVersion* ver) {
+	assert(this->segArrayUpdateSeq < ver->m_segArrayUpdateSeq);
+	size_t indexNum = m_tab->getIndexNum();
 	size_t oldSegNum = m_segCtx.size();
-	size_t segNum = tab->getSegNum();
+	size_t segNum = ver->m_segments.size();
 	if (m_segCtx.size() < segNum) {
 		m_segCtx.resize(segNum, NULL);
 		for (size_t i = oldSegNum; i < segNum; ++i)
-			m_segCtx[i] = SegCtx::create(tab->getSegmentPtr(i), indexNum);
+			m_segCtx[i] = SegCtx::create(ver->m_segments[i].get(), indexNum);
 	}
-	if (tab->m_wrSeg.get() != m_wrSegPtr) {
-		auto new_wrseg = tab->m_wrSeg.get();
+	if (ver->m_wrSeg.get() != m_wrSegPtr) {
+		auto new_wrseg = ver->m_wrSeg.get();
 		assert(DbTransaction::started != m_transaction->m_status);
 		m_transaction.reset();
 		if (new_wrseg) {
 			m_transaction.reset(new_wrseg->createTransaction());
+			m_transaction->m_walSegUid = new_wrseg->m_walSegUid;
 		}
 		m_wrSegPtr = new_wrseg;
 	}
 	SegCtx** sctx = m_segCtx.data();
 	for (size_t i = 0; i < segNum; ++i) {
-		ReadableSegment* seg = tab->getSegmentPtr(i);
+		ReadableSegment* seg = ver->m_segments[i].get();
 		if (NULL == sctx[i]) {
 			sctx[i] = SegCtx::create(seg, indexNum);
 			continue;
@@ -164,14 +177,13 @@ void DbContext::doSyncSegCtxNoLock(const CompositeTable* tab) {
 	for (size_t i = 0; i < segNum; ++i) {
 		TERARK_RT_assert(NULL != sctx[i], std::logic_error);
 		TERARK_RT_assert(NULL != sctx[i]->seg, std::logic_error);
-		TERARK_RT_assert(tab->getSegmentPtr(i) == sctx[i]->seg, std::logic_error);
+		TERARK_RT_assert(ver->m_segments[i].get() == sctx[i]->seg, std::logic_error);
 	}
 	m_segCtx.risk_set_size(segNum);
-	m_rowNumVec.assign(tab->m_rowNumVec);
+	m_rowNumVec.assign(ver->m_rowNumVec);
 	TERARK_RT_assert(m_rowNumVec.size() == segNum + 1, std::logic_error);
-	TERARK_RT_assert(tab->getSegArrayUpdateSeq() == oldtab_segArrayUpdateSeq,
-					 std::logic_error);
-	segArrayUpdateSeq = tab->getSegArrayUpdateSeq();
+	m_segLocator.build(m_rowNumVec.data(), segNum);
+	segArrayUpdateSeq = ver->m_segArrayUpdateSeq;
 }
 
 StoreIterator* DbContext::getWrtStoreIterNoLock(size_t segIdx) {
@@ -2,6 +2,7 @@
 #define __terark_db_db_context_hpp__
 
 #include "db_conf.hpp"
+#include "seg_locator.hpp"
 
 namespace terark {
 	class BaseDFA;
@@ -26,6 +27,7 @@ public:
 	~DbContext();
 
 	void doSyncSegCtxNoLock(const CompositeTable* tab);
+	void doSyncSegCtx(const class SegArrayVersion* ver);
 	void trySyncSegCtxNoLock(const CompositeTable* tab);
 	void trySyncSegCtxSpeculativeLock(const CompositeTable* tab);
 	class StoreIterator* getWrtStoreIterNoLock(size_t segIdx);
@@ -38,6 +40,8 @@ public:
 /// @{ delegate methods
 	StoreIteratorPtr createTableIterForward();
 	StoreIteratorPtr createTableIterBackward();
+	StoreIteratorPtr createProjectIterForward(const valvec<size_t>& cols);
+	StoreIteratorPtr createProjectIterBackward(const valvec<size_t>& cols);
 
 	void getValueAppend(llong id, valvec<byte>* val);
 	void getValue(llong id, valvec<byte>* val);
@@ -57,6 +61,10 @@ public:
 	void indexSearchExactNoLock(size_t indexId, fstring key, valvec<llong>* recIdvec);
 	bool indexKeyExistsNoLock(size_t indexId, fstring key);
 
+	void indexSearchExactBatch(size_t indexId, const fstring* keys, size_t keyNum, valvec<valvec<llong> >* recIdvecs);
+	void indexSearchExactBatch(size_t indexId, const fstring* keys, size_t keyNum, const size_t* colsId, size_t colsNum, valvec<valvec<llong> >* recIdvecs, valvec<valvec<byte> >* colsDataVec);
+	void indexSearchExactBatchNoLock(size_t indexId, const fstring* keys, size_t keyNum, valvec<valvec<llong> >* recIdvecs);
+
 	bool indexMatchRegex(size_t indexId, BaseDFA* regexDFA, valvec<llong>* recIdvec);
 	bool indexMatchRegex(size_t indexId, fstring  regexStr, fstring regexOptions, valvec<llong>* recIdvec);
 
@@ -101,6 +109,7 @@ public:
 	std::unique_ptr<class DbTransaction> m_transaction;
 	valvec<SegCtx*> m_segCtx;
 	valvec<llong>   m_rowNumVec; // copy of CompositeTable::m_rowNumVec
+	SegLocator      m_segLocator; // built from m_rowNumVec
 	std::string  errMsg;
 	valvec<byte> buf1;
 	valvec<byte> buf2;
@@ -115,6 +124,8 @@ public:
 	valvec<llong> exactMatchRecIdvec;
 	size_t regexMatchMemLimit;
 	size_t segArrayUpdateSeq;
+	uint32_t statsShard; // shard of CompositeTable::m_stats
+	uint32_t statsTick;  // for latency sampling
 	bool syncIndex;
 	byte isUpsertOverwritten;
 };
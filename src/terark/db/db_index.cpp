@@ -75,6 +75,19 @@ void ReadableIndex::decodeIndexKey(const Schema& schema, byte* key, size_t keyLe
 	}
 }
 
+void
+ReadableIndex::searchExactBatchAppend(const fstring* keys, size_t keyNum,
+							valvec<llong>* const* recIdvecs, DbContext* ctx)
+const {
+	for (size_t i = 0; i < keyNum; ++i) {
+		searchExactAppend(keys[i], recIdvecs[i], ctx);
+	}
+}
+
+llong ReadableIndex::lowerBoundRank(fstring, DbContext*) const {
+	return -1; // not supported
+}
+
 ReadableStore* ReadableIndex::getReadableStore() {
 	return nullptr;
 }
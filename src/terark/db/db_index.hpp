@@ -62,6 +62,11 @@ public:
 		searchExactAppend(key, recIdvec, ctx);
 	}
 	virtual void searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const = 0;
+
+	/// keys are sorted by memcmp, result of keys[i] is appended to
+	/// *recIdvecs[i], default calls searchExactAppend for each key
+	virtual void searchExactBatchAppend(const fstring* keys, size_t keyNum,
+							valvec<llong>* const* recIdvecs, DbContext*) const;
 	///@}
 
 	///@{ ordered index only
@@ -73,6 +78,11 @@ public:
 
 	virtual IndexIterator* createIndexIterForward(DbContext*) const = 0;
 	virtual IndexIterator* createIndexIterBackward(DbContext*) const = 0;
+
+	///@returns number of index entries whose key < key, empty key is the
+	///         min key, -1 if the index can not compute it cheaply
+	///@note used for size estimation, need not be exact
+	virtual llong lowerBoundRank(fstring key, DbContext*) const;
 	///@}
 
 	/// ReadableIndex can be a ReadableStore
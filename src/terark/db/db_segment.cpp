@@ -5,6 +5,9 @@
 #include "fixed_len_key_index.hpp"
 #include "fixed_len_store.hpp"
 #include "appendonly.hpp"
+#include "bg_scheduler.hpp"
+#include "write_ahead_log.hpp"
+#include "row_cache.hpp"
 #include <terark/util/autoclose.hpp>
 #include <terark/io/FileStream.hpp>
 #include <terark/io/StreamBuffer.hpp>
@@ -28,6 +31,13 @@
 #endif
 #include <fcntl.h>
 #include <float.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
 
 #include "json.hpp"
 
@@ -47,8 +57,20 @@ ReadableSegment::ReadableSegment() {
 	m_bookUpdates = false;
 	m_withPurgeBits = false;
 	m_isPurgedMmap = nullptr;
+	m_snapDelLog = nullptr;
 }
+void
+ReadableSegment::indexSearchExactBatchAppend(size_t mySegIdx, size_t indexId,
+											 const fstring* keys, size_t keyNum,
+											 valvec<llong>* const* recIdvecs,
+											 DbContext* ctx) const {
+	for (size_t i = 0; i < keyNum; ++i) {
+		indexSearchExactAppend(mySegIdx, indexId, keys[i], recIdvecs[i], ctx);
+	}
+}
+
 ReadableSegment::~ReadableSegment() {
+	delete m_snapDelLog;
 	if (m_isDelMmap) {
 		closeIsDel();
 	}
@@ -189,6 +211,12 @@ void ReadableSegment::save(PathRef segDir) const {
 	this->saveIsDel(segDir);
 }
 
+// writable segment may remap its stores on append, values can not be pinned
+bool ReadableSegment::selectOneColgroupPinned(llong, size_t, fstring*,
+											  DbContext*) const {
+	return false;
+}
+
 size_t ReadableSegment::getPhysicRows() const {
 	if (m_isPurged.size())
 		return m_isPurged.max_rank0();
@@ -252,6 +280,178 @@ void ReadableSegment::addtoUpdateList(size_t logicId) {
 	}
 }
 
+// Delete marks set and unique index entries removed while TableSnapshot
+// were alive, guarded by ReadableSegment::m_segMutex.
+//
+// m_delSeq[logicId] is the seq of the newest live snapshot when the delete
+// mark was set, the row is still visible to snapshots whose seq <= it.
+// A ghost is a removed unique index entry of a writable segment row, the
+// store data of the row is kept, it is visible to the same snapshots.
+class SnapshotDelLog {
+public:
+	struct Ghost {
+		std::string key;
+		llong subId;
+		llong seq;
+	};
+	struct GhostLess {
+		const Schema* schema;
+		bool operator()(const Ghost& x, const Ghost& y) const {
+			int r = schema->compareData(x.key, y.key);
+			if (r)
+				return r < 0;
+			return x.subId < y.subId;
+		}
+	};
+	typedef std::set<Ghost, GhostLess> GhostSet;
+
+	std::unordered_map<size_t, llong> m_delSeq;
+	std::vector<GhostSet> m_ghosts; // indexed by indexId
+
+	static bool isVisible(const Ghost& g, llong snapshotSeq, size_t rows) {
+		return g.seq >= snapshotSeq && size_t(g.subId) < rows;
+	}
+};
+
+void ReadableSegment::markDelForSnapshotInLock(size_t logicId, llong newestSnapshotSeq) {
+	if (newestSnapshotSeq <= 0) {
+		return; // no live snapshot
+	}
+	if (NULL == m_snapDelLog) {
+		m_snapDelLog = new SnapshotDelLog();
+	}
+	// keep the first, a row is deleted just once
+	m_snapDelLog->m_delSeq.insert(std::make_pair(logicId, newestSnapshotSeq));
+}
+
+void
+ReadableSegment::addSnapshotGhostInLock(size_t indexId, fstring key,
+										size_t subId, llong newestSnapshotSeq) {
+	if (newestSnapshotSeq <= 0) {
+		return;
+	}
+	if (NULL == m_snapDelLog) {
+		m_snapDelLog = new SnapshotDelLog();
+	}
+	auto& ghosts = m_snapDelLog->m_ghosts;
+	if (ghosts.empty()) {
+		ghosts.reserve(m_schema->getIndexNum());
+		for (size_t i = 0; i < m_schema->getIndexNum(); ++i) {
+			SnapshotDelLog::GhostLess cmp = { &m_schema->getIndexSchema(i) };
+			ghosts.emplace_back(cmp);
+		}
+	}
+	SnapshotDelLog::Ghost g;
+	g.key.assign(key.data(), key.size());
+	g.subId = llong(subId);
+	g.seq = newestSnapshotSeq;
+	ghosts[indexId].insert(std::move(g));
+}
+
+bool ReadableSegment::isDelInSnapshot(llong snapshotSeq, size_t logicId) const {
+	SpinRwLock lock(m_segMutex, false);
+	if (m_snapDelLog) {
+		auto iter = m_snapDelLog->m_delSeq.find(logicId);
+		if (m_snapDelLog->m_delSeq.end() != iter && iter->second >= snapshotSeq)
+			return false; // deleted after the snapshot was created
+	}
+	if (logicId >= m_isDel.size()) {
+		return true; // deleted tail of a frozen writable segment
+	}
+	return m_isDel[logicId];
+}
+
+void
+ReadableSegment::searchSnapshotGhosts(size_t indexId, fstring key,
+									  llong snapshotSeq, size_t snapshotRows,
+									  valvec<llong>* subIds) const {
+	SpinRwLock lock(m_segMutex, false);
+	if (NULL == m_snapDelLog || m_snapDelLog->m_ghosts.empty()) {
+		return;
+	}
+	auto& ghosts = m_snapDelLog->m_ghosts[indexId];
+	SnapshotDelLog::Ghost probe;
+	probe.key.assign(key.data(), key.size());
+	probe.subId = -1;
+	for (auto iter = ghosts.lower_bound(probe); ghosts.end() != iter; ++iter) {
+		if (fstring(iter->key) != key)
+			break;
+		if (SnapshotDelLog::isVisible(*iter, snapshotSeq, snapshotRows))
+			subIds->push_back(iter->subId);
+	}
+}
+
+bool
+ReadableSegment::nextSnapshotGhost(size_t indexId, bool forward, bool hasBound,
+								   fstring bkey, llong bSubId,
+								   llong snapshotSeq, size_t snapshotRows,
+								   valvec<byte>* key, llong* subId) const {
+	SpinRwLock lock(m_segMutex, false);
+	if (NULL == m_snapDelLog || m_snapDelLog->m_ghosts.empty()) {
+		return false;
+	}
+	auto& ghosts = m_snapDelLog->m_ghosts[indexId];
+	SnapshotDelLog::Ghost probe;
+	if (hasBound) {
+		probe.key.assign(bkey.data(), bkey.size());
+		probe.subId = bSubId;
+	}
+	const SnapshotDelLog::Ghost* found = NULL;
+	if (forward) {
+		auto iter = hasBound ? ghosts.upper_bound(probe) : ghosts.begin();
+		for (; ghosts.end() != iter; ++iter) {
+			if (SnapshotDelLog::isVisible(*iter, snapshotSeq, snapshotRows)) {
+				found = &*iter;
+				break;
+			}
+		}
+	}
+	else {
+		auto iter = hasBound ? ghosts.lower_bound(probe) : ghosts.end();
+		while (ghosts.begin() != iter) {
+			--iter;
+			if (SnapshotDelLog::isVisible(*iter, snapshotSeq, snapshotRows)) {
+				found = &*iter;
+				break;
+			}
+		}
+	}
+	if (NULL == found) {
+		return false;
+	}
+	key->assign((const byte*)found->key.data(), found->key.size());
+	*subId = found->subId;
+	return true;
+}
+
+void ReadableSegment::pruneSnapshotDels(llong minLiveSeq) {
+	SpinRwLock lock(m_segMutex, true);
+	if (NULL == m_snapDelLog) {
+		return;
+	}
+	auto& delSeq = m_snapDelLog->m_delSeq;
+	for (auto iter = delSeq.begin(); delSeq.end() != iter; ) {
+		if (iter->second < minLiveSeq)
+			iter = delSeq.erase(iter);
+		else
+			++iter;
+	}
+	bool hasGhost = false;
+	for (auto& ghosts : m_snapDelLog->m_ghosts) {
+		for (auto iter = ghosts.begin(); ghosts.end() != iter; ) {
+			if (iter->seq < minLiveSeq)
+				iter = ghosts.erase(iter);
+			else
+				++iter;
+		}
+		hasGhost = hasGhost || !ghosts.empty();
+	}
+	if (delSeq.empty() && !hasGhost) {
+		delete m_snapDelLog;
+		m_snapDelLog = NULL;
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
 ReadonlySegment::ReadonlySegment() {
@@ -260,8 +460,15 @@ ReadonlySegment::ReadonlySegment() {
 	m_dataInflateSize = 0;
 	m_isFreezed = true;
 	m_isPurgedMmap = 0;
+	m_bulkTempFiles = NULL;
+	m_rowCacheId = RowCache::instance().newSegmentId();
+	m_rowCacheUsed = false;
 }
 ReadonlySegment::~ReadonlySegment() {
+	if (m_rowCacheUsed.load(std::memory_order_relaxed)) {
+		RowCache::instance().eraseSegment(m_rowCacheId);
+	}
+	delete m_bulkTempFiles;
 	if (m_isPurgedMmap) {
 		mmap_close(m_isPurgedMmap, m_isPurged.mem_size());
 		m_isPurged.risk_release_ownership();
@@ -289,7 +496,21 @@ void ReadonlySegment::getValueAppend(llong id, valvec<byte>* val, DbContext* txn
 	if (id < 0 || id >= rows) {
 		THROW_STD(out_of_range, "invalid id=%lld, rows=%lld", id, rows);
 	}
-	getValueByLogicId(id, val, txn);
+	// point reads go through the row cache, store iterators(scan, merge)
+	// bypass it to avoid flushing hot rows.
+	// updatable colgroups are updated in place(updateColumn), a cached
+	// row would be stale, so such tables bypass it
+	RowCache& cache = RowCache::instance();
+	if (!cache.enabled() || !m_schema->m_updatableColgroups.empty()) {
+		getValueByLogicId(id, val, txn);
+		return;
+	}
+	size_t physicId = getPhysicId(id);
+	if (!cache.lookup(m_rowCacheId, physicId, val)) {
+		getValueByPhysicId(physicId, val, txn);
+		m_rowCacheUsed.store(true, std::memory_order_relaxed);
+		cache.insert(m_rowCacheId, physicId, *val);
+	}
 }
 
 void
@@ -349,9 +570,51 @@ void
 ReadonlySegment::indexSearchExactAppend(size_t mySegIdx, size_t indexId,
 										fstring key, valvec<llong>* recIdvec,
 										DbContext* ctx) const {
+	if (indexId < m_keyFilters.size()) {
+		auto filter = m_keyFilters[indexId].get();
+		if (filter && !filter->mayContain(key))
+			return;
+	}
 	size_t oldsize = recIdvec->size();
 	auto index = m_indices[indexId].get();
 	index->searchExactAppend(key, recIdvec, ctx);
+	indexResultToLogicId(recIdvec, oldsize);
+}
+
+void
+ReadonlySegment::indexSearchExactBatchAppend(size_t mySegIdx, size_t indexId,
+											 const fstring* keys, size_t keyNum,
+											 valvec<llong>* const* recIdvecs,
+											 DbContext* ctx) const {
+	// drop keys rejected by key filter, then probe the index by all
+	// remaining keys in one call, keys keep sorted
+	const KeyFilter* filter = NULL;
+	if (indexId < m_keyFilters.size()) {
+		filter = m_keyFilters[indexId].get();
+	}
+	valvec<fstring> keys2(keyNum, valvec_reserve());
+	valvec<valvec<llong>*> recIdvecs2(keyNum, valvec_reserve());
+	valvec<size_t> oldsizes(keyNum, valvec_reserve());
+	for (size_t i = 0; i < keyNum; ++i) {
+		if (filter && !filter->mayContain(keys[i]))
+			continue;
+		keys2.push_back(keys[i]);
+		recIdvecs2.push_back(recIdvecs[i]);
+		oldsizes.push_back(recIdvecs[i]->size());
+	}
+	if (keys2.empty()) {
+		return;
+	}
+	auto index = m_indices[indexId].get();
+	index->searchExactBatchAppend(keys2.data(), keys2.size(), recIdvecs2.data(), ctx);
+	for (size_t i = 0; i < keys2.size(); ++i) {
+		indexResultToLogicId(recIdvecs2[i], oldsizes[i]);
+	}
+}
+
+void
+ReadonlySegment::indexResultToLogicId(valvec<llong>* recIdvec, size_t oldsize)
+const {
 	size_t newsize = oldsize;
 	llong* recIdvecData = recIdvec->data();
 	if (m_isPurged.empty()) {
@@ -384,6 +647,7 @@ const {
 	recId = getPhysicId(size_t(recId));
 	colsData->erase_all();
 	ctx->buf1.erase_all();
+	ctx->cols1.erase_all();
 	ctx->offsets.resize_fill(m_colgroups.size(), UINT32_MAX);
 	auto offsets = ctx->offsets.data();
 	for(size_t i = 0; i < colsNum; ++i) {
@@ -442,6 +706,16 @@ void ReadonlySegment::selectColgroups(llong recId,
 	}
 }
 
+bool ReadonlySegment::selectOneColgroupPinned(llong recId, size_t cgId,
+						fstring* cgData, DbContext* ctx) const {
+	if (cgId >= m_schema->getColgroupNum()) {
+		THROW_STD(out_of_range, "cgId = %zd, cgNum = %zd"
+			, cgId, m_schema->getColgroupNum());
+	}
+	llong physicId = this->getPhysicId(recId);
+	return m_colgroups[cgId]->getValuePinned(physicId, cgData, ctx);
+}
+
 class ReadonlySegment::MyStoreIterForward : public StoreIterator {
 	llong  m_id = 0;
 	DbContextPtr m_ctx;
@@ -507,82 +781,180 @@ StoreIterator* ReadonlySegment::createStoreIterBackward(DbContext* ctx) const {
 	return new MyStoreIterBackward(this, ctx);
 }
 
-namespace {
-	class TempFileList {
-		const SchemaSet& m_schemaSet;
-		valvec<byte> m_projRowBuf;
-		valvec<ReadableStorePtr> m_readers;
-		valvec<AppendableStore*> m_appenders;
-		TERARK_IF_DEBUG(ColumnVec m_debugCols;,;);
-	public:
-		TempFileList(PathRef segDir, const SchemaSet& schemaSet)
-			: m_schemaSet(schemaSet)
-		{
-			size_t cgNum = schemaSet.m_nested.end_i();
-			m_readers.resize(cgNum);
-			m_appenders.resize(cgNum);
-			for (size_t i = 0; i < cgNum; ++i) {
-				const Schema& schema = *schemaSet.m_nested.elem_at(i);
-				if (schema.getFixedRowLen()) {
-					m_readers[i] = new FixedLenStore(segDir, schema);
-				}
-				else {
-					m_readers[i] = new SeqReadAppendonlyStore(segDir, schema);
-				}
-				m_appenders[i] = m_readers[i]->getAppendableStore();
+// temporary colgroup files of a segment being built, rows are appended to
+// them in the order of logic id
+class ReadonlySegment::TempFileList {
+	const SchemaSet& m_schemaSet;
+	valvec<byte> m_projRowBuf;
+	BgWriteThrottle m_throttle;
+	valvec<ReadableStorePtr> m_readers;
+	valvec<AppendableStore*> m_appenders;
+	TERARK_IF_DEBUG(ColumnVec m_debugCols;,;);
+public:
+	TempFileList(PathRef segDir, const SchemaSet& schemaSet)
+		: m_schemaSet(schemaSet)
+	{
+		size_t cgNum = schemaSet.m_nested.end_i();
+		m_readers.resize(cgNum);
+		m_appenders.resize(cgNum);
+		for (size_t i = 0; i < cgNum; ++i) {
+			const Schema& schema = *schemaSet.m_nested.elem_at(i);
+			if (schema.getFixedRowLen()) {
+				m_readers[i] = new FixedLenStore(segDir, schema);
+			}
+			else {
+				m_readers[i] = new SeqReadAppendonlyStore(segDir, schema);
 			}
+			m_appenders[i] = m_readers[i]->getAppendableStore();
 		}
-		void writeColgroups(const ColumnVec& columns) {
-			size_t colgroupNum = m_readers.size();
-			for (size_t i = 0; i < colgroupNum; ++i) {
-				const Schema& schema = *m_schemaSet.m_nested.elem_at(i);
-				schema.selectParent(columns, &m_projRowBuf);
+	}
+	void writeColgroups(const ColumnVec& columns) {
+		size_t colgroupNum = m_readers.size();
+		for (size_t i = 0; i < colgroupNum; ++i) {
+			const Schema& schema = *m_schemaSet.m_nested.elem_at(i);
+			schema.selectParent(columns, &m_projRowBuf);
 #if !defined(NDEBUG)
-				schema.parseRow(m_projRowBuf, &m_debugCols);
-				assert(m_debugCols.size() == schema.columnNum());
-				for(size_t j = 0; j < m_debugCols.size(); ++j) {
-					size_t k = schema.parentColumnId(j);
-					assert(k < columns.size());
-					assert(m_debugCols[j] == columns[k]);
-				}
+			schema.parseRow(m_projRowBuf, &m_debugCols);
+			assert(m_debugCols.size() == schema.columnNum());
+			for(size_t j = 0; j < m_debugCols.size(); ++j) {
+				size_t k = schema.parentColumnId(j);
+				assert(k < columns.size());
+				assert(m_debugCols[j] == columns[k]);
+			}
 #endif
-				m_appenders[i]->append(m_projRowBuf, NULL);
+			m_appenders[i]->append(m_projRowBuf, NULL);
+			m_throttle.add(m_projRowBuf.size());
+		}
+	}
+	void completeWrite() {
+		size_t colgroupNum = m_readers.size();
+		for (size_t i = 0; i < colgroupNum; ++i) {
+			m_appenders[i]->shrinkToFit();
+		}
+	}
+	ReadableStore* getStore(size_t cgId) const {
+		return m_readers[cgId].get();
+	}
+	size_t size() const { return m_readers.size(); }
+	size_t
+	collectData(size_t cgId, StoreIterator* iter, SortableStrVec& strVec,
+				size_t maxMemSize = size_t(-1)) const {
+		assert(strVec.m_index.size() == 0);
+		assert(strVec.m_strpool.size() == 0);
+		const Schema& schema = *m_schemaSet.getSchema(cgId);
+		const llong   rows = iter->getStore()->numDataRows();
+		const size_t  fixlen = schema.getFixedRowLen();
+		if (fixlen == 0) {
+			valvec<byte> buf;
+			llong  recId = INT_MAX; // for fail fast
+			while (strVec.mem_size() < maxMemSize && iter->increment(&recId, &buf)) {
+				assert(recId < rows);
+				strVec.push_back(buf);
 			}
+			return strVec.size();
+		}
+		else { // ignore maxMemSize
+			size_t size = fixlen * rows;
+			strVec.m_strpool.resize_no_init(size);
+			byte_t* basePtr = iter->getStore()->getRecordsBasePtr();
+			memcpy(strVec.m_strpool.data(), basePtr, size);
+			return rows;
 		}
-		void completeWrite() {
-			size_t colgroupNum = m_readers.size();
-			for (size_t i = 0; i < colgroupNum; ++i) {
-				m_appenders[i]->shrinkToFit();
+	}
+};
+
+namespace {
+	// Run independent index/colgroup builds on multiple threads.
+	// sum of memSize of running tasks does not exceed memBudget, a task whose
+	// memSize exceeds memBudget can only run when no other task is running.
+	// running tasks also hold their memSize from BgScheduler memory budget.
+	// the first exception thrown by a task is rethrown by run()
+	// env TerarkDB_ParallelBuildThreads limits the number of threads,
+	// 1 builds in the calling thread, the result is the same
+	class ParallelBuildTasks {
+		struct Task {
+			size_t memSize;
+			std::function<void()> func;
+		};
+		std::vector<Task> m_tasks;
+		std::mutex   m_mutex;
+		std::condition_variable m_cond;
+		size_t m_nextTask;
+		size_t m_usedMem;
+		size_t m_running;
+		std::exception_ptr m_ex;
+
+		void worker(size_t memBudget) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (m_nextTask < m_tasks.size() && !m_ex) {
+				Task& t = m_tasks[m_nextTask];
+				size_t memSize = std::min(t.memSize, memBudget);
+				if (m_running && m_usedMem + memSize > memBudget) {
+					m_cond.wait(lock);
+					continue;
+				}
+				m_nextTask++;
+				m_usedMem += memSize;
+				m_running++;
+				lock.unlock();
+				try {
+					BgMemGuard memGuard(memSize);
+					t.func();
+					t.func = nullptr; // release captured resources
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> exLock(m_mutex);
+					if (!m_ex)
+						m_ex = std::current_exception();
+				}
+				lock.lock();
+				m_usedMem -= memSize;
+				m_running--;
+				m_cond.notify_all();
 			}
 		}
-		ReadableStore* getStore(size_t cgId) const {
-			return m_readers[cgId].get();
-		}
-		size_t size() const { return m_readers.size(); }
-		size_t
-		collectData(size_t cgId, StoreIterator* iter, SortableStrVec& strVec,
-					size_t maxMemSize = size_t(-1)) const {
-			assert(strVec.m_index.size() == 0);
-			assert(strVec.m_strpool.size() == 0);
-			const Schema& schema = *m_schemaSet.getSchema(cgId);
-			const llong   rows = iter->getStore()->numDataRows();
-			const size_t  fixlen = schema.getFixedRowLen();
-			if (fixlen == 0) {
-				valvec<byte> buf;
-				llong  recId = INT_MAX; // for fail fast
-				while (strVec.mem_size() < maxMemSize && iter->increment(&recId, &buf)) {
-					assert(recId < rows);
-					strVec.push_back(buf);
+	public:
+		ParallelBuildTasks() : m_nextTask(0), m_usedMem(0), m_running(0) {}
+		void add(size_t memSize, std::function<void()> func) {
+			m_tasks.push_back(Task());
+			m_tasks.back().memSize = memSize;
+			m_tasks.back().func.swap(func);
+		}
+		void run(size_t memBudget) {
+			// larger tasks first, smaller ones fill the remaining budget
+			std::stable_sort(m_tasks.begin(), m_tasks.end(),
+				[](const Task& x, const Task& y) { return x.memSize > y.memSize; });
+			size_t thrNum = std::min<size_t>(m_tasks.size(),
+									std::thread::hardware_concurrency());
+			if (const char* env = getenv("TerarkDB_ParallelBuildThreads")) {
+				thrNum = std::min<size_t>(thrNum, atoi(env));
+			}
+			if (thrNum <= 1) {
+				for (auto& t : m_tasks) {
+					BgMemGuard memGuard(std::min(t.memSize, memBudget));
+					t.func();
 				}
-				return strVec.size();
+				return;
 			}
-			else { // ignore maxMemSize
-				size_t size = fixlen * rows;
-				strVec.m_strpool.resize_no_init(size);
-				byte_t* basePtr = iter->getStore()->getRecordsBasePtr();
-				memcpy(strVec.m_strpool.data(), basePtr, size);
-				return rows;
+			std::vector<std::thread> threads;
+			threads.reserve(thrNum - 1);
+			for (size_t i = 0; i < thrNum - 1; ++i) {
+				// workers pull tasks until none is left, so fewer threads
+				// still build all, started threads are always joined
+				try {
+					threads.emplace_back(&ParallelBuildTasks::worker, this, memBudget);
+				}
+				catch (const std::system_error& ex) {
+					fprintf(stderr
+						, "WARN: ParallelBuildTasks: create thread failed: %s, use %zd threads\n"
+						, ex.what(), i + 1);
+					break;
+				}
 			}
+			worker(memBudget);
+			for (auto& th : threads) th.join();
+			if (m_ex)
+				std::rethrow_exception(m_ex);
 		}
 	};
 }
@@ -636,6 +1008,80 @@ public:
 }
 */
 
+// build indices and colgroup stores from temporary colgroup files,
+// independent builds run in parallel within m_compressingWorkMemSize
+void
+ReadonlySegment::buildFromTempFiles(TempFileList& colgroupTempFiles,
+									PathRef tmpDir, llong newRowNum) {
+	size_t indexNum = m_schema->getIndexNum();
+	m_indices.resize(indexNum);
+	m_keyFilters.resize(indexNum);
+	m_colgroups.resize(m_schema->getColgroupNum());
+	const size_t maxMem = m_schema->m_compressingWorkMemSize;
+	ParallelBuildTasks tasks;
+	for (size_t i = 0; i < indexNum; ++i) {
+		auto tmpStore = colgroupTempFiles.getStore(i);
+		size_t memSize = size_t(tmpStore->dataInflateSize())
+					   + sizeof(SortableStrVec::SEntry) * newRowNum;
+		tasks.add(memSize, [&,i,tmpStore]() {
+			SortableStrVec strVec;
+			const Schema& schema = m_schema->getIndexSchema(i);
+			StoreIteratorPtr iter = tmpStore->ensureStoreIterForward(NULL);
+			colgroupTempFiles.collectData(i, iter.get(), strVec);
+			buildKeyFilter(i, strVec);
+			m_indices[i] = this->buildIndex(schema, strVec);
+			m_colgroups[i] = m_indices[i]->getReadableStore();
+			if (!schema.m_enableLinearScan) {
+				iter.reset();
+				tmpStore->deleteFiles();
+			}
+		});
+	}
+	for (size_t i = indexNum; i < colgroupTempFiles.size(); ++i) {
+		const Schema& schema = m_schema->getColgroupSchema(i);
+		auto tmpStore = colgroupTempFiles.getStore(i);
+		if (schema.should_use_FixedLenStore()) {
+			m_colgroups[i] = tmpStore;
+			continue;
+		}
+		// dictZipLocalMatch is true by default
+		// dictZipLocalMatch == false is just for experiment
+		// dictZipLocalMatch should always be true in production
+		// dictZipSampleRatio < 0 indicate don't use dictZip
+		if (schema.m_dictZipLocalMatch && schema.m_dictZipSampleRatio >= 0.0) {
+			double sRatio = schema.m_dictZipSampleRatio;
+			double avgLen = double(tmpStore->dataInflateSize()) / newRowNum;
+			if (sRatio > 0 || (sRatio < FLT_EPSILON && avgLen > 100)) {
+				size_t memSize = size_t(tmpStore->dataInflateSize());
+				tasks.add(memSize, [&,i,tmpStore]() {
+					const Schema& schema = m_schema->getColgroupSchema(i);
+					StoreIteratorPtr iter = tmpStore->ensureStoreIterForward(NULL);
+					m_colgroups[i] = buildDictZipStore(schema, tmpDir, *iter, NULL, NULL);
+					iter.reset();
+					tmpStore->deleteFiles();
+				});
+				continue;
+			}
+		}
+		size_t memSize = std::min(size_t(tmpStore->dataInflateSize()), maxMem);
+		tasks.add(memSize, [&,i,tmpStore]() {
+			const Schema& schema = m_schema->getColgroupSchema(i);
+			llong rows = 0;
+			valvec<ReadableStorePtr> parts;
+			StoreIteratorPtr iter = tmpStore->ensureStoreIterForward(NULL);
+			while (rows < newRowNum) {
+				SortableStrVec strVec;
+				rows += colgroupTempFiles.collectData(i, iter.get(), strVec, maxMem);
+				parts.push_back(this->buildStore(schema, strVec));
+			}
+			m_colgroups[i] = parts.size()==1 ? parts[0] : new MultiPartStore(parts);
+			iter.reset();
+			tmpStore->deleteFiles();
+		});
+	}
+	tasks.run(maxMem);
+}
+
 void
 ReadonlySegment::convFrom(CompositeTable* tab, size_t segIdx)
 {
@@ -660,7 +1106,6 @@ ReadonlySegment::convFrom(CompositeTable* tab, size_t segIdx)
 	llong logicRowNum = input->m_isDel.size();
 	llong newRowNum = 0;
 	assert(logicRowNum > 0);
-	size_t indexNum = m_schema->getIndexNum();
 {
 	TempFileList colgroupTempFiles(tmpDir, *m_schema->m_colgroupSchemaSet);
 {
@@ -694,68 +1139,23 @@ ReadonlySegment::convFrom(CompositeTable* tab, size_t segIdx)
 	assert(newRowNum <= inputRowNum);
 	assert(size_t(logicRowNum - newRowNum) == m_delcnt);
 }
-	// build index from temporary index files
 	colgroupTempFiles.completeWrite();
-	m_indices.resize(indexNum);
-	m_colgroups.resize(m_schema->getColgroupNum());
-	for (size_t i = 0; i < indexNum; ++i) {
-		SortableStrVec strVec;
-		const Schema& schema = m_schema->getIndexSchema(i);
-		auto tmpStore = colgroupTempFiles.getStore(i);
-		StoreIteratorPtr iter = tmpStore->ensureStoreIterForward(NULL);
-		colgroupTempFiles.collectData(i, iter.get(), strVec);
-		m_indices[i] = this->buildIndex(schema, strVec);
-		m_colgroups[i] = m_indices[i]->getReadableStore();
-		if (!schema.m_enableLinearScan) {
-			iter.reset();
-			tmpStore->deleteFiles();
-		}
-	}
-	for (size_t i = indexNum; i < colgroupTempFiles.size(); ++i) {
-		const Schema& schema = m_schema->getColgroupSchema(i);
-		auto tmpStore = colgroupTempFiles.getStore(i);
-		if (schema.should_use_FixedLenStore()) {
-			m_colgroups[i] = tmpStore;
-			continue;
-		}
-		// dictZipLocalMatch is true by default
-		// dictZipLocalMatch == false is just for experiment
-		// dictZipLocalMatch should always be true in production
-		// dictZipSampleRatio < 0 indicate don't use dictZip
-		if (schema.m_dictZipLocalMatch && schema.m_dictZipSampleRatio >= 0.0) {
-			double sRatio = schema.m_dictZipSampleRatio;
-			double avgLen = double(tmpStore->dataInflateSize()) / newRowNum;
-			if (sRatio > 0 || (sRatio < FLT_EPSILON && avgLen > 100)) {
-				StoreIteratorPtr iter = tmpStore->ensureStoreIterForward(NULL);
-				m_colgroups[i] = buildDictZipStore(schema, tmpDir, *iter, NULL, NULL);
-				iter.reset();
-				tmpStore->deleteFiles();
-				continue;
-			}
-		}
-		size_t maxMem = m_schema->m_compressingWorkMemSize;
-		llong rows = 0;
-		valvec<ReadableStorePtr> parts;
-		StoreIteratorPtr iter = tmpStore->ensureStoreIterForward(NULL);
-		while (rows < newRowNum) {
-			SortableStrVec strVec;
-			rows += colgroupTempFiles.collectData(i, iter.get(), strVec, maxMem);
-			parts.push_back(this->buildStore(schema, strVec));
-		}
-		m_colgroups[i] = parts.size()==1 ? parts[0] : new MultiPartStore(parts);
-		iter.reset();
-		tmpStore->deleteFiles();
-	}
+	buildFromTempFiles(colgroupTempFiles, tmpDir, newRowNum);
 }
 	completeAndReload(tab, segIdx, &*input);
 
 	fs::rename(tmpDir, m_segDir);
+	// logged ops of input are dropped when input is destroyed, so this
+	// segment must be durable before that
+	if (auto wseg = input->getWritableSegment()) {
+		if (wseg->m_walSegUid)
+			WriteAheadLog::syncDir(m_segDir);
+	}
 	input->deleteSegment();
 }
 
-void
-ReadonlySegment::completeAndReload(CompositeTable* tab, size_t segIdx,
-								   ReadableSegment* input) {
+// save the newly built segment to m_segDir.tmp, then reload it as mmap
+void ReadonlySegment::saveAndReloadTmp() {
 	m_dataMemSize = 0;
 	m_dataInflateSize = 0;
 	for (size_t i = 0; i < m_colgroups.size(); ++i) {
@@ -770,6 +1170,7 @@ ReadonlySegment::completeAndReload(CompositeTable* tab, size_t segIdx,
 	}
 	auto tmpDir = m_segDir + ".tmp";
 	this->save(tmpDir);
+	throttleWrittenFiles(tmpDir);
 
 	// reload as mmap
 	m_isDel.clear();
@@ -777,6 +1178,39 @@ ReadonlySegment::completeAndReload(CompositeTable* tab, size_t segIdx,
 	m_indices.erase_all();
 	m_colgroups.erase_all();
 	this->load(tmpDir);
+}
+
+void ReadonlySegment::bulkLoadAppend(fstring row, DbContext* ctx) {
+	if (NULL == m_bulkTempFiles) {
+		auto tmpDir = m_segDir + ".tmp";
+		fs::create_directories(tmpDir);
+		m_bulkTempFiles = new TempFileList(tmpDir, *m_schema->m_colgroupSchemaSet);
+	}
+	m_schema->m_rowSchema->parseRow(row, &ctx->cols1);
+	m_bulkTempFiles->writeColgroups(ctx->cols1);
+	m_isDel.push_back(false);
+}
+
+void ReadonlySegment::bulkLoadFinish() {
+	if (NULL == m_bulkTempFiles) {
+		THROW_STD(invalid_argument, "no rows were appended: %s"
+			, m_segDir.string().c_str());
+	}
+	auto tmpDir = m_segDir + ".tmp";
+	llong rows = m_isDel.size();
+	m_delcnt = 0;
+	m_bulkTempFiles->completeWrite();
+	buildFromTempFiles(*m_bulkTempFiles, tmpDir, rows);
+	delete m_bulkTempFiles;
+	m_bulkTempFiles = NULL;
+	saveAndReloadTmp();
+	fs::rename(tmpDir, m_segDir);
+}
+
+void
+ReadonlySegment::completeAndReload(CompositeTable* tab, size_t segIdx,
+								   ReadableSegment* input) {
+	saveAndReloadTmp();
 	assert(this->m_isDel.size() == input->m_isDel.size());
 	assert(this->m_isDel.popcnt() == this->m_delcnt);
 	assert(this->m_isPurged.max_rank1() == this->m_delcnt);
@@ -877,6 +1311,7 @@ ReadonlySegment::completeAndReload(CompositeTable* tab, size_t segIdx,
 	assert(tab->m_segments[segIdx].get() == input);
 	tab->m_segments[segIdx] = this;
 	tab->m_segArrayUpdateSeq++;
+	tab->publishSegArrayVersionInLock();
 }
 
 // dstBaseId is for merge update
@@ -953,6 +1388,7 @@ ReadonlySegment::purgeDeletedRecords(CompositeTable* tab, size_t segIdx) {
 	m_isDel = input->m_isDel; // make a copy, input->m_isDel[*] may be changed
 	m_delcnt = m_isDel.popcnt(); // recompute delcnt
 	m_indices.resize(m_schema->getIndexNum());
+	m_keyFilters.resize(m_schema->getIndexNum());
 	m_colgroups.resize(m_schema->getColgroupNum());
 	auto tmpSegDir = m_segDir + ".tmp";
 	fs::create_directories(tmpSegDir);
@@ -994,6 +1430,10 @@ ReadonlySegment::purgeIndex(size_t indexId, ReadonlySegment* input, DbContext* c
 	SortableStrVec strVec;
 	const Schema& schema = m_schema->getIndexSchema(indexId);
 	const size_t  fixlen = schema.getFixedRowLen();
+	// index is built from all keys in memory
+	BgMemGuard memGuard(size_t(input->m_indices[indexId]->getReadableStore()
+								->dataInflateSize())
+				+ sizeof(SortableStrVec::SEntry) * size_t(inputRowNum));
 	if (0 == fixlen && schema.m_enableLinearScan) {
 		ReadableStorePtr store = new SeqReadAppendonlyStore(input->m_segDir, schema);
 		StoreIteratorPtr iter = store->createStoreIterForward(ctx);
@@ -1023,6 +1463,7 @@ ReadonlySegment::purgeIndex(size_t indexId, ReadonlySegment* input, DbContext* c
 			}
 		}
 	}
+	buildKeyFilter(indexId, strVec);
 	return this->buildIndex(schema, strVec);
 }
 
@@ -1069,7 +1510,9 @@ ReadonlySegment::purgeColgroup(size_t colgroupId, ReadonlySegment* input, DbCont
 	}
 	SortableStrVec strVec;
 	size_t fixlen = schema.getFixedRowLen();
-	size_t maxMem = size_t(m_schema->m_compressingWorkMemSize);
+	size_t maxMem = BgScheduler::instance().capWorkMem(
+						size_t(m_schema->m_compressingWorkMemSize));
+	BgMemGuard memGuard(std::min(maxMem, size_t(colgroup.dataInflateSize())));
 	valvec<ReadableStorePtr> parts;
 	auto partsPushRecord = [&](const ReadableStore& store, llong physicId) {
 		if (terark_unlikely(strVec.mem_size() >= maxMem)) {
@@ -1124,6 +1567,7 @@ ReadonlySegment::purgeColgroup(size_t colgroupId, ReadonlySegment* input, DbCont
 
 void ReadonlySegment::load(PathRef segDir) {
 	ReadableSegment::load(segDir);
+	loadKeyFilters(segDir);
 	removePurgeBitsForCompactIdspace(segDir);
 }
 
@@ -1214,9 +1658,56 @@ void ReadonlySegment::save(PathRef segDir) const {
 		return;
 	}
 	savePurgeBits(segDir);
+	saveKeyFilters(segDir);
 	ReadableSegment::save(segDir);
 }
 
+///@param indexData must be called before buildIndex, because buildIndex
+///                 may consume indexData
+void
+ReadonlySegment::buildKeyFilter(size_t indexId, const SortableStrVec& indexData) {
+	const Schema& schema = m_schema->getIndexSchema(indexId);
+	// may be called in parallel for different indexId, don't resize here
+	assert(m_keyFilters.size() == m_schema->getIndexNum());
+	m_keyFilters[indexId].reset();
+	if (!KeyFilter::isEnabled(schema)) {
+		return;
+	}
+	if (indexData.size() == 0 && indexData.str_size() == 0) {
+		return;
+	}
+	KeyFilterPtr filter(new KeyFilter());
+	filter->build(schema, indexData);
+	m_keyFilters[indexId] = filter;
+}
+
+void ReadonlySegment::saveKeyFilters(PathRef segDir) const {
+	for (size_t i = 0; i < m_keyFilters.size(); ++i) {
+		if (m_keyFilters[i]) {
+			const Schema& schema = m_schema->getIndexSchema(i);
+			fs::path path = segDir / ("index-" + schema.m_name);
+			m_keyFilters[i]->save(path);
+		}
+	}
+}
+
+// filter file is optional, segments built when filter is disabled
+// have no filter file
+void ReadonlySegment::loadKeyFilters(PathRef segDir) {
+	size_t indexNum = m_schema->getIndexNum();
+	m_keyFilters.erase_all();
+	m_keyFilters.resize(indexNum);
+	for (size_t i = 0; i < indexNum; ++i) {
+		const Schema& schema = m_schema->getIndexSchema(i);
+		fs::path path = segDir / ("index-" + schema.m_name);
+		if (fs::exists(path + ".filter")) {
+			KeyFilterPtr filter(new KeyFilter());
+			filter->load(path);
+			m_keyFilters[i] = filter;
+		}
+	}
+}
+
 void ReadonlySegment::saveRecordStore(PathRef segDir) const {
 	size_t indexNum = m_schema->getIndexNum();
 	size_t colgroupNum = m_schema->getColgroupNum();
@@ -1289,6 +1780,7 @@ void ReadonlySegment::closeFiles() {
 		m_isDel.risk_release_ownership();
 	}
 	m_indices.clear();
+	m_keyFilters.clear();
 	m_colgroups.clear();
 }
 
@@ -1365,33 +1857,200 @@ DbTransaction::~DbTransaction() {
 }
 DbTransaction::DbTransaction() {
 	m_status = committed;
+	m_walSegUid = 0;
+}
+void DbTransaction::walPut(llong recId, fstring row) {
+	if (m_walSegUid)
+		WriteAheadLog::encodePut(&m_walOps, recId, row);
+}
+void DbTransaction::walRemove(llong recId) {
+	if (m_walSegUid)
+		WriteAheadLog::encodeRemove(&m_walOps, recId);
 }
 void DbTransaction::startTransaction() {
 	assert(started != m_status);
+	m_walOps.erase_all();
 	do_startTransaction();
 	m_status = started;
 }
 bool DbTransaction::commit() {
 	assert(started == m_status);
-	if (do_commit()) {
+	// the log record is appended before do_commit, so records of
+	// conflicting transactions are in commit order, failed ones are
+	// marked as aborted
+	WriteAheadLog* wal = m_walOps.empty() ? NULL : WriteAheadLog::global();
+	uint64_t lsn = wal ? wal->append(m_walSegUid, m_walOps) : 0;
+	m_walOps.erase_all();
+	bool ok;
+	try {
+		ok = do_commit();
+	}
+	catch (const std::exception&) {
+		if (wal)
+			wal->abort(lsn);
+		throw;
+	}
+	if (ok) {
 		m_status = committed;
+		if (wal)
+			wal->waitDurable(lsn);
 		return true;
 	} else {
 		m_status = rollbacked;
+		if (wal)
+			wal->abort(lsn);
 		return false;
 	}
 }
 void DbTransaction::rollback() {
 	assert(started == m_status);
+	m_walOps.erase_all();
 	do_rollback();
 	m_status = rollbacked;
 }
 
 WritableSegment::WritableSegment() {
+	m_walSegUid = 0;
+	m_snapPinnedRows = 0;
 }
 WritableSegment::~WritableSegment() {
 	if (!m_tobeDel)
 		flushSegment();
+	// saved or converted to readonly segment, logged ops are obsolete.
+	// converted readonly segment was synced by convFrom
+	if (m_walSegUid) {
+		if (WriteAheadLog* wal = WriteAheadLog::global()) {
+			try {
+				if (!m_tobeDel)
+					WriteAheadLog::syncDir(m_segDir);
+				wal->detachSegment(m_walSegUid);
+			}
+			catch (const std::exception& ex) {
+				// keep the segment attached, its ops will be replayed
+				fprintf(stderr, "ERROR: ~WritableSegment(%s): %s\n"
+					, m_segDir.string().c_str(), ex.what());
+			}
+		}
+	}
+}
+
+bool WritableSegment::hasOwnLog() const {
+	return false;
+}
+
+void WritableSegment::attachWriteAheadLog() {
+	WriteAheadLog* wal = WriteAheadLog::global();
+	if (NULL == wal || hasOwnLog()) {
+		return;
+	}
+	m_walSegUid = WriteAheadLog::getSegmentUid(m_segDir);
+	wal->attachSegment(m_walSegUid);
+}
+
+void WritableSegment::walPut(llong subId, fstring row) {
+	WriteAheadLog* wal = WriteAheadLog::global();
+	if (m_walSegUid && wal) {
+		valvec<byte> ops;
+		WriteAheadLog::encodePut(&ops, subId, row);
+		wal->appendAndWait(m_walSegUid, ops);
+	}
+}
+void WritableSegment::walRemove(llong subId) {
+	WriteAheadLog* wal = WriteAheadLog::global();
+	if (m_walSegUid && wal) {
+		valvec<byte> ops;
+		WriteAheadLog::encodeRemove(&ops, subId);
+		wal->appendAndWait(m_walSegUid, ops);
+	}
+}
+
+// called on load, before the segment is visible to others.
+// ops are idempotent: put removes keys of the old row(if any) and inserts
+// keys of the new row, remove removes keys and row, so ops which are
+// already in the saved segment are harmless
+size_t WritableSegment::replayWriteAheadLog() {
+	WriteAheadLog* wal = WriteAheadLog::global();
+	if (NULL == wal || 0 == m_walSegUid) {
+		return 0;
+	}
+	const SchemaConfig& sconf = *m_schema;
+	std::unique_ptr<DbTransaction> txn(createTransaction());
+	ColumnVec    cols;
+	valvec<byte> oldRow, key;
+	valvec<llong> idvec;
+	const size_t batchOps = 1024;
+	size_t txnOps = 0;
+	auto removeOld = [&](llong subId) {
+		if (subId >= m_wrtStore->numDataRows())
+			return;
+		try {
+			txn->storeGetRow(subId, &oldRow);
+		}
+		catch (const ReadRecordException&) {
+			return;
+		}
+		if (oldRow.empty())
+			return;
+		sconf.m_rowSchema->parseRow(oldRow, &cols);
+		for (size_t i = 0; i < m_indices.size(); ++i) {
+			sconf.getIndexSchema(i).selectParent(cols, &key);
+			txn->indexRemove(i, key, subId);
+		}
+		txn->storeRemove(subId);
+	};
+	auto doReplay = [&](WriteAheadLog::OpType op, llong subId, fstring row) {
+		if (0 == txnOps)
+			txn->startTransaction();
+		// records may be logged out of subId order
+		while (llong(m_isDel.size()) <= subId) {
+			pushIsDel(true);
+			m_delcnt++;
+		}
+		removeOld(subId);
+		if (WriteAheadLog::OpPut == op) {
+			auto wrtStore = m_wrtStore->getWritableStore();
+			for (llong id = m_wrtStore->numDataRows(); id < subId; ++id)
+				wrtStore->update(id, fstring(), NULL); // placeholder, isDel is set
+			sconf.m_rowSchema->parseRow(row, &cols);
+			for (size_t i = 0; i < m_indices.size(); ++i) {
+				const Schema& iSchema = sconf.getIndexSchema(i);
+				iSchema.selectParent(cols, &key);
+				if (!txn->indexInsert(i, key, subId) && iSchema.m_isUnique) {
+					// the key was moved to subId by a later op of the log
+					txn->indexSearch(i, key, &idvec);
+					for (llong other : idvec)
+						txn->indexRemove(i, key, other);
+					txn->indexInsert(i, key, subId);
+				}
+			}
+			txn->storeUpsert(subId, row);
+			if (m_isDel[subId]) {
+				m_isDel.set0(subId);
+				m_delcnt--;
+			}
+		}
+		else if (!m_isDel[subId]) {
+			m_isDel.set1(subId);
+			m_delcnt++;
+		}
+		if (++txnOps == batchOps) {
+			if (!txn->commit())
+				THROW_STD(runtime_error, "replay commit failed: %s, seg = %s"
+					, txn->strError().c_str(), m_segDir.string().c_str());
+			txnOps = 0;
+		}
+	};
+	size_t opNum = wal->replay(m_walSegUid, doReplay);
+	if (txnOps && !txn->commit()) {
+		THROW_STD(runtime_error, "replay commit failed: %s, seg = %s"
+			, txn->strError().c_str(), m_segDir.string().c_str());
+	}
+	if (opNum) {
+		m_isDirty = true;
+		fprintf(stderr, "INFO: replayed %zd ops of write ahead log, seg = %s\n"
+			, opNum, m_segDir.string().c_str());
+	}
+	return opNum;
 }
 
 void WritableSegment::pushIsDel(bool val) {
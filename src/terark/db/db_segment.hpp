@@ -3,10 +3,12 @@
 
 #include "db_index.hpp"
 #include "db_store.hpp"
+#include "key_filter.hpp"
 #include <terark/bitmap.hpp>
 #include <terark/rank_select.hpp>
 #include <tbb/spin_rw_mutex.h>
 #include <tbb/tbb_thread.h>
+#include <atomic>
 
 namespace terark {
 	class SortableStrVec;
@@ -17,6 +19,8 @@ namespace terark { namespace db {
 typedef tbb::spin_rw_mutex        SpinRwMutex;
 typedef SpinRwMutex::scoped_lock  SpinRwLock;
 
+class SnapshotDelLog;
+
 // This ReadableStore is used for return full-row
 // A full-row is of one table, the table has multiple indices
 class TERARK_DB_DLL ReadableSegment : public ReadableStore {
@@ -47,6 +51,13 @@ public:
 										fstring key, valvec<llong>* recIdvec,
 										DbContext*) const = 0;
 
+	/// keys are sorted by memcmp, result of keys[i] is appended to
+	/// *recIdvecs[i], default calls indexSearchExactAppend for each key
+	virtual void indexSearchExactBatchAppend(size_t mySegIdx, size_t indexId,
+								const fstring* keys, size_t keyNum,
+								valvec<llong>* const* recIdvecs,
+								DbContext*) const;
+
 	virtual void selectColumns(llong recId, const size_t* colsId, size_t colsNum,
 							   valvec<byte>* colsData, DbContext*) const = 0;
 	virtual void selectOneColumn(llong recId, size_t columnId,
@@ -55,6 +66,10 @@ public:
 	virtual void selectColgroups(llong id, const size_t* cgIdvec, size_t cgIdvecSize,
 								 valvec<byte>* cgDataVec, DbContext*) const = 0;
 
+	///@returns false if the colgroup value can not be pinned
+	virtual bool selectOneColgroupPinned(llong id, size_t cgId, fstring* cgData,
+										 DbContext*) const;
+
 	void openIndices(PathRef dir);
 	void saveIndices(PathRef dir) const;
 	llong totalIndexSize() const;
@@ -80,12 +95,39 @@ public:
 		return m_isDel[logicId];
 	}
 
+	///@{ delete marks and removed unique index entries kept for
+	///    TableSnapshot, newestSnapshotSeq is the seq of the newest live
+	///    snapshot when the row is deleted, 0 if there is no live snapshot
+	// called in m_segMutex writer lock when setting the delete mark
+	void markDelForSnapshotInLock(size_t logicId, llong newestSnapshotSeq);
+	// called in m_segMutex writer lock before removing the entry of a row
+	// which is visible to live snapshots from unique index of a writable
+	// segment, so the key can be inserted again
+	void addSnapshotGhostInLock(size_t indexId, fstring key, size_t subId,
+								llong newestSnapshotSeq);
+	bool isDelInSnapshot(llong snapshotSeq, size_t logicId) const;
+	// append subId of ghosts of key which are visible to the snapshot
+	void searchSnapshotGhosts(size_t indexId, fstring key, llong snapshotSeq,
+							  size_t snapshotRows, valvec<llong>* subIds) const;
+	// the first ghost visible to the snapshot after (bkey, bSubId) in the
+	// iteration order, which is (key, subId) for forward, reversed for
+	// backward. If hasBound is false, find the first ghost.
+	bool nextSnapshotGhost(size_t indexId, bool forward, bool hasBound,
+						   fstring bkey, llong bSubId,
+						   llong snapshotSeq, size_t snapshotRows,
+						   valvec<byte>* key, llong* subId) const;
+	// drop marks and ghosts which are invisible to all live snapshots,
+	// minLiveSeq is the seq of the oldest live snapshot, or LLONG_MAX
+	void pruneSnapshotDels(llong minLiveSeq);
+	///@}
+
 	SchemaConfigPtr         m_schema;
 	valvec<ReadableIndexPtr> m_indices; // parallel with m_indexSchemaSet
 	valvec<ReadableStorePtr> m_colgroups; // indices + pure_colgroups
 	size_t      m_delcnt;
 	febitvec    m_isDel;
 	byte*       m_isDelMmap = nullptr;
+	SnapshotDelLog* m_snapDelLog; // nullptr if no row is logged
 	rank_select_se m_isPurged; // just for ReadonlySegment
 	byte*          m_isPurgedMmap;
 	boost::filesystem::path m_segDir;
@@ -132,12 +174,23 @@ public:
 	void convFrom(class CompositeTable*, size_t segIdx);
 	void purgeDeletedRecords(class CompositeTable*, size_t segIdx);
 
+	///@{ bulk load, build the segment from rows without a writable segment.
+	///   rows are written to colgroup temp files in m_segDir.tmp, then
+	///   bulkLoadFinish builds indices and stores, and moves it to m_segDir
+	void bulkLoadAppend(fstring row, DbContext*);
+	void bulkLoadFinish();
+	///@}
+
 	void getValueByLogicId(size_t id, valvec<byte>* val, DbContext*) const;
 	void getValueByPhysicId(size_t id, valvec<byte>* val, DbContext*) const;
 
 	void indexSearchExactAppend(size_t mySegIdx, size_t indexId,
 								fstring key, valvec<llong>* recIdvec,
 								DbContext*) const override;
+	void indexSearchExactBatchAppend(size_t mySegIdx, size_t indexId,
+								const fstring* keys, size_t keyNum,
+								valvec<llong>* const* recIdvecs,
+								DbContext*) const override;
 
 	void selectColumns(llong recId, const size_t* colsId, size_t colsNum,
 					   valvec<byte>* colsData, DbContext*) const override;
@@ -146,6 +199,8 @@ public:
 
 	void selectColgroups(llong id, const size_t* cgIdvec, size_t cgIdvecSize,
 						 valvec<byte>* cgDataVec, DbContext*) const override;
+	bool selectOneColgroupPinned(llong id, size_t cgId, fstring* cgData,
+								 DbContext*) const override;
 
 	void load(PathRef segDir) override;
 	void save(PathRef segDir) const override;
@@ -168,6 +223,9 @@ protected:
 							  const bm_uint_t* isDel, const febitvec* isPurged)
 			const;
 
+	class TempFileList;
+	void buildFromTempFiles(TempFileList&, PathRef tmpDir, llong newRowNum);
+	void saveAndReloadTmp();
 	void completeAndReload(class CompositeTable*, size_t segIdx,
 						   class ReadableSegment* input);
 	void syncUpdateRecordNoLock(size_t dstBaseId, size_t logicId,
@@ -183,14 +241,26 @@ protected:
 	void removePurgeBitsForCompactIdspace(PathRef segDir);
 	void savePurgeBits(PathRef segDir) const;
 
+	void buildKeyFilter(size_t indexId, const SortableStrVec& indexData);
+	void saveKeyFilters(PathRef segDir) const;
+	void loadKeyFilters(PathRef segDir);
+
+	// map physic ids appended by index search to logic ids, drop deleted
+	void indexResultToLogicId(valvec<llong>* recIdvec, size_t oldsize) const;
+
 protected:
 	friend class CompositeTable;
+	friend class TableSnapshot;
 	friend class TableIndexIter;
 	class MyStoreIterForward;  friend class MyStoreIterForward;
 	class MyStoreIterBackward; friend class MyStoreIterBackward;
+	valvec<KeyFilterPtr> m_keyFilters; // m_keyFilters[indexId] may be null
 	llong  m_dataInflateSize;
 	llong  m_dataMemSize;
 	llong  m_totalStorageSize;
+	TempFileList* m_bulkTempFiles; // just for bulk load
+	uint64_t      m_rowCacheId; // key prefix in RowCache
+	mutable std::atomic<bool> m_rowCacheUsed; // has inserted to RowCache
 };
 typedef boost::intrusive_ptr<ReadonlySegment> ReadonlySegmentPtr;
 
@@ -201,6 +271,12 @@ public:
 	valvec<llong>   m_removeOnCommit;
 	valvec<llong>   m_removeOnRollback; // the subId, must be in m_wrSeg
 	// @}
+	///@{ ops of the shared WriteAheadLog, appended on commit
+	uint64_t        m_walSegUid; // 0 if the log is not enabled
+	valvec<byte>    m_walOps;
+	void walPut(llong recId, fstring row);
+	void walRemove(llong recId);
+	///@}
 	virtual void indexSearch(size_t indexId, fstring key, valvec<llong>* recIdvec) = 0;
 	virtual void indexRemove(size_t indexId, fstring key, llong recId) = 0;
 	virtual bool indexInsert(size_t indexId, fstring key, llong recId) = 0;
@@ -264,6 +340,8 @@ public:
 	}
 	const std::string& strError() const { return m_txn->strError(); }
 	const char* szError() const { return m_txn->strError().c_str(); }
+	void walPut(llong recId, fstring row) { m_txn->walPut(recId, row); }
+	void walRemove(llong recId) { m_txn->walRemove(recId); }
 };
 class DefaultRollbackTransaction : public TransactionGuard {
 public:
@@ -341,8 +419,28 @@ public:
 
 	void getWrtStoreData(llong subId, valvec<byte>* buf, DbContext* ctx) const;
 
+	// true if the segment is recoverable by itself(such as a wiredtiger
+	// segment with its own log), it will not use the shared WriteAheadLog
+	virtual bool hasOwnLog() const;
+
+	///@{ shared WriteAheadLog, attached by CompositeTable
+	void attachWriteAheadLog();
+	// apply logged ops which may not be in the saved segment data
+	size_t replayWriteAheadLog();
+	///@{ log ops which are not in a DbTransaction
+	void walPut(llong subId, fstring row);
+	void walRemove(llong subId);
+	///@}
+	uint64_t m_walSegUid; // 0 if not attached
+	///@}
+
 	ReadableStorePtr  m_wrtStore;
 	valvec<uint32_t>  m_deletedWrIdSet;
+
+	// rows [0, m_snapPinnedRows) are visible to live snapshots, they must
+	// not be overwritten, recycled or removed from the store, guarded by
+	// m_segMutex
+	size_t m_snapPinnedRows;
 };
 typedef boost::intrusive_ptr<WritableSegment> WritableSegmentPtr;
 
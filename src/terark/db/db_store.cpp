@@ -87,6 +87,10 @@ UpdatableStore* ReadableStore::getUpdatableStore() {
 	return nullptr;
 }
 
+bool ReadableStore::getValuePinned(llong, fstring*, DbContext*) const {
+	return false;
+}
+
 void ReadableStore::deleteFiles() {
 	THROW_STD(invalid_argument, "Unsupportted Method");
 }
@@ -238,6 +242,20 @@ const {
 	m_parts[upp-1]->getValueAppend(id - baseId, val, ctx);
 }
 
+bool
+MultiPartStore::getValuePinned(llong id, fstring* val, DbContext* ctx)
+const {
+	assert(m_parts.size() + 1 == m_rowNumVec.size());
+	llong maxId = m_rowNumVec.back();
+	if (id >= maxId) {
+		THROW_STD(out_of_range, "id %lld, maxId = %lld", id, maxId);
+	}
+	size_t upp = upper_bound_a(m_rowNumVec, uint32_t(id));
+	assert(upp < m_rowNumVec.size());
+	llong baseId = m_rowNumVec[upp-1];
+	return m_parts[upp-1]->getValuePinned(id - baseId, val, ctx);
+}
+
 class MultiPartStore::MyStoreIterForward : public StoreIterator {
 	size_t m_partIdx = 0;
 	llong  m_id = 0;
@@ -73,6 +73,12 @@ public:
 	virtual llong dataInflateSize() const = 0;
 	virtual llong numDataRows() const = 0;
 	virtual void getValueAppend(llong id, valvec<byte>* val, DbContext*) const = 0;
+
+	// if the value is stored as plain bytes which live as long as the store,
+	// such as in the mmap of a readonly segment, set *val to point to it.
+	///@returns false if the value needs decoding, use getValueAppend then
+	virtual bool getValuePinned(llong id, fstring* val, DbContext*) const;
+
 	virtual void deleteFiles();
 	virtual StoreIterator* createStoreIterForward(DbContext*) const = 0;
 	virtual StoreIterator* createStoreIterBackward(DbContext*) const = 0;
@@ -124,6 +130,7 @@ public:
 	llong dataStorageSize() const override;
 	llong numDataRows() const override;
 	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	bool getValuePinned(llong id, fstring* val, DbContext*) const override;
 	StoreIterator* createStoreIterForward(DbContext*) const override;
 	StoreIterator* createStoreIterBackward(DbContext*) const override;
 
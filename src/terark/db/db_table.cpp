@@ -14,10 +14,21 @@
 #include <terark/util/sortable_strvec.hpp>
 #include <boost/scope_exit.hpp>
 #include <thread> // for std::this_thread::sleep_for
-#include <tbb/tbb_thread.h>
-#include <terark/util/concurrent_queue.hpp>
+#include <mutex>
+#include <system_error>
+#include "bg_scheduler.hpp"
+#include "write_ahead_log.hpp"
 #include <float.h>
 #include <terark/util/profiling.hpp>
+#include "json.hpp"
+
+#if defined(_MSC_VER)
+	#include <io.h>
+#else
+	#include <unistd.h>
+	#include <sys/file.h>
+#endif
+#include <fcntl.h>
 
 #undef min
 #undef max
@@ -30,6 +41,8 @@ namespace fs = boost::filesystem;
 
 const size_t DEFAULT_maxSegNum = 4095;
 
+static profiling g_statsPf;
+
 ///////////////////////////////////////////////////////////////////////////////
 
 #if defined(NDEBUG)
@@ -43,6 +56,38 @@ const size_t DEFAULT_maxSegNum = 4095;
 	} BOOST_SCOPE_EXIT_END
 #endif
 
+// run.lock is flock'ed while the table is opened, so run.lock left by a
+// crashed process can be told from run.lock of a live process.
+///@returns -1 if run.lock is locked by another process
+static int lockRunLockFile(PathRef fpath) {
+#if defined(_MSC_VER)
+	int fd = ::_open(fpath.string().c_str(), _O_RDWR|_O_CREAT, _S_IREAD|_S_IWRITE);
+#else
+	int fd = ::open(fpath.string().c_str(), O_RDWR|O_CREAT, 0644);
+#endif
+	if (fd < 0) {
+		THROW_STD(runtime_error, "open(%s) = %s"
+			, fpath.string().c_str(), strerror(errno));
+	}
+#if !defined(_MSC_VER)
+	if (::flock(fd, LOCK_EX|LOCK_NB) != 0) {
+		::close(fd);
+		return -1;
+	}
+#endif
+	return fd;
+}
+
+static void unlockRunLockFile(int fd) {
+	if (fd >= 0) {
+#if defined(_MSC_VER)
+		::_close(fd);
+#else
+		::close(fd); // also releases the flock
+#endif
+	}
+}
+
 CompositeTable* CompositeTable::open(PathRef dbPath) {
 	fs::path jsonFile = dbPath / "dbmeta.json";
 	SchemaConfigPtr sconf = new SchemaConfig();
@@ -65,10 +110,26 @@ CompositeTable::CompositeTable() {
 	m_bgTaskNum = 0;
 	m_rowNum = 0;
 	m_segArrayUpdateSeq = 1;
+	m_segArrayVersion = nullptr;
+	m_segVerEpoch = 0;
+	m_segVerReaders[0] = 0;
+	m_segVerReaders[1] = 0;
+	m_snapshotSeqGen = 0;
+	m_newestSnapshotSeq = 0;
+	m_mergePlanCnt = 0;
+	m_mergedSegCnt = 0;
+	m_mergedBytes = 0;
+	m_runLockFd = -1;
 //	m_ctxListHead = new DbContextLink();
 }
 
 CompositeTable::~CompositeTable() {
+	if (SegArrayVersion* ver = m_segArrayVersion.exchange(nullptr)) {
+		ver->release();
+	}
+	BOOST_SCOPE_EXIT(&m_runLockFd) {
+		unlockRunLockFile(m_runLockFd); // after run.lock was removed
+	} BOOST_SCOPE_EXIT_END;
 	if (m_dir.empty() || m_segments.empty()) {
 		return;
 	}
@@ -162,7 +223,16 @@ void CompositeTable::removeStaleDir(PathRef root, size_t inUseMergeSeq) const {
 	for (auto& x : fs::directory_iterator(root)) {
 		std::string mergeDir = x.path().filename().string();
 		size_t mergeSeq = -1;
-		if (sscanf(mergeDir.c_str(), "g-%04zd", &mergeSeq) == 1) {
+		if (fstring(mergeDir).startsWith("bulk-")) {
+			// TableBulkLoader was not finished
+			fprintf(stderr, "INFO: Remove stale bulk load dir: %s\n"
+				, x.path().string().c_str());
+			try { fs::remove_all(x.path()); }
+			catch (const std::exception& ex) {
+				fprintf(stderr, "ERROR: ex.what = %s\n", ex.what());
+			}
+		}
+		else if (sscanf(mergeDir.c_str(), "g-%04zd", &mergeSeq) == 1) {
 			if (mergeSeq != inUseMergeSeq) {
 				fprintf(stderr, "INFO: Remove stale dir: %s\n"
 					, x.path().string().c_str());
@@ -279,17 +349,31 @@ void CompositeTable::load(PathRef dir) {
 
 void CompositeTable::doLoad(PathRef dir) {
 	assert(m_schema.get() != nullptr);
+	m_mergePolicy = MergePolicy::create(m_schema->m_mergePolicy);
 	fs::path runLockFpath = dir / "run.lock";
-	if (fs::exists(runLockFpath)) {
+	const bool unclean = fs::exists(runLockFpath);
+	int runLockFd = lockRunLockFile(runLockFpath);
+	if (runLockFd < 0) {
 		THROW_STD(invalid_argument
-			, "Table is in using or closed unclean/crashed: %s"
+			, "Table is in using by another process: %s"
+			, dir.string().c_str());
+	}
+	if (unclean) {
+		// run.lock is not locked, the process which created it is dead
+		if (NULL == WriteAheadLog::global()) {
+			unlockRunLockFile(runLockFd);
+			THROW_STD(invalid_argument
+				, "Table is closed unclean/crashed: %s"
+				, dir.string().c_str());
+		}
+		fprintf(stderr
+			, "WARN: Table closed unclean/crashed: %s, recover by write ahead log\n"
 			, dir.string().c_str());
 	}
-	FileStream runLockFile(runLockFpath.string().c_str(), "w");
-	BOOST_SCOPE_EXIT(&runLockFile, &runLockFpath) {
-		if (runLockFile.fp()) { // failed
-			runLockFile.close();
+	BOOST_SCOPE_EXIT(&runLockFd, &runLockFpath) {
+		if (runLockFd >= 0) { // failed
 			fs::remove(runLockFpath);
+			unlockRunLockFile(runLockFd);
 		}
 	} BOOST_SCOPE_EXIT_END;
 	m_dir = dir;
@@ -311,6 +395,12 @@ void CompositeTable::doLoad(PathRef dir) {
 			if (fs::exists(rDir)) {
 				fprintf(stdout, "INFO: readonly segment: %s existed for writable seg: %s, remove it\n"
 					, rDir.string().c_str(), strDir.c_str());
+				if (WriteAheadLog* wal = WriteAheadLog::global()) {
+					if (fs::exists(segDir / "WalSegUid")) {
+						WriteAheadLog::syncDir(rDir);
+						wal->detachSegment(WriteAheadLog::getSegmentUid(segDir));
+					}
+				}
 				fs::remove_all(segDir);
 				continue;
 			}
@@ -318,6 +408,8 @@ void CompositeTable::doLoad(PathRef dir) {
 			fflush(stdout);
 			auto wseg = openWritableSegment(segDir);
 			wseg->m_segDir = segDir;
+			wseg->attachWriteAheadLog();
+			wseg->replayWriteAheadLog();
 			seg = wseg;
 		}
 		else if (sscanf(fname.c_str(), "rd-%ld", &segIdx) > 0) {
@@ -343,6 +435,7 @@ void CompositeTable::doLoad(PathRef dir) {
 		assert(seg);
 		m_segments[segIdx] = seg;
 	}
+	valvec<size_t> toCompress;
 	for (size_t i = 0; i < m_segments.size(); ++i) {
 		if (m_segments[i] == nullptr) {
 			THROW_STD(invalid_argument, "ERROR: missing segment: %s\n",
@@ -350,7 +443,7 @@ void CompositeTable::doLoad(PathRef dir) {
 		}
 		if (i < m_segments.size()-1 && m_segments[i]->getWritableStore()) {
 			m_segments[i]->m_isFreezed = true;
-			this->putToCompressionQueue(i);
+			toCompress.push_back(i);
 		}
 	}
 	fprintf(stderr, "INFO: CompositeTable::load(%s): loaded %zd segs\n",
@@ -376,7 +469,154 @@ void CompositeTable::doLoad(PathRef dir) {
 	}
 	m_rowNumVec.back() = baseId; // the end guard
 	m_rowNum = baseId;
-	runLockFile.close();
+	{
+		MyRwLock lock(m_rwMutex, true);
+		publishSegArrayVersionInLock();
+	}
+	// compression tasks use m_rowNumVec and the published segment array,
+	// so they must be queued after both are ready
+	for (size_t segIdx : toCompress) {
+		this->putToCompressionQueue(segIdx);
+	}
+	m_runLockFd = runLockFd; // hold the lock until the table is closed
+	runLockFd = -1;
+}
+
+SegArrayVersion::~SegArrayVersion() {
+}
+
+SegArrayVersionPtr CompositeTable::getSegArrayVersion() const {
+	for (;;) {
+		size_t epoch = m_segVerEpoch.load();
+		auto& readers = m_segVerReaders[epoch % 2];
+		readers++;
+		if (m_segVerEpoch.load() == epoch) {
+			// writer of next epoch will wait for us to release its old version
+			SegArrayVersionPtr ver(m_segArrayVersion.load());
+			readers--;
+			assert(nullptr != ver);
+			return ver;
+		}
+		readers--; // a writer is publishing, retry
+	}
+}
+
+// writers are serialized by m_rwMutex writer lock
+void CompositeTable::publishSegArrayVersionInLock() {
+	SegArrayVersion* ver = new SegArrayVersion();
+	ver->add_ref();
+	ver->m_segments.assign(m_segments);
+	ver->m_rowNumVec.assign(m_rowNumVec);
+	ver->m_wrSeg = m_wrSeg;
+	ver->m_segArrayUpdateSeq = m_segArrayUpdateSeq;
+	SegArrayVersion* old = m_segArrayVersion.exchange(ver);
+	size_t epoch = m_segVerEpoch++;
+	// readers registered in old epoch may be loading old version, new
+	// readers register in the other counter and will see new version
+	while (m_segVerReaders[epoch % 2].load() != 0) {
+		std::this_thread::yield();
+	}
+	if (old) {
+		old->release();
+	}
+}
+
+TableSnapshotPtr CompositeTable::createSnapshot() {
+	TableSnapshotPtr snap(new TableSnapshot());
+	profiling pf;
+	llong t0 = pf.now();
+	llong t1 = t0;
+	for (;;) {
+		MyRwLock lock(m_rwMutex, true);
+		DebugCheckRowNumVecNoLock(this);
+		// the caller is not a writer, wait for all in progress writers and
+		// BatchWriters, so the snapshot never sees half done writes
+		if (m_inprogressWritingCount > 0) {
+			lock.release();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			llong t2 = pf.now();
+			if (pf.ms(t1, t2) > 1000) {
+				fprintf(stderr
+					, "INFO: createSnapshot: wait for inprogress writing: %s, %f seconds\n"
+					, m_dir.string().c_str(), pf.sf(t0, t2));
+				t1 = t2;
+			}
+			continue;
+		}
+		SegArrayVersionPtr ver = getSegArrayVersion();
+		size_t segNum = ver->m_segments.size();
+		snap->m_tab.reset(this);
+		snap->m_segNum = segNum;
+		snap->m_rowNum = m_rowNum;
+		if (segNum) {
+			snap->m_lastSegRows = size_t(m_rowNum - ver->m_rowNumVec[segNum-1]);
+		}
+		if (auto wrseg = m_wrSeg.get()) {
+			assert(ver->m_segments.back().get() == wrseg);
+			SpinRwLock wsLock(wrseg->m_segMutex, true);
+			assert(wrseg->m_isDel.size() == snap->m_lastSegRows);
+			wrseg->m_snapPinnedRows = wrseg->m_isDel.size();
+			snap->m_hasWrSeg = true;
+		}
+		snap->m_segVer.swap(ver);
+		snap->m_seq = ++m_snapshotSeqGen;
+		m_liveSnapshots.push_back(snap->m_seq);
+		m_newestSnapshotSeq = snap->m_seq;
+		break;
+	}
+	return snap;
+}
+
+void CompositeTable::releaseSnapshot(const TableSnapshot* snap) {
+	MyRwLock lock(m_rwMutex, true);
+	size_t idx = lower_bound_a(m_liveSnapshots, snap->m_seq);
+	assert(idx < m_liveSnapshots.size());
+	assert(m_liveSnapshots[idx] == snap->m_seq);
+	m_liveSnapshots.erase_i(idx, 1);
+	m_newestSnapshotSeq = m_liveSnapshots.empty() ? 0 : m_liveSnapshots.back();
+	llong minLiveSeq = m_liveSnapshots.empty() ? LLONG_MAX : m_liveSnapshots[0];
+	if (m_liveSnapshots.empty() && m_wrSeg) {
+		SpinRwLock wsLock(m_wrSeg->m_segMutex, true);
+		m_wrSeg->m_snapPinnedRows = 0;
+	}
+	// segments which are not in m_segments are pinned by other snapshots,
+	// they are pruned when those snapshots are released
+	for (auto& seg : snap->m_segVer->m_segments) {
+		seg->pruneSnapshotDels(minLiveSeq);
+	}
+	for (auto& seg : m_segments) {
+		seg->pruneSnapshotDels(minLiveSeq);
+	}
+}
+
+bool CompositeTable::isPinnedWrSegRow(llong subId) const {
+	auto wrseg = m_wrSeg.get();
+	SpinRwLock wsLock(wrseg->m_segMutex, false);
+	return size_t(subId) < wrseg->m_snapPinnedRows;
+}
+
+// the row of m_wrSeg is visible to live snapshots, it will be deleted by
+// just setting the delete mark, but its unique index entries are removed
+// so the key can be inserted again, the entries are kept as ghosts for
+// snapshots. cols is the parsed row.
+void
+CompositeTable::removePinnedRowUniqueKeys(llong subId, const ColumnVec& cols,
+										  DbTransaction* txn, valvec<byte>* key) {
+	auto wrseg = m_wrSeg.get();
+	const SchemaConfig& sconf = *m_schema;
+	{
+		// ghosts must be added before the index entries are removed
+		SpinRwLock wsLock(wrseg->m_segMutex, true);
+		for (size_t indexId : sconf.m_uniqIndices) {
+			sconf.getIndexSchema(indexId).selectParent(cols, key);
+			wrseg->addSnapshotGhostInLock(indexId, *key, size_t(subId),
+										  m_newestSnapshotSeq);
+		}
+	}
+	for (size_t indexId : sconf.m_uniqIndices) {
+		sconf.getIndexSchema(indexId).selectParent(cols, key);
+		txn->indexRemove(indexId, *key, subId);
+	}
 }
 
 size_t CompositeTable::findSegIdx(size_t segIdxBeg, ReadableSegment* seg) const {
@@ -642,6 +882,230 @@ public:
 	}
 };
 
+// Projection iterators walk record ids of each segment and select just the
+// columns by seg->selectColumns, for a readonly segment it reads only the
+// colgroups covering the columns and stitches them by physic id. Segment
+// store iterators of MyStoreIterBase are not used.
+class CompositeTable::MyProjectIterForward : public MyStoreIterBase {
+	valvec<size_t> m_colsId;
+	llong m_subId; // next subId in m_segs[m_segIdx]
+	StoreIterator* createSegStoreIter(ReadableSegment* seg) override {
+		return seg->createStoreIterForward(m_ctx.get());
+	}
+public:
+	MyProjectIterForward(const CompositeTable* tab,
+						 const size_t* colsId, size_t colsNum, DbContext* ctx)
+	  : m_colsId(colsId, colsNum) {
+		init(tab, ctx);
+		m_segIdx = 0;
+		m_subId = 0;
+	}
+	bool increment(llong* id, valvec<byte>* val) override {
+		assert(dynamic_cast<const CompositeTable*>(m_store.get()));
+		auto tab = static_cast<const CompositeTable*>(m_store.get());
+		MyRwLock lock(tab->m_rwMutex, false);
+		for (;;) {
+			const OneSeg& cur = m_segs[m_segIdx];
+			const ReadableSegment* seg = cur.seg.get();
+			llong rows = seg->m_isDel.size();
+			while (m_subId < rows && seg->m_isDel[m_subId])
+				m_subId++;
+			if (m_subId < rows) {
+				*id = cur.baseId + m_subId;
+				seg->selectColumns(m_subId, m_colsId.data(), m_colsId.size(),
+								   val, m_ctx.get());
+				m_subId++;
+				return true;
+			}
+			syncTabSegs();
+			if (m_segIdx >= m_segs.size()-2) {
+				return false;
+			}
+			m_segIdx++;
+			m_subId = 0;
+		}
+	}
+	bool seekExact(llong id, valvec<byte>* val) override {
+		auto tab = static_cast<const CompositeTable*>(m_store.get());
+		MyRwLock lock(tab->m_rwMutex, false);
+		syncTabSegs();
+		size_t upp = upper_bound_a(m_segs, id, CompareBy_baseId());
+		if (id < 0 || upp >= m_segs.size()) {
+			return false;
+		}
+		const OneSeg& cur = m_segs[upp-1];
+		llong subId = id - cur.baseId;
+		if (cur.seg->m_isDel[subId]) {
+			return false;
+		}
+		cur.seg->selectColumns(subId, m_colsId.data(), m_colsId.size(),
+							   val, m_ctx.get());
+		m_segIdx = upp - 1;
+		m_subId = subId + 1;
+		return true;
+	}
+	void reset() override {
+		auto tab = static_cast<const CompositeTable*>(m_store.get());
+		MyRwLock lock(tab->m_rwMutex, false);
+		resetIterBase();
+		m_segIdx = 0;
+		m_subId = 0;
+	}
+};
+
+class CompositeTable::MyProjectIterBackward : public MyStoreIterBase {
+	valvec<size_t> m_colsId;
+	llong m_subId; // next subId in m_segs[m_segIdx-1] is m_subId-1
+	StoreIterator* createSegStoreIter(ReadableSegment* seg) override {
+		return seg->createStoreIterBackward(m_ctx.get());
+	}
+public:
+	MyProjectIterBackward(const CompositeTable* tab,
+						  const size_t* colsId, size_t colsNum, DbContext* ctx)
+	  : m_colsId(colsId, colsNum) {
+		init(tab, ctx);
+		m_segIdx = m_segs.size() - 1;
+		// m_isDel of the writable segment grows by concurrent inserts
+		MyRwLock lock(tab->m_rwMutex, false);
+		m_subId = m_segs[m_segIdx-1].seg->m_isDel.size();
+	}
+	bool increment(llong* id, valvec<byte>* val) override {
+		assert(dynamic_cast<const CompositeTable*>(m_store.get()));
+		auto tab = static_cast<const CompositeTable*>(m_store.get());
+		MyRwLock lock(tab->m_rwMutex, false);
+		for (;;) {
+			const OneSeg& cur = m_segs[m_segIdx-1];
+			const ReadableSegment* seg = cur.seg.get();
+			while (m_subId > 0 && seg->m_isDel[m_subId-1])
+				m_subId--;
+			if (m_subId > 0) {
+				m_subId--;
+				*id = cur.baseId + m_subId;
+				seg->selectColumns(m_subId, m_colsId.data(), m_colsId.size(),
+								   val, m_ctx.get());
+				return true;
+			}
+			// don't need to sync, because new segs are appended
+			if (m_segIdx <= 1) {
+				return false;
+			}
+			m_segIdx--;
+			m_subId = m_segs[m_segIdx-1].seg->m_isDel.size();
+		}
+	}
+	bool seekExact(llong id, valvec<byte>* val) override {
+		auto tab = static_cast<const CompositeTable*>(m_store.get());
+		MyRwLock lock(tab->m_rwMutex, false);
+		syncTabSegs();
+		size_t upp = upper_bound_a(m_segs, id, CompareBy_baseId());
+		if (id < 0 || upp >= m_segs.size()) {
+			return false;
+		}
+		const OneSeg& cur = m_segs[upp-1];
+		llong subId = id - cur.baseId;
+		if (cur.seg->m_isDel[subId]) {
+			return false;
+		}
+		cur.seg->selectColumns(subId, m_colsId.data(), m_colsId.size(),
+							   val, m_ctx.get());
+		m_segIdx = upp;
+		m_subId = subId;
+		return true;
+	}
+	void reset() override {
+		auto tab = static_cast<const CompositeTable*>(m_store.get());
+		MyRwLock lock(tab->m_rwMutex, false);
+		resetIterBase();
+		m_segIdx = m_segs.size() - 1;
+		m_subId = m_segs[m_segIdx-1].seg->m_isDel.size();
+	}
+};
+
+// iterate record ids [beg, end) which are in one segment
+class CompositeTable::MyStoreIterRange : public StoreIterator {
+	DbContextPtr m_ctx;
+	ReadableSegmentPtr m_seg;
+	StoreIteratorPtr m_iter;
+	llong m_baseId;
+	llong m_subBeg;
+	llong m_subEnd;
+	bool  m_started;
+
+	// caller should hold m_rwMutex, m_isDel of writable segment may grow
+	bool isDelNoLock(llong subId) const {
+		return m_seg->m_isDel[subId];
+	}
+public:
+	MyStoreIterRange(const CompositeTable* tab, DbContext* ctx,
+					 llong beg, llong end) {
+		m_store.reset(const_cast<CompositeTable*>(tab));
+		m_ctx.reset(ctx);
+		MyRwLock lock(tab->m_rwMutex, false);
+		size_t upp = upper_bound_0(tab->m_rowNumVec.data(),
+								   tab->m_rowNumVec.size(), beg);
+		if (beg < 0 || beg >= end || upp >= tab->m_rowNumVec.size() ||
+				end > tab->m_rowNumVec[upp]) {
+			THROW_STD(invalid_argument,
+				"range [%lld, %lld) is not in one segment, rows = %lld",
+				beg, end, tab->m_rowNumVec.back());
+		}
+		m_seg = tab->m_segments[upp-1];
+		m_baseId = tab->m_rowNumVec[upp-1];
+		m_subBeg = beg - m_baseId;
+		m_subEnd = end - m_baseId;
+		m_started = false;
+		lock.upgrade_to_writer();
+		tab->m_tableScanningRefCount++;
+	}
+	~MyStoreIterRange() {
+		auto tab = static_cast<const CompositeTable*>(m_store.get());
+		MyRwLock lock(tab->m_rwMutex, true);
+		tab->m_tableScanningRefCount--;
+	}
+	bool increment(llong* id, valvec<byte>* val) override {
+		auto tab = static_cast<const CompositeTable*>(m_store.get());
+		MyRwLock lock(tab->m_rwMutex, false);
+		if (terark_unlikely(!m_iter))
+			m_iter = m_seg->createStoreIterForward(m_ctx.get());
+		llong subId;
+		if (!m_started) {
+			m_started = true;
+			for (subId = m_subBeg; subId < m_subEnd; ++subId) {
+				if (!isDelNoLock(subId) && m_iter->seekExact(subId, val)) {
+					*id = m_baseId + subId;
+					return true;
+				}
+			}
+			return false;
+		}
+		while (m_iter->increment(&subId, val) && subId < m_subEnd) {
+			if (!isDelNoLock(subId)) {
+				*id = m_baseId + subId;
+				return true;
+			}
+		}
+		return false;
+	}
+	bool seekExact(llong id, valvec<byte>* val) override {
+		llong subId = id - m_baseId;
+		if (subId < m_subBeg || subId >= m_subEnd)
+			return false;
+		auto tab = static_cast<const CompositeTable*>(m_store.get());
+		MyRwLock lock(tab->m_rwMutex, false);
+		if (terark_unlikely(!m_iter))
+			m_iter = m_seg->createStoreIterForward(m_ctx.get());
+		if (isDelNoLock(subId))
+			return false;
+		m_started = true;
+		return m_iter->seekExact(subId, val);
+	}
+	void reset() override {
+		if (m_iter)
+			m_iter->reset();
+		m_started = false;
+	}
+};
+
 const std::string& BatchWriter::strError() const {
 	return m_ctx->m_transaction->strError();
 }
@@ -705,6 +1169,21 @@ BatchWriter::~BatchWriter() {
 	tab->m_inprogressWritingCount -= 2;
 	txn->m_removeOnCommit.erase_all();
 	txn->m_removeOnRollback.erase_all();
+	m_pinnedRemoveOnCommit.erase_all();
+}
+
+// the row is visible to live snapshots, just remove its unique keys, the
+// delete mark is set on commit, caller should hold tab->m_rwMutex
+void BatchWriter::removePinnedWrSegRow(llong subId) {
+	auto ctx = m_ctx.get();
+	auto tab = ctx->m_tab;
+	auto txn = ctx->m_transaction.get();
+	const SchemaConfig& sconf = *tab->m_schema;
+	txn->storeGetRow(subId, &ctx->row2); // throws ReadRecordException
+	sconf.m_rowSchema->parseRow(ctx->row2, &ctx->cols2);
+	tab->removePinnedRowUniqueKeys(subId, ctx->cols2, txn, &ctx->key2);
+	txn->walRemove(subId);
+	m_pinnedRemoveOnCommit.push_back(subId);
 }
 
 llong BatchWriter::overwriteExisting(fstring row) {
@@ -717,6 +1196,15 @@ llong BatchWriter::overwriteExisting(fstring row) {
 	DbTransaction* txn(ctx->m_transaction.get());
 	assert(tab->m_wrSeg.get() == m_wrSeg);
 	assert(txn == m_txn);
+	if (tab->isPinnedWrSegRow(subId)) {
+		// can not overwrite, delete it and insert the new row
+		removePinnedWrSegRow(subId);
+		llong newRecId = tab->insertRowDoInsertNoCommit(row, ctx);
+		if (newRecId >= 0) {
+			txn->m_removeOnRollback.push_back(newRecId - baseId);
+		}
+		return newRecId;
+	}
 	if (!sconf.m_multIndices.empty()) {
 		try {
 			txn->storeGetRow(subId, &ctx->row2);
@@ -732,6 +1220,7 @@ llong BatchWriter::overwriteExisting(fstring row) {
 		tab->updateSyncMultIndex(subId, txn, ctx);
 	}
 	txn->storeUpsert(subId, row);
+	txn->walPut(subId, row);
 	return baseId + subId;
 }
 
@@ -793,7 +1282,7 @@ FindInFrozenSegments:
 			MyRwLock lock(tab->m_rwMutex, false);
 			if (ctx->segArrayUpdateSeq != tab->m_segArrayUpdateSeq) {
 				ctx->doSyncSegCtxNoLock(tab);
-				size_t upp = upper_bound_a(ctx->m_rowNumVec, recId);
+				size_t upp = ctx->m_segLocator.upper_bound(recId);
 #if !defined(NDEBUG)
 				if (seg != ctx->m_segCtx[upp-1]->seg) {
 					seg = ctx->m_segCtx[upp-1]->seg; // for set break point
@@ -827,7 +1316,7 @@ void BatchWriter::removeRow(llong recId) {
 	assert(tab->m_wrSeg.get() == m_wrSeg);
 	assert(txn == m_txn);
 	ctx->trySyncSegCtxSpeculativeLock(tab);
-	size_t upp = upper_bound_a(ctx->m_rowNumVec, recId);
+	size_t upp = ctx->m_segLocator.upper_bound(recId);
 	llong baseId = ctx->m_rowNumVec[upp-1];
 	llong subId = recId - baseId;
 	assert(recId >= baseId);
@@ -840,12 +1329,21 @@ void BatchWriter::removeRow(llong recId) {
 		assert(wrseg == seg);
 		assert(!wrseg->m_isFreezed);
 		assert(!wrseg->m_bookUpdates);
-		{
-			if (wrseg->locked_testIsDel(subId))
-				return;
-			else
-				txn->m_removeOnCommit.push_back(recId);
+		if (wrseg->locked_testIsDel(subId))
+			return;
+		if (tab->isPinnedWrSegRow(subId)) {
+			MyRwLock lock(tab->m_rwMutex, false);
+			try {
+				removePinnedWrSegRow(subId);
+			}
+			catch (const ReadRecordException& ex) {
+				fprintf(stderr
+					, "ERROR: removeRow(id=%lld): read row data failed: %s\n"
+					, recId, ex.what());
+			}
+			return;
 		}
+		txn->m_removeOnCommit.push_back(recId);
 		valvec<byte> &row = ctx->row1, &key = ctx->key1;
 		ColumnVec& columns = ctx->cols1;
 		try {
@@ -866,6 +1364,7 @@ void BatchWriter::removeRow(llong recId) {
 			txn->indexRemove(i, key, subId);
 		}
 		txn->storeRemove(subId);
+		txn->walRemove(subId);
 	}
 	else {
 		if (!seg->m_isDel[subId])
@@ -902,6 +1401,9 @@ bool BatchWriter::commit() {
 				if (seg->m_isDel[subId]) {
 					continue;
 				}
+				if (&ws != seg) {
+					seg->markDelForSnapshotInLock(subId, tab->m_newestSnapshotSeq);
+				}
 				seg->m_isDel.set1(subId);
 				seg->m_delcnt++;
 				if (&ws == seg) {
@@ -911,6 +1413,18 @@ bool BatchWriter::commit() {
 				}
 			}
 		}
+		if (!m_pinnedRemoveOnCommit.empty()) {
+			MyRwLock lock(tab->m_rwMutex, false);
+			SpinRwLock segLock(ws.m_segMutex, true);
+			for (llong subId : m_pinnedRemoveOnCommit) {
+				if (!ws.m_isDel[subId]) {
+					ws.markDelForSnapshotInLock(size_t(subId), tab->m_newestSnapshotSeq);
+					ws.m_isDel.set1(subId);
+					ws.m_delcnt++;
+					ws.m_isDirty = true;
+				}
+			}
+		}
 		myDelcnt = txn->m_removeOnCommit.size();
 	}
 	else {
@@ -934,6 +1448,7 @@ bool BatchWriter::commit() {
 		}
 		myDelcnt = txn->m_removeOnRollback.size();
 	}
+	m_pinnedRemoveOnCommit.erase_all();
 	if (myDelcnt > 0) {
 		MyRwLock lock(tab->m_rwMutex, true);
 		const size_t segNum = tab->m_segments.size();
@@ -957,6 +1472,7 @@ void BatchWriter::rollback() {
 	assert(txn == m_txn);
 	assert(DbTransaction::started == txn->m_status);
 	txn->rollback();
+	m_pinnedRemoveOnCommit.erase_all();
 	MyRwLock lock(tab->m_rwMutex, false);
 	auto& ws = *tab->m_wrSeg;
 	for (llong wrSubId : txn->m_removeOnRollback) {
@@ -978,6 +1494,101 @@ StoreIterator* CompositeTable::createStoreIterBackward(DbContext* ctx) const {
 	return new MyStoreIterBackward(this, ctx);
 }
 
+StoreIterator*
+CompositeTable::createStoreIterRange(llong beg, llong end, DbContext* ctx)
+const {
+	assert(m_schema);
+	return new MyStoreIterRange(this, ctx, beg, end);
+}
+
+valvec<std::pair<llong, llong> >
+CompositeTable::getStoreScanRanges(size_t maxRows) const {
+	maxRows = std::max<size_t>(maxRows, 1);
+	valvec<std::pair<llong, llong> > ranges;
+	MyRwLock lock(m_rwMutex, false);
+	for (size_t i = 0; i < m_segments.size(); ++i) {
+		llong beg = m_rowNumVec[i];
+		llong end = m_rowNumVec[i+1];
+		if (beg == end)
+			continue;
+		// split to ranges of nearly equal size
+		size_t num = size_t(end - beg + maxRows - 1) / maxRows;
+		for (size_t j = 0; j < num; ++j) {
+			llong lo = beg + llong((end - beg) * j / num);
+			llong hi = beg + llong((end - beg) * (j+1) / num);
+			ranges.emplace_back(lo, hi);
+		}
+	}
+	return ranges;
+}
+
+void
+CompositeTable::storeScanParallel(size_t thrNum, const StoreScanCallback& fn)
+const {
+	if (0 == thrNum) {
+		thrNum = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+	// scanning is registered before ranges are computed, so the ranges
+	// stay valid until all of them are scanned
+	{
+		MyRwLock lock(m_rwMutex, true);
+		m_tableScanningRefCount++;
+	}
+	BOOST_SCOPE_EXIT(&m_rwMutex, &m_tableScanningRefCount){
+		MyRwLock lock(m_rwMutex, true);
+		m_tableScanningRefCount--;
+	}BOOST_SCOPE_EXIT_END;
+	llong rows = inlineGetRowNum();
+	// more ranges than threads, so that threads finish at nearly same time
+	size_t maxRows = std::max<size_t>(size_t(rows) / (4 * thrNum), 1024);
+	auto ranges = getStoreScanRanges(maxRows);
+	thrNum = std::min(thrNum, ranges.size());
+	std::atomic_size_t nextRange(0);
+	std::mutex exMutex;
+	std::exception_ptr ex;
+	auto scanRanges = [&]() {
+		try {
+			DbContextPtr ctx(createDbContext());
+			valvec<byte> row;
+			for (;;) {
+				size_t rangeIdx = nextRange++;
+				if (rangeIdx >= ranges.size())
+					break;
+				auto r = ranges[rangeIdx];
+				StoreIteratorPtr iter(createStoreIterRange(r.first, r.second, ctx.get()));
+				llong recId = -1;
+				while (iter->increment(&recId, &row)) {
+					if (!fn(rangeIdx, recId, row))
+						break;
+				}
+			}
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(exMutex);
+			if (!ex)
+				ex = std::current_exception();
+		}
+	};
+	std::vector<std::thread> threads;
+	threads.reserve(thrNum);
+	for (size_t i = 1; i < thrNum; ++i) {
+		// ranges are taken on demand, fewer threads still scan all
+		try {
+			threads.emplace_back(scanRanges);
+		}
+		catch (const std::system_error& e) {
+			fprintf(stderr
+				, "WARN: storeScanParallel: create thread failed: %s, use %zd threads\n"
+				, e.what(), i);
+			break;
+		}
+	}
+	scanRanges();
+	for (auto& th : threads) th.join();
+	if (ex)
+		std::rethrow_exception(ex);
+}
+
 DbContext* CompositeTable::createDbContext() const {
 	MyRwLock lock(m_rwMutex, false);
 	return this->createDbContextNoLock();
@@ -1024,12 +1635,23 @@ const {
 	ctx->trySyncSegCtxSpeculativeLock(this);
 	assert(ctx->m_rowNumVec.size() == ctx->m_segCtx.size() + 1);
 	auto rowNumPtr = ctx->m_rowNumVec.data();
-	size_t upp = upper_bound_0(rowNumPtr, ctx->m_rowNumVec.size(), id);
+	size_t upp = ctx->m_segLocator.upper_bound(id);
 	assert(upp < ctx->m_rowNumVec.size());
 	llong baseId = rowNumPtr[upp-1];
 	llong subId = id - baseId;
 	auto seg = ctx->m_segCtx[upp-1]->seg;
-	seg->getValueAppend(subId, val, ctx);
+	size_t oldsize = val->size();
+	if (m_stats.shouldSample(&ctx->statsTick)) {
+		llong t0 = g_statsPf.now();
+		seg->getValueAppend(subId, val, ctx);
+		m_stats.addLatency(ctx->statsShard, TableStats::ValueFetch,
+						   g_statsPf.ns(t0, g_statsPf.now()));
+	} else {
+		seg->getValueAppend(subId, val, ctx);
+	}
+	if (seg->getReadonlySegment()) {
+		m_stats.addDecompressed(ctx->statsShard, val->size() - oldsize);
+	}
 }
 
 bool
@@ -1079,7 +1701,9 @@ CompositeTable::doCreateNewSegmentInLock() {
 	auto oldwrseg = m_wrSeg.get();
 	{
 		SpinRwLock wrsegLock(oldwrseg->m_segMutex, true);
-		while (oldwrseg->m_isDel.size() && oldwrseg->m_isDel.back()) {
+		// rows visible to live snapshots must be kept
+		while (oldwrseg->m_isDel.size() > oldwrseg->m_snapPinnedRows &&
+			   oldwrseg->m_isDel.back()) {
 			assert(oldwrseg->m_delcnt > 0);
 			oldwrseg->popIsDel();
 			oldwrseg->m_delcnt--;
@@ -1098,6 +1722,7 @@ CompositeTable::doCreateNewSegmentInLock() {
 	m_rowNumVec.push_back(newMaxRowNum);
 	m_newWrSegNum++;
 	m_segArrayUpdateSeq++;
+	publishSegArrayVersionInLock();
 	oldwrseg->m_deletedWrIdSet.clear(); // free memory
 	// freeze oldwrseg, this may be too slow
 	// auto& oldwrseg = m_segments.ende(2);
@@ -1135,6 +1760,7 @@ CompositeTable::myCreateWritableSegment(PathRef segDir) const {
 			seg->m_colgroups[colgroupId] = new FixedLenStore(segDir, schema);
 		}
 	}
+	seg->attachWriteAheadLog();
 	return seg.release();
 }
 
@@ -1229,7 +1855,9 @@ CompositeTable::insertRowDoInsertNoCommit(fstring row, DbContext* ctx) {
 	auto& ws = *m_wrSeg;
 	{
 		SpinRwLock wsLock(ws.m_segMutex, true);
-		if (ws.m_deletedWrIdSet.empty()) {
+		// deleted rows below m_snapPinnedRows are invisible to snapshots,
+		// recycling them would make the new row visible to snapshots
+		if (ws.m_deletedWrIdSet.empty() || ws.m_snapPinnedRows) {
 			subId = (llong)ws.m_isDel.size();
 			ws.pushIsDel(true); // invisible to others
 			ws.m_delcnt++;
@@ -1245,6 +1873,7 @@ CompositeTable::insertRowDoInsertNoCommit(fstring row, DbContext* ctx) {
 	if (ctx->syncIndex) {
 		if (insertSyncIndex(subId, txn, ctx)) {
 			txn->storeUpsert(subId, row);
+			txn->walPut(subId, row);
 			SpinRwLock wsLock(ws.m_segMutex, true);
 			ws.m_isDirty = true;
 			ws.m_isDel.set0(subId);
@@ -1269,6 +1898,7 @@ CompositeTable::insertRowDoInsertNoCommit(fstring row, DbContext* ctx) {
 	}
 	else {
 		ws.update(subId, row, ctx);
+		ws.walPut(subId, row);
 		SpinRwLock wsLock(ws.m_segMutex, true);
 		ws.m_isDirty = true;
 		ws.m_isDel.set0(subId);
@@ -1370,7 +2000,7 @@ CompositeTable::doUpsertRow(fstring row, DbContext* ctx) {
 			if (ctx->segArrayUpdateSeq != m_segArrayUpdateSeq) {
 				ctx->doSyncSegCtxNoLock(this);
 				llong recId = baseId + subId;
-				size_t upp = upper_bound_a(ctx->m_rowNumVec, recId);
+				size_t upp = ctx->m_segLocator.upper_bound(recId);
 #if !defined(NDEBUG)
 				if (seg != ctx->m_segCtx[upp-1]->seg) {
 					seg = ctx->m_segCtx[upp-1]->seg; // for set break point
@@ -1391,6 +2021,7 @@ CompositeTable::doUpsertRow(fstring row, DbContext* ctx) {
 			if (newRecId >= 0) {
 				{
 					SpinRwLock segLock(seg->m_segMutex, true);
+					seg->markDelForSnapshotInLock(size_t(subId), m_newestSnapshotSeq);
 					seg->m_delcnt++;
 					seg->m_isDel.set1(subId);
 					seg->addtoUpdateList(subId);
@@ -1422,6 +2053,9 @@ CompositeTable::doUpsertRow(fstring row, DbContext* ctx) {
 	llong subId = ctx->exactMatchRecIdvec[0];
 	llong baseId = m_rowNumVec.ende(2);
 	assert(ctx->exactMatchRecIdvec.size() == 1);
+	if (isPinnedWrSegRow(subId)) {
+		return upsertOverPinnedRow(subId, row, ctx, lock);
+	}
 	TransactionGuard txn(ctx->m_transaction.get());
 	if (!sconf.m_multIndices.empty()) {
 		try {
@@ -1439,6 +2073,7 @@ CompositeTable::doUpsertRow(fstring row, DbContext* ctx) {
 		updateSyncMultIndex(subId, txn.getTxn(), ctx);
 	}
 	txn.storeUpsert(subId, row);
+	txn.walPut(subId, row);
 	if (!txn.commit()) {
 		TERARK_THROW(CommitException
 			, "commit failed: %s, baseId=%lld, subId=%lld, seg = %s, caller should retry"
@@ -1449,6 +2084,98 @@ CompositeTable::doUpsertRow(fstring row, DbContext* ctx) {
 	return baseId + subId;
 }
 
+// the old row in m_wrSeg is visible to live snapshots, it can not be
+// overwritten, delete it and insert the new row
+llong
+CompositeTable::upsertOverPinnedRow(llong subId, fstring row, DbContext* ctx,
+									MyRwLock& lock) {
+	const SchemaConfig& sconf = *m_schema;
+	llong baseId = m_rowNumVec.ende(2);
+	auto wrseg = m_wrSeg.get();
+	{
+		TransactionGuard txn(ctx->m_transaction.get());
+		try {
+			txn.storeGetRow(subId, &ctx->row2);
+		}
+		catch (const ReadRecordException&) {
+			txn.rollback();
+			throw ReadRecordException("upsertOverPinnedRow",
+						wrseg->m_segDir.string(), baseId, subId);
+		}
+		sconf.m_rowSchema->parseRow(ctx->row2, &ctx->cols2); // old
+		removePinnedRowUniqueKeys(subId, ctx->cols2, txn.getTxn(), &ctx->key2);
+		txn.walRemove(subId);
+		if (!txn.commit()) {
+			TERARK_THROW(CommitException
+				, "commit failed: %s, baseId=%lld, subId=%lld, seg = %s, caller should retry"
+				, txn.szError(), baseId, subId, wrseg->m_segDir.string().c_str());
+		}
+	}
+	{
+		SpinRwLock wsLock(wrseg->m_segMutex, true);
+		wrseg->markDelForSnapshotInLock(size_t(subId), m_newestSnapshotSeq);
+		wrseg->m_isDel.set1(subId);
+		wrseg->m_delcnt++;
+		wrseg->m_isDirty = true;
+		assert(wrseg->m_isDel.popcnt() == wrseg->m_delcnt);
+	}
+	llong recId = insertRowDoInsert(row, ctx);
+	if (recId >= 0) {
+		ctx->isUpsertOverwritten = 2;
+	}
+	maybeCreateNewSegment(lock);
+	return recId;
+}
+
+// the old row in m_wrSeg is visible to live snapshots, it can not be
+// updated in place, delete it and insert the new row, lock is writer
+llong
+CompositeTable::updatePinnedRow(llong subId, fstring row, DbContext* ctx,
+								MyRwLock& lock) {
+	const SchemaConfig& sconf = *m_schema;
+	llong baseId = m_rowNumVec.ende(2);
+	WritableSegmentPtr wrseg = m_wrSeg;
+	if (ctx->syncIndex) {
+		// ctx->cols2 is the old row, unique keys of the old row must be
+		// removed before inserting the new row
+		TransactionGuard txn(ctx->m_transaction.get());
+		removePinnedRowUniqueKeys(subId, ctx->cols2, txn.getTxn(), &ctx->key2);
+		if (!txn.commit()) {
+			TERARK_THROW(CommitException
+				, "commit failed: %s, baseId=%lld, subId=%lld, seg = %s"
+				, txn.szError(), baseId, subId, wrseg->m_segDir.string().c_str());
+		}
+	}
+	lock.downgrade_to_reader();
+	llong recId = insertRowImpl(row, ctx, lock); // id is changed
+	if (recId >= 0) {
+		{
+			SpinRwLock wsLock(wrseg->m_segMutex, true);
+			wrseg->markDelForSnapshotInLock(size_t(subId), m_newestSnapshotSeq);
+			wrseg->m_isDel.set1(subId);
+			wrseg->m_delcnt++;
+			wrseg->m_isDirty = true;
+			assert(wrseg->m_isDel.popcnt() == wrseg->m_delcnt);
+		}
+		wrseg->walRemove(subId);
+	}
+	else if (ctx->syncIndex) {
+		// restore unique keys of the old row, ghosts are dropped when
+		// snapshots are released
+		TransactionGuard txn(ctx->m_transaction.get());
+		for (size_t indexId : sconf.m_uniqIndices) {
+			sconf.getIndexSchema(indexId).selectParent(ctx->cols2, &ctx->key2);
+			txn.indexInsert(indexId, ctx->key2, subId);
+		}
+		if (!txn.commit()) {
+			fprintf(stderr
+				, "ERROR: updateRow: restore unique keys failed: %s, baseId=%lld, subId=%lld, seg = %s\n"
+				, txn.szError(), baseId, subId, wrseg->m_segDir.string().c_str());
+		}
+	}
+	return recId;
+}
+
 void
 CompositeTable::upsertRowMultiUniqueIndices(fstring row, valvec<llong>* resRecIdvec, DbContext* ctx) {
 	THROW_STD(domain_error, "This method is not supported for now");
@@ -1513,12 +2240,16 @@ CompositeTable::updateRow(llong id, fstring row, DbContext* ctx) {
 		seg = &*m_segments[j-1];
 	}
 	if (j == m_rowNumVec.size()-1) { // id is in m_wrSeg
+		if (isPinnedWrSegRow(subId)) {
+			return updatePinnedRow(subId, row, ctx, lock);
+		}
 		if (ctx->syncIndex) {
 			updateWithSyncIndex(subId, row, ctx);
 		}
 		else {
 			m_wrSeg->m_isDirty = true;
 			m_wrSeg->update(subId, row, ctx);
+			m_wrSeg->walPut(subId, row);
 		}
 		return id; // id is not changed
 	}
@@ -1531,6 +2262,7 @@ CompositeTable::updateRow(llong id, fstring row, DbContext* ctx) {
 		if (recId >= 0) {
 			// mark old subId as deleted
 			SpinRwLock segLock(seg->m_segMutex);
+			seg->markDelForSnapshotInLock(size_t(subId), m_newestSnapshotSeq);
 			seg->addtoUpdateList(size_t(subId));
 			seg->m_isDel.set1(subId);
 			seg->m_delcnt++;
@@ -1615,6 +2347,7 @@ CompositeTable::updateWithSyncIndex(llong subId, fstring row, DbContext* ctx) {
 	}
 	updateSyncMultIndex(subId, txn.getTxn(), ctx);
 	txn.storeUpsert(subId, row);
+	txn.walPut(subId, row);
 	if (!txn.commit()) {
 		llong baseId = m_rowNumVec.ende(2);
 		TERARK_THROW(CommitException
@@ -1670,10 +2403,15 @@ CompositeTable::removeRow(llong id, DbContext* ctx) {
 		auto wrseg = m_wrSeg.get();
 		assert(wrseg == seg);
 		assert(!wrseg->m_bookUpdates);
+		bool pinned;
 		{
 			SpinRwLock wsLock(wrseg->m_segMutex);
 			if (!wrseg->m_isDel[subId]) {
-				wrseg->m_deletedWrIdSet.push_back(uint32_t(subId));
+				pinned = size_t(subId) < wrseg->m_snapPinnedRows;
+				if (pinned) // keep the row for snapshots, don't recycle it
+					wrseg->markDelForSnapshotInLock(size_t(subId), m_newestSnapshotSeq);
+				else
+					wrseg->m_deletedWrIdSet.push_back(uint32_t(subId));
 				wrseg->m_delcnt++;
 				wrseg->m_isDel.set1(subId); // always set delmark
 				wrseg->m_isDirty = true;
@@ -1699,12 +2437,18 @@ CompositeTable::removeRow(llong id, DbContext* ctx) {
 					wrseg->m_segDir.string(), baseId, subId);
 			}
 			m_schema->m_rowSchema->parseRow(row, &columns);
-			for (size_t i = 0; i < wrseg->m_indices.size(); ++i) {
-				const Schema& iSchema = m_schema->getIndexSchema(i);
-				iSchema.selectParent(columns, &key);
-				txn.indexRemove(i, key, subId);
+			if (pinned) {
+				removePinnedRowUniqueKeys(subId, columns, txn.getTxn(), &key);
 			}
-			txn.storeRemove(subId);
+			else {
+				for (size_t i = 0; i < wrseg->m_indices.size(); ++i) {
+					const Schema& iSchema = m_schema->getIndexSchema(i);
+					iSchema.selectParent(columns, &key);
+					txn.indexRemove(i, key, subId);
+				}
+				txn.storeRemove(subId);
+			}
+			txn.walRemove(subId);
 			if (!txn.commit()) {
 				// this fail should be ignored, because the deletion bit
 				// have always be set, remove index is just an optimization
@@ -1712,13 +2456,18 @@ CompositeTable::removeRow(llong id, DbContext* ctx) {
 				fprintf(stderr
 					, "WARN: removeRow: commit failed: recId=%lld, baseId=%lld, subId=%lld, seg = %s"
 					, id, baseId, subId, wrseg->m_segDir.string().c_str());
+				wrseg->walRemove(subId);
 			}
 		}
+		else {
+			wrseg->walRemove(subId);
+		}
 	}
 	else { // freezed segment, just set del mark
 		{
 			SpinRwLock wsLock(seg->m_segMutex);
 			if (!seg->m_isDel[subId]) {
+				seg->markDelForSnapshotInLock(size_t(subId), m_newestSnapshotSeq);
 				seg->addtoUpdateList(size_t(subId));
 				seg->m_isDel.set1(subId);
 				seg->m_delcnt++;
@@ -1737,6 +2486,45 @@ CompositeTable::removeRow(llong id, DbContext* ctx) {
 	return true;
 }
 
+size_t
+CompositeTable::removeSegmentRows(ReadableSegment* seg) {
+	IncrementGuard_size_t guard(m_inprogressWritingCount);
+	MyRwLock lock(m_rwMutex, false);
+	if (findSegIdx(0, seg) == m_segments.size()) {
+		return 0; // merged or purged into a new segment
+	}
+	if (!seg->m_isFreezed) {
+		THROW_STD(invalid_argument
+			, "segment is writable, seg = %s", seg->m_segDir.string().c_str());
+	}
+	size_t rows = seg->m_isDel.size();
+	size_t newlyDeleted = 0;
+	{
+		SpinRwLock wsLock(seg->m_segMutex);
+		if (seg->m_delcnt == rows) {
+			return 0;
+		}
+		if (seg->m_bookUpdates || m_newestSnapshotSeq) {
+			for (size_t subId = 0; subId < rows; ++subId) {
+				if (!seg->m_isDel[subId]) {
+					seg->markDelForSnapshotInLock(subId, m_newestSnapshotSeq);
+					if (seg->m_bookUpdates)
+						seg->addtoUpdateList(subId);
+				}
+			}
+		}
+		newlyDeleted = rows - seg->m_delcnt;
+		seg->m_isDel.set1(0, rows);
+		seg->m_delcnt = rows;
+		seg->m_isDirty = true;
+	}
+	if (checkPurgeDeleteNoLock(seg)) {
+		lock.upgrade_to_writer();
+		asyncPurgeDeleteInLock();
+	}
+	return newlyDeleted;
+}
+
 ///! Can inplace update column in ReadonlySegment
 void
 CompositeTable::updateColumn(llong recordId, size_t columnId,
@@ -1943,15 +2731,25 @@ bool
 CompositeTable::indexKeyExistsNoLock(size_t indexId, fstring key, DbContext* ctx)
 const {
 	ctx->exactMatchRecIdvec.erase_all();
+	const bool sample = m_stats.shouldSample(&ctx->statsTick);
+	const llong t0 = sample ? g_statsPf.now() : 0;
 	size_t segNum = ctx->m_segCtx.size();
-	for (size_t i = 0; i < segNum; ++i) {
+	size_t i = 0;
+	for (; i < segNum; ++i) {
 		auto seg = ctx->m_segCtx[i]->seg;
 		seg->indexSearchExactAppend(i, indexId, key, &ctx->exactMatchRecIdvec, ctx);
 		if (ctx->exactMatchRecIdvec.size()) {
-			return true;
+			m_stats.addSegHit(ctx->statsShard, i);
+			i++;
+			break;
 		}
 	}
-	return false;
+	m_stats.addExactLookup(ctx->statsShard, i);
+	if (sample) {
+		m_stats.addLatency(ctx->statsShard, TableStats::IndexSeek,
+						   g_statsPf.ns(t0, g_statsPf.now()));
+	}
+	return !ctx->exactMatchRecIdvec.empty();
 }
 
 void
@@ -1994,6 +2792,9 @@ const {
 	}
 //	std::reverse(recIdvec->begin(), recIdvec->end()); // make descending
 #else
+	const bool sample = m_stats.shouldSample(&ctx->statsTick);
+	const llong t0 = sample ? g_statsPf.now() : 0;
+	size_t probes = 0;
 	// search newer segments first
 	for (size_t i = segNum; i > 0; ) {
 		auto seg = ctx->m_segCtx[--i]->seg;
@@ -2001,9 +2802,11 @@ const {
 			continue;
 		size_t oldsize = recIdvec->size();
 		seg->indexSearchExactAppend(i, indexId, key, recIdvec, ctx);
+		probes++;
 		size_t newsize = recIdvec->size();
 		size_t len = newsize - oldsize;
 		if (len) {
+			m_stats.addSegHit(ctx->statsShard, i);
 			llong* p = recIdvec->data() + oldsize;
 			llong baseId = ctx->m_rowNumVec[i];
 			for (size_t j = 0; j < len; ++j) {
@@ -2011,7 +2814,7 @@ const {
 			}
 			if (isUnique) {
 			//	assert(1 == newsize);
-				TERARK_IF_DEBUG(;,return);
+				TERARK_IF_DEBUG(;,break);
 			}
 			if (len >= 2) {
 				std::sort(p, p + len); // don't use std::greater
@@ -2019,9 +2822,123 @@ const {
 			}
 		}
 	}
+	m_stats.addExactLookup(ctx->statsShard, probes);
+	if (sample) {
+		m_stats.addLatency(ctx->statsShard, TableStats::IndexSeek,
+						   g_statsPf.ns(t0, g_statsPf.now()));
+	}
 #endif
 }
 
+void
+CompositeTable::indexSearchExactBatch(size_t indexId,
+									  const fstring* keys, size_t keyNum,
+									  valvec<valvec<llong> >* recIdvecs,
+									  DbContext* ctx)
+const {
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	indexSearchExactBatchNoLock(indexId, keys, keyNum, recIdvecs, ctx);
+}
+
+void
+CompositeTable::indexSearchExactBatch(size_t indexId,
+									  const fstring* keys, size_t keyNum,
+									  const size_t* colsId, size_t colsNum,
+									  valvec<valvec<llong> >* recIdvecs,
+									  valvec<valvec<byte> >* colsDataVec,
+									  DbContext* ctx)
+const {
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	indexSearchExactBatchNoLock(indexId, keys, keyNum, recIdvecs, ctx);
+	colsDataVec->resize(keyNum);
+	for (size_t i = 0; i < keyNum; ++i) {
+		const valvec<llong>& recIdvec = (*recIdvecs)[i];
+		valvec<byte>& colsData = (*colsDataVec)[i];
+		if (recIdvec.empty()) {
+			colsData.erase_all();
+			continue;
+		}
+		// recIdvec is in descending order, [0] is the newest record
+		llong id = recIdvec[0];
+		size_t upp = ctx->m_segLocator.upper_bound(id);
+		llong baseId = ctx->m_rowNumVec[upp-1];
+		auto seg = ctx->m_segCtx[upp-1]->seg;
+		seg->selectColumns(id - baseId, colsId, colsNum, &colsData, ctx);
+	}
+}
+
+/// same as calling indexSearchExactNoLock for each key, but keys are sorted
+/// once, and each segment is probed by all pending keys in one call, so a
+/// segment index searches sorted keys with locality. segments are still
+/// newest first. for unique index, a key is dropped from the pending list
+/// once it is found
+void
+CompositeTable::indexSearchExactBatchNoLock(size_t indexId,
+									  const fstring* keys, size_t keyNum,
+									  valvec<valvec<llong> >* recIdvecs,
+									  DbContext* ctx)
+const {
+	recIdvecs->resize(keyNum);
+	for (size_t k = 0; k < keyNum; ++k) {
+		(*recIdvecs)[k].erase_all();
+	}
+	const bool isUnique = m_schema->getIndexSchema(indexId).m_isUnique;
+	valvec<size_t> pending(keyNum, valvec_no_init());
+	for (size_t k = 0; k < keyNum; ++k) {
+		pending[k] = k;
+	}
+	std::sort(pending.begin(), pending.end(), [keys](size_t x, size_t y) {
+		return keys[x] < keys[y];
+	});
+	valvec<fstring> pendingKeys(keyNum, valvec_reserve());
+	valvec<valvec<llong>*> pendingOut(keyNum, valvec_reserve());
+	valvec<size_t> oldsizes(keyNum, valvec_reserve());
+	size_t segNum = ctx->m_segCtx.size();
+	size_t probes = 0;
+	for (size_t i = segNum; i > 0 && pending.size(); ) {
+		auto seg = ctx->m_segCtx[--i]->seg;
+		if (seg->m_isDel.size() == seg->m_delcnt)
+			continue;
+		llong baseId = ctx->m_rowNumVec[i];
+		pendingKeys.erase_all();
+		pendingOut.erase_all();
+		for (size_t k : pending) {
+			pendingKeys.push_back(keys[k]);
+			pendingOut.push_back(&(*recIdvecs)[k]);
+		}
+		oldsizes.resize_no_init(pending.size());
+		for (size_t j = 0; j < pending.size(); ++j) {
+			oldsizes[j] = pendingOut[j]->size();
+		}
+		probes += pending.size();
+		seg->indexSearchExactBatchAppend(i, indexId, pendingKeys.data(),
+				pendingKeys.size(), pendingOut.data(), ctx);
+		size_t numPending = 0;
+		for (size_t j = 0; j < pending.size(); ++j) {
+			valvec<llong>* recIdvec = pendingOut[j];
+			size_t oldsize = oldsizes[j];
+			size_t len = recIdvec->size() - oldsize;
+			if (len) {
+				m_stats.addSegHit(ctx->statsShard, i);
+				llong* p = recIdvec->data() + oldsize;
+				for (size_t l = 0; l < len; ++l) {
+					p[l] += baseId;
+				}
+				if (isUnique) {
+					continue; // found, drop from pending
+				}
+				if (len >= 2) {
+					std::sort(p, p + len); // don't use std::greater
+					std::reverse(p, p + len); // in descending order
+				}
+			}
+			pending[numPending++] = pending[j];
+		}
+		pending.risk_set_size(numPending);
+	}
+	m_stats.addExactLookup(ctx->statsShard, probes, keyNum);
+}
+
 // implemented in DfaDbTable
 ///@params recIdvec result of matched record id list
 bool
@@ -2068,6 +2985,36 @@ CompositeTable::indexInsert(size_t indexId, fstring indexKey, llong id,
 	return wrIndex->insert(indexKey, subId, txn);
 }
 
+size_t
+CompositeTable::indexInsertBatch(size_t indexId, const fstring* indexKeys,
+								 const llong* ids, size_t num, DbContext* txn)
+{
+	assert(txn != nullptr);
+	if (indexId >= m_schema->getIndexNum()) {
+		THROW_STD(invalid_argument,
+			"Invalid indexId=%lld, indexNum=%lld",
+			llong(indexId), llong(m_schema->getIndexNum()));
+	}
+	size_t failed = 0;
+	MyRwLock lock(m_rwMutex, true);
+	for (size_t i = 0; i < num; ++i) {
+		llong id = ids[i];
+		assert(id >= 0);
+		size_t upp = upper_bound_0(m_rowNumVec.data(), m_rowNumVec.size(), id);
+		assert(upp <= m_segments.size());
+		auto seg = m_segments[upp-1].get();
+		auto wrIndex = seg->m_indices[indexId]->getWritableIndex();
+		if (!wrIndex) {
+			continue;
+		}
+		llong subId = id - m_rowNumVec[upp-1];
+		seg->m_isDirty = true;
+		if (!wrIndex->insert(indexKeys[i], subId, txn))
+			failed++;
+	}
+	return failed;
+}
+
 bool
 CompositeTable::indexRemove(size_t indexId, fstring indexKey, llong id,
 							DbContext* txn)
@@ -2163,9 +3110,42 @@ llong CompositeTable::indexStorageSize(size_t indexId) const {
 	return sum;
 }
 
+llong
+CompositeTable::indexApproximateSize(size_t indexId, fstring beg, fstring end,
+									 DbContext* ctx)
+const {
+	if (indexId >= m_schema->getIndexNum()) {
+		THROW_STD(invalid_argument,
+			"Invalid indexId=%lld, indexNum=%lld",
+			llong(indexId), llong(m_schema->getIndexNum()));
+	}
+	SegArrayVersionPtr ver = getSegArrayVersion();
+	double sum = 0;
+	for (auto& seg : ver->m_segments) {
+		if (nullptr == seg->getReadonlySegment()) {
+			continue;
+		}
+		size_t rows = seg->getPhysicRows();
+		if (0 == rows) {
+			continue;
+		}
+		auto index = seg->m_indices[indexId].get();
+		llong lo = index->lowerBoundRank(beg, ctx);
+		llong hi = end.empty() ? llong(rows) : index->lowerBoundRank(end, ctx);
+		if (lo < 0 || hi < 0) {
+			continue; // index does not support rank
+		}
+		if (hi > lo) {
+			sum += double(hi - lo) * seg->totalStorageSize() / rows;
+		}
+	}
+	return llong(sum);
+}
+
 class TableIndexIter : public IndexIterator {
 	const CompositeTablePtr m_tab;
 	const DbContextPtr m_ctx;
+	const TableSnapshotPtr m_snap; // nullptr means the newest data
 	const size_t m_indexId;
 	struct OneSeg {
 		ReadableSegmentPtr seg;
@@ -2173,9 +3153,11 @@ class TableIndexIter : public IndexIterator {
 		valvec<byte>       data;
 		llong              subId = -1;
 		llong              baseId;
+		bool               eof = true;
 	};
 	valvec<OneSeg> m_segs;
-	bool lessThanImp(const Schema* schema, size_t x, size_t y) {
+	const Schema* m_schema;
+	bool lessThanImp(size_t x, size_t y) const {
 			const auto& xkey = m_segs[x].data;
 			const auto& ykey = m_segs[y].data;
 			if (xkey.empty()) {
@@ -2186,35 +3168,143 @@ class TableIndexIter : public IndexIterator {
 			}
 			if (ykey.empty())
 				return false; // xkey > ykey
-			int r = schema->compareData(xkey, ykey);
+			int r;
+			if (m_isByteLexKey) {
+				size_t n = std::min(xkey.size(), ykey.size());
+				r = memcmp(xkey.data(), ykey.data(), n);
+				if (0 == r)
+					r = int(xkey.size() > ykey.size()) - int(xkey.size() < ykey.size());
+			}
+			else {
+				r = m_schema->compareData(xkey, ykey);
+			}
 			if (r) return r < 0;
 			else   return x < y;
 	}
-	bool lessThan(const Schema* schema, size_t x, size_t y) {
+	// eof segment is greater than all others
+	bool lessThan(size_t x, size_t y) const {
+		if (m_segs[x].eof) return false;
+		if (m_segs[y].eof) return true;
 		if (m_forward)
-			return lessThanImp(schema, x, y);
+			return lessThanImp(x, y);
 		else
-			return lessThanImp(schema, y, x);
-	}
-	class HeapKeyCompare {
-		TableIndexIter* owner;
-		const Schema* schema;
-	public:
-		bool operator()(size_t x, size_t y) const {
-			// min heap's compare is 'greater'
-			return owner->lessThan(schema, y, x);
-		}
-		HeapKeyCompare(TableIndexIter* o)
-			: owner(o)
-			, schema(&o->m_tab->m_schema->getIndexSchema(o->m_indexId)) {}
-	};
-	friend class HeapKeyCompare;
+			return lessThanImp(y, x);
+	}
+	// Loser tree of segments, m_tree[0] is the winner(current min segment),
+	// m_tree[1, segNum) are internal nodes which keep the loser of the match,
+	// leaf of segment i is (segNum + i), parent of node n is n/2.
+	// Replaying the winner path needs just log2(segNum) comparisons, while
+	// a binary heap needs about 2*log2(segNum).
+	void buildLoserTree() {
+		const size_t segNum = m_segs.size();
+		m_tree.resize_no_init(segNum);
+		if (0 == segNum) {
+			return;
+		}
+		valvec<size_t> winner(2 * segNum, valvec_no_init());
+		for (size_t i = 0; i < segNum; ++i) {
+			winner[segNum + i] = i;
+		}
+		for (size_t n = segNum - 1; n > 0; --n) {
+			size_t l = winner[2*n], r = winner[2*n + 1];
+			if (lessThan(l, r))
+				winner[n] = l, m_tree[n] = r;
+			else
+				winner[n] = r, m_tree[n] = l;
+		}
+		m_tree[0] = segNum > 1 ? winner[1] : 0;
+	}
+	// leaf of segment segIdx was changed, replay its path to the root
+	void replayLoserTree(size_t segIdx) {
+		const size_t segNum = m_segs.size();
+		size_t w = segIdx;
+		for (size_t n = (segNum + segIdx) / 2; n > 0; n /= 2) {
+			if (lessThan(m_tree[n], w))
+				std::swap(m_tree[n], w);
+		}
+		m_tree[0] = w;
+	}
+	bool hasWinner() const {
+		return !m_tree.empty() && !m_segs[m_tree[0]].eof;
+	}
+	int compareKey(const valvec<byte>& xkey, const valvec<byte>& ykey) const {
+		if (xkey.empty() || ykey.empty())
+			return int(!xkey.empty()) - int(!ykey.empty());
+		if (m_isByteLexKey) {
+			size_t n = std::min(xkey.size(), ykey.size());
+			int r = memcmp(xkey.data(), ykey.data(), n);
+			if (r)
+				return r;
+			return int(xkey.size() > ykey.size()) - int(xkey.size() < ykey.size());
+		}
+		return m_schema->compareData(xkey, ykey);
+	}
+
+	///@{ unique index entries of the writable segment which were removed
+	///    after the snapshot was created, they are merged with the loser
+	///    tree by (key, subId), m_bound is the last emitted position
+	bool nextGhost(llong* subId) {
+		size_t segIdx = m_snap->m_segNum - 1;
+		return m_segs[segIdx].seg->nextSnapshotGhost(m_indexId, m_forward,
+				m_hasBound, m_boundKey, m_boundSubId,
+				m_snap->m_seq, m_snap->m_lastSegRows, &m_ghostKey, subId);
+	}
+	bool ghostBeforeWinner(llong gSubId) const {
+		size_t segIdx = m_tree[0];
+		const OneSeg& w = m_segs[segIdx];
+		int r = compareKey(m_ghostKey, w.data);
+		if (r)
+			return m_forward ? r < 0 : r > 0;
+		// equal keys are ordered by segIdx, ghosts are in the last segment
+		llong wSubId = segIdx + 1 == m_segs.size() ? w.subId : -1;
+		return m_forward ? gSubId < wSubId : gSubId > wSubId;
+	}
+	void setBound(fstring key, llong subId) {
+		m_boundKey.assign(key.udata(), key.size());
+		m_boundSubId = subId;
+		m_hasBound = true;
+	}
+	///@}
+
+	// pop rows until a visible one, its key is put into m_keyBuf
+	bool nextVisible(llong* id) {
+		for (;;) {
+			llong subId;
+			if (m_hasGhost && nextGhost(&subId) &&
+					(!hasWinner() || ghostBeforeWinner(subId))) {
+				// ghosts are always visible to the snapshot
+				m_keyBuf.swap(m_ghostKey);
+				setBound(m_keyBuf, subId);
+				*id = m_segs.back().baseId + subId;
+				return true;
+			}
+			if (!hasWinner())
+				return false;
+			size_t segIdx = incrementNoCheckDel(&subId);
+			if (m_hasGhost) {
+				setBound(m_keyBuf, segIdx + 1 == m_segs.size() ? subId : -1);
+			}
+			if (!isDeleted(segIdx, subId)) {
+				assert(subId < m_segs[segIdx].seg->numDataRows());
+				llong baseId = m_segs[segIdx].baseId;
+				*id = baseId + subId;
+				assert(*id < m_tab->numDataRows());
+				return true;
+			}
+		}
+	}
 	valvec<byte> m_keyBuf;
 	ColumnVec    m_keyColvec;
-	terark::valvec<size_t> m_heap;
+	terark::valvec<size_t> m_tree;
 	size_t m_oldsegArrayUpdateSeq;
 	const bool m_forward;
 	bool m_isHeapBuilt;
+	bool m_isByteLexKey; // memcmp is same as m_schema->compareData
+	bool m_hasGhost; // iterate unique index of a snapshot with m_wrSeg
+	bool m_hasBound;
+	llong m_boundSubId;
+	valvec<byte> m_boundKey;
+	valvec<byte> m_ghostKey;
 
 	IndexIterator* createIter(const ReadableSegment& seg) {
 		auto index = seg.m_indices[m_indexId];
@@ -2225,24 +3315,37 @@ class TableIndexIter : public IndexIterator {
 	}
 
 	size_t syncSegPtr() {
-		if (m_oldsegArrayUpdateSeq == m_tab->m_segArrayUpdateSeq) {
-			return 0;
+		SegArrayVersionPtr ver;
+		size_t segNum;
+		if (m_snap) {
+			// segment array of the snapshot never changes
+			if (!m_segs.empty() || 0 == m_snap->m_segNum) {
+				return 0;
+			}
+			ver = m_snap->m_segVer;
+			segNum = m_snap->m_segNum;
+		}
+		else {
+			if (m_oldsegArrayUpdateSeq == m_tab->m_segArrayUpdateSeq) {
+				return 0;
+			}
+			ver = m_tab->getSegArrayVersion();
+			segNum = ver->m_segments.size();
 		}
 		size_t numChangedSegs = 0;
-		MyRwLock lock(m_tab->m_rwMutex, false);
-		m_oldsegArrayUpdateSeq = m_tab->m_segArrayUpdateSeq;
-		m_segs.resize(m_tab->m_segments.size());
+		m_oldsegArrayUpdateSeq = ver->m_segArrayUpdateSeq;
+		m_segs.resize(segNum);
 		for (size_t i = 0; i < m_segs.size(); ++i) {
 			auto& cur = m_segs[i];
-			assert(m_tab->m_segments[i]);
-			if (cur.seg != m_tab->m_segments[i]) {
+			assert(ver->m_segments[i]);
+			if (cur.seg != ver->m_segments[i]) {
 				if (cur.seg) { // segment converted
 					cur.subId = -2; // need re-seek position??
 				}
 				cur.iter = nullptr;
-				cur.seg  = m_tab->m_segments[i];
+				cur.seg  = ver->m_segments[i];
 				cur.data.erase_all();
-				cur.baseId = m_tab->m_rowNumVec[i];
+				cur.baseId = ver->m_rowNumVec[i];
 				numChangedSegs++;
 			}
 		}
@@ -2250,31 +3353,58 @@ class TableIndexIter : public IndexIterator {
 	}
 
 public:
-	TableIndexIter(const CompositeTable* tab, size_t indexId, bool forward)
+	TableIndexIter(const CompositeTable* tab, size_t indexId, bool forward,
+				   const TableSnapshot* snap = nullptr)
 	  : m_tab(const_cast<CompositeTable*>(tab))
 	  , m_ctx(tab->createDbContext())
+	  , m_snap(const_cast<TableSnapshot*>(snap))
 	  , m_indexId(indexId)
 	  , m_forward(forward)
 	{
 		assert(tab->m_schema->getIndexSchema(indexId).m_isOrdered);
 		m_isUniqueInSchema = tab->m_schema->getIndexSchema(indexId).m_isUnique;
+		m_schema = &tab->m_schema->getIndexSchema(indexId);
+		m_isByteLexKey = true;
+		for (size_t i = 0, n = m_schema->columnNum(); i < n; ++i) {
+			switch (m_schema->getColumnType(i)) {
+			case ColumnType::Uint08:
+			case ColumnType::Uuid:
+			case ColumnType::Fixed:
+			case ColumnType::StrZero:
+				break;
+			case ColumnType::Binary:
+			case ColumnType::CarBin:
+				// length is omitted just when it is the last column
+				if (i + 1 == n)
+					break;
+				// fall through
+			default:
+				m_isByteLexKey = false;
+				break;
+			}
+		}
 		{
 			MyRwLock lock(tab->m_rwMutex);
 			tab->m_tableScanningRefCount++;
 		}
 		m_oldsegArrayUpdateSeq = 0;
 		m_isHeapBuilt = false;
+		m_hasGhost = snap && snap->m_hasWrSeg && snap->m_segNum &&
+					 m_isUniqueInSchema;
+		m_hasBound = false;
+		m_boundSubId = -1;
 	}
 	~TableIndexIter() {
 		MyRwLock lock(m_tab->m_rwMutex);
 		m_tab->m_tableScanningRefCount--;
 	}
 	void reset() override {
-		m_heap.erase_all();
+		m_tree.erase_all();
 		m_segs.erase_all();
 		m_keyBuf.erase_all();
 		m_oldsegArrayUpdateSeq = 0;
 		m_isHeapBuilt = false;
+		m_hasBound = false;
 	}
 	bool increment(llong* id, valvec<byte>* key) override {
 		if (terark_unlikely(!m_isHeapBuilt)) {
@@ -2286,53 +3416,45 @@ public:
 						cur.iter->reset();
 				}
 			}
-			m_heap.erase_all();
-			m_heap.reserve(m_segs.size());
 			for (size_t i = 0; i < m_segs.size(); ++i) {
 				auto& cur = m_segs[i];
-				if (cur.iter->increment(&cur.subId, &cur.data)) {
-					m_heap.push_back(i);
+				cur.eof = !cur.iter->increment(&cur.subId, &cur.data);
+				if (!cur.eof) {
 					cur.subId = cur.seg->getLogicId(cur.subId);
-				}
-			}
-			std::make_heap(m_heap.begin(), m_heap.end(), HeapKeyCompare(this));
-			m_isHeapBuilt = true;
-		}
-		while (!m_heap.empty()) {
-			llong subId;
-			size_t segIdx = incrementNoCheckDel(&subId);
-			if (!isDeleted(segIdx, subId)) {
-				assert(subId < m_segs[segIdx].seg->numDataRows());
-				llong baseId = m_segs[segIdx].baseId;
-				*id = baseId + subId;
-				assert(*id < m_tab->numDataRows());
-				if (key)
-					key->swap(m_keyBuf);
-				return true;
+				}
 			}
+			buildLoserTree();
+			m_isHeapBuilt = true;
+			m_hasBound = false;
+		}
+		if (nextVisible(id)) {
+			if (key)
+				key->swap(m_keyBuf);
+			return true;
 		}
 		return false;
 	}
 	size_t incrementNoCheckDel(llong* subId) {
-		assert(!m_heap.empty());
-		size_t segIdx = m_heap[0];
-		std::pop_heap(m_heap.begin(), m_heap.end(), HeapKeyCompare(this));
+		assert(hasWinner());
+		size_t segIdx = m_tree[0];
 		auto& cur = m_segs[segIdx];
 		*subId = cur.subId;
 		m_keyBuf.swap(cur.data); // should be assign, but swap is more efficient
 		if (cur.iter->increment(&cur.subId, &cur.data)) {
-			assert(m_heap.back() == segIdx);
-			std::push_heap(m_heap.begin(), m_heap.end(), HeapKeyCompare(this));
 			cur.subId = cur.seg->getLogicId(cur.subId);
 		}
 		else {
-			m_heap.pop_back();
+			cur.eof = true;
 			cur.subId = -3; // eof
 			cur.data.erase_all();
 		}
+		replayLoserTree(segIdx);
 		return segIdx;
 	}
 	bool isDeleted(size_t segIdx, llong subId) {
+		if (m_snap) {
+			return m_snap->isDeleted(segIdx, subId);
+		}
 		if (m_tab->m_segments.size()-1 == segIdx) {
 			MyRwLock lock(m_tab->m_rwMutex, false);
 			return m_segs[segIdx].seg->m_isDel[subId];
@@ -2388,16 +3510,14 @@ public:
 				if (cur.iter == nullptr)
 					cur.iter = createIter(*cur.seg);
 		}
-		m_heap.erase_all();
-		m_heap.reserve(m_segs.size());
 		for(size_t i = 0; i < m_segs.size(); ++i) {
 			auto& cur = m_segs[i];
 			int ret = inclusive
 					? cur.iter->seekLowerBound(key, &cur.subId, &cur.data)
 					: cur.iter->seekUpperBound(key, &cur.subId, &cur.data)
 					;
-			if (ret >= 0) {
-				m_heap.push_back(i);
+			cur.eof = ret < 0;
+			if (!cur.eof) {
 				cur.subId = cur.seg->getLogicId(cur.subId);
 			}
 		#if 0//!defined(NDEBUG)
@@ -2411,38 +3531,35 @@ public:
 		#endif
 		}
 		m_isHeapBuilt = true;
-		if (m_heap.size()) {
-			std::make_heap(m_heap.begin(), m_heap.end(), HeapKeyCompare(this));
-			while (!m_heap.empty()) {
-				llong subId;
-				size_t segIdx = incrementNoCheckDel(&subId);
-				if (!isDeleted(segIdx, subId)) {
-					assert(subId < m_segs[segIdx].seg->numDataRows());
-					llong baseId = m_segs[segIdx].baseId;
-					*id = baseId + subId;
-				#if !defined(NDEBUG)
-					assert(*id < m_tab->numDataRows());
-					if (m_forward) {
-						if (schema.compareData(key, m_keyBuf) > 0) {
-							fprintf(stderr, "ERROR: key=%s m_keyBuf=%s\n"
-								, schema.toJsonStr(key).c_str()
-								, schema.toJsonStr(m_keyBuf).c_str());
-						}
-						assert(schema.compareData(key, m_keyBuf) <= 0);
-					} else {
-						assert(schema.compareData(key, m_keyBuf) >= 0);
+		buildLoserTree();
+		if (m_hasGhost) {
+			// ghosts after the bound are candidates
+			bool afterKey = m_forward != inclusive;
+			setBound(key, afterKey ? LLONG_MAX : -1);
+		}
+		if (hasWinner() || m_hasGhost) {
+			if (nextVisible(id)) {
+			#if !defined(NDEBUG)
+				if (m_forward) {
+					if (schema.compareData(key, m_keyBuf) > 0) {
+						fprintf(stderr, "ERROR: key=%s m_keyBuf=%s\n"
+							, schema.toJsonStr(key).c_str()
+							, schema.toJsonStr(m_keyBuf).c_str());
 					}
-				#endif
-					int ret = (key == m_keyBuf) ? 0 : 1;
-					if (retKey)
-						retKey->swap(m_keyBuf);
-					return ret;
+					assert(schema.compareData(key, m_keyBuf) <= 0);
+				} else {
+					assert(schema.compareData(key, m_keyBuf) >= 0);
 				}
+			#endif
+				int ret = (key == m_keyBuf) ? 0 : 1;
+				if (retKey)
+					retKey->swap(m_keyBuf);
+				return ret;
 			}
 		}
 		else {
 		#if !defined(NDEBUG)
-			fprintf(stderr, "DEBUG: heap is empty: key=%s\n"
+			fprintf(stderr, "DEBUG: loser tree is empty: key=%s\n"
 				, schema.toJsonStr(key).c_str());
 		#endif
 		}
@@ -2478,6 +3595,512 @@ IndexIteratorPtr CompositeTable::createIndexIterBackward(fstring indexCols) cons
 	return createIndexIterBackward(indexId);
 }
 
+TableSnapshot::TableSnapshot() {
+	m_segNum = 0;
+	m_rowNum = 0;
+	m_seq = 0;
+	m_lastSegRows = 0;
+	m_hasWrSeg = false;
+}
+
+TableSnapshot::~TableSnapshot() {
+	if (m_tab) {
+		m_tab->releaseSnapshot(this);
+	}
+}
+
+PinnedValue::PinnedValue() {
+}
+PinnedValue::~PinnedValue() {
+}
+
+void PinnedValue::reset() {
+	m_seg.reset();
+	m_data = fstring();
+}
+
+static void
+selectOneColgroupPinnedImpl(ReadableSegment* seg, llong subId, size_t cgId,
+							PinnedValue* val, DbContext* ctx) {
+	if (seg->selectOneColgroupPinned(subId, cgId, &val->m_data, ctx)) {
+		val->m_seg.reset(seg);
+	}
+	else {
+		val->m_seg.reset();
+		seg->selectColgroups(subId, &cgId, 1, &val->m_buf, ctx);
+		val->m_data = fstring(val->m_buf);
+	}
+}
+
+size_t TableSnapshot::getSegIdx(llong id) const {
+	assert(id >= 0);
+	if (id >= m_rowNum) {
+		THROW_STD(out_of_range, "id = %lld, snapshot rows = %lld", id, m_rowNum);
+	}
+	const llong* rowNumVec = m_segVer->m_rowNumVec.data();
+	size_t upp = upper_bound_0(rowNumVec, m_segNum, id);
+	assert(upp > 0);
+	return upp - 1;
+}
+
+bool TableSnapshot::isDeleted(size_t segIdx, llong subId) const {
+	assert(segIdx < m_segNum);
+	if (segIdx + 1 == m_segNum && size_t(subId) >= m_lastSegRows) {
+		return true; // appended after the snapshot was created
+	}
+	auto seg = m_segVer->m_segments[segIdx].get();
+	return seg->isDelInSnapshot(m_seq, size_t(subId));
+}
+
+bool TableSnapshot::exists(llong id) const {
+	if (id < 0 || id >= m_rowNum) {
+		return false;
+	}
+	size_t segIdx = getSegIdx(id);
+	return !isDeleted(segIdx, id - m_segVer->m_rowNumVec[segIdx]);
+}
+
+void
+TableSnapshot::indexSearchExact(size_t indexId, fstring key,
+								valvec<llong>* recIdvec, DbContext* ctx)
+const {
+	assert(indexId < m_tab->getIndexNum());
+	recIdvec->erase_all();
+	for (size_t segIdx = m_segNum; segIdx > 0; ) {
+		auto seg = m_segVer->m_segments[--segIdx].get();
+		auto rdseg = seg->getReadonlySegment();
+		if (rdseg && indexId < rdseg->m_keyFilters.size()) {
+			auto filter = rdseg->m_keyFilters[indexId].get();
+			if (filter && !filter->mayContain(key))
+				continue;
+		}
+		llong baseId = m_segVer->m_rowNumVec[segIdx];
+		size_t oldsize = recIdvec->size();
+		seg->m_indices[indexId]->searchExactAppend(key, recIdvec, ctx);
+		size_t newsize = oldsize;
+		llong* p = recIdvec->data();
+		for (size_t k = oldsize; k < recIdvec->size(); ++k) {
+			size_t logicId = seg->getLogicId(size_t(p[k]));
+			if (!isDeleted(segIdx, logicId))
+				p[newsize++] = baseId + logicId;
+		}
+		recIdvec->risk_set_size(newsize);
+		if (m_hasWrSeg && segIdx + 1 == m_segNum &&
+				m_tab->getIndexSchema(indexId).m_isUnique) {
+			// entries removed from the unique index after the snapshot
+			// was created, skip the ones still in the index
+			valvec<llong> ghosts;
+			seg->searchSnapshotGhosts(indexId, key, m_seq, m_lastSegRows, &ghosts);
+			for (llong subId : ghosts) {
+				llong recId = baseId + subId;
+				p = recIdvec->data();
+				if (std::find(p + oldsize, p + recIdvec->size(), recId)
+						== p + recIdvec->size())
+					recIdvec->push_back(recId);
+			}
+		}
+	}
+}
+
+void
+TableSnapshot::selectOneColgroup(llong id, size_t cgId,
+								 valvec<byte>* cgData, DbContext* ctx)
+const {
+	size_t segIdx = getSegIdx(id);
+	llong  subId = id - m_segVer->m_rowNumVec[segIdx];
+	auto seg = m_segVer->m_segments[segIdx].get();
+	seg->selectColgroups(subId, &cgId, 1, cgData, ctx);
+}
+
+void
+TableSnapshot::selectOneColgroupPinned(llong id, size_t cgId,
+									   PinnedValue* val, DbContext* ctx)
+const {
+	size_t segIdx = getSegIdx(id);
+	llong  subId = id - m_segVer->m_rowNumVec[segIdx];
+	auto seg = m_segVer->m_segments[segIdx].get();
+	selectOneColgroupPinnedImpl(seg, subId, cgId, val, ctx);
+}
+
+IndexIteratorPtr TableSnapshot::createIndexIterForward(size_t indexId) const {
+	assert(indexId < m_tab->getIndexNum());
+	assert(m_tab->getIndexSchema(indexId).m_isOrdered);
+	return new TableIndexIter(m_tab.get(), indexId, true, this);
+}
+
+IndexIteratorPtr TableSnapshot::createIndexIterBackward(size_t indexId) const {
+	assert(indexId < m_tab->getIndexNum());
+	assert(m_tab->getIndexSchema(indexId).m_isOrdered);
+	return new TableIndexIter(m_tab.get(), indexId, false, this);
+}
+
+// seg is put at the place of m_wrSeg, m_wrSeg must be empty, so no record
+// id is changed, a new empty m_wrSeg is created after seg
+void CompositeTable::addBulkLoadedSegment(ReadonlySegment* seg) {
+	profiling pf;
+	llong t0 = pf.now();
+	llong t1 = t0;
+	MyRwLock lock;
+	for (;;) {
+		lock.acquire(m_rwMutex, true);
+		// merging requires segment array unchanged, and in progress
+		// writers may hold m_wrSeg, which will be replaced
+		if (m_isMerging || m_inprogressWritingCount > 0) {
+			lock.release();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			llong t2 = pf.now();
+			if (pf.ms(t1, t2) > 1000) {
+				fprintf(stderr
+					, "INFO: addBulkLoadedSegment: wait for %s: %s, %f seconds\n"
+					, m_isMerging ? "merging" : "inprogress writing"
+					, m_dir.string().c_str(), pf.sf(t0, t2));
+				t1 = t2;
+			}
+			continue;
+		}
+		break;
+	}
+	DebugCheckRowNumVecNoLock(this);
+	if (m_wrSeg->m_isDel.size() > 0) {
+		doCreateNewSegmentInLock();
+	}
+	if (m_segments.size() == m_segments.capacity()) {
+		THROW_STD(invalid_argument,
+			"Reaching maxSegNum=%d", int(m_segments.capacity()));
+	}
+	size_t segIdx = m_segments.size() - 1;
+	assert(m_segments[segIdx] == m_wrSeg);
+	assert(m_wrSeg->m_isDel.size() == 0);
+	assert(m_rowNumVec[segIdx] == m_rowNum);
+	fs::path segDir = getSegPath("rd", segIdx);
+	fs::rename(seg->m_segDir, segDir);
+	seg->m_segDir = segDir;
+	WritableSegmentPtr oldWrSeg = m_wrSeg;
+	m_wrSeg = myCreateWritableSegment(getSegPath("wr", segIdx + 1));
+	m_segments[segIdx] = seg;
+	m_segments.push_back(m_wrSeg);
+	llong newRowNum = m_rowNum + seg->m_isDel.size();
+	m_rowNumVec.back() = newRowNum;
+	m_rowNumVec.push_back(newRowNum);
+	m_rowNum = newRowNum;
+	m_segArrayUpdateSeq++;
+	publishSegArrayVersionInLock();
+	oldWrSeg->deleteSegment(); // it is empty, removed on release
+	fprintf(stderr, "INFO: addBulkLoadedSegment: %s, rows = %zd\n"
+		, segDir.string().c_str(), seg->m_isDel.size());
+}
+
+TableBulkLoader::TableBulkLoader(CompositeTable* tab, llong maxSegBytes)
+  : m_tab(tab), m_ctx(tab->createDbContext())
+{
+	const SchemaConfig& sconf = *tab->m_schema;
+	if (sconf.m_uniqIndices.size() > 1) {
+		THROW_STD(invalid_argument
+			, "this table has %zd unique indices, "
+			  "must have at most one unique index for bulk load"
+			, sconf.m_uniqIndices.size());
+	}
+	if (maxSegBytes <= 0)
+		maxSegBytes = llong(sconf.m_compressingWorkMemSize);
+	m_maxSegBytes = maxSegBytes;
+	m_segBytes = 0;
+	m_runBytes = 0;
+	m_rows = 0;
+	m_dupRows = 0;
+	m_segNum = 0;
+	m_uniqIndexId = sconf.m_uniqIndices.empty() ? size_t(-1) : sconf.m_uniqIndices[0];
+	m_checkExisting = tab->numDataRows() > 0;
+	m_ctx->syncIndex = true;
+}
+
+TableBulkLoader::~TableBulkLoader() {
+	try {
+		if (m_seg) { // not finished, discard the building segment
+			fs::path segDir = m_seg->m_segDir;
+			m_seg = nullptr;
+			fs::remove_all(segDir + ".tmp");
+			fs::remove_all(segDir);
+		}
+		removeRuns();
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "ERROR: ~TableBulkLoader: ex.what = %s\n", ex.what());
+	}
+}
+
+// in table dir, it is removed on load if the process crashed
+fs::path TableBulkLoader::getBulkDir(const char* kind, size_t idx) const {
+	char szBuf[64];
+	snprintf(szBuf, sizeof(szBuf), "bulk-%p-%s-%04zd", (void*)this, kind, idx);
+	return m_tab->m_dir / szBuf;
+}
+
+void TableBulkLoader::insertRow(fstring row) {
+	if (size_t(-1) == m_uniqIndexId) {
+		appendToSegment(row);
+		return;
+	}
+	const SchemaConfig& sconf = *m_tab->m_schema;
+	sconf.m_rowSchema->parseRow(row, &m_cols);
+	sconf.getIndexSchema(m_uniqIndexId).selectParent(m_cols, &m_keyBuf);
+	RunEntry e;
+	e.keyPos = m_runPool.size();
+	e.keyLen = m_keyBuf.size();
+	m_runPool.append(m_keyBuf);
+	e.rowPos = m_runPool.size();
+	e.rowLen = row.size();
+	m_runPool.append(row.udata(), row.size());
+	m_runEntries.push_back(e);
+	m_runBytes += row.size() + m_keyBuf.size() + sizeof(RunEntry);
+	if (m_runBytes >= m_maxSegBytes) {
+		spillRun();
+	}
+}
+
+// sort the buffered rows by unique key, the last row of a key wins
+void TableBulkLoader::sortRun() {
+	const Schema& schema = m_tab->m_schema->getIndexSchema(m_uniqIndexId);
+	const byte* pool = m_runPool.data();
+	auto key = [pool](const RunEntry& e) {
+		return fstring(pool + e.keyPos, e.keyLen);
+	};
+	std::stable_sort(m_runEntries.begin(), m_runEntries.end(),
+		[&](const RunEntry& x, const RunEntry& y) {
+			return schema.compareData(key(x), key(y)) < 0;
+		});
+	size_t n = 0;
+	for (size_t i = 0; i < m_runEntries.size(); ++i) {
+		if (n && schema.compareData(key(m_runEntries[n-1]), key(m_runEntries[i])) == 0) {
+			m_runEntries[n-1] = m_runEntries[i];
+			m_dupRows++;
+		} else {
+			m_runEntries[n++] = m_runEntries[i];
+		}
+	}
+	m_runEntries.risk_set_size(n);
+}
+
+void TableBulkLoader::spillRun() {
+	if (m_runEntries.empty()) {
+		return;
+	}
+	sortRun();
+	fs::path runDir = getBulkDir("run", m_runs.size());
+	fs::create_directories(runDir);
+	const Schema& rowSchema = *m_tab->m_schema->m_rowSchema;
+	ReadableStorePtr run = new SeqReadAppendonlyStore(runDir, rowSchema);
+	m_runs.push_back(run);
+	AppendableStore* appender = run->getAppendableStore();
+	for (const RunEntry& e : m_runEntries) {
+		appender->append(fstring(m_runPool.data() + e.rowPos, e.rowLen), NULL);
+	}
+	appender->shrinkToFit();
+	m_runPool.erase_all();
+	m_runEntries.erase_all();
+	m_runBytes = 0;
+}
+
+void TableBulkLoader::removeRuns() {
+	for (size_t i = 0; i < m_runs.size(); ++i) {
+		m_runs[i] = nullptr;
+		fs::remove_all(getBulkDir("run", i));
+	}
+	m_runs.erase_all();
+}
+
+// k-way merge of the spilled runs, equal keys in multiple runs are resolved
+// to the row of the last run, which is inserted last
+void TableBulkLoader::mergeRuns() {
+	const SchemaConfig& sconf = *m_tab->m_schema;
+	const Schema& schema = sconf.getIndexSchema(m_uniqIndexId);
+	struct RunCursor {
+		StoreIteratorPtr iter;
+		valvec<byte> row;
+		valvec<byte> key;
+	};
+	const size_t runNum = m_runs.size();
+	valvec<RunCursor> cursors(runNum);
+	ColumnVec cols;
+	auto next = [&](size_t i) {
+		RunCursor& c = cursors[i];
+		llong id;
+		if (!c.iter->increment(&id, &c.row))
+			return false;
+		sconf.m_rowSchema->parseRow(c.row, &cols);
+		schema.selectParent(cols, &c.key);
+		return true;
+	};
+	// heap top is the min key, the last run on equal keys
+	auto heapLess = [&](size_t x, size_t y) {
+		int r = schema.compareData(cursors[x].key, cursors[y].key);
+		if (r)
+			return r > 0;
+		return x < y;
+	};
+	valvec<size_t> heap;
+	for (size_t i = 0; i < runNum; ++i) {
+		cursors[i].iter = m_runs[i]->ensureStoreIterForward(NULL);
+		if (next(i))
+			heap.push_back(i);
+	}
+	std::make_heap(heap.begin(), heap.end(), heapLess);
+	valvec<byte> lastKey;
+	bool hasLast = false;
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), heapLess);
+		size_t i = heap.back();
+		RunCursor& c = cursors[i];
+		if (hasLast && schema.compareData(lastKey, c.key) == 0) {
+			m_dupRows++; // the row of a later run was taken
+		}
+		else {
+			appendSorted(c.row, c.key);
+			lastKey.assign(c.key);
+			hasLast = true;
+		}
+		if (next(i))
+			std::push_heap(heap.begin(), heap.end(), heapLess);
+		else
+			heap.pop_back();
+	}
+}
+
+void TableBulkLoader::appendSorted(fstring row, fstring key) {
+	if (m_checkExisting) {
+		// loaded row replaces the existing one, same as upsertRow
+		DbContext* ctx = m_ctx.get();
+		m_tab->indexSearchExact(m_uniqIndexId, key, &ctx->exactMatchRecIdvec, ctx);
+		for (llong recId : ctx->exactMatchRecIdvec) {
+			if (m_tab->removeRow(recId, ctx))
+				m_dupRows++;
+		}
+	}
+	appendToSegment(row);
+}
+
+void TableBulkLoader::appendToSegment(fstring row) {
+	if (!m_seg) {
+		m_seg = m_tab->myCreateReadonlySegment(getBulkDir("seg", m_segNum));
+	}
+	m_seg->bulkLoadAppend(row, m_ctx.get());
+	// index builds sort the keys of the segment in memory, it is the
+	// memory bound, stores are built in parts within the bound
+	const SchemaConfig& sconf = *m_tab->m_schema;
+	const ColumnVec& cols = m_ctx->cols1; // parsed by bulkLoadAppend
+	for (size_t i = 0; i < sconf.getIndexNum(); ++i) {
+		sconf.getIndexSchema(i).selectParent(cols, &m_keyBuf);
+		m_segBytes += m_keyBuf.size() + sizeof(SortableStrVec::SEntry);
+	}
+	m_rows++;
+	if (m_segBytes >= m_maxSegBytes) {
+		commitSegment();
+	}
+}
+
+void TableBulkLoader::commitSegment() {
+	m_seg->bulkLoadFinish();
+	m_tab->addBulkLoadedSegment(m_seg.get());
+	m_seg = nullptr;
+	m_segBytes = 0;
+	m_segNum++;
+}
+
+llong TableBulkLoader::finish() {
+	if (!m_runs.empty()) {
+		spillRun();
+		mergeRuns();
+		removeRuns();
+	}
+	else if (!m_runEntries.empty()) {
+		sortRun(); // all rows fit in memory
+		const byte* pool = m_runPool.data();
+		for (const RunEntry& e : m_runEntries) {
+			appendSorted(fstring(pool + e.rowPos, e.rowLen),
+						 fstring(pool + e.keyPos, e.keyLen));
+		}
+		m_runPool.clear();
+		m_runEntries.clear();
+		m_runBytes = 0;
+	}
+	if (m_seg) {
+		commitSegment();
+	}
+	return m_rows;
+}
+
+void
+CompositeTable::indexScanParallel(size_t indexId,
+								  const fstring* bounds, size_t boundNum,
+								  const IndexScanCallback& fn)
+const {
+	assert(indexId < m_schema->getIndexNum());
+	const Schema& schema = m_schema->getIndexSchema(indexId);
+	if (!schema.m_isOrdered) {
+		THROW_STD(invalid_argument, "index: %s is not ordered",
+			schema.m_name.c_str());
+	}
+	for (size_t i = 1; i < boundNum; ++i) {
+		if (schema.compareData(bounds[i-1], bounds[i]) > 0) {
+			THROW_STD(invalid_argument, "bounds[%zd] > bounds[%zd]", i-1, i);
+		}
+	}
+	const size_t rangeNum = boundNum + 1;
+	size_t thrNum = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	thrNum = std::min(thrNum, rangeNum);
+	std::atomic_size_t nextRange(0);
+	std::mutex exMutex;
+	std::exception_ptr ex;
+	auto scanRanges = [&]() {
+		try {
+			// each TableIndexIter has its own DbContext, reused by all
+			// ranges scanned by this thread
+			IndexIteratorPtr iter = createIndexIterForward(indexId);
+			valvec<byte> key;
+			for (;;) {
+				size_t rangeIdx = nextRange++;
+				if (rangeIdx >= rangeNum)
+					break;
+				llong recId = -1;
+				iter->reset();
+				bool hasData = 0 == rangeIdx
+					? iter->increment(&recId, &key)
+					: iter->seekLowerBound(bounds[rangeIdx-1], &recId, &key) >= 0;
+				while (hasData) {
+					if (rangeIdx < boundNum &&
+							schema.compareData(key, bounds[rangeIdx]) >= 0)
+						break;
+					if (!fn(rangeIdx, recId, key))
+						break;
+					hasData = iter->increment(&recId, &key);
+				}
+			}
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(exMutex);
+			if (!ex)
+				ex = std::current_exception();
+		}
+	};
+	std::vector<std::thread> threads;
+	threads.reserve(thrNum);
+	for (size_t i = 1; i < thrNum; ++i) {
+		// ranges are taken on demand, fewer threads still scan all
+		try {
+			threads.emplace_back(scanRanges);
+		}
+		catch (const std::system_error& e) {
+			fprintf(stderr
+				, "WARN: indexScanParallel: create thread failed: %s, use %zd threads\n"
+				, e.what(), i);
+			break;
+		}
+	}
+	scanRanges();
+	for (auto& th : threads) th.join();
+	if (ex)
+		std::rethrow_exception(ex);
+}
+
 template<class T>
 static
 valvec<size_t>
@@ -2517,7 +4140,7 @@ const {
 	if (terark_unlikely(id < 0 || id >= rows)) {
 		THROW_STD(out_of_range, "id = %lld, rows=%lld", id, rows);
 	}
-	size_t upp = upper_bound_a(ctx->m_rowNumVec, id);
+	size_t upp = ctx->m_segLocator.upper_bound(id);
 	llong baseId = ctx->m_rowNumVec[upp-1];
 	auto seg = ctx->m_segCtx[upp-1]->seg;
 	seg->selectColumns(id - baseId, cols.data(), cols.size(), colsData, ctx);
@@ -2540,7 +4163,7 @@ const {
 	if (terark_unlikely(id < 0 || id >= rows)) {
 		THROW_STD(out_of_range, "id = %lld, rows=%lld", id, rows);
 	}
-	size_t upp = upper_bound_a(ctx->m_rowNumVec, id);
+	size_t upp = ctx->m_segLocator.upper_bound(id);
 	llong baseId = ctx->m_rowNumVec[upp-1];
 	auto seg = ctx->m_segCtx[upp-1]->seg;
 	seg->selectColumns(id - baseId, colsId, colsNum, colsData, ctx);
@@ -2563,7 +4186,7 @@ const {
 	if (terark_unlikely(id < 0 || id >= rows)) {
 		THROW_STD(out_of_range, "id = %lld, rows=%lld", id, rows);
 	}
-	size_t upp = upper_bound_a(ctx->m_rowNumVec, id);
+	size_t upp = ctx->m_segLocator.upper_bound(id);
 	llong baseId = ctx->m_rowNumVec[upp-1];
 	auto seg = ctx->m_segCtx[upp-1]->seg;
 	seg->selectOneColumn(id - baseId, columnId, colsData, ctx);
@@ -2595,7 +4218,7 @@ void CompositeTable::selectColgroupsNoLock(llong recId,
 	if (terark_unlikely(recId < 0 || recId >= rows)) {
 		THROW_STD(out_of_range, "recId = %lld, rows=%lld", recId, rows);
 	}
-	size_t upp = upper_bound_a(ctx->m_rowNumVec, recId);
+	size_t upp = ctx->m_segLocator.upper_bound(recId);
 	llong baseId = ctx->m_rowNumVec[upp-1];
 	llong subId = recId - baseId;
 	assert(recId >= baseId);
@@ -2614,7 +4237,20 @@ void CompositeTable::selectOneColgroupNoLock(llong recId, size_t cgId,
 	selectColgroupsNoLock(recId, &cgId, 1, cgData, ctx);
 }
 
-#if 0
+void CompositeTable::selectOneColgroupPinned(llong recId, size_t cgId,
+						PinnedValue* val, DbContext* ctx) const {
+	ctx->trySyncSegCtxSpeculativeLock(this);
+	llong rows = m_rowNum;
+	if (terark_unlikely(recId < 0 || recId >= rows)) {
+		THROW_STD(out_of_range, "recId = %lld, rows=%lld", recId, rows);
+	}
+	size_t upp = ctx->m_segLocator.upper_bound(recId);
+	llong baseId = ctx->m_rowNumVec[upp-1];
+	assert(recId >= baseId);
+	auto seg = ctx->m_segCtx[upp-1]->seg;
+	selectOneColgroupPinnedImpl(seg, recId - baseId, cgId, val, ctx);
+}
+
 StoreIteratorPtr
 CompositeTable::createProjectIterForward(const valvec<size_t>& cols, DbContext* ctx)
 const {
@@ -2626,16 +4262,34 @@ const {
 	return createProjectIterBackward(cols.data(), cols.size(), ctx);
 }
 
+static void
+checkProjectCols(const Schema& rowSchema, const size_t* colsId, size_t colsNum) {
+	if (0 == colsNum) {
+		THROW_STD(invalid_argument, "colsNum must be > 0");
+	}
+	for (size_t i = 0; i < colsNum; ++i) {
+		if (colsId[i] >= rowSchema.columnNum()) {
+			THROW_STD(out_of_range, "colsId[%zd] = %zd, columnNum = %zd"
+				, i, colsId[i], rowSchema.columnNum());
+		}
+	}
+}
+
 StoreIteratorPtr
-CompositeTable::createProjectIterForward(const size_t* colsId, size_t colsNum, DbContext*)
+CompositeTable::createProjectIterForward(const size_t* colsId, size_t colsNum, DbContext* ctx)
 const {
+	assert(m_schema);
+	checkProjectCols(*m_schema->m_rowSchema, colsId, colsNum);
+	return new MyProjectIterForward(this, colsId, colsNum, ctx);
 }
 
 StoreIteratorPtr
-CompositeTable::createProjectIterBackward(const size_t* colsId, size_t colsNum, DbContext*)
+CompositeTable::createProjectIterBackward(const size_t* colsId, size_t colsNum, DbContext* ctx)
 const {
+	assert(m_schema);
+	checkProjectCols(*m_schema->m_rowSchema, colsId, colsNum);
+	return new MyProjectIterBackward(this, colsId, colsNum, ctx);
 }
-#endif
 
 namespace {
 fstring getDotExtension(fstring fpath) {
@@ -2763,42 +4417,42 @@ public:
 			this->m_tabSegNum = tab->m_segments.size();
 			DebugCheckRowNumVecNoLock(tab);
 		}
-		size_t sumSegRows = 0;
+		valvec<MergeSegInfo> segInfo(this->size(), valvec_reserve());
 		for (size_t i = 0; i < this->size(); ++i) {
-			sumSegRows += this->p[i].seg->m_isDel.size();
-		}
-		size_t avgSegRows = sumSegRows / this->size();
-		size_t maxSegRows = avgSegRows * 7/4;
-		if (m_forcePurgeAndMerge) {
-			maxSegRows = avgSegRows * 3;
-		}
-
-		// find max range in which every seg rows < maxSegRows
-		size_t rngBeg = 0, rngLen = 0;
-		for(size_t j = 0; j < this->size(); ) {
-			size_t k = j;
-			for (; k < this->size(); ++k) {
-				if (this->p[k].seg->m_isDel.size() > maxSegRows)
-					break;
-			}
-			if (k - j > rngLen) {
-				rngBeg = j;
-				rngLen = k - j;
-			}
-			j = k + 1;
-		}
-		for (size_t j = 0; j < rngLen; ++j) {
-			this->p[j] = this->p[rngBeg + j];
-		}
-		this->trim(rngLen);
-		if (rngLen < tab->m_schema->m_minMergeSegNum) {
+			const ReadonlySegment* seg = this->p[i].seg;
+			MergeSegInfo si;
+			si.rows = seg->m_isDel.size();
+			si.delcnt = seg->m_delcnt;
+			si.dataSize = seg->dataStorageSize();
+			segInfo.push_back(si);
+		}
+		MergePlan plan;
+		if (!tab->m_mergePolicy->pickMerge(*tab->m_schema, segInfo,
+										   m_forcePurgeAndMerge, &plan)) {
 			tab->m_isMerging = false;
 			return false;
 		}
+		assert(plan.num >= 1);
+		assert(plan.beg + plan.num <= this->size());
+		llong planBytes = 0;
+		for (size_t j = 0; j < plan.num; ++j) {
+			planBytes += segInfo[plan.beg + j].dataSize;
+			this->p[j] = this->p[plan.beg + j];
+		}
+		this->trim(plan.num);
 		m_newSegRows = 0;
-		for (size_t j = 0; j < rngLen; ++j) {
+		for (size_t j = 0; j < plan.num; ++j) {
 			m_newSegRows += this->p[j].seg->m_isDel.size();
 		}
+		std::string planStr = plan.toString();
+		fprintf(stderr, "INFO: %s: MergePolicy %s of %zd readonly segs: %s, bytes = %lld\n"
+			, tab->m_dir.string().c_str(), tab->m_mergePolicy->name()
+			, segInfo.size(), planStr.c_str(), planBytes);
+		MyRwLock lock(tab->m_rwMutex, true);
+		tab->m_mergePlanCnt++;
+		tab->m_mergedSegCnt += plan.num;
+		tab->m_mergedBytes += planBytes;
+		tab->m_lastMergePlan.swap(planStr);
 		return true;
 	}
 
@@ -2881,6 +4535,13 @@ mergeIndex(ReadonlySegment* dseg, size_t indexId, DbContext* ctx) {
 	valvec<byte> rec;
 	SortableStrVec strVec;
 	const Schema& schema = this->p[0].seg->m_schema->getIndexSchema(indexId);
+	// index is built from all keys in memory
+	size_t memSize = sizeof(SortableStrVec::SEntry) * size_t(m_newSegRows);
+	for (auto& e : *this) {
+		memSize += size_t(e.seg->m_indices[indexId]->getReadableStore()
+							->dataInflateSize());
+	}
+	BgMemGuard memGuard(memSize);
 	const size_t fixedIndexRowLen = schema.getFixedRowLen();
 	std::unique_ptr<SeqReadAppendonlyStore> seqStore;
 	if (schema.m_enableLinearScan) {
@@ -2925,6 +4586,7 @@ mergeIndex(ReadonlySegment* dseg, size_t indexId, DbContext* ctx) {
 	if (strVec.str_size() == 0 && strVec.size() == 0) {
 		return new EmptyIndexStore();
 	}
+	dseg->buildKeyFilter(indexId, strVec);
 	ReadableIndex* index = dseg->buildIndex(schema, strVec);
 #if !defined(NDEBUG)
 	valvec<byte> rec2;
@@ -3130,12 +4792,12 @@ mergeAndPurgeColgroup(ReadonlySegment* dseg, size_t colgroupId) {
 	//	dseg->m_colgroups[colgroupId]->save(storeFilePath);
 		return;
 	}
+	llong sumLen = 0;
+	for (const auto& e : *this) {
+		sumLen += e.seg->m_colgroups[colgroupId]->dataInflateSize();
+	}
 	if (schema.m_dictZipSampleRatio >= 0.0) {
-		llong sumLen = 0;
 		llong oldphysicRowNum = m_oldpurgeBits.max_rank0();
-		for (const auto& e : *this) {
-			sumLen += e.seg->m_colgroups[colgroupId]->dataInflateSize();
-		}
 		assert(oldphysicRowNum > 0);
 		double sRatio = schema.m_dictZipSampleRatio;
 		double avgLen = 1.0 * sumLen / oldphysicRowNum;
@@ -3144,6 +4806,22 @@ mergeAndPurgeColgroup(ReadonlySegment* dseg, size_t colgroupId) {
 			return;
 		}
 	}
+	// the merged colgroup is always one store: if all rows fit in work mem,
+	// they are loaded into one SortableStrVec, else they are streamed into
+	// the dictZip builder, which only keeps its samples in memory
+	size_t newPhysicRows = m_newpurgeBits.max_rank0();
+	size_t memSize = size_t(sumLen)
+				   + sizeof(SortableStrVec::SEntry) * newPhysicRows;
+	size_t maxMem = BgScheduler::instance().capWorkMem(
+						size_t(dseg->m_schema->m_compressingWorkMemSize));
+	if (memSize > maxMem && schema.m_dictZipSampleRatio >= 0.0) {
+		mergeGdictZipColgroup(dseg, colgroupId);
+		return;
+	}
+	// rows fit in work mem, or dictZip is disabled and they must be in
+	// memory anyway, a request larger than the budget waits until nothing
+	// else holds the budget
+	BgMemGuard memGuard(memSize);
 	valvec<byte> rec;
 	SortableStrVec strVec;
 	const size_t fixedIndexRowLen = schema.getFixedRowLen();
@@ -3243,6 +4921,7 @@ try{
 	const size_t indexNum = m_schema->getIndexNum();
 	const size_t colgroupNum = m_schema->getColgroupNum();
 	dseg->m_indices.resize(indexNum);
+	dseg->m_keyFilters.resize(indexNum);
 	dseg->m_colgroups.resize(colgroupNum);
 	toMerge.syncPurgeBits(m_schema->m_purgeDeleteThreshold);
 	DbContextPtr ctx(this->createDbContext());
@@ -3337,7 +5016,9 @@ try{
 
 	dseg->savePurgeBits(destSegDir);
 	dseg->saveIndices(destSegDir);
+	dseg->saveKeyFilters(destSegDir);
 	dseg->saveIsDel(destSegDir);
+	throttleWrittenFiles(destSegDir); // reused store files are hard links
 
 	// load as mmap
 	dseg->m_withPurgeBits = true;
@@ -3500,6 +5181,7 @@ try{
 		m_rowNumVec.back() = newRowNumVec.back();
 		m_mergeSeqNum++;
 		m_segArrayUpdateSeq++;
+		publishSegArrayVersionInLock();
 		m_isMerging = false;
 #if !defined(NDEBUG)
 		valvec<byte> r1, r2;
@@ -3587,6 +5269,7 @@ void CompositeTable::clear() {
 	}
 	m_segments.clear();
 	m_rowNumVec.clear();
+	publishSegArrayVersionInLock(); // release segments held by old version
 }
 
 void CompositeTable::flush() {
@@ -3676,7 +5359,9 @@ void CompositeTable::compact() {
 			m_bgTaskNum--;
 		}BOOST_SCOPE_EXIT_END;
 
+		llong t0 = g_statsPf.now();
 		this->merge(toMerge);
+		m_stats.addBgOp(TableStats::Merge, g_statsPf.mf(t0, g_statsPf.now()));
 	}
 }
 
@@ -3705,10 +5390,12 @@ void CompositeTable::asyncPurgeDelete() {
 
 void CompositeTable::dropTable() {
 	assert(!m_dir.empty());
+	MyRwLock lock(m_rwMutex, true);
 	for (auto& seg : m_segments) {
 		seg->deleteSegment();
 	}
 	m_segments.erase_all();
+	publishSegArrayVersionInLock(); // release segments held by old version
 	m_tobeDrop = true;
 }
 
@@ -3793,7 +5480,9 @@ void CompositeTable::convWritableSegmentToReadonly(size_t segIdx) {
 	auto segDir = getSegPath("rd", segIdx);
 	fprintf(stderr, "INFO: convWritableSegmentToReadonly: %s\n", segDir.string().c_str());
 	ReadonlySegmentPtr newSeg = myCreateReadonlySegment(segDir);
+	llong t0 = g_statsPf.now();
 	newSeg->convFrom(this, segIdx);
+	m_stats.addBgOp(TableStats::Convert, g_statsPf.mf(t0, g_statsPf.now()));
 	fprintf(stderr, "INFO: convWritableSegmentToReadonly: %s done!\n", segDir.string().c_str());
 	fs::path wrSegPath = getSegPath("wr", segIdx);
 	try {
@@ -3825,11 +5514,8 @@ void CompositeTable::convWritableSegmentToReadonly(size_t segIdx) {
 		return;
 	}
   }
-  MergeParam toMerge;
-  if (toMerge.canMerge(this)) {
-	  assert(this->m_isMerging);
-	  this->merge(toMerge);
-  }
+  // merge has lower priority than flush and compress
+  putToMergeQueue();
 }
 
 void CompositeTable::freezeFlushWritableSegment(size_t segIdx) {
@@ -3842,9 +5528,11 @@ void CompositeTable::freezeFlushWritableSegment(size_t segIdx) {
 		return;
 	}
 	fprintf(stderr, "freezeFlushWritableSegment: %s\n", seg->m_segDir.string().c_str());
+	llong t0 = g_statsPf.now();
 	seg->saveIndices(seg->m_segDir);
 	seg->saveRecordStore(seg->m_segDir);
 	seg->saveIsDel(seg->m_segDir);
+	m_stats.addBgOp(TableStats::Flush, g_statsPf.mf(t0, g_statsPf.now()));
 	fprintf(stderr, "freezeFlushWritableSegment: %s done!\n", seg->m_segDir.string().c_str());
 }
 
@@ -3887,111 +5575,47 @@ void CompositeTable::runPurgeDelete() {
 
 namespace anonymousForDebugMSVC {
 
-class MyTask : public RefCounter {
-public:
-	virtual void execute() = 0;
-};
-typedef boost::intrusive_ptr<MyTask> MyTaskPtr;
-terark::util::concurrent_queue<std::deque<MyTaskPtr> > g_flushQueue;
-terark::util::concurrent_queue<std::deque<MyTaskPtr> > g_compressQueue;
-
-volatile bool g_stopPutToFlushQueue = false;
-volatile bool g_stopCompress = false;
-volatile bool g_flushStopped = false;
-
-void FlushThreadFunc() {
-	while (true) {
-		MyTaskPtr t;
-		while (g_flushQueue.pop_front(t, 100)) {
-			if (t)
-				t->execute();
-			else // must only one flush thread
-				goto Done; // nullptr is stop notifier
-		}
-	}
-Done:
-	assert(g_flushQueue.empty());
-	g_flushStopped = true;
-	fprintf(stderr, "INFO: flushing thread completed!\n");
-}
-
-void CompressThreadFunc() {
-	while (!g_flushStopped && !g_stopCompress) {
-		MyTaskPtr t;
-		while (!g_stopCompress && g_compressQueue.pop_front(t, 100)) {
-			if (g_stopCompress)
-				break;
-			t->execute();
-		}
-	}
-}
-
-class CompressionThreadsList : private std::vector<tbb::tbb_thread*> {
-public:
-	CompressionThreadsList() {
-		size_t n = tbb::tbb_thread::hardware_concurrency();
-		if (const char* env = getenv("TerarkDB_CompressionThreadsNum")) {
-			size_t n2 = atoi(env);
-			n = std::min(n, n2);
-		}
-		else {
-			n = std::min<size_t>(n, 4);
-		}
-		this->resize(n);
-		for (size_t i = 0; i < n; ++i) {
-			(*this)[i] = new tbb::tbb_thread(&CompressThreadFunc);
-		}
-	}
-	~CompressionThreadsList() {
-		if (!this->empty())
-			CompositeTable::safeStopAndWaitForFlush();
-	}
-	void join() {
-		for (auto& th : *this) {
-			th->join();
-			delete th;
-			th = NULL;
-		}
-		fprintf(stderr, "INFO: compression threads(%zd) completed!\n", this->size());
-		this->clear();
-		g_compressQueue.clearQueue();
-	}
-};
-tbb::tbb_thread g_flushThread(&FlushThreadFunc);
-CompressionThreadsList g_compressThreads;
-
-class SegWrToRdConvTask : public MyTask {
+class SegWrToRdConvTask : public BgTask {
 	CompositeTablePtr m_tab;
 	size_t m_segIdx;
 
 public:
 	SegWrToRdConvTask(CompositeTablePtr tab, size_t segIdx)
-		: m_tab(tab), m_segIdx(segIdx) {}
+		: BgTask(Compress, tab.get()), m_tab(tab), m_segIdx(segIdx) {}
 
 	void execute() override {
 		m_tab->convWritableSegmentToReadonly(m_segIdx);
 	}
 };
 
-class PurgeDeleteTask : public MyTask {
+class PurgeDeleteTask : public BgTask {
 	CompositeTablePtr m_tab;
 public:
 	void execute() override {
 		m_tab->runPurgeDelete();
 	}
-	PurgeDeleteTask(CompositeTablePtr tab) : m_tab(tab) {}
+	PurgeDeleteTask(CompositeTablePtr tab) : BgTask(Merge, tab.get()), m_tab(tab) {}
+};
+
+class MergeTask : public BgTask {
+	CompositeTablePtr m_tab;
+public:
+	void execute() override {
+		m_tab->runMerge();
+	}
+	MergeTask(CompositeTablePtr tab) : BgTask(Merge, tab.get()), m_tab(tab) {}
 };
 
-class WrSegFreezeFlushTask : public MyTask {
+class WrSegFreezeFlushTask : public BgTask {
 	CompositeTablePtr m_tab;
 	size_t m_segIdx;
 public:
 	WrSegFreezeFlushTask(CompositeTablePtr tab, size_t segIdx)
-		: m_tab(tab), m_segIdx(segIdx) {}
+		: BgTask(Flush, tab.get()), m_tab(tab), m_segIdx(segIdx) {}
 
 	void execute() override {
 		m_tab->freezeFlushWritableSegment(m_segIdx);
-		g_compressQueue.push_back(new SegWrToRdConvTask(m_tab, m_segIdx));
+		m_tab->putFlushedToCompressionQueue(m_segIdx);
 	}
 };
 
@@ -3999,32 +5623,84 @@ public:
 using namespace anonymousForDebugMSVC;
 
 void CompositeTable::putToFlushQueue(size_t segIdx) {
-	assert(!g_stopPutToFlushQueue);
-	if (g_stopPutToFlushQueue) {
-		return;
-	}
+	assert(!BgScheduler::instance().isStopping());
 	assert(segIdx < m_segments.size());
 	assert(m_segments[segIdx]->m_isDel.size() > 0);
 	assert(m_segments[segIdx]->getWritableStore() != nullptr);
-	g_flushQueue.push_back(new WrSegFreezeFlushTask(this, segIdx));
-	m_bgTaskNum++;
+	if (BgScheduler::instance().submit(new WrSegFreezeFlushTask(this, segIdx))) {
+		m_bgTaskNum++;
+	}
 }
 
 void CompositeTable::putToCompressionQueue(size_t segIdx) {
 	assert(segIdx < m_segments.size());
 	assert(m_segments[segIdx]->m_isDel.size() > 0);
 	assert(m_segments[segIdx]->getWritableStore() != nullptr);
-	if (g_stopCompress) {
-		return;
+	if (BgScheduler::instance().submit(new SegWrToRdConvTask(this, segIdx))) {
+		m_bgTaskNum++;
+	}
+}
+
+// the flush task is taken over by the compression task,
+// so m_bgTaskNum is not increased
+void CompositeTable::putFlushedToCompressionQueue(size_t segIdx) {
+	if (!BgScheduler::instance().submit(new SegWrToRdConvTask(this, segIdx))) {
+		// scheduler is stopping
+		MyRwLock lock(m_rwMutex, true);
+		m_bgTaskNum--;
+	}
+}
+
+std::string CompositeTable::getMergeStatsJson() const {
+	MyRwLock lock(m_rwMutex, false);
+	valvec<MergeSegInfo> segInfo;
+	for (size_t i = 0; i < m_segments.size(); ++i) {
+		const ReadableSegment* seg = m_segments[i].get();
+		if (seg->getWritableSegment())
+			break;
+		MergeSegInfo si;
+		si.rows = seg->m_isDel.size();
+		si.delcnt = seg->m_delcnt;
+		si.dataSize = seg->dataStorageSize();
+		segInfo.push_back(si);
+	}
+	json js;
+	js["policy"] = m_mergePolicy ? m_mergePolicy->name() : "";
+	js["readonlySegs"] = segInfo.size();
+	js["readAmplification"] = MergePolicy::readAmplification(segInfo);
+	js["isMerging"] = m_isMerging;
+	js["plans"] = m_mergePlanCnt;
+	js["mergedSegs"] = m_mergedSegCnt;
+	js["mergedBytes"] = m_mergedBytes;
+	js["lastPlan"] = m_lastMergePlan;
+	return js.dump();
+}
+
+void CompositeTable::putToMergeQueue() {
+	MyRwLock lock(m_rwMutex, true);
+	if (BgScheduler::instance().submit(new MergeTask(this))) {
+		m_bgTaskNum++;
+	}
+}
+
+void CompositeTable::runMerge() {
+	BOOST_SCOPE_EXIT(&m_rwMutex, &m_bgTaskNum){
+		MyRwLock lock(m_rwMutex, true);
+		m_bgTaskNum--;
+	}BOOST_SCOPE_EXIT_END;
+	MergeParam toMerge;
+	if (toMerge.canMerge(this)) {
+		assert(this->m_isMerging);
+		llong t0 = g_statsPf.now();
+		this->merge(toMerge);
+		m_stats.addBgOp(TableStats::Merge, g_statsPf.mf(t0, g_statsPf.now()));
 	}
-	g_compressQueue.push_back(new SegWrToRdConvTask(this, segIdx));
-	m_bgTaskNum++;
 }
 
 inline
 bool CompositeTable::checkPurgeDeleteNoLock(const ReadableSegment* seg) {
-	assert(!g_stopPutToFlushQueue);
-	if (g_stopPutToFlushQueue) {
+	assert(!BgScheduler::instance().isStopping());
+	if (BgScheduler::instance().isStopping()) {
 		return false;
 	}
 	auto maxDelcnt = seg->m_isDel.size() * m_schema->m_purgeDeleteThreshold;
@@ -4062,34 +5738,21 @@ void CompositeTable::asyncPurgeDeleteInLock() {
 }
 
 void CompositeTable::inLockPutPurgeDeleteTaskToQueue() {
-	assert(!g_stopPutToFlushQueue);
-	if (g_stopPutToFlushQueue) {
+	assert(!BgScheduler::instance().isStopping());
+	if (!BgScheduler::instance().submit(new PurgeDeleteTask(this))) {
 		return;
 	}
-	g_compressQueue.push_back(new PurgeDeleteTask(this));
 	m_purgeStatus = PurgeStatus::purging;
 	m_bgTaskNum++;
 }
 
 // flush is the most urgent
 void CompositeTable::safeStopAndWaitForFlush() {
-	g_stopPutToFlushQueue = true;
-	g_stopCompress = true;
-	g_flushQueue.push_back(nullptr); // notify and stop flag
-	g_flushThread.join();
-	assert(g_flushStopped);
-	g_compressThreads.join();
-	assert(g_flushQueue.empty());
-	assert(g_compressQueue.empty());
+	BgScheduler::instance().stopAndWait(false);
 }
 
 void CompositeTable::safeStopAndWaitForCompress() {
-	g_stopPutToFlushQueue = true;
-	g_flushQueue.push_back(nullptr); // notify and stop flag
-	g_flushThread.join();
-	g_compressThreads.join();
-	assert(g_flushQueue.empty());
-	assert(g_compressQueue.empty());
+	BgScheduler::instance().stopAndWait(true);
 }
 
 /*
@@ -2,10 +2,13 @@
 #define __terark_db_table_store_hpp__
 
 #include "db_store.hpp"
+#include "merge_policy.hpp"
+#include "table_stats.hpp"
 #include "db_index.hpp"
 #include <tbb/queuing_rw_mutex.h>
 //#include <tbb/spin_rw_mutex.h>
 #include <atomic>
+#include <functional>
 
 #if defined(TBB_VERSION_MAJOR)
 	#if TBB_VERSION_MAJOR * 1000 + TBB_VERSION_MINOR < 4004
@@ -42,6 +45,44 @@ class TERARK_DB_DLL WritableSegment;
 typedef boost::intrusive_ptr<ReadableSegment> ReadableSegmentPtr;
 typedef boost::intrusive_ptr<WritableSegment> WritableSegmentPtr;
 
+// Immutable snapshot of the segment array of a CompositeTable, a new version
+// is published each time m_segArrayUpdateSeq is changed.
+// Readers get the current version by CompositeTable::getSegArrayVersion()
+// without locking CompositeTable::m_rwMutex
+class TERARK_DB_DLL SegArrayVersion : public RefCounter {
+public:
+	~SegArrayVersion();
+	valvec<ReadableSegmentPtr> m_segments;
+	valvec<llong>  m_rowNumVec; // back() may be stale, use tab->m_rowNum
+	WritableSegmentPtr m_wrSeg;
+	size_t m_segArrayUpdateSeq;
+};
+typedef boost::intrusive_ptr<SegArrayVersion> SegArrayVersionPtr;
+
+class TERARK_DB_DLL TableSnapshot;
+typedef boost::intrusive_ptr<TableSnapshot> TableSnapshotPtr;
+
+// A colgroup value which points into the mmap of a readonly segment when the
+// store keeps it as plain bytes, m_seg is a lease which keeps the segment
+// (and its mmap) alive until reset() or the next select into this object.
+// Values which need decoding are copied into m_buf, which is reused.
+// A pinned value of an inplace updatable colgroup may be changed in place
+// by concurrent updateColumn, the same as the copied value may be stale.
+class TERARK_DB_DLL PinnedValue {
+	DECLARE_NONE_COPYABLE_CLASS(PinnedValue);
+public:
+	PinnedValue();
+	~PinnedValue();
+	void reset();
+	bool isPinned() const { return m_seg.get() != NULL; }
+	fstring data() const { return m_data; }
+	size_t  size() const { return m_data.size(); }
+
+	ReadableSegmentPtr m_seg;
+	fstring      m_data;
+	valvec<byte> m_buf;
+};
+
 // Now BatchWriter is supported only when table has at most one unique index
 class TERARK_DB_DLL BatchWriter {
 	DECLARE_NONE_COPYABLE_CLASS(BatchWriter);
@@ -49,6 +90,10 @@ protected:
 	DbContextPtr     m_ctx;
 	WritableSegment* m_wrSeg; // for debug only
 	DbTransaction*   m_txn; // for debug only
+	// subId of writable segment rows visible to snapshots, which are
+	// removed by this batch, their delete marks are set on commit
+	valvec<llong>    m_pinnedRemoveOnCommit;
+	void removePinnedWrSegRow(llong subId);
 	llong overwriteExisting(fstring row);
 	llong upsertRowImpl(fstring row);
 public:
@@ -69,6 +114,9 @@ class TERARK_DB_DLL CompositeTable : public ReadableStore {
 	class MyStoreIterBase;	    friend class MyStoreIterBase;
 	class MyStoreIterForward;	friend class MyStoreIterForward;
 	class MyStoreIterBackward;	friend class MyStoreIterBackward;
+	class MyStoreIterRange;		friend class MyStoreIterRange;
+	class MyProjectIterForward;	friend class MyProjectIterForward;
+	class MyProjectIterBackward;friend class MyProjectIterBackward;
 public:
 	CompositeTable();
 	~CompositeTable();
@@ -106,6 +154,11 @@ public:
 	llong updateRow(llong id, fstring row, DbContext*);
 	bool  removeRow(llong id, DbContext*);
 
+	/// delete all rows of a frozen segment at once, such as the oldest
+	/// segment of a capped table, the rows are then dropped by purge delete
+	///@returns number of newly deleted rows, 0 if seg has been merged
+	size_t removeSegmentRows(ReadableSegment* seg);
+
 	void upsertRowMultiUniqueIndices(fstring row, valvec<llong>* resRecIdvec, DbContext*);
 
 	void updateColumn(llong recordId, size_t columnId, fstring newColumnData, DbContext* = NULL);
@@ -153,21 +206,76 @@ public:
 	void indexSearchExactNoLock(size_t indexId, fstring key, valvec<llong>* recIdvec, DbContext*) const;
 	bool indexKeyExistsNoLock(size_t indexId, fstring key, DbContext*) const;
 
+	///@{ search keys[0..keyNum) in one pass over the segments
+	/// (*recIdvecs)[i] is the result of keys[i], same order as indexSearchExact
+	/// if colsId is given, (*colsDataVec)[i] is the projection of the newest
+	/// matched record of keys[i], or empty if keys[i] is not found
+	void indexSearchExactBatch(size_t indexId, const fstring* keys, size_t keyNum,
+							   valvec<valvec<llong> >* recIdvecs, DbContext*) const;
+	void indexSearchExactBatch(size_t indexId, const fstring* keys, size_t keyNum,
+							   const size_t* colsId, size_t colsNum,
+							   valvec<valvec<llong> >* recIdvecs,
+							   valvec<valvec<byte> >* colsDataVec, DbContext*) const;
+	void indexSearchExactBatchNoLock(size_t indexId, const fstring* keys, size_t keyNum,
+							   valvec<valvec<llong> >* recIdvecs, DbContext*) const;
+	///@}
+
 	virtual	bool indexMatchRegex(size_t indexId, BaseDFA* regexDFA, valvec<llong>* recIdvec, DbContext*) const;
 	virtual	bool indexMatchRegex(size_t indexId, fstring  regexStr, fstring regexOptions, valvec<llong>* recIdvec, DbContext*) const;
 
 	bool indexInsert(size_t indexId, fstring indexKey, llong id, DbContext*);
 	bool indexRemove(size_t indexId, fstring indexKey, llong id, DbContext*);
+
+	// insert keys of existing rows in one writer lock, for building index.
+	// keys of rows in readonly segments are skipped, readonly segments
+	// have been indexed when they were built
+	///@returns number of keys failed to insert(duplicate)
+	size_t indexInsertBatch(size_t indexId, const fstring* indexKeys,
+							const llong* ids, size_t num, DbContext*);
 	bool indexUpdate(size_t indexId, fstring indexKey, llong oldId, llong newId, DbContext*);
 
 	llong indexStorageSize(size_t indexId) const;
 
+	///@returns approximate storage size of rows whose index key is in
+	///         [beg, end), empty end means no upper bound.
+	/// Estimated by lower bound ranks in readonly segments multiplied by
+	/// average row size of the segment, writable segments are not counted
+	llong indexApproximateSize(size_t indexId, fstring beg, fstring end, DbContext*) const;
+
 	IndexIteratorPtr createIndexIterForward(size_t indexId) const;
 	IndexIteratorPtr createIndexIterForward(fstring indexCols) const;
 
 	IndexIteratorPtr createIndexIterBackward(size_t indexId) const;
 	IndexIteratorPtr createIndexIterBackward(fstring indexCols) const;
 
+	typedef std::function<bool(size_t rangeIdx, llong recId, fstring key)>
+			IndexScanCallback;
+	///@param bounds ascending split keys, range i is [bounds[i-1], bounds[i]),
+	///              the first range is unbounded below, the last range is
+	///              unbounded above, boundNum+1 ranges are scanned in
+	///              forward order by at most hardware_concurrency threads,
+	///              ranges are taken by the threads on demand
+	///@param fn may be called concurrently for different ranges,
+	///          return false to stop scanning the range
+	void indexScanParallel(size_t indexId, const fstring* bounds, size_t boundNum,
+						   const IndexScanCallback& fn) const;
+
+	///@{ partitioned store scan
+	/// a range [first, second) of record ids is in one segment, a segment
+	/// which has more than maxRows rows is split into multiple ranges,
+	/// ranges cover the rows existed when getStoreScanRanges is called
+	valvec<std::pair<llong, llong> > getStoreScanRanges(size_t maxRows) const;
+	StoreIterator* createStoreIterRange(llong beg, llong end, DbContext*) const;
+
+	typedef std::function<bool(size_t rangeIdx, llong recId, fstring row)>
+			StoreScanCallback;
+	///@param thrNum 0 means all cores, ranges are taken by the threads on
+	///              demand, each thread uses one DbContext for all its ranges
+	///@param fn may be called concurrently for different ranges,
+	///          return false to stop scanning the range
+	void storeScanParallel(size_t thrNum, const StoreScanCallback& fn) const;
+	///@}
+
 	valvec<size_t> getProjectColumns(const hash_strmap<>& colnames) const;
 
 	void selectColumns(llong id, const valvec<size_t>& cols,
@@ -183,6 +291,7 @@ public:
 						 valvec<byte>* cgDataVec, DbContext*) const;
 
 	void selectOneColgroup(llong id, size_t cgId, valvec<byte>* cgData, DbContext*) const;
+	void selectOneColgroupPinned(llong id, size_t cgId, PinnedValue*, DbContext*) const;
 
 protected:
 	void selectColumnsNoLock(llong id, const valvec<size_t>& cols,
@@ -199,7 +308,9 @@ protected:
 
 	void selectOneColgroupNoLock(llong id, size_t cgId, valvec<byte>* cgData, DbContext*) const;
 
-#if 0
+	///@{ iterate values of columns colsId, the value is encoded as
+	///   selectColumns, readonly segments read and decode only the
+	///   colgroups covering colsId, instead of whole rows
 	StoreIteratorPtr
 	createProjectIterForward(const valvec<size_t>& cols, DbContext*)
 	const;
@@ -213,7 +324,7 @@ protected:
 	StoreIteratorPtr
 	createProjectIterBackward(const size_t* colsId, size_t colsNum, DbContext*)
 	const;
-#endif
+	///@}
 
 public:
 	void clear();
@@ -236,16 +347,31 @@ public:
 	size_t getSegNum() const { return m_segments.size(); }
 	size_t getWritableSegNum() const;
 	size_t getSegArrayUpdateSeq() const { return this->m_segArrayUpdateSeq; }
+	SegArrayVersionPtr getSegArrayVersion() const; // lock free
+
+	///@{ snapshot isolation for readers, see TableSnapshot
+	TableSnapshotPtr createSnapshot();
+	llong getNewestSnapshotSeq() const { return m_newestSnapshotSeq; }
+	///@}
 	size_t getSegmentIndexOfRecordIdNoLock(llong recId) const;
 
 	///@{ internal use only
 	void convWritableSegmentToReadonly(size_t segIdx);
 	void freezeFlushWritableSegment(size_t segIdx);
 	void runPurgeDelete();
+	void runMerge();
 	void putToFlushQueue(size_t segIdx);
 	void putToCompressionQueue(size_t segIdx);
+	void putFlushedToCompressionQueue(size_t segIdx);
+	void putToMergeQueue();
 	///@}
 
+	// merge policy and its recent plans, as json string
+	std::string getMergeStatsJson() const;
+	// read path counters and latency, background task durations, see
+	// TableStats, as json string
+	std::string getStatsJson() const { return m_stats.toJson(); }
+
 	static void safeStopAndWaitForFlush();
 	static void safeStopAndWaitForCompress();
 
@@ -257,6 +383,14 @@ protected:
 	class MergeParam; friend class MergeParam;
 	void merge(MergeParam&);
 	void checkRowNumVecNoLock() const;
+	void publishSegArrayVersionInLock();
+	void releaseSnapshot(const TableSnapshot*);
+	bool isPinnedWrSegRow(llong subId) const;
+	void removePinnedRowUniqueKeys(llong subId, const ColumnVec& cols,
+								   DbTransaction*, valvec<byte>* key);
+	llong upsertOverPinnedRow(llong subId, fstring row, DbContext*, MyRwLock&);
+	llong updatePinnedRow(llong subId, fstring row, DbContext*, MyRwLock&);
+	void addBulkLoadedSegment(ReadonlySegment*);
 
 	bool maybeCreateNewSegment(MyRwLock&);
 	void maybeCreateNewSegmentInWriteLock();
@@ -316,6 +450,32 @@ protected:
 	bool m_tobeDrop;
 	bool m_isMerging;
 	PurgeStatus m_purgeStatus;
+	int  m_runLockFd; // run.lock is flock'ed while the table is opened
+
+	// created by doLoad from m_schema->m_mergePolicy
+	MergePolicyPtr m_mergePolicy;
+	// guarded by m_rwMutex
+	llong  m_mergePlanCnt;
+	llong  m_mergedSegCnt;
+	llong  m_mergedBytes;
+	std::string m_lastMergePlan;
+
+	mutable TableStats m_stats;
+
+	// m_segArrayVersion is replaced by writers in m_rwMutex writer lock,
+	// readers register in m_segVerReaders[m_segVerEpoch%2] while loading
+	// and add_ref m_segArrayVersion, writer advances m_segVerEpoch and waits
+	// for readers of the old epoch before releasing the old version
+	std::atomic<SegArrayVersion*> m_segArrayVersion;
+	std::atomic_size_t         m_segVerEpoch;
+	mutable std::atomic_size_t m_segVerReaders[2];
+
+	// seq of live TableSnapshot in ascending order, guarded by m_rwMutex,
+	// m_newestSnapshotSeq is m_liveSnapshots.back() or 0 if there is none,
+	// it is read by writers in segment lock before setting delete marks
+	valvec<llong>      m_liveSnapshots;
+	llong              m_snapshotSeqGen;
+	std::atomic<llong> m_newestSnapshotSeq;
 
 	// constant once constructed
 	boost::filesystem::path m_dir;
@@ -324,9 +484,127 @@ protected:
 	friend class TableIndexIterBackward;
 	friend class DbContext;
 	friend class ReadonlySegment;
+	friend class TableSnapshot;
+	friend class TableBulkLoader;
 };
 typedef boost::intrusive_ptr<CompositeTable> CompositeTablePtr;
 
+// Consistent read view of a CompositeTable.
+//
+// A snapshot is a row number watermark plus a seq(delete epoch), nothing is
+// copied or frozen when it is created:
+//  - The segment array is pinned by SegArrayVersion, so merge, purge and
+//    compress don't change the rows seen by the snapshot.
+//  - Rows appended to the writable segment after the snapshot was created
+//    are beyond the watermark.
+//  - A row deleted while snapshots are alive is logged with the seq of the
+//    newest live snapshot, it is still visible to snapshots whose seq is
+//    not larger than it, see ReadableSegment::markDelForSnapshotInLock.
+//  - Rows of the writable segment below the watermark are not overwritten,
+//    recycled or removed from the store while they are visible to a live
+//    snapshot, updating such a row deletes it and inserts a new row. Their
+//    unique index entries are still removed, so the key can be inserted
+//    again, the removed entries are kept as ghosts in the segment and are
+//    searched by the snapshot in place of the index.
+// In place column updates(updateColumn...) are not isolated.
+//
+// Snapshot is released when the last reference is released.
+class TERARK_DB_DLL TableSnapshot : public RefCounter {
+	friend class CompositeTable;
+	friend class TableIndexIter;
+public:
+	~TableSnapshot();
+
+	CompositeTable* getTable() const { return m_tab.get(); }
+	llong  getSeq() const { return m_seq; }
+	llong  numDataRows() const { return m_rowNum; }
+	size_t getSegNum() const { return m_segNum; }
+
+	bool isDeleted(size_t segIdx, llong subId) const;
+	bool exists(llong id) const;
+
+	void indexSearchExact(size_t indexId, fstring key, valvec<llong>* recIdvec, DbContext*) const;
+	void selectOneColgroup(llong id, size_t cgId, valvec<byte>* cgData, DbContext*) const;
+	void selectOneColgroupPinned(llong id, size_t cgId, PinnedValue*, DbContext*) const;
+
+	IndexIteratorPtr createIndexIterForward(size_t indexId) const;
+	IndexIteratorPtr createIndexIterBackward(size_t indexId) const;
+
+protected:
+	TableSnapshot();
+	size_t getSegIdx(llong id) const;
+
+	CompositeTablePtr  m_tab;
+	SegArrayVersionPtr m_segVer;
+	size_t m_segNum; // m_segVer->m_segments[0, m_segNum) are visible
+	llong  m_rowNum; // ids in [0, m_rowNum) are visible
+	llong  m_seq;
+	size_t m_lastSegRows; // visible rows of the last segment
+	bool   m_hasWrSeg; // the last segment was writable when created
+};
+
+// Load rows into readonly segments directly, for initial loads.
+//
+// Rows are written to colgroup temp files of a new ReadonlySegment, indices
+// and stores are built the same way as compressing a writable segment, then
+// the segment is appended to the table, before the writable segment. So
+// rows are not written to writable segment, flushed and read back.
+// Index builds sort keys in memory, so a segment is cut when its index keys
+// reach maxSegBytes, stores are built in parts within the same budget.
+//
+// If the table has a unique index, rows are external sorted by the unique
+// key: runs of maxSegBytes are sorted and spilled to bulk-* dirs, finish()
+// merges the runs into segments. A key loaded multiple times keeps the last
+// row, a loaded row replaces the existing row of the same key, the same as
+// upsertRow. Tables with multiple unique indices are not supported.
+class TERARK_DB_DLL TableBulkLoader : boost::noncopyable {
+public:
+	///@param maxSegBytes 0 means m_compressingWorkMemSize
+	explicit TableBulkLoader(CompositeTable* tab, llong maxSegBytes = 0);
+	~TableBulkLoader();
+
+	void insertRow(fstring row);
+
+	///@returns number of rows loaded, include rows in committed segments
+	llong finish();
+
+	llong numRows() const { return m_rows; }
+	size_t numSegments() const { return m_segNum; }
+	// rows replaced by a later row of the same unique key
+	llong numDupRows() const { return m_dupRows; }
+
+protected:
+	struct RunEntry {
+		size_t keyPos, keyLen;
+		size_t rowPos, rowLen;
+	};
+	boost::filesystem::path getBulkDir(const char* kind, size_t idx) const;
+	void sortRun();
+	void spillRun();
+	void removeRuns();
+	void mergeRuns();
+	void appendSorted(fstring row, fstring key);
+	void appendToSegment(fstring row);
+	void commitSegment();
+
+	CompositeTablePtr m_tab;
+	DbContextPtr m_ctx;
+	boost::intrusive_ptr<ReadonlySegment> m_seg;
+	llong  m_maxSegBytes;
+	llong  m_segBytes; // index key bytes of m_seg
+	llong  m_runBytes;
+	llong  m_rows;
+	llong  m_dupRows;
+	size_t m_segNum;
+	size_t m_uniqIndexId; // size_t(-1) if no unique index, no sort
+	bool   m_checkExisting;
+	valvec<byte>     m_runPool;
+	valvec<RunEntry> m_runEntries; // rows in m_runPool
+	valvec<ReadableStorePtr> m_runs; // spilled sorted runs
+	valvec<byte> m_keyBuf;
+	ColumnVec    m_cols;
+};
+
 /////////////////////////////////////////////////////////////////////////////
 
 inline
@@ -339,6 +617,16 @@ StoreIteratorPtr DbContext::createTableIterBackward() {
 	assert(this != nullptr);
 	return m_tab->createStoreIterBackward(this);
 }
+inline
+StoreIteratorPtr DbContext::createProjectIterForward(const valvec<size_t>& cols) {
+	assert(this != nullptr);
+	return m_tab->createProjectIterForward(cols, this);
+}
+inline
+StoreIteratorPtr DbContext::createProjectIterBackward(const valvec<size_t>& cols) {
+	assert(this != nullptr);
+	return m_tab->createProjectIterBackward(cols, this);
+}
 
 inline
 void DbContext::getValueAppend(llong id, valvec<byte>* val) {
@@ -404,6 +692,24 @@ inline bool
 DbContext::indexKeyExistsNoLock(size_t indexId, fstring key) {
 	return m_tab->indexKeyExistsNoLock(indexId, key, this);
 }
+inline void
+DbContext::indexSearchExactBatch(size_t indexId, const fstring* keys, size_t keyNum,
+								 valvec<valvec<llong> >* recIdvecs) {
+	m_tab->indexSearchExactBatch(indexId, keys, keyNum, recIdvecs, this);
+}
+inline void
+DbContext::indexSearchExactBatch(size_t indexId, const fstring* keys, size_t keyNum,
+								 const size_t* colsId, size_t colsNum,
+								 valvec<valvec<llong> >* recIdvecs,
+								 valvec<valvec<byte> >* colsDataVec) {
+	m_tab->indexSearchExactBatch(indexId, keys, keyNum, colsId, colsNum,
+								 recIdvecs, colsDataVec, this);
+}
+inline void
+DbContext::indexSearchExactBatchNoLock(size_t indexId, const fstring* keys, size_t keyNum,
+									   valvec<valvec<llong> >* recIdvecs) {
+	m_tab->indexSearchExactBatchNoLock(indexId, keys, keyNum, recIdvecs, this);
+}
 inline bool
 DbContext::indexMatchRegex(size_t indexId, BaseDFA* regexDFA, valvec<llong>* recIdvec) {
 	return m_tab->indexMatchRegex(indexId, regexDFA, recIdvec, this);
@@ -490,11 +796,17 @@ inline
 void DbContext::trySyncSegCtxSpeculativeLock(const CompositeTable* tab) {
 	if (this->segArrayUpdateSeq != tab->m_segArrayUpdateSeq) {
 		assert(this->segArrayUpdateSeq < tab->m_segArrayUpdateSeq);
-		MyRwLock lock(tab->m_rwMutex, false);
-		this->doSyncSegCtxNoLock(tab);
-		assert(m_segCtx.size() == tab->m_segments.size());
-		assert(m_rowNumVec.size() == tab->m_segments.size()+1);
-		assert(m_rowNumVec.size() == tab->m_rowNumVec.size());
+		// don't lock tab->m_rwMutex, the version may lag behind
+		// tab->m_segArrayUpdateSeq a little, we will sync again next time
+		SegArrayVersionPtr ver = tab->getSegArrayVersion();
+		if (this->segArrayUpdateSeq != ver->m_segArrayUpdateSeq) {
+			this->doSyncSegCtx(ver.get());
+			assert(m_segCtx.size() == ver->m_segments.size());
+			assert(m_rowNumVec.size() == ver->m_segments.size()+1);
+		}
+		if (this->segArrayUpdateSeq == tab->m_segArrayUpdateSeq) {
+			m_rowNumVec.back() = tab->m_rowNum;
+		}
 	}
 	else {
 		m_rowNumVec.back() = tab->m_rowNum;
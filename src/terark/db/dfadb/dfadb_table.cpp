@@ -5,9 +5,12 @@
 #include <terark/io/FileStream.hpp>
 #include <terark/io/DataIO.hpp>
 #include <terark/num_to_str.hpp>
+#include <terark/util/linebuf.hpp>
 #include <terark/util/mmap.hpp>
 #include <terark/db/appendonly.hpp>
 #include <terark/db/mock_db_engine.hpp>
+#include <terark/db/mem_writable_segment.hpp>
+#include <terark/db/write_ahead_log.hpp>
 #include <terark/db/wiredtiger/wt_db_segment.hpp>
 #include <terark/db/dfadb/nlt_index.hpp>
 #include <boost/filesystem.hpp>
@@ -30,19 +33,68 @@ DfaDbTable::createReadonlySegment(PathRef dir) const {
 	return seg.release();
 }
 
+// env TerarkDB_DfaWritableSegment overrides "WritableSegmentClass" in
+// dbmeta.json, "mock" and "mem" are in memory, others are wiredtiger
+static const char* writableSegmentClass(const SchemaConfig& sconf) {
+	const char* dfaWritableSeg = getenv("TerarkDB_DfaWritableSegment");
+	if (dfaWritableSeg && *dfaWritableSeg)
+		return dfaWritableSeg;
+	return sconf.m_writableSegmentClass.c_str();
+}
+
+// the class a writable segment was created with is saved in segDir, so
+// changing dbmeta.json or env does not reopen it as another class
+static std::string loadWritableSegmentClass(const SchemaConfig& sconf, PathRef dir) {
+	auto fpath = dir / "WrSegClass";
+	if (boost::filesystem::exists(fpath)) {
+		LineBuf line;
+		FileStream fp(fpath.string().c_str(), "r");
+		line.getline(fp.fp());
+		line.trim();
+		return std::string(line.p, line.n);
+	}
+	return writableSegmentClass(sconf); // segment of old version
+}
+
+static void saveWritableSegmentClass(const std::string& wrSegClass, PathRef dir) {
+	boost::filesystem::create_directories(dir);
+	auto fpath = dir / "WrSegClass";
+	FileStream fp(fpath.string().c_str(), "w");
+	fp.ensureWrite(wrSegClass.data(), wrSegClass.size());
+}
+
+// mem segment is persisted only when it is saved or converted to readonly,
+// and its transaction can not rollback, the write ahead log is required
+static WritableSegment*
+newInMemoryWritableSegment(const std::string& wrSegClass, PathRef dir) {
+	if (strcasecmp(wrSegClass.c_str(), "mock") == 0)
+		return new MockWritableSegment(dir);
+	if (strcasecmp(wrSegClass.c_str(), "mem") == 0) {
+		if (NULL == WriteAheadLog::global()) {
+			THROW_STD(invalid_argument
+				, "WritableSegmentClass \"mem\" requires write ahead log: %s"
+				, dir.string().c_str());
+		}
+		return new MemWritableSegment(dir);
+	}
+	return NULL;
+}
+
 WritableSegment*
 DfaDbTable::createWritableSegment(PathRef dir) const {
-	const char* dfaWritableSeg = getenv("TerarkDB_DfaWritableSegment");
-	if (dfaWritableSeg && strcasecmp(dfaWritableSeg, "mock") == 0) {
-		std::unique_ptr<WritableSegment> seg(new MockWritableSegment(dir));
-		seg->m_schema = this->m_schema;
-		return seg.release();
+	std::string wrSegClass = writableSegmentClass(*m_schema);
+	std::unique_ptr<WritableSegment> memSeg(newInMemoryWritableSegment(wrSegClass, dir));
+	if (memSeg) {
+		memSeg->m_schema = this->m_schema;
+		saveWritableSegmentClass(wrSegClass, dir);
+		return memSeg.release();
 	}
 	else {
 		using terark::db::wt::WtWritableSegment;
 		std::unique_ptr<WtWritableSegment> seg(new WtWritableSegment());
 		seg->m_schema = this->m_schema;
 		seg->load(dir);
+		saveWritableSegmentClass("wt", dir);
 		return seg.release();
 	}
 }
@@ -51,12 +103,12 @@ WritableSegment*
 DfaDbTable::openWritableSegment(PathRef dir) const {
 	auto isDelPath = dir / "IsDel";
 	if (boost::filesystem::exists(isDelPath)) {
-		const char* dfaWritableSeg = getenv("TerarkDB_DfaWritableSegment");
-		if (dfaWritableSeg && strcasecmp(dfaWritableSeg, "mock") == 0) {
-			std::unique_ptr<WritableSegment> seg(new MockWritableSegment(dir));
-			seg->m_schema = this->m_schema;
-			seg->load(dir);
-			return seg.release();
+		std::string wrSegClass = loadWritableSegmentClass(*m_schema, dir);
+		std::unique_ptr<WritableSegment> memSeg(newInMemoryWritableSegment(wrSegClass, dir));
+		if (memSeg) {
+			memSeg->m_schema = this->m_schema;
+			memSeg->load(dir);
+			return memSeg.release();
 		}
 		else {
 			using terark::db::wt::WtWritableSegment;
@@ -598,6 +598,22 @@ IndexIterator* NestLoudsTrieIndex::createIndexIterBackward(DbContext*) const {
 		return new DupableIndexIterBackward(this);
 }
 
+llong NestLoudsTrieIndex::lowerBoundRank(fstring key, DbContext*) const {
+	if (key.empty()) {
+		return 0;
+	}
+	std::unique_ptr<ADFA_LexIterator> iter(m_dfa->adfa_make_iter());
+	if (!iter->seek_lower_bound(key)) {
+		return numDataRows();
+	}
+	size_t dawgIdx = m_dfa->state_to_word_id(iter->word_state());
+	if (m_isUnique) {
+		return llong(dawgIdx);
+	}
+	// position of the first record of key dawgIdx
+	return llong(m_recBits.select1(dawgIdx));
+}
+
 bool NestLoudsTrieIndex::matchRegexAppend(BaseDFA* regexDFA,
 										  valvec<llong>* recIdvec,
 										  DbContext* ctx) const {
@@ -24,6 +24,7 @@ public:
 
 	IndexIterator* createIndexIterForward(DbContext*) const override;
 	IndexIterator* createIndexIterBackward(DbContext*) const override;
+	llong lowerBoundRank(fstring key, DbContext*) const override;
 
 	ReadableIndex* getReadableIndex() override;
 	ReadableStore* getReadableStore() override;
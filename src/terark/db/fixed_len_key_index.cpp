@@ -1,4 +1,5 @@
 #include "fixed_len_key_index.hpp"
+#include "parallel_sort.hpp"
 #include <terark/io/FileStream.hpp>
 #include <terark/io/DataIO.hpp>
 #include <terark/util/mmap.hpp>
@@ -56,6 +57,45 @@ const {
 	}
 }
 
+// keys are sorted by memcmp, so is the index if keys need no encoding,
+// then each search starts from the lower bound of previous key
+void
+FixedLenKeyIndex::searchExactBatchAppend(const fstring* keys, size_t keyNum,
+					valvec<llong>* const* recIdvecs, DbContext* ctx)
+const {
+	if (m_schema.m_needEncodeToLexByteComparable) {
+		ReadableIndex::searchExactBatchAppend(keys, keyNum, recIdvecs, ctx);
+		return;
+	}
+	size_t f = m_fixedLen;
+	size_t lo = 0;
+	const byte* keysData = m_keys.data();
+	for (size_t i = 0; i < keyNum; ++i) {
+		fstring key = keys[i];
+		assert(i == 0 || keys[i-1] <= key);
+		if (key.size() != f)
+			continue;
+		size_t j = lo = searchLowerBound(key, lo);
+		size_t id;
+		while (j < m_index.size() &&
+			   memcmp(keysData + f*(id=m_index[j]), key.p, f) == 0)
+		{
+			recIdvecs[i]->push_back(id);
+			++j;
+		}
+	}
+}
+
+llong FixedLenKeyIndex::lowerBoundRank(fstring key, DbContext*) const {
+	if (key.empty()) {
+		return 0;
+	}
+	if (key.size() != m_fixedLen) {
+		return -1;
+	}
+	return llong(searchLowerBound_cvt(key));
+}
+
 size_t FixedLenKeyIndex::searchLowerBound_cvt(fstring key) const {
 	if (m_schema.m_needEncodeToLexByteComparable) {
 		size_t fixlen = m_fixedLen;
@@ -82,14 +122,15 @@ size_t FixedLenKeyIndex::searchUpperBound_cvt(fstring key) const {
 	}
 }
 
-size_t FixedLenKeyIndex::searchLowerBound(fstring key) const {
+// search in [lo, size)
+size_t FixedLenKeyIndex::searchLowerBound(fstring key, size_t lo) const {
 	assert(key.size() == m_fixedLen);
 	auto indexData = m_index.data();
 	auto indexBits = m_index.uintbits();
 	auto indexMask = m_index.uintmask();
 	auto keysData = m_keys.data();
 	size_t fixlen = m_fixedLen;
-	size_t i = 0, j = m_index.size();
+	size_t i = lo, j = m_index.size();
 	while (i < j) {
 		size_t mid = (i + j) / 2;
 		size_t hitPos = UintVecMin0::fast_get(indexData, indexBits, indexMask, mid);
@@ -164,22 +205,11 @@ void FixedLenKeyIndex::build(const Schema& schema, SortableStrVec& strVec) {
 	assert(strVec.m_index.size() == 0);
 	assert(strVec.m_strpool.size() % fixlen == 0);
 	if (schema.m_needEncodeToLexByteComparable) {
-		for (size_t i = 0; i < rows; ++i) {
-			schema.byteLexEncode(data + i*fixlen, fixlen);
-		}
+		schema.byteLexEncodeFixedBatch(data, rows);
 	}
 	valvec<uint32_t> index(rows, valvec_no_init());
 	for (size_t i = 0; i < rows; ++i) index[i] = i;
-	std::sort(index.begin(), index.end(),
-		[data,fixlen](size_t x, size_t y) {
-		const byte* xkey = data + fixlen * x;
-		const byte* ykey = data + fixlen * y;
-		int ret = memcmp(xkey, ykey, fixlen);
-		if (ret)
-			return ret < 0;
-		else
-			return x < y;
-	});
+	parallelSortFixedLen(data, fixlen, index.data(), rows);
 	m_fixedLen = fixlen;
 	m_uniqKeys = 0;
 	for(size_t i = 0; i < m_keys.size(); ) {
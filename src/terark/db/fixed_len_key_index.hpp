@@ -16,10 +16,13 @@ public:
 	llong indexStorageSize() const override;
 
 	void searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const override;
+	void searchExactBatchAppend(const fstring* keys, size_t keyNum,
+					valvec<llong>* const* recIdvecs, DbContext*) const override;
 	///@}
 
 	IndexIterator* createIndexIterForward(DbContext*) const override;
 	IndexIterator* createIndexIterBackward(DbContext*) const override;
+	llong lowerBoundRank(fstring key, DbContext*) const override;
 
 	ReadableStore* getReadableStore() override;
 	ReadableIndex* getReadableIndex() override;
@@ -44,7 +47,7 @@ protected:
 	size_t       m_fixedLen;
 	size_t       m_uniqKeys;
 
-	size_t searchLowerBound(fstring binkey) const;
+	size_t searchLowerBound(fstring binkey, size_t lo = 0) const;
 	size_t searchUpperBound(fstring binkey) const;
 
 	size_t searchLowerBound_cvt(fstring binkey) const;
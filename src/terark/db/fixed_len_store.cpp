@@ -72,6 +72,14 @@ void FixedLenStore::getValueAppend(llong id, valvec<byte>* val, DbContext*) cons
 	val->append(dataPtr, m_mmapBase->fixlen);
 }
 
+bool FixedLenStore::getValuePinned(llong id, fstring* val, DbContext*) const {
+	assert(id >= 0);
+	assert(id < llong(m_mmapBase->rows));
+	const byte* dataPtr = m_mmapBase->get_data(id);
+	*val = fstring((const char*)dataPtr, m_mmapBase->fixlen);
+	return true;
+}
+
 StoreIterator* FixedLenStore::createStoreIterForward(DbContext*) const {
 	return nullptr; // not needed
 }
@@ -70,6 +70,10 @@ void ZipIntKeyIndex::searchExactAppend(fstring key, valvec<llong>* recIdvec, DbC
 	}
 }
 
+llong ZipIntKeyIndex::lowerBoundRank(fstring key, DbContext*) const {
+	return key.empty() ? 0 : llong(searchLowerBound(key));
+}
+
 size_t ZipIntKeyIndex::searchLowerBound(fstring key) const {
 	switch (m_keyType) {
 	default:
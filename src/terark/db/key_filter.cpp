@@ -0,0 +1,136 @@
+#include "key_filter.hpp"
+#include <terark/io/FileStream.hpp>
+#include <terark/io/DataIO.hpp>
+#include <terark/util/mmap.hpp>
+#include <terark/util/sortable_strvec.hpp>
+#include <math.h>
+
+namespace terark { namespace db {
+
+namespace {
+	struct Header {
+		char     magic[8]; // "KeyFilt"
+		uint64_t numBlocks;
+		uint32_t numProbes;
+		uint32_t padding;
+		uint64_t numKeys;
+	};
+	static const char KeyFilterMagic[8] = "KeyFilt";
+}
+
+KeyFilter::KeyFilter() {
+	m_numBlocks = 0;
+	m_numProbes = 0;
+	m_mmapBase = nullptr;
+	m_mmapSize = 0;
+}
+
+KeyFilter::~KeyFilter() {
+	if (m_mmapBase) {
+		m_bits.risk_release_ownership();
+		mmap_close(m_mmapBase, m_mmapSize);
+	}
+}
+
+// 64 bit hash, high 32 bits select the block, low 32 bits and
+// (high 32 bits | 1) are the double hashing seeds of probes in the block
+uint64_t KeyFilter::hashKey(fstring key) {
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	uint64_t h = 0x8445d61a4e774912ULL ^ (key.size() * m);
+	const byte_t* p = key.udata();
+	size_t n = key.size();
+	for (; n >= 8; p += 8, n -= 8) {
+		uint64_t k = unaligned_load<uint64_t>(p);
+		k *= m; k ^= k >> 47; k *= m;
+		h ^= k; h *= m;
+	}
+	if (n) {
+		uint64_t k = 0;
+		memcpy(&k, p, n);
+		h ^= k; h *= m;
+	}
+	h ^= h >> 47; h *= m; h ^= h >> 47;
+	return h;
+}
+
+void KeyFilter::add(fstring key) {
+	uint64_t h = hashKey(key);
+	size_t   blk = size_t((h >> 32) * m_numBlocks >> 32);
+	uint64_t* words = m_bits.data() + blk * WordsPerBlock;
+	uint32_t h1 = uint32_t(h);
+	uint32_t h2 = uint32_t(h >> 32) | 1;
+	for (size_t i = 0; i < m_numProbes; ++i) {
+		uint32_t bitpos = h1 & (BitsPerBlock - 1);
+		words[bitpos / 64] |= uint64_t(1) << (bitpos % 64);
+		h1 += h2;
+	}
+}
+
+void KeyFilter::build(const Schema& indexSchema, const SortableStrVec& keys) {
+	assert(isEnabled(indexSchema));
+	assert(nullptr == m_mmapBase);
+	const size_t fixlen = indexSchema.getFixedRowLen();
+	size_t numKeys = keys.size();
+	if (0 == numKeys && fixlen) {
+		numKeys = keys.str_size() / fixlen;
+	}
+	double bitsPerKey = indexSchema.m_keyFilterBitsPerKey;
+	size_t numBits = size_t(ceil(bitsPerKey * numKeys));
+	// ln(2) * bitsPerKey is optimal for a plain bloom filter, blocked bloom
+	// filter has a little higher false positive rate, but less cache miss
+	m_numProbes = std::min<size_t>(16, std::max<size_t>(1, size_t(bitsPerKey * 0.69)));
+	m_numBlocks = std::max<size_t>(1, (numBits + BitsPerBlock-1) / BitsPerBlock);
+	if (m_numBlocks > size_t(UINT32_MAX)) {
+		THROW_STD(length_error, "too many keys: %zd, bitsPerKey = %f",
+			numKeys, bitsPerKey);
+	}
+	m_bits.resize_fill(m_numBlocks * WordsPerBlock, 0);
+	if (keys.size()) {
+		for (size_t i = 0; i < numKeys; ++i)
+			add(keys[i]);
+	}
+	else {
+		const byte_t* base = keys.m_strpool.data();
+		for (size_t i = 0; i < numKeys; ++i)
+			add(fstring(base + fixlen * i, fixlen));
+	}
+}
+
+void KeyFilter::load(PathRef path) {
+	auto fpath = path + ".filter";
+	m_mmapBase = (byte_t*)mmap_load(fpath.string(), &m_mmapSize);
+	auto h = (const Header*)m_mmapBase;
+	if (m_mmapSize < sizeof(Header) ||
+			memcmp(h->magic, KeyFilterMagic, sizeof(KeyFilterMagic)) != 0) {
+		mmap_close(m_mmapBase, m_mmapSize);
+		m_mmapBase = nullptr;
+		THROW_STD(invalid_argument, "bad key filter file: %s",
+			fpath.string().c_str());
+	}
+	size_t words = size_t(h->numBlocks * WordsPerBlock);
+	if (sizeof(Header) + sizeof(uint64_t) * words > m_mmapSize) {
+		mmap_close(m_mmapBase, m_mmapSize);
+		m_mmapBase = nullptr;
+		THROW_STD(invalid_argument, "truncated key filter file: %s",
+			fpath.string().c_str());
+	}
+	m_numBlocks = size_t(h->numBlocks);
+	m_numProbes = h->numProbes;
+	m_bits.risk_set_data((uint64_t*)(h + 1), words);
+}
+
+void KeyFilter::save(PathRef path) const {
+	auto fpath = path + ".filter";
+	NativeDataOutput<FileStream> dio;
+	dio.open(fpath.string().c_str(), "wb");
+	Header h;
+	memcpy(h.magic, KeyFilterMagic, sizeof(KeyFilterMagic));
+	h.numBlocks = m_numBlocks;
+	h.numProbes = uint32_t(m_numProbes);
+	h.padding   = 0;
+	h.numKeys   = 0; // reserved
+	dio.ensureWrite(&h, sizeof(h));
+	dio.ensureWrite(m_bits.data(), m_bits.used_mem_size());
+}
+
+} } // namespace terark::db
@@ -0,0 +1,70 @@
+#ifndef __terark_db_key_filter_hpp__
+#define __terark_db_key_filter_hpp__
+
+#include "db_store.hpp"
+
+namespace terark {
+	class SortableStrVec;
+}
+
+namespace terark { namespace db {
+
+// Blocked bloom filter on index keys of a readonly segment, each key sets
+// all of its probe bits in one cache line(512 bits), so a query touches
+// at most one cache line.
+//
+// used by ReadonlySegment::indexSearchExactAppend to skip the index probe
+// when the key is definitely not in the segment
+class TERARK_DB_DLL KeyFilter : public RefCounter {
+public:
+	KeyFilter();
+	~KeyFilter();
+
+	static bool isEnabled(const Schema& indexSchema) {
+		return indexSchema.m_keyFilterBitsPerKey > 0;
+	}
+
+	///@param keys if keys.m_index is empty, keys are fixlen records in
+	///            keys.m_strpool
+	void build(const Schema& indexSchema, const SortableStrVec& keys);
+
+	bool mayContain(fstring key) const {
+		if (0 == m_numBlocks)
+			return true; // not built, must be conservative
+		uint64_t h = hashKey(key);
+		size_t   blk = size_t((h >> 32) * m_numBlocks >> 32);
+		const uint64_t* words = m_bits.data() + blk * WordsPerBlock;
+		uint32_t h1 = uint32_t(h);
+		uint32_t h2 = uint32_t(h >> 32) | 1;
+		for (size_t i = 0; i < m_numProbes; ++i) {
+			uint32_t bitpos = h1 & (BitsPerBlock - 1);
+			if (!(words[bitpos / 64] & (uint64_t(1) << (bitpos % 64))))
+				return false;
+			h1 += h2;
+		}
+		return true;
+	}
+
+	size_t mem_size() const { return m_bits.used_mem_size(); }
+
+	void load(PathRef path);
+	void save(PathRef path) const;
+
+	static const size_t BitsPerBlock  = 512;
+	static const size_t WordsPerBlock = BitsPerBlock / 64;
+
+protected:
+	static uint64_t hashKey(fstring key);
+	void add(fstring key);
+
+	valvec<uint64_t> m_bits;
+	size_t m_numBlocks;
+	size_t m_numProbes;
+	byte_t* m_mmapBase;
+	size_t  m_mmapSize;
+};
+typedef boost::intrusive_ptr<KeyFilter> KeyFilterPtr;
+
+} } // namespace terark::db
+
+#endif // __terark_db_key_filter_hpp__
@@ -0,0 +1,771 @@
+#include "mem_writable_segment.hpp"
+#include <terark/io/FileStream.hpp>
+#include <terark/io/StreamBuffer.hpp>
+#include <terark/io/DataIO.hpp>
+#include <limits.h>
+#include <new>
+
+namespace terark { namespace db {
+
+MemArena::MemArena() {
+	m_pos = m_end = NULL;
+	m_usedSize = 0;
+}
+MemArena::~MemArena() {
+	for (byte* p : m_blocks)
+		::free(p);
+}
+
+byte* MemArena::alloc(size_t len) {
+	len = (len + 7) & ~size_t(7);
+	m_usedSize.fetch_add(len, std::memory_order_relaxed);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (len > BlockSize / 4) {
+		// large one has its own block, don't waste the current block
+		byte* p = (byte*)::malloc(len);
+		if (NULL == p) throw std::bad_alloc();
+		m_blocks.push_back(p);
+		return p;
+	}
+	if (size_t(m_end - m_pos) < len) {
+		byte* p = (byte*)::malloc(BlockSize);
+		if (NULL == p) throw std::bad_alloc();
+		m_blocks.push_back(p);
+		m_pos = p;
+		m_end = p + BlockSize;
+	}
+	byte* p = m_pos;
+	m_pos += len;
+	return p;
+}
+
+//////////////////////////////////////////////////////////////////
+// record layout: uint32 len + data
+
+static inline fstring recordData(const byte* rec) {
+	return fstring((const char*)rec + 4, *(const uint32_t*)rec);
+}
+
+MemWritableStore::MemWritableStore() {
+	for (auto& c : m_chunks) c.store(NULL, std::memory_order_relaxed);
+	m_rowNum = 0;
+	m_dataSize = 0;
+}
+MemWritableStore::~MemWritableStore() {
+	for (auto& c : m_chunks) {
+		Slot* chunk = c.load(std::memory_order_relaxed);
+		if (chunk) ::free(chunk);
+	}
+}
+
+// NULL if the record is removed or not yet written
+const byte* MemWritableStore::record(llong id) const {
+	Slot* chunk = m_chunks[id >> ChunkBits].load(std::memory_order_acquire);
+	if (NULL == chunk)
+		return NULL;
+	return chunk[id & (ChunkSize - 1)].load(std::memory_order_acquire);
+}
+
+MemWritableStore::Slot& MemWritableStore::slotForWrite(llong id) {
+	if (id >= llong(ChunkSize) * ChunkNum) {
+		THROW_STD(out_of_range, "id = %lld exceeds max rows of MemWritableStore", id);
+	}
+	auto& pchunk = m_chunks[id >> ChunkBits];
+	Slot* chunk = pchunk.load(std::memory_order_acquire);
+	if (terark_unlikely(NULL == chunk)) {
+		std::lock_guard<std::mutex> lock(m_chunkMutex);
+		chunk = pchunk.load(std::memory_order_acquire);
+		if (NULL == chunk) {
+			// all zero bits is null pointers
+			chunk = (Slot*)::calloc(ChunkSize, sizeof(Slot));
+			if (NULL == chunk) throw std::bad_alloc();
+			pchunk.store(chunk, std::memory_order_release);
+		}
+	}
+	return chunk[id & (ChunkSize - 1)];
+}
+
+const byte* MemWritableStore::makeRecord(fstring row) {
+	byte* rec = m_arena.alloc(4 + row.size());
+	*(uint32_t*)rec = uint32_t(row.size());
+	memcpy(rec + 4, row.data(), row.size());
+	return rec;
+}
+
+void MemWritableStore::save(PathRef fpath) const {
+	FileStream fp(fpath.string().c_str(), "wb");
+	fp.disbuf();
+	NativeDataOutput<OutputBuffer> dio; dio.attach(&fp);
+	llong rows = m_rowNum.load(std::memory_order_acquire);
+	dio << var_size_t(rows);
+	for (llong id = 0; id < rows; ++id) {
+		const byte* rec = record(id);
+		if (rec) {
+			fstring row = recordData(rec);
+			dio << var_size_t(row.size() + 1);
+			dio.ensureWrite(row.data(), row.size());
+		}
+		else {
+			dio << var_size_t(0); // removed
+		}
+	}
+}
+void MemWritableStore::load(PathRef fpath) {
+	FileStream fp(fpath.string().c_str(), "rb");
+	fp.disbuf();
+	NativeDataInput<InputBuffer> dio; dio.attach(&fp);
+	llong rows = dio.load_as<var_size_t>();
+	valvec<byte> row;
+	for (llong id = 0; id < rows; ++id) {
+		size_t len = dio.load_as<var_size_t>();
+		if (len) {
+			row.resize_no_init(len - 1);
+			dio.ensureRead(row.data(), row.size());
+			update(id, row, NULL);
+		}
+	}
+	m_rowNum = rows;
+}
+
+llong MemWritableStore::dataStorageSize() const {
+	return m_arena.usedSize();
+}
+
+llong MemWritableStore::dataInflateSize() const {
+	return m_dataSize.load(std::memory_order_relaxed);
+}
+
+llong MemWritableStore::numDataRows() const {
+	return m_rowNum.load(std::memory_order_acquire);
+}
+
+void MemWritableStore::getValueAppend(llong id, valvec<byte>* val, DbContext*) const {
+	assert(id >= 0);
+	assert(id < numDataRows());
+	const byte* rec = record(id);
+	if (rec) {
+		fstring row = recordData(rec);
+		val->append(row.udata(), row.size());
+	}
+}
+
+class MemWritableStoreIterForward : public StoreIterator {
+	llong m_id;
+public:
+	MemWritableStoreIterForward(const MemWritableStore* store) {
+		m_store.reset(const_cast<MemWritableStore*>(store));
+		m_id = 0;
+	}
+	bool increment(llong* id, valvec<byte>* val) override {
+		auto store = static_cast<MemWritableStore*>(m_store.get());
+		llong rowNum = store->numDataRows();
+		while (m_id < rowNum) {
+			llong k = m_id++;
+			const byte* rec = store->record(k);
+			if (rec) {
+				*id = k;
+				fstring row = recordData(rec);
+				val->assign(row.udata(), row.size());
+				return true;
+			}
+		}
+		return false;
+	}
+	bool seekExact(llong id, valvec<byte>* val) override {
+		auto store = static_cast<MemWritableStore*>(m_store.get());
+		if (id < 0 || id >= store->numDataRows()) {
+			THROW_STD(out_of_range, "Invalid id = %lld, rows = %lld"
+				, id, store->numDataRows());
+		}
+		const byte* rec = store->record(id);
+		if (rec) {
+			fstring row = recordData(rec);
+			val->assign(row.udata(), row.size());
+			m_id = id + 1;
+			return true;
+		}
+		return false;
+	}
+	void reset() override {
+		m_id = 0;
+	}
+};
+class MemWritableStoreIterBackward : public StoreIterator {
+	llong m_id;
+public:
+	MemWritableStoreIterBackward(const MemWritableStore* store) {
+		m_store.reset(const_cast<MemWritableStore*>(store));
+		m_id = store->numDataRows();
+	}
+	bool increment(llong* id, valvec<byte>* val) override {
+		auto store = static_cast<MemWritableStore*>(m_store.get());
+		while (m_id > 0) {
+			llong k = --m_id;
+			const byte* rec = store->record(k);
+			if (rec) {
+				*id = k;
+				fstring row = recordData(rec);
+				val->assign(row.udata(), row.size());
+				return true;
+			}
+		}
+		return false;
+	}
+	bool seekExact(llong id, valvec<byte>* val) override {
+		auto store = static_cast<MemWritableStore*>(m_store.get());
+		if (id < 0 || id >= store->numDataRows()) {
+			THROW_STD(out_of_range, "Invalid id = %lld, rows = %lld"
+				, id, store->numDataRows());
+		}
+		const byte* rec = store->record(id);
+		if (rec) {
+			fstring row = recordData(rec);
+			val->assign(row.udata(), row.size());
+			m_id = id;
+			return true;
+		}
+		return false;
+	}
+	void reset() override {
+		m_id = m_store->numDataRows();
+	}
+};
+
+StoreIterator* MemWritableStore::createStoreIterForward(DbContext*) const {
+	return new MemWritableStoreIterForward(this);
+}
+StoreIterator* MemWritableStore::createStoreIterBackward(DbContext*) const {
+	return new MemWritableStoreIterBackward(this);
+}
+
+llong MemWritableStore::append(fstring row, DbContext*) {
+	llong id = m_rowNum.fetch_add(1, std::memory_order_acq_rel);
+	slotForWrite(id).store(makeRecord(row), std::memory_order_release);
+	m_dataSize.fetch_add(row.size(), std::memory_order_relaxed);
+	return id;
+}
+
+// different threads update different ids, an id may be stored before a
+// smaller one, so m_rowNum is raised to max(m_rowNum, id+1)
+void MemWritableStore::update(llong id, fstring row, DbContext*) {
+	assert(id >= 0);
+	const byte* rec = makeRecord(row);
+	const byte* old = slotForWrite(id).exchange(rec, std::memory_order_acq_rel);
+	llong oldLen = old ? recordData(old).size() : 0;
+	m_dataSize.fetch_add(llong(row.size()) - oldLen, std::memory_order_relaxed);
+	llong rows = m_rowNum.load(std::memory_order_relaxed);
+	while (rows <= id &&
+		!m_rowNum.compare_exchange_weak(rows, id + 1, std::memory_order_release))
+	{}
+}
+
+void MemWritableStore::remove(llong id, DbContext*) {
+	assert(id >= 0);
+	assert(id < numDataRows());
+	const byte* old = slotForWrite(id).exchange(NULL, std::memory_order_acq_rel);
+	if (old) {
+		m_dataSize.fetch_sub(recordData(old).size(), std::memory_order_relaxed);
+	}
+}
+
+void MemWritableStore::shrinkToFit() {
+}
+
+AppendableStore* MemWritableStore::getAppendableStore() { return this; }
+UpdatableStore* MemWritableStore::getUpdatableStore() { return this; }
+WritableStore* MemWritableStore::getWritableStore() { return this; }
+
+//////////////////////////////////////////////////////////////////
+
+struct MemWritableIndex::Node {
+	std::atomic<llong> liveId; // -1 if removed
+	llong    ordId;  // for non-unique index, entries are ordered by (key,id)
+	uint32_t keyLen;
+	uint32_t height;
+	std::atomic<Node*> next[1]; // [height], followed by key bytes
+
+	fstring key() const {
+		return fstring((const char*)(next + height), keyLen);
+	}
+	Node* getNext(int level) const {
+		return next[level].load(std::memory_order_acquire);
+	}
+};
+
+MemWritableIndex::MemWritableIndex(const Schema& schema) {
+	m_schema = &schema;
+	m_isUnique = schema.m_isUnique;
+	m_isOrdered = true;
+	m_maxHeight = 1;
+	m_head = newNode(fstring(), -1, MaxHeight);
+}
+MemWritableIndex::~MemWritableIndex() {
+}
+
+MemWritableIndex::Node*
+MemWritableIndex::newNode(fstring key, llong id, int height) {
+	size_t size = sizeof(Node) + sizeof(std::atomic<Node*>) * (height - 1);
+	byte* mem = m_arena.alloc(size + key.size());
+	Node* n = (Node*)mem;
+	new(&n->liveId) std::atomic<llong>(id);
+	n->ordId = id;
+	n->keyLen = uint32_t(key.size());
+	n->height = uint32_t(height);
+	for (int i = 0; i < height; ++i)
+		new(&n->next[i]) std::atomic<Node*>(NULL);
+	memcpy(mem + size, key.data(), key.size());
+	return n;
+}
+
+int MemWritableIndex::compare(const Node* n, fstring key, llong id) const {
+	int c = m_schema->compareData(n->key(), key);
+	if (c || m_isUnique)
+		return c;
+	return n->ordId < id ? -1 : n->ordId > id ? 1 : 0;
+}
+
+// first node >= (key,id), prev/succ are the splice at each level if not null
+MemWritableIndex::Node*
+MemWritableIndex::findGreaterOrEqual(fstring key, llong id, Node** prev, Node** succ)
+const {
+	Node* x = m_head;
+	int level = m_maxHeight.load(std::memory_order_relaxed) - 1;
+	if (prev) level = MaxHeight - 1;
+	for (;;) {
+		Node* next = x->getNext(level);
+		if (next && compare(next, key, id) < 0) {
+			x = next;
+		}
+		else {
+			if (prev) {
+				prev[level] = x;
+				succ[level] = next;
+			}
+			if (0 == level)
+				return next;
+			level--;
+		}
+	}
+}
+
+// last node < (key,id), m_head if none
+MemWritableIndex::Node*
+MemWritableIndex::findLess(fstring key, llong id) const {
+	Node* x = m_head;
+	int level = m_maxHeight.load(std::memory_order_relaxed) - 1;
+	for (;;) {
+		Node* next = x->getNext(level);
+		if (next && compare(next, key, id) < 0) {
+			x = next;
+		}
+		else {
+			if (0 == level)
+				return x;
+			level--;
+		}
+	}
+}
+
+// last node whose key <= key, m_head if none
+MemWritableIndex::Node*
+MemWritableIndex::findLessOrEqualKey(fstring key) const {
+	Node* x = m_head;
+	int level = m_maxHeight.load(std::memory_order_relaxed) - 1;
+	for (;;) {
+		Node* next = x->getNext(level);
+		if (next && m_schema->compareData(next->key(), key) <= 0) {
+			x = next;
+		}
+		else {
+			if (0 == level)
+				return x;
+			level--;
+		}
+	}
+}
+
+MemWritableIndex::Node* MemWritableIndex::findLast() const {
+	Node* x = m_head;
+	int level = m_maxHeight.load(std::memory_order_relaxed) - 1;
+	for (;;) {
+		Node* next = x->getNext(level);
+		if (next) {
+			x = next;
+		}
+		else {
+			if (0 == level)
+				return x;
+			level--;
+		}
+	}
+}
+
+MemWritableIndex::Node*
+MemWritableIndex::findExact(fstring key, llong id) const {
+	Node* n = findGreaterOrEqual(key, id, NULL, NULL);
+	if (n && compare(n, key, id) == 0)
+		return n;
+	return NULL;
+}
+
+static int randomHeight(int maxHeight) {
+	// branching factor 4, seeded by a global counter mixed by splitmix64
+	static std::atomic<unsigned long long> s_seed(0);
+	unsigned long long x = s_seed.fetch_add(0x9E3779B97F4A7C15ULL,
+											std::memory_order_relaxed);
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	x = x ^ (x >> 31);
+	int height = 1;
+	while (height < maxHeight && (x & 3) == 0) {
+		height++;
+		x >>= 2;
+	}
+	return height;
+}
+
+///@returns false if key is in unique index with a different live id
+bool MemWritableIndex::insertNode(fstring key, llong id) {
+	Node* prev[MaxHeight];
+	Node* succ[MaxHeight];
+	Node* node = NULL;
+	for (;;) {
+		Node* n = findGreaterOrEqual(key, id, prev, succ);
+		if (n && compare(n, key, id) == 0) {
+			// the node exists, revive it or check it
+			llong liveId = n->liveId.load(std::memory_order_acquire);
+			for (;;) {
+				if (liveId == id)
+					return true;
+				if (liveId >= 0) {
+					assert(m_isUnique);
+					return false;
+				}
+				if (n->liveId.compare_exchange_weak(liveId, id,
+						std::memory_order_acq_rel)) {
+					return true;
+				}
+			}
+		}
+		if (NULL == node) {
+			node = newNode(key, id, randomHeight(MaxHeight));
+		}
+		node->next[0].store(succ[0], std::memory_order_relaxed);
+		Node* expected = succ[0];
+		if (prev[0]->next[0].compare_exchange_strong(expected, node,
+				std::memory_order_acq_rel)) {
+			break;
+		}
+		// lost the race at level 0, an equal node may be inserted
+	}
+	const int height = int(node->height);
+	int maxHeight = m_maxHeight.load(std::memory_order_relaxed);
+	while (height > maxHeight &&
+		!m_maxHeight.compare_exchange_weak(maxHeight, height)) {}
+	for (int level = 1; level < height; ++level) {
+		for (;;) {
+			node->next[level].store(succ[level], std::memory_order_relaxed);
+			Node* expected = succ[level];
+			if (prev[level]->next[level].compare_exchange_strong(expected, node,
+					std::memory_order_acq_rel)) {
+				break;
+			}
+			findGreaterOrEqual(key, id, prev, succ);
+		}
+	}
+	return true;
+}
+
+bool MemWritableIndex::insert(fstring key, llong id, DbContext*) {
+	assert(id >= 0);
+	return insertNode(key, id);
+}
+
+bool MemWritableIndex::remove(fstring key, llong id, DbContext*) {
+	Node* n = findExact(key, id);
+	if (NULL == n)
+		return false;
+	llong expected = id;
+	if (n->liveId.compare_exchange_strong(expected, -1,
+			std::memory_order_acq_rel)) {
+		return true;
+	}
+	return false;
+}
+
+bool MemWritableIndex::replace(fstring key, llong oldId, llong newId, DbContext* ctx) {
+	if (m_isUnique) {
+		Node* n = findExact(key, oldId);
+		llong expected = oldId;
+		if (n && n->liveId.compare_exchange_strong(expected, newId,
+					std::memory_order_acq_rel)) {
+			return true;
+		}
+	}
+	else if (oldId != newId) {
+		remove(key, oldId, ctx);
+	}
+	return insertNode(key, newId);
+}
+
+// reclaiming nodes is unsafe with concurrent readers, just mark them dead
+void MemWritableIndex::clear() {
+	for (Node* n = m_head->getNext(0); n; n = n->getNext(0)) {
+		n->liveId.store(-1, std::memory_order_release);
+	}
+}
+
+void
+MemWritableIndex::searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*)
+const {
+	Node* n = findGreaterOrEqual(key, LLONG_MIN, NULL, NULL);
+	while (n && m_schema->compareData(n->key(), key) == 0) {
+		llong id = n->liveId.load(std::memory_order_acquire);
+		if (id >= 0)
+			recIdvec->push_back(id);
+		if (m_isUnique)
+			break;
+		n = n->getNext(0);
+	}
+}
+
+llong MemWritableIndex::indexStorageSize() const {
+	return m_arena.usedSize();
+}
+
+void MemWritableIndex::save(PathRef fpath) const {
+	FileStream fp(fpath.string().c_str(), "wb");
+	fp.disbuf();
+	NativeDataOutput<OutputBuffer> dio; dio.attach(&fp);
+	for (Node* n = m_head->getNext(0); n; n = n->getNext(0)) {
+		llong id = n->liveId.load(std::memory_order_acquire);
+		if (id >= 0) {
+			fstring key = n->key();
+			dio << var_size_t(key.size() + 1);
+			dio.ensureWrite(key.data(), key.size());
+			dio << var_size_t(id);
+		}
+	}
+	dio << var_size_t(0); // end mark
+}
+void MemWritableIndex::load(PathRef fpath) {
+	FileStream fp(fpath.string().c_str(), "rb");
+	fp.disbuf();
+	NativeDataInput<InputBuffer> dio; dio.attach(&fp);
+	valvec<byte> key;
+	for (;;) {
+		size_t len = dio.load_as<var_size_t>();
+		if (0 == len)
+			break;
+		key.resize_no_init(len - 1);
+		dio.ensureRead(key.data(), key.size());
+		llong id = dio.load_as<var_size_t>();
+		insertNode(key, id);
+	}
+}
+
+class MemWritableIndex::MyIndexIterForward : public IndexIterator {
+	MemWritableIndexPtr m_index;
+	const Node* m_cur; // next node to visit
+public:
+	MyIndexIterForward(const MemWritableIndex* owner) {
+		m_isUniqueInSchema = owner->isUnique();
+		m_index.reset(const_cast<MemWritableIndex*>(owner));
+		m_cur = owner->m_head->getNext(0);
+	}
+	bool increment(llong* id, valvec<byte>* key) override {
+		for (; m_cur; m_cur = m_cur->getNext(0)) {
+			llong liveId = m_cur->liveId.load(std::memory_order_acquire);
+			if (liveId >= 0) {
+				*id = liveId;
+				fstring k = m_cur->key();
+				key->assign(k.udata(), k.size());
+				m_cur = m_cur->getNext(0);
+				return true;
+			}
+		}
+		return false;
+	}
+	void reset() override {
+		m_cur = m_index->m_head->getNext(0);
+	}
+	int seekLowerBound(fstring key, llong* id, valvec<byte>* retKey) override {
+		auto owner = m_index.get();
+		m_cur = owner->findGreaterOrEqual(key, LLONG_MIN, NULL, NULL);
+		if (increment(id, retKey)) {
+			if (owner->m_schema->compareData(*retKey, key) == 0)
+				return 0;
+			else
+				return 1;
+		}
+		return -1;
+	}
+};
+
+class MemWritableIndex::MyIndexIterBackward : public IndexIterator {
+	MemWritableIndexPtr m_index;
+	const Node* m_pos; // last visited node, NULL: not started, m_head: eof
+public:
+	MyIndexIterBackward(const MemWritableIndex* owner) {
+		m_isUniqueInSchema = owner->isUnique();
+		m_index.reset(const_cast<MemWritableIndex*>(owner));
+		m_pos = NULL;
+	}
+	// from n(inclusive) to head, skip removed nodes
+	bool visit(const Node* n, llong* id, valvec<byte>* key) {
+		auto owner = m_index.get();
+		while (n != owner->m_head) {
+			llong liveId = n->liveId.load(std::memory_order_acquire);
+			if (liveId >= 0) {
+				m_pos = n;
+				*id = liveId;
+				fstring k = n->key();
+				key->assign(k.udata(), k.size());
+				return true;
+			}
+			n = owner->findLess(n->key(), n->ordId);
+		}
+		m_pos = owner->m_head;
+		return false;
+	}
+	bool increment(llong* id, valvec<byte>* key) override {
+		auto owner = m_index.get();
+		if (NULL == m_pos)
+			return visit(owner->findLast(), id, key);
+		if (owner->m_head == m_pos)
+			return false;
+		return visit(owner->findLess(m_pos->key(), m_pos->ordId), id, key);
+	}
+	void reset() override {
+		m_pos = NULL;
+	}
+	int seekLowerBound(fstring key, llong* id, valvec<byte>* retKey) override {
+		auto owner = m_index.get();
+		if (visit(owner->findLessOrEqualKey(key), id, retKey)) {
+			if (owner->m_schema->compareData(*retKey, key) == 0)
+				return 0;
+			else
+				return 1;
+		}
+		return -1;
+	}
+};
+
+IndexIterator* MemWritableIndex::createIndexIterForward(DbContext*) const {
+	return new MyIndexIterForward(this);
+}
+IndexIterator* MemWritableIndex::createIndexIterBackward(DbContext*) const {
+	return new MyIndexIterBackward(this);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+MemWritableSegment::MemWritableSegment(PathRef dir) {
+	m_segDir = dir;
+	m_wrtStore = new MemWritableStore();
+	m_hasLockFreePointSearch = true;
+}
+MemWritableSegment::~MemWritableSegment() {
+	if (!m_tobeDel && !m_isDel.empty())
+		this->save(m_segDir);
+	m_wrtStore.reset();
+}
+
+// No global lock, each operation is atomic by itself and is visible to
+// others as soon as it is done, there is no isolation between concurrent
+// transactions.
+// commit and rollback do nothing: durability is given by the shared write
+// ahead log (DbTransaction::commit appends the logged ops, rollback drops
+// them), which is required for mem segment. rollback does not undo ops
+// which have been applied, CompositeTable removes index entries of a
+// failed insert by itself before rollback, the unindexed row is garbage.
+class MemDbTransaction : public DbTransaction {
+	const SchemaConfig& m_sconf;
+	MemWritableSegment* m_seg;
+public:
+	explicit
+	MemDbTransaction(MemWritableSegment* seg) : m_sconf(*seg->m_schema) {
+		m_seg = seg;
+	}
+	void indexSearch(size_t indexId, fstring key, valvec<llong>* recIdvec)
+	override {
+		auto index = m_seg->m_indices[indexId].get();
+		index->searchExact(key, recIdvec, NULL);
+	}
+	void indexRemove(size_t indexId, fstring key, llong recId) override {
+		auto wrIndex = m_seg->m_indices[indexId]->getWritableIndex();
+		wrIndex->remove(key, recId, NULL);
+	}
+	bool indexInsert(size_t indexId, fstring key, llong recId) override {
+		auto wrIndex = m_seg->m_indices[indexId]->getWritableIndex();
+		return wrIndex->insert(key, recId, NULL);
+	}
+	void indexUpsert(size_t indexId, fstring key, llong recId) override {
+		auto wrIndex = m_seg->m_indices[indexId]->getWritableIndex();
+		wrIndex->insert(key, recId, NULL);
+	}
+	void storeRemove(llong recId) override {
+		m_seg->m_wrtStore->getWritableStore()->remove(recId, NULL);
+	}
+	void storeUpsert(llong recId, fstring row) override {
+		auto wrtStore = m_seg->m_wrtStore->getWritableStore();
+		if (m_sconf.m_updatableColgroups.empty()) {
+			wrtStore->update(recId, row, NULL);
+		}
+		else {
+			auto& sconf = m_sconf;
+			auto seg = m_seg;
+			sconf.m_rowSchema->parseRow(row, &m_cols1);
+			SpinRwLock lock(m_seg->m_segMutex);
+			for (size_t colgroupId : sconf.m_updatableColgroups) {
+				auto store = seg->m_colgroups[colgroupId]->getUpdatableStore();
+				assert(nullptr != store);
+				const Schema& schema = sconf.getColgroupSchema(colgroupId);
+				schema.selectParent(m_cols1, &m_wrtBuf);
+				store->update(recId, m_wrtBuf, NULL);
+			}
+			sconf.m_wrtSchema->selectParent(m_cols1, &m_wrtBuf);
+			wrtStore->update(recId, m_wrtBuf, NULL);
+		}
+	}
+	void storeGetRow(llong recId, valvec<byte>* row) override {
+		auto seg = m_seg;
+		if (m_sconf.m_updatableColgroups.empty()) {
+			seg->m_wrtStore->getValue(recId, row, NULL);
+		}
+		else {
+			row->erase_all();
+			m_cols1.erase_all();
+			seg->m_wrtStore->getValue(recId, &m_wrtBuf, NULL);
+			SpinRwLock  lock(seg->m_segMutex, false);
+			seg->getCombineAppend(recId, row, m_wrtBuf, m_cols1, m_cols2);
+		}
+	}
+	void do_startTransaction() override {}
+	bool do_commit() override { return true; } // see comment of this class
+	void do_rollback() override {} // can not undo applied ops
+	const std::string& strError() const override { return m_strError; }
+
+	valvec<byte> m_wrtBuf;
+	ColumnVec    m_cols1;
+	ColumnVec    m_cols2;
+	std::string  m_strError;
+};
+
+DbTransaction* MemWritableSegment::createTransaction() {
+	return new MemDbTransaction(this);
+}
+
+ReadableIndex*
+MemWritableSegment::openIndex(const Schema& schema, PathRef path) const {
+	std::unique_ptr<ReadableIndex> index(createIndex(schema, path));
+	index->load(path);
+	return index.release();
+}
+
+ReadableIndex*
+MemWritableSegment::createIndex(const Schema& schema, PathRef) const {
+	return new MemWritableIndex(schema);
+}
+
+} } // namespace terark::db
@@ -0,0 +1,133 @@
+#ifndef __terark_db_mem_writable_segment_hpp__
+#define __terark_db_mem_writable_segment_hpp__
+
+#include "db_segment.hpp"
+#include <atomic>
+#include <mutex>
+
+namespace terark { namespace db {
+
+// Bump allocator, memory is freed only when the arena is destroyed.
+// Allocation holds the mutex for just a pointer bump.
+class TERARK_DB_DLL MemArena {
+	enum { BlockSize = 1 << 20 };
+	std::mutex    m_mutex;
+	valvec<byte*> m_blocks;
+	byte*  m_pos;
+	byte*  m_end;
+	std::atomic<size_t> m_usedSize;
+public:
+	MemArena();
+	~MemArena();
+	byte* alloc(size_t len); // 8 bytes aligned
+	size_t usedSize() const { return m_usedSize.load(std::memory_order_relaxed); }
+};
+
+// Rows are immutable records in arena, an update allocates a new record
+// and swaps the record pointer, so readers need no lock.
+class TERARK_DB_DLL MemWritableStore : public ReadableStore, public WritableStore {
+	enum { ChunkBits = 16, ChunkSize = 1 << ChunkBits, ChunkNum = 1 << 14 };
+	typedef std::atomic<const byte*> Slot;
+	mutable std::atomic<Slot*> m_chunks[ChunkNum];
+	std::mutex          m_chunkMutex;
+	std::atomic<llong>  m_rowNum;
+	std::atomic<llong>  m_dataSize;
+	MemArena            m_arena;
+
+	const byte* record(llong id) const;
+	Slot& slotForWrite(llong id);
+	const byte* makeRecord(fstring row);
+	friend class MemWritableStoreIterForward;
+	friend class MemWritableStoreIterBackward;
+public:
+	MemWritableStore();
+	~MemWritableStore();
+
+	void save(PathRef) const override;
+	void load(PathRef) override;
+
+	llong dataStorageSize() const override;
+	llong dataInflateSize() const override;
+	llong numDataRows() const override;
+	void getValueAppend(llong id, valvec<byte>* val, DbContext*) const override;
+	StoreIterator* createStoreIterForward(DbContext*) const override;
+	StoreIterator* createStoreIterBackward(DbContext*) const override;
+
+	llong append(fstring row, DbContext*) override;
+	void  update(llong id, fstring row, DbContext*) override;
+	void  remove(llong id, DbContext*) override;
+
+	void shrinkToFit() override;
+
+	AppendableStore* getAppendableStore() override;
+	UpdatableStore* getUpdatableStore() override;
+	WritableStore* getWritableStore() override;
+};
+typedef boost::intrusive_ptr<MemWritableStore> MemWritableStorePtr;
+
+// Concurrent insert-only skiplist, writers link nodes by CAS, readers
+// need no lock. A unique index has one node per key, non-unique index has
+// one node per (key,id). Removed entries are marked dead(id = -1) and may
+// be revived by later insert, node memory is reclaimed when the segment
+// is dropped(after it is converted to a readonly segment).
+class TERARK_DB_DLL MemWritableIndex : public ReadableIndex, public WritableIndex {
+public:
+	struct Node;
+private:
+	enum { MaxHeight = 12 };
+	class MyIndexIterForward;  friend class MyIndexIterForward;
+	class MyIndexIterBackward; friend class MyIndexIterBackward;
+	const Schema*    m_schema;
+	Node*            m_head;
+	std::atomic<int> m_maxHeight;
+	MemArena         m_arena;
+
+	int  compare(const Node*, fstring key, llong id) const;
+	Node* newNode(fstring key, llong id, int height);
+	Node* findGreaterOrEqual(fstring key, llong id, Node** prev, Node** succ) const;
+	Node* findLess(fstring key, llong id) const;
+	Node* findLessOrEqualKey(fstring key) const;
+	Node* findLast() const;
+	Node* findExact(fstring key, llong id) const;
+	bool  insertNode(fstring key, llong id);
+public:
+	MemWritableIndex(const Schema&);
+	~MemWritableIndex();
+
+	void save(PathRef) const override;
+	void load(PathRef) override;
+
+	IndexIterator* createIndexIterForward(DbContext*) const override;
+	IndexIterator* createIndexIterBackward(DbContext*) const override;
+	llong indexStorageSize() const override;
+	bool remove(fstring key, llong id, DbContext*) override;
+	bool insert(fstring key, llong id, DbContext*) override;
+	bool replace(fstring key, llong oldId, llong newId, DbContext*) override;
+	void clear() override;
+
+	void searchExactAppend(fstring key, valvec<llong>* recIdvec, DbContext*) const override;
+	WritableIndex* getWritableIndex() override { return this; }
+};
+typedef boost::intrusive_ptr<MemWritableIndex> MemWritableIndexPtr;
+
+// In-memory writable segment, selected by "WritableSegmentClass": "mem" in
+// dbmeta.json. Stores and indices are lock free, so transactions do not
+// serialize writers, each operation is atomic by itself and the table
+// undoes index entries of a failed insert. Transaction rollback does not
+// undo applied ops, and the segment is persisted only by save() like
+// MockWritableSegment, so it requires the shared WriteAheadLog, creating
+// or opening it without the log throws. It is converted to readonly
+// segment without wiredtiger.
+class TERARK_DB_DLL MemWritableSegment : public PlainWritableSegment {
+public:
+	MemWritableSegment(PathRef dir);
+	~MemWritableSegment();
+protected:
+	DbTransaction* createTransaction() override;
+	ReadableIndex* createIndex(const Schema&, PathRef path) const override;
+	ReadableIndex* openIndex(const Schema&, PathRef) const override;
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_mem_writable_segment_hpp__
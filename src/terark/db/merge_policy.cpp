@@ -0,0 +1,224 @@
+#include "merge_policy.hpp"
+#include <terark/num_to_str.hpp>
+#include <float.h>
+
+namespace terark { namespace db {
+
+std::string MergePlan::toString() const {
+	string_appender<> str;
+	str << "segs[" << beg << "," << (beg + num) << ")"
+		<< " score=" << score << " " << reason;
+	return std::move(str);
+}
+
+MergePolicy::~MergePolicy() {
+}
+
+// msvc std::function is not memmovable, use SafeCopy
+typedef
+hash_strmap < std::function<MergePolicy*()>
+			, fstring_func::hash_align
+			, fstring_func::equal_align
+			, ValueInline, SafeCopy
+			>
+MergePolicyFactoryType;
+static MergePolicyFactoryType& s_getMergePolicyFactory() {
+	static MergePolicyFactoryType instance;
+	return instance;
+}
+
+MergePolicy::RegisterPolicy::RegisterPolicy
+(fstring name, const std::function<MergePolicy*()>& f)
+{
+	auto ib = s_getMergePolicyFactory().insert_i(name, f);
+	assert(ib.second);
+	if (!ib.second) {
+		THROW_STD(invalid_argument, "duplicate merge policy: %.*s",
+			name.ilen(), name.data());
+	}
+}
+
+MergePolicy* MergePolicy::create(fstring name) {
+	auto& factory = s_getMergePolicyFactory();
+	size_t idx = factory.find_i(name);
+	if (idx >= factory.end_i()) {
+		THROW_STD(invalid_argument, "MergePolicy = '%.*s' is not registered",
+			name.ilen(), name.data());
+	}
+	MergePolicy* policy = factory.val(idx)();
+	assert(policy);
+	return policy;
+}
+
+size_t MergePolicy::readAmplification(const valvec<MergeSegInfo>& segs) {
+	size_t n = 0;
+	for (auto& s : segs) {
+		if (s.liveRows() > 0)
+			n++;
+	}
+	return n;
+}
+
+// score is benefit per rewritten byte, benefit is the removed segments
+// (in unit of average segment size) plus the reclaimed deleted bytes
+bool MergePolicy::pickBestRange(const valvec<MergeSegInfo>& segs,
+								size_t minNum, size_t maxNum,
+								double sizeRatio, MergePlan* plan) {
+	const size_t n = segs.size();
+	minNum = std::max<size_t>(minNum, 2);
+	maxNum = std::max(maxNum, minNum);
+	if (n < minNum)
+		return false;
+	double sumSize = 0;
+	for (auto& s : segs) sumSize += s.dataSize;
+	const double avgSize = std::max(sumSize / n, 1.0);
+	bool found = false;
+	for (size_t beg = 0; beg + minNum <= n; ++beg) {
+		double minLive = DBL_MAX, maxLive = 0;
+		double bytes = 0, reclaim = 0;
+		for (size_t end = beg; end < n && end - beg < maxNum; ++end) {
+			const MergeSegInfo& s = segs[end];
+			double live = std::max<double>(s.liveSize(), 1.0);
+			minLive = std::min(minLive, live);
+			maxLive = std::max(maxLive, live);
+			if (maxLive > minLive * sizeRatio)
+				break;
+			bytes += s.dataSize;
+			reclaim += s.dataSize - s.liveSize();
+			size_t num = end - beg + 1;
+			if (num < minNum)
+				continue;
+			double score = ((num - 1) * avgSize + reclaim) / std::max(bytes, 1.0);
+			if (!found || score > plan->score) {
+				plan->beg = beg;
+				plan->num = num;
+				plan->score = score;
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+static size_t maxMergeSegNum(const SchemaConfig& conf) {
+	return conf.m_maxMergeSegNum ? conf.m_maxMergeSegNum : size_t(-1);
+}
+
+// when read amplification is too high, merge the best range regardless of
+// size ratio
+static bool
+pickForReadAmp(const SchemaConfig& conf, const valvec<MergeSegInfo>& segs,
+			   bool force, MergePlan* plan) {
+	size_t readAmp = MergePolicy::readAmplification(segs);
+	if (!force && (0 == conf.m_maxReadonlySegNum ||
+				   readAmp < conf.m_maxReadonlySegNum))
+		return false;
+	if (!MergePolicy::pickBestRange(segs, 2, maxMergeSegNum(conf), DBL_MAX, plan))
+		return false;
+	string_appender<> reason;
+	reason << (force ? "force" : "readAmp") << "(" << readAmp << ")";
+	plan->reason = std::move(reason);
+	return true;
+}
+
+// The original heuristic: find the longest run in which every segment has
+// less than 7/4 of average rows(3x for force). It does not use
+// MaxMergeSegNum, MaxReadonlySegNum or MergeSizeRatio, so the merges of
+// existing tables are not changed.
+class DefaultMergePolicy : public MergePolicy {
+public:
+	const char* name() const override { return "Default"; }
+	bool pickMerge(const SchemaConfig& conf, const valvec<MergeSegInfo>& segs,
+				   bool force, MergePlan* plan) const override {
+		const size_t n = segs.size();
+		if (n <= 1)
+			return false;
+		size_t sumSegRows = 0;
+		for (auto& s : segs) sumSegRows += size_t(s.rows);
+		size_t avgSegRows = sumSegRows / n;
+		size_t maxSegRows = force ? avgSegRows * 3 : avgSegRows * 7/4;
+
+		// find max range in which every seg rows < maxSegRows
+		size_t rngBeg = 0, rngLen = 0;
+		for(size_t j = 0; j < n; ) {
+			size_t k = j;
+			for (; k < n; ++k) {
+				if (size_t(segs[k].rows) > maxSegRows)
+					break;
+			}
+			if (k - j > rngLen) {
+				rngBeg = j;
+				rngLen = k - j;
+			}
+			j = k + 1;
+		}
+		if (rngLen < conf.m_minMergeSegNum)
+			return false;
+		plan->beg = rngBeg;
+		plan->num = rngLen;
+		plan->score = rngLen;
+		plan->reason = "longestRun";
+		return true;
+	}
+};
+TERARK_DB_REGISTER_MERGE_POLICY("Default", DefaultMergePolicy);
+
+class TieredMergePolicy : public MergePolicy {
+public:
+	const char* name() const override { return "Tiered"; }
+	bool pickMerge(const SchemaConfig& conf, const valvec<MergeSegInfo>& segs,
+				   bool force, MergePlan* plan) const override {
+		if (pickForReadAmp(conf, segs, force, plan))
+			return true;
+		if (pickBestRange(segs, conf.m_minMergeSegNum, maxMergeSegNum(conf),
+						  conf.m_mergeSizeRatio, plan)) {
+			plan->reason = "tier";
+			return true;
+		}
+		return false;
+	}
+};
+TERARK_DB_REGISTER_MERGE_POLICY("Tiered", TieredMergePolicy);
+
+// Segments are older(and should be larger) at lower index, segments after
+// j are merged into j when their sum of live size reaches size(j)/ratio.
+// The smallest such j is chosen, so a merge cascades to older segments
+// when newer ones have grown.
+class LeveledMergePolicy : public MergePolicy {
+public:
+	const char* name() const override { return "Leveled"; }
+	bool pickMerge(const SchemaConfig& conf, const valvec<MergeSegInfo>& segs,
+				   bool force, MergePlan* plan) const override {
+		if (pickForReadAmp(conf, segs, force, plan))
+			return true;
+		const size_t n = segs.size();
+		const size_t maxNum = maxMergeSegNum(conf);
+		if (n < 2)
+			return false;
+		double tail = 0;
+		size_t best = n;
+		for (size_t j = n - 1; j > 0; ) {
+			tail += segs[j].liveSize();
+			--j;
+			if (n - j > maxNum)
+				break;
+			if (tail * conf.m_mergeSizeRatio >= segs[j].liveSize())
+				best = j;
+		}
+		if (best == n)
+			return false;
+		double bytes = segs[best].dataSize, newer = 0;
+		for (size_t j = best + 1; j < n; ++j) {
+			bytes += segs[j].dataSize;
+			newer += segs[j].liveSize();
+		}
+		plan->beg = best;
+		plan->num = n - best;
+		plan->score = newer / std::max(bytes, 1.0);
+		plan->reason = "level";
+		return true;
+	}
+};
+TERARK_DB_REGISTER_MERGE_POLICY("Leveled", LeveledMergePolicy);
+
+} } // namespace terark::db
@@ -0,0 +1,76 @@
+#ifndef __terark_db_merge_policy_hpp__
+#define __terark_db_merge_policy_hpp__
+
+#include "db_conf.hpp"
+#include <functional>
+
+namespace terark { namespace db {
+
+// A readonly segment as seen by merge policy, in record id order
+struct MergeSegInfo {
+	llong  rows;     // logic rows, including deleted
+	llong  delcnt;
+	llong  dataSize; // storage size, the bytes to be rewritten by merge
+
+	llong liveRows() const { return rows - delcnt; }
+	llong liveSize() const {
+		return rows ? llong(double(dataSize) * liveRows() / rows) : 0;
+	}
+};
+
+// segments [beg, beg+num) will be merged into one segment
+struct MergePlan {
+	size_t beg = 0;
+	size_t num = 0;
+	double score = 0;
+	std::string reason;
+
+	std::string toString() const;
+};
+
+// Chooses which readonly segments to merge. merge requires the chosen
+// segments to be contiguous in record id space, so a plan is a range of
+// the segment array.
+//
+// Policy is chosen by "MergePolicy" in dbmeta.json:
+//   Default: longest run of segments which are not much larger than average
+//   Tiered : merge runs of similar size(max/min <= MergeSizeRatio), the run
+//            with most segments and deleted bytes per rewritten byte wins
+//   Leveled: merge newer segments into the older one when their sum
+//            reaches 1/MergeSizeRatio of it, segment sizes are kept in a
+//            geometric progression
+// Tiered and Leveled merge at most MaxMergeSegNum segments, and when
+// segments with live rows reach MaxReadonlySegNum, the read amplification
+// of index search(which probes each such segment), they relax their size
+// constraints to reduce the segment number. Both are 0(off) by default.
+class TERARK_DB_DLL MergePolicy : public RefCounter {
+public:
+	virtual ~MergePolicy();
+	virtual const char* name() const = 0;
+
+	///@param force merge as much as possible, for syncFinishWriting
+	///@returns false if no merge is needed
+	virtual bool pickMerge(const SchemaConfig&, const valvec<MergeSegInfo>&,
+						   bool force, MergePlan*) const = 0;
+
+	struct RegisterPolicy {
+		RegisterPolicy(fstring name, const std::function<MergePolicy*()>& f);
+	};
+#define TERARK_DB_REGISTER_MERGE_POLICY(Name, PolicyClass) \
+	static MergePolicy::RegisterPolicy \
+		regMergePolicy_##PolicyClass(Name, [](){ return new PolicyClass(); });
+
+	///@throws invalid_argument if name is not registered
+	static MergePolicy* create(fstring name);
+
+	// the most valuable range of [minNum, maxNum] segments in which
+	// max/min of live size is not larger than sizeRatio
+	static bool pickBestRange(const valvec<MergeSegInfo>&, size_t minNum,
+							  size_t maxNum, double sizeRatio, MergePlan*);
+	static size_t readAmplification(const valvec<MergeSegInfo>&);
+};
+typedef boost::intrusive_ptr<MergePolicy> MergePolicyPtr;
+
+} } // namespace terark::db
+
+#endif // __terark_db_merge_policy_hpp__
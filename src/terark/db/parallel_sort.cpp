@@ -0,0 +1,311 @@
+#include "parallel_sort.hpp"
+#include <terark/util/sortable_strvec.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace terark { namespace db {
+
+size_t getParallelSortThreadNum(size_t keyNum) {
+	size_t minKeys = size_t(1) << 20;
+	if (const char* env = getenv("TerarkDB_ParallelSortMinKeys")) {
+		minKeys = size_t(atoll(env));
+	}
+	if (keyNum < minKeys) {
+		return 1;
+	}
+	size_t n = std::thread::hardware_concurrency();
+	if (const char* env = getenv("TerarkDB_ParallelSortThreadsNum")) {
+		n = std::min<size_t>(n, atoi(env));
+	}
+	return std::max<size_t>(n, 1);
+}
+
+namespace {
+
+// thrNum-1 threads are created once and reused by each run(func), which
+// calls func(tid) in all threads, tid 0 runs in calling thread
+class ThreadTeam {
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_jobCond;
+	std::condition_variable m_doneCond;
+	const std::function<void(size_t)>* m_func;
+	size_t m_jobSeq;
+	size_t m_running;
+	bool   m_quit;
+
+	void worker(size_t tid) {
+		size_t seenSeq = 0;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (;;) {
+			m_jobCond.wait(lock, [&]{ return m_quit || m_jobSeq != seenSeq; });
+			if (m_quit)
+				break;
+			seenSeq = m_jobSeq;
+			const std::function<void(size_t)>& func = *m_func;
+			lock.unlock();
+			func(tid);
+			lock.lock();
+			if (--m_running == 0)
+				m_doneCond.notify_one();
+		}
+	}
+
+public:
+	explicit ThreadTeam(size_t thrNum) {
+		m_func = NULL;
+		m_jobSeq = 0;
+		m_running = 0;
+		m_quit = false;
+		m_threads.reserve(thrNum > 1 ? thrNum - 1 : 0);
+		for (size_t tid = 1; tid < thrNum; ++tid) {
+			m_threads.emplace_back([this,tid]() { worker(tid); });
+		}
+	}
+	~ThreadTeam() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+		}
+		m_jobCond.notify_all();
+		for (auto& th : m_threads) th.join();
+	}
+	void run(const std::function<void(size_t)>& func) {
+		if (m_threads.empty()) {
+			func(0);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_func = &func;
+			m_running = m_threads.size();
+			m_jobSeq++;
+		}
+		m_jobCond.notify_all();
+		func(0);
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_doneCond.wait(lock, [&]{ return 0 == m_running; });
+	}
+};
+
+template<class Elem, class KeyOf>
+class MsdRadixSorter {
+	static const size_t BucketNum = 257; // bucket 0 is for key end
+	static const size_t CmpSortMaxNum = 64;
+	static const size_t MaxRadixDepth = 16;
+
+	struct Range {
+		size_t beg;
+		size_t num;
+		size_t depth;
+	};
+	KeyOf   m_keyOf;
+	size_t  m_thrNum;
+	Elem*   m_base;
+	Elem*   m_tmp;
+	ThreadTeam* m_team;
+
+	size_t bucketOf(const Elem& e, size_t depth) const {
+		fstring k = m_keyOf(e);
+		return size_t(k.size()) > depth ? size_t(k.udata()[depth]) + 1 : 0;
+	}
+
+	// all keys in [beg, beg+num) have the same first depth bytes
+	void cmpSort(Elem* beg, size_t num, size_t depth) const {
+		const KeyOf keyOf = m_keyOf;
+		std::sort(beg, beg + num, [&keyOf,depth](const Elem& x, const Elem& y) {
+			fstring kx = keyOf(x);
+			fstring ky = keyOf(y);
+			assert(size_t(kx.size()) >= depth);
+			assert(size_t(ky.size()) >= depth);
+			size_t nx = kx.size() - depth;
+			size_t ny = ky.size() - depth;
+			int ret = memcmp(kx.udata() + depth, ky.udata() + depth,
+							 std::min(nx, ny));
+			if (ret)
+				return ret < 0;
+			if (nx != ny)
+				return nx < ny;
+			return keyOf.tieLess(x, y);
+		});
+	}
+
+	void seqSort(Elem* beg, size_t num, size_t depth, Elem* tmp) const {
+		while (num > CmpSortMaxNum && depth < MaxRadixDepth) {
+			size_t cnt[BucketNum] = {0};
+			for (size_t i = 0; i < num; ++i) {
+				cnt[bucketOf(beg[i], depth)]++;
+			}
+			if (cnt[0] == num) {
+				return; // all keys are equal, input order is kept
+			}
+			size_t pos[BucketNum];
+			size_t sum = 0, maxBucket = 0;
+			for (size_t b = 0; b < BucketNum; ++b) {
+				pos[b] = sum;
+				sum += cnt[b];
+				if (cnt[b] > cnt[maxBucket])
+					maxBucket = b;
+			}
+			if (cnt[maxBucket] == num) {
+				depth++; // common prefix, no need to scatter
+				continue;
+			}
+			for (size_t i = 0; i < num; ++i) {
+				tmp[pos[bucketOf(beg[i], depth)]++] = beg[i];
+			}
+			std::copy(tmp, tmp + num, beg);
+			for (size_t b = 1, off = cnt[0]; b < BucketNum; ++b) {
+				if (cnt[b] > 1)
+					seqSort(beg + off, cnt[b], depth + 1, tmp + off);
+				off += cnt[b];
+			}
+			return;
+		}
+		if (num > 1)
+			cmpSort(beg, num, depth);
+	}
+
+	// partition [beg, beg+num) by byte at depth with all threads
+	void parallelPartition(size_t beg, size_t num, size_t depth,
+						   size_t* cnt) {
+		const size_t thrNum = m_thrNum;
+		const size_t chunk = (num + thrNum - 1) / thrNum;
+		Elem* src = m_base + beg;
+		Elem* dst = m_tmp + beg;
+		valvec<size_t> hist(thrNum * BucketNum, 0);
+		m_team->run([&](size_t tid) {
+			size_t* h = hist.data() + tid * BucketNum;
+			size_t lo = std::min(num, chunk * tid);
+			size_t hi = std::min(num, lo + chunk);
+			for (size_t i = lo; i < hi; ++i)
+				h[bucketOf(src[i], depth)]++;
+		});
+		std::fill_n(cnt, BucketNum, 0);
+		size_t sum = 0;
+		for (size_t b = 0; b < BucketNum; ++b) {
+			for (size_t tid = 0; tid < thrNum; ++tid) {
+				size_t c = hist[tid * BucketNum + b];
+				hist[tid * BucketNum + b] = sum; // now is scatter pos
+				sum += c;
+				cnt[b] += c;
+			}
+		}
+		assert(sum == num);
+		m_team->run([&](size_t tid) {
+			size_t* pos = hist.data() + tid * BucketNum;
+			size_t lo = std::min(num, chunk * tid);
+			size_t hi = std::min(num, lo + chunk);
+			for (size_t i = lo; i < hi; ++i)
+				dst[pos[bucketOf(src[i], depth)]++] = src[i];
+		});
+		m_team->run([&](size_t tid) {
+			size_t lo = std::min(num, chunk * tid);
+			size_t hi = std::min(num, lo + chunk);
+			std::copy(dst + lo, dst + hi, src + lo);
+		});
+	}
+
+public:
+	MsdRadixSorter(KeyOf keyOf, size_t thrNum)
+		: m_keyOf(keyOf), m_thrNum(std::max<size_t>(thrNum, 1)) {
+		m_base = NULL;
+		m_tmp = NULL;
+		m_team = NULL;
+	}
+
+	void sort(Elem* base, size_t num) {
+		valvec<Elem> tmp(num, valvec_no_init());
+		m_base = base;
+		m_tmp = tmp.data();
+		if (m_thrNum <= 1) {
+			seqSort(base, num, 0, m_tmp);
+			return;
+		}
+		ThreadTeam team(m_thrNum);
+		m_team = &team;
+		// ranges larger than bigMin are partitioned by all threads, so a
+		// dominant first byte(such as high bytes of big endian ints) does
+		// not leave other threads idle
+		const size_t bigMin = std::max(num / (4 * m_thrNum), CmpSortMaxNum);
+		valvec<Range> big, small;
+		big.push_back({0, num, 0});
+		while (!big.empty()) {
+			Range r = big.pop_val();
+			if (r.depth >= MaxRadixDepth) {
+				small.push_back(r);
+				continue;
+			}
+			size_t cnt[BucketNum];
+			parallelPartition(r.beg, r.num, r.depth, cnt);
+			size_t off = r.beg + cnt[0];
+			for (size_t b = 1; b < BucketNum; ++b) {
+				if (cnt[b] > bigMin)
+					big.push_back({off, cnt[b], r.depth + 1});
+				else if (cnt[b] > 1)
+					small.push_back({off, cnt[b], r.depth + 1});
+				off += cnt[b];
+			}
+		}
+		std::sort(small.begin(), small.end(),
+			[](const Range& x, const Range& y) { return x.num > y.num; });
+		std::atomic<size_t> next(0);
+		team.run([&](size_t) {
+			for (;;) {
+				size_t i = next++;
+				if (i >= small.size())
+					break;
+				const Range& r = small[i];
+				seqSort(m_base + r.beg, r.num, r.depth, m_tmp + r.beg);
+			}
+		});
+	}
+};
+
+struct StrVecKeyOf {
+	const byte* pool;
+	fstring operator()(const SortableStrVec::SEntry& x) const {
+		return fstring(pool + x.offset, size_t(x.length));
+	}
+	bool tieLess(const SortableStrVec::SEntry& x,
+				 const SortableStrVec::SEntry& y) const {
+		return x.seq_id < y.seq_id;
+	}
+};
+
+struct FixedLenKeyOf {
+	const byte* keys;
+	size_t fixlen;
+	fstring operator()(uint32_t id) const {
+		return fstring(keys + fixlen * id, fixlen);
+	}
+	bool tieLess(uint32_t x, uint32_t y) const { return x < y; }
+};
+
+} // namespace
+
+void parallelSortStrVec(SortableStrVec& strVec, size_t thrNum) {
+	if (0 == thrNum) {
+		thrNum = getParallelSortThreadNum(strVec.size());
+	}
+	StrVecKeyOf keyOf = { strVec.m_strpool.data() };
+	MsdRadixSorter<SortableStrVec::SEntry, StrVecKeyOf> sorter(keyOf, thrNum);
+	sorter.sort(strVec.m_index.data(), strVec.m_index.size());
+}
+
+void parallelSortFixedLen(const byte* keys, size_t fixlen,
+						  uint32_t* ids, size_t num, size_t thrNum) {
+	if (0 == thrNum) {
+		thrNum = getParallelSortThreadNum(num);
+	}
+	FixedLenKeyOf keyOf = { keys, fixlen };
+	MsdRadixSorter<uint32_t, FixedLenKeyOf> sorter(keyOf, thrNum);
+	sorter.sort(ids, num);
+}
+
+} } // namespace terark::db
@@ -0,0 +1,39 @@
+#ifndef __terark_db_parallel_sort_hpp__
+#define __terark_db_parallel_sort_hpp__
+
+#include "db_conf.hpp"
+
+namespace terark {
+	class SortableStrVec;
+}
+
+namespace terark { namespace db {
+
+// Sort byte lex keys for index construction.
+//
+// MSD radix sort on one byte per level: large ranges are partitioned by all
+// threads (per thread histogram, stable scatter), the resulting buckets are
+// then sorted by the threads independently. Small ranges, and ranges deeper
+// than MaxRadixDepth (long common prefix), fall back to std::sort which
+// compares keys after the known common prefix.
+//
+// The order is the same as SortableStrVec::sort(): memcmp, then shorter key
+// first. Equal keys are ordered by seq_id.
+//
+///@param thrNum 0 means getParallelSortThreadNum(keyNum)
+TERARK_DB_DLL void
+parallelSortStrVec(SortableStrVec& strVec, size_t thrNum = 0);
+
+// Sort record ids by fixed len keys: keys[fixlen*id, fixlen*(id+1)),
+// ids of equal keys are sorted ascending.
+TERARK_DB_DLL void
+parallelSortFixedLen(const byte* keys, size_t fixlen,
+					 uint32_t* ids, size_t num, size_t thrNum = 0);
+
+// 1 if keyNum is less than env TerarkDB_ParallelSortMinKeys(default 1M),
+// else env TerarkDB_ParallelSortThreadsNum(default all cores)
+TERARK_DB_DLL size_t getParallelSortThreadNum(size_t keyNum);
+
+} } // namespace terark::db
+
+#endif // __terark_db_parallel_sort_hpp__
@@ -0,0 +1,191 @@
+#include "row_cache.hpp"
+#include "json.hpp"
+
+namespace terark { namespace db {
+
+RowCache& RowCache::instance() {
+	static RowCache cache;
+	return cache;
+}
+
+RowCache::RowCache() {
+	size_t cap = 0;
+	if (const char* env = getenv("TerarkDB_RowCacheSize")) {
+		cap = size_t(atoll(env));
+	}
+	m_capacity = cap;
+	m_nextSegId = 1; // 0 marks free slot
+	for (Shard& s : m_shards) {
+		s.hand = 0;
+		s.usedBytes = 0;
+		s.hits = 0;
+		s.misses = 0;
+		s.inserts = 0;
+		s.evictions = 0;
+		s.invalidated = 0;
+	}
+}
+
+RowCache::~RowCache() {
+}
+
+size_t RowCache::KeyHash::operator()(const Key& k) const {
+	uint64_t h = k.segId * 0x9E3779B97F4A7C15ULL ^ k.physicId;
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 32;
+	return size_t(h);
+}
+
+// approximate memory of an entry, including slot and hash node
+size_t RowCache::charge(size_t rowLen) {
+	return rowLen + sizeof(Entry) + 4 * sizeof(void*);
+}
+
+RowCache::Shard& RowCache::shardOf(const Key& k) {
+	// high bits, low bits are used by the hash map of the shard
+	return m_shards[(KeyHash()(k) >> 58) % ShardNum];
+}
+
+uint64_t RowCache::newSegmentId() {
+	return m_nextSegId.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RowCache::setCapacity(size_t bytes) {
+	m_capacity = bytes;
+	size_t limit = bytes / ShardNum;
+	for (Shard& s : m_shards) {
+		std::lock_guard<std::mutex> lock(s.mutex);
+		evictInLock(s, limit);
+	}
+}
+
+bool RowCache::lookup(uint64_t segId, size_t physicId, valvec<byte>* val) {
+	Key k = { segId, physicId };
+	Shard& s = shardOf(k);
+	std::lock_guard<std::mutex> lock(s.mutex);
+	auto iter = s.index.find(k);
+	if (s.index.end() == iter) {
+		s.misses++;
+		return false;
+	}
+	Entry& e = s.slots[iter->second];
+	e.referenced = true;
+	val->assign((const byte*)e.row.data(), e.row.size());
+	s.hits++;
+	return true;
+}
+
+void RowCache::insert(uint64_t segId, size_t physicId, fstring row) {
+	size_t limit = capacity() / ShardNum;
+	size_t bytes = charge(row.size());
+	if (bytes > limit / 8) {
+		return; // a huge row would flush too many hot rows
+	}
+	Key k = { segId, physicId };
+	Shard& s = shardOf(k);
+	std::lock_guard<std::mutex> lock(s.mutex);
+	if (s.index.count(k)) {
+		return; // inserted by a concurrent reader
+	}
+	evictInLock(s, limit - bytes);
+	size_t slot;
+	if (s.freeSlots.empty()) {
+		slot = s.slots.size();
+		s.slots.emplace_back();
+	} else {
+		slot = s.freeSlots.back();
+		s.freeSlots.pop_back();
+	}
+	Entry& e = s.slots[slot];
+	e.key = k;
+	e.referenced = false;
+	e.row.assign(row.data(), row.size());
+	s.index.emplace(k, slot);
+	s.usedBytes += bytes;
+	s.inserts++;
+}
+
+void RowCache::removeSlotInLock(Shard& s, size_t slot) {
+	Entry& e = s.slots[slot];
+	assert(0 != e.key.segId);
+	s.index.erase(e.key);
+	s.usedBytes -= charge(e.row.size());
+	e.key.segId = 0;
+	std::string().swap(e.row);
+	s.freeSlots.push_back(slot);
+}
+
+void RowCache::evictInLock(Shard& s, size_t limit) {
+	const size_t slotNum = s.slots.size();
+	while (s.usedBytes > limit) {
+		if (s.hand >= slotNum)
+			s.hand = 0;
+		Entry& e = s.slots[s.hand];
+		if (0 == e.key.segId) {
+			// free slot
+		}
+		else if (e.referenced) {
+			e.referenced = false;
+		}
+		else {
+			removeSlotInLock(s, s.hand);
+			s.evictions++;
+		}
+		s.hand++;
+	}
+	if (s.index.empty() && !s.slots.empty()) {
+		s.slots.clear();
+		s.freeSlots.clear();
+		s.hand = 0;
+	}
+}
+
+void RowCache::eraseSegment(uint64_t segId) {
+	for (Shard& s : m_shards) {
+		std::lock_guard<std::mutex> lock(s.mutex);
+		if (s.index.empty())
+			continue;
+		for (size_t i = 0; i < s.slots.size(); ++i) {
+			if (s.slots[i].key.segId == segId) {
+				removeSlotInLock(s, i);
+				s.invalidated++;
+			}
+		}
+	}
+}
+
+RowCache::Stats RowCache::getStats() const {
+	Stats st;
+	memset(&st, 0, sizeof(st));
+	st.capacity = capacity();
+	for (const Shard& s : m_shards) {
+		std::lock_guard<std::mutex> lock(s.mutex);
+		st.usedBytes += s.usedBytes;
+		st.entries += s.index.size();
+		st.hits += s.hits;
+		st.misses += s.misses;
+		st.inserts += s.inserts;
+		st.evictions += s.evictions;
+		st.invalidated += s.invalidated;
+	}
+	return st;
+}
+
+std::string RowCache::getStatsJson() const {
+	Stats st = getStats();
+	unsigned long long lookups = st.hits + st.misses;
+	json js;
+	js["capacity"] = st.capacity;
+	js["usedBytes"] = st.usedBytes;
+	js["entries"] = st.entries;
+	js["hits"] = st.hits;
+	js["misses"] = st.misses;
+	js["hitRatio"] = lookups ? double(st.hits) / lookups : 0.0;
+	js["inserts"] = st.inserts;
+	js["evictions"] = st.evictions;
+	js["invalidated"] = st.invalidated;
+	return js.dump();
+}
+
+} } // namespace terark::db
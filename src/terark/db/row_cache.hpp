@@ -0,0 +1,104 @@
+#ifndef __terark_db_row_cache_hpp__
+#define __terark_db_row_cache_hpp__
+
+#include "db_conf.hpp"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace terark { namespace db {
+
+// Process wide cache of decompressed rows of readonly segments, keyed by
+// (segment cache id, physical id). Rows of a readonly segment never change,
+// except for updatable colgroups, which are updated in place, so tables
+// having updatable colgroups do not use the cache. merge/purge build a new
+// segment with a new cache id, and entries of a segment are dropped when
+// the segment is destroyed, if it has inserted any.
+//
+// The cache is split into ShardNum shards by key hash, each shard has its
+// own mutex and is evicted by CLOCK: a hit just sets the reference bit, the
+// hand clears reference bits and evicts the first unreferenced entry, so a
+// row read only once is evicted before hot rows.
+//
+// Capacity(bytes) is shared by all tables, 0 disables the cache, it is
+// initialized by env TerarkDB_RowCacheSize(default 0) and may be changed
+// by setCapacity at any time, such as leveldb Options::block_cache.
+class TERARK_DB_DLL RowCache {
+public:
+	enum { ShardNum = 64 };
+	struct Stats {
+		size_t capacity;
+		size_t usedBytes;
+		size_t entries;
+		unsigned long long hits;
+		unsigned long long misses;
+		unsigned long long inserts;
+		unsigned long long evictions;
+		unsigned long long invalidated;
+	};
+
+	static RowCache& instance();
+
+	// returns a unique id for a readonly segment, ids are never reused
+	uint64_t newSegmentId();
+
+	bool enabled() const { return m_capacity.load(std::memory_order_relaxed) != 0; }
+	size_t capacity() const { return m_capacity.load(std::memory_order_relaxed); }
+	void setCapacity(size_t bytes);
+
+	///@returns true and assign the row to val if found
+	bool lookup(uint64_t segId, size_t physicId, valvec<byte>* val);
+	void insert(uint64_t segId, size_t physicId, fstring row);
+	// drop all entries of the segment
+	void eraseSegment(uint64_t segId);
+
+	Stats getStats() const;
+	std::string getStatsJson() const;
+
+private:
+	RowCache();
+	~RowCache();
+
+	struct Key {
+		uint64_t segId;
+		uint64_t physicId;
+		bool operator==(const Key& y) const {
+			return segId == y.segId && physicId == y.physicId;
+		}
+	};
+	struct KeyHash {
+		size_t operator()(const Key& k) const;
+	};
+	struct Entry {
+		Key  key; // key.segId == 0 for free slot
+		bool referenced;
+		std::string row;
+	};
+	struct Shard {
+		mutable std::mutex mutex;
+		std::unordered_map<Key, size_t, KeyHash> index; // to slot
+		std::vector<Entry>  slots;
+		std::vector<size_t> freeSlots;
+		size_t hand;
+		size_t usedBytes;
+		unsigned long long hits;
+		unsigned long long misses;
+		unsigned long long inserts;
+		unsigned long long evictions;
+		unsigned long long invalidated;
+		char padding[64];
+	};
+	static size_t charge(size_t rowLen);
+	Shard& shardOf(const Key&);
+	void removeSlotInLock(Shard&, size_t slot);
+	void evictInLock(Shard&, size_t limit);
+
+	std::atomic<size_t>   m_capacity;
+	std::atomic<uint64_t> m_nextSegId;
+	Shard m_shards[ShardNum];
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_row_cache_hpp__
@@ -0,0 +1,58 @@
+#include "seg_locator.hpp"
+
+namespace terark { namespace db {
+
+SegLocator::SegLocator() {
+	m_num = 0;
+}
+
+SegLocator::~SegLocator() {
+}
+
+static size_t
+fillEytzinger(const llong* sorted, size_t n, size_t i, size_t k,
+			  llong* eyt, uint32_t* rank) {
+	if (k <= n) {
+		i = fillEytzinger(sorted, n, i, 2 * k, eyt, rank);
+		eyt[k] = sorted[i];
+		rank[k] = uint32_t(i);
+		i++;
+		i = fillEytzinger(sorted, n, i, 2 * k + 1, eyt, rank);
+	}
+	return i;
+}
+
+void SegLocator::build(const llong* rowNumVec, size_t segNum) {
+	if (0 == segNum) {
+		// a DbContext created before any segment is loaded
+		m_num = 0;
+		m_sorted.clear();
+		m_eytzinger.clear();
+		m_rank.clear();
+		return;
+	}
+	assert(0 == rowNumVec[0]);
+	m_num = segNum - 1;
+	m_sorted.assign(rowNumVec + 1, m_num);
+	if (m_num <= LinearMaxNum) {
+		m_eytzinger.clear();
+		m_rank.clear();
+		return;
+	}
+	m_eytzinger.resize_no_init(m_num + 1);
+	m_rank.resize_no_init(m_num + 1);
+	m_eytzinger[0] = -1;
+	m_rank[0] = uint32_t(m_num); // no base id > id
+	size_t filled = fillEytzinger(m_sorted.data(), m_num, 0, 1,
+								  m_eytzinger.data(), m_rank.data());
+	TERARK_RT_assert(filled == m_num, std::logic_error);
+#if !defined(NDEBUG)
+	for (size_t i = 0; i < m_num; ++i) {
+		llong id = m_sorted[i];
+		size_t upp = upper_bound(id);
+		assert(upp == terark::upper_bound_0(rowNumVec, segNum, id));
+	}
+#endif
+}
+
+} } // namespace terark::db
@@ -0,0 +1,70 @@
+#ifndef __terark_db_seg_locator_hpp__
+#define __terark_db_seg_locator_hpp__
+
+#include "db_conf.hpp"
+#include <terark/bitmanip.hpp>
+
+#if defined(_MSC_VER)
+	#include <xmmintrin.h>
+	#define TERARK_DB_PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+	#define TERARK_DB_PREFETCH(p) __builtin_prefetch(p)
+#endif
+
+namespace terark { namespace db {
+
+// Maps a record id to its segment, upper_bound(id) returns the same value as
+// upper_bound_a(rowNumVec, id) when id < rowNumVec.back(), so segIdx is
+// upper_bound(id)-1.
+//
+// rowNumVec.back() grows on each insert and is not used, ids beyond the
+// base id of the last segment are all in the last segment.
+//
+// When there are few segments, upper_bound is a linear count which is
+// vectorized by the compiler. Otherwise segment base ids are stored in
+// Eytzinger(BFS) layout, the search loop has no data dependent branch and
+// prefetches the cache line of the descendants 3 levels below.
+class TERARK_DB_DLL SegLocator {
+public:
+	SegLocator();
+	~SegLocator();
+
+	void build(const llong* rowNumVec, size_t segNum);
+
+	size_t upper_bound(llong id) const {
+		assert(id >= 0);
+		const size_t n = m_num;
+		if (n <= LinearMaxNum) {
+			const llong* keys = m_sorted.data();
+			size_t cnt = 1; // rowNumVec[0] == 0 <= id
+			for (size_t i = 0; i < n; ++i)
+				cnt += keys[i] <= id;
+			return cnt;
+		}
+		const llong* eyt = m_eytzinger.data();
+		size_t k = 1;
+		while (k <= n) {
+			TERARK_DB_PREFETCH(eyt + PrefetchMultiplier * k);
+			k = 2 * k + (eyt[k] <= id);
+		}
+		// drop trailing right turns and the last left turn, k is the
+		// first base id > id, or 0 if there is no such one
+		k >>= fast_ctz(~k) + 1;
+		return m_rank[k] + 1;
+	}
+
+	size_t segNum() const { return m_num + 1; }
+
+	static const size_t LinearMaxNum = 4;
+	static const size_t PrefetchMultiplier = 64 / sizeof(llong);
+
+protected:
+	valvec<llong>    m_sorted;    // rowNumVec[1 .. segNum-1]
+	valvec<llong>    m_eytzinger; // [0] is unused
+	valvec<uint32_t> m_rank;      // rank of m_eytzinger[k] in m_sorted
+	size_t m_num;
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_seg_locator_hpp__
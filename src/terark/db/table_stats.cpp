@@ -0,0 +1,112 @@
+#include "table_stats.hpp"
+#include <terark/bitmanip.hpp>
+#include "json.hpp"
+
+namespace terark { namespace db {
+
+TableStats::TableStats() {
+	for (Shard& s : m_shards) {
+		s.exactLookups = 0;
+		s.segProbes = 0;
+		s.bytesDecompressed = 0;
+		for (auto& x : s.segHits) x = 0;
+		for (auto& h : s.hist) for (auto& x : h) x = 0;
+		for (auto& x : s.sumNs) x = 0;
+	}
+	for (BgOpStats& b : m_bgOps) {
+		b.count = 0;
+		b.sumUs = 0;
+		b.maxUs = 0;
+	}
+	m_sampleRate = 16;
+	if (const char* env = getenv("TerarkDB_LatencySampleRate")) {
+		m_sampleRate = uint32_t(atoi(env));
+	}
+}
+
+TableStats::~TableStats() {
+}
+
+// bucket b holds latency in [2^(b-1), 2^b) nanoseconds
+void TableStats::addLatency(size_t shard, Latency lat, long long ns) {
+	size_t b = ns > 0 ? terark_bsr_u64((unsigned long long)ns) + 1 : 0;
+	b = b < HistBucketNum ? b : HistBucketNum - 1;
+	Shard& s = m_shards[shard];
+	s.hist[lat][b].fetch_add(1, std::memory_order_relaxed);
+	s.sumNs[lat].fetch_add(ns, std::memory_order_relaxed);
+}
+
+void TableStats::addBgOp(BgOp op, double ms) {
+	BgOpStats& b = m_bgOps[op];
+	unsigned long long us = (unsigned long long)(ms * 1000);
+	b.count++;
+	b.sumUs += us;
+	unsigned long long old = b.maxUs;
+	while (old < us && !b.maxUs.compare_exchange_weak(old, us)) {}
+}
+
+std::string TableStats::toJson() const {
+	static const char* latNames[] = { "indexSeek", "valueFetch" };
+	static const char* bgNames[] = { "flush", "convert", "merge" };
+	unsigned long long lookups = 0, probes = 0, decompressed = 0;
+	unsigned long long segHits[SegSlotNum] = {0};
+	unsigned long long hist[LatencyNum][HistBucketNum] = {{0}};
+	unsigned long long sumNs[LatencyNum] = {0};
+	for (const Shard& s : m_shards) {
+		lookups += s.exactLookups.load(std::memory_order_relaxed);
+		probes += s.segProbes.load(std::memory_order_relaxed);
+		decompressed += s.bytesDecompressed.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < SegSlotNum; ++i)
+			segHits[i] += s.segHits[i].load(std::memory_order_relaxed);
+		for (size_t l = 0; l < LatencyNum; ++l) {
+			for (size_t b = 0; b < HistBucketNum; ++b)
+				hist[l][b] += s.hist[l][b].load(std::memory_order_relaxed);
+			sumNs[l] += s.sumNs[l].load(std::memory_order_relaxed);
+		}
+	}
+	json js;
+	js["exactLookups"] = lookups;
+	js["segProbes"] = probes;
+	js["avgSegProbes"] = lookups ? double(probes) / lookups : 0.0;
+	js["bytesDecompressed"] = decompressed;
+	size_t slotNum = SegSlotNum;
+	while (slotNum > 0 && 0 == segHits[slotNum-1]) --slotNum;
+	json& jhits = js["segHits"];
+	jhits = json::array();
+	for (size_t i = 0; i < slotNum; ++i) {
+		jhits.push_back(segHits[i]);
+	}
+	js["latencySampleRate"] = m_sampleRate;
+	for (size_t l = 0; l < LatencyNum; ++l) {
+		unsigned long long cnt = 0;
+		for (size_t b = 0; b < HistBucketNum; ++b) cnt += hist[l][b];
+		json& jl = js[latNames[l]];
+		jl["samples"] = cnt;
+		jl["avgUs"] = cnt ? sumNs[l] / 1e3 / cnt : 0.0;
+		// percentiles are upper bounds of histogram buckets
+		static const double pct[] = { 0.50, 0.99, 0.999 };
+		static const char* pctNames[] = { "p50Us", "p99Us", "p999Us" };
+		for (size_t p = 0; p < 3; ++p) {
+			unsigned long long rank = (unsigned long long)(cnt * pct[p]);
+			unsigned long long acc = 0;
+			size_t b = 0;
+			for (; b < HistBucketNum - 1; ++b) {
+				acc += hist[l][b];
+				if (acc > rank) break;
+			}
+			jl[pctNames[p]] = cnt ? double(1ULL << b) / 1e3 : 0.0;
+		}
+	}
+	for (size_t i = 0; i < BgOpNum; ++i) {
+		const BgOpStats& b = m_bgOps[i];
+		unsigned long long cnt = b.count;
+		json& jb = js[bgNames[i]];
+		jb["count"] = cnt;
+		jb["sumMs"] = b.sumUs / 1e3;
+		jb["avgMs"] = cnt ? b.sumUs / 1e3 / cnt : 0.0;
+		jb["maxMs"] = b.maxUs / 1e3;
+	}
+	return js.dump();
+}
+
+} } // namespace terark::db
@@ -0,0 +1,72 @@
+#ifndef __terark_db_table_stats_hpp__
+#define __terark_db_table_stats_hpp__
+
+#include "db_conf.hpp"
+#include <atomic>
+
+namespace terark { namespace db {
+
+// Read path and background task counters of a CompositeTable.
+//
+// Read counters are sharded, a DbContext(which is used by one thread at a
+// time) always writes the same shard, shards are cache line padded, so
+// counters of different threads do not share cache lines. Latency of only
+// 1 in TerarkDB_LatencySampleRate(default 16, 0 disables) reads is timed.
+// Readers of the stats sum up all shards, the sum may be a bit stale.
+class TERARK_DB_DLL TableStats {
+public:
+	enum { ShardNum = 16, SegSlotNum = 64, HistBucketNum = 40 };
+	enum Latency { IndexSeek, ValueFetch, LatencyNum };
+	enum BgOp { Flush, Convert, Merge, BgOpNum };
+
+	TableStats();
+	~TableStats();
+
+	///@{ called by readers with DbContext::statsShard
+	void addExactLookup(size_t shard, size_t probes, size_t lookups = 1) {
+		Shard& s = m_shards[shard];
+		s.exactLookups.fetch_add(lookups, std::memory_order_relaxed);
+		s.segProbes.fetch_add(probes, std::memory_order_relaxed);
+	}
+	// segIdx >= SegSlotNum-1 shares the last slot
+	void addSegHit(size_t shard, size_t segIdx) {
+		segIdx = segIdx < SegSlotNum ? segIdx : SegSlotNum - 1;
+		m_shards[shard].segHits[segIdx].fetch_add(1, std::memory_order_relaxed);
+	}
+	void addDecompressed(size_t shard, size_t bytes) {
+		m_shards[shard].bytesDecompressed.fetch_add(bytes, std::memory_order_relaxed);
+	}
+	void addLatency(size_t shard, Latency lat, long long ns);
+	///@returns true if this read should be timed
+	bool shouldSample(uint32_t* tick) const {
+		return m_sampleRate && ++*tick % m_sampleRate == 0;
+	}
+	///@}
+
+	void addBgOp(BgOp op, double ms);
+
+	std::string toJson() const;
+
+private:
+	struct Shard {
+		std::atomic<unsigned long long> exactLookups;
+		std::atomic<unsigned long long> segProbes;
+		std::atomic<unsigned long long> bytesDecompressed;
+		std::atomic<unsigned long long> segHits[SegSlotNum];
+		std::atomic<unsigned long long> hist[LatencyNum][HistBucketNum];
+		std::atomic<unsigned long long> sumNs[LatencyNum];
+		char padding[64]; // avoid false sharing with next shard
+	};
+	struct BgOpStats {
+		std::atomic<unsigned long long> count;
+		std::atomic<unsigned long long> sumUs;
+		std::atomic<unsigned long long> maxUs;
+	};
+	Shard     m_shards[ShardNum];
+	BgOpStats m_bgOps[BgOpNum];
+	uint32_t  m_sampleRate;
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_table_stats_hpp__
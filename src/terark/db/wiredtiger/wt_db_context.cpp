@@ -3,6 +3,65 @@
 namespace terark { namespace db { namespace wt {
 
 namespace fs = boost::filesystem;
+
+WtCursorPool::WtCursorPool() {
+	m_conn = NULL;
+}
+WtCursorPool::~WtCursorPool() {
+	for (WT_CURSOR* cursor : m_idle) {
+		WT_SESSION* session = cursor->session;
+		cursor->close(cursor);
+		session->close(session, NULL);
+	}
+}
+
+void WtCursorPool::init(WT_CONNECTION* conn, const std::string& uri, const char* config) {
+	assert(NULL == m_conn);
+	m_conn = conn;
+	m_uri = uri;
+	m_config = config ? config : "";
+}
+
+WT_CURSOR* WtCursorPool::pop() {
+	{
+		tbb::mutex::scoped_lock lock(m_mutex);
+		if (!m_idle.empty())
+			return m_idle.pop_val();
+	}
+	WT_SESSION* session;
+	int err = m_conn->open_session(m_conn, NULL, NULL, &session);
+	if (err) {
+		THROW_STD(invalid_argument
+			, "FATAL: wiredtiger open session(dir=%s) = %s"
+			, m_conn->get_home(m_conn), wiredtiger_strerror(err)
+			);
+	}
+	WT_CURSOR* cursor;
+	const char* config = m_config.empty() ? NULL : m_config.c_str();
+	err = session->open_cursor(session, m_uri.c_str(), NULL, config, &cursor);
+	if (err) {
+		std::string msg = session->strerror(session, err);
+		session->close(session, NULL);
+		THROW_STD(invalid_argument
+			, "ERROR: wiredtiger open_cursor(uri=%s, config=%s) = %s"
+			, m_uri.c_str(), m_config.c_str(), msg.c_str());
+	}
+	return cursor;
+}
+
+void WtCursorPool::push(WT_CURSOR* cursor) {
+	cursor->reset(cursor);
+	{
+		tbb::mutex::scoped_lock lock(m_mutex);
+		if (m_idle.size() < MaxIdle) {
+			m_idle.push_back(cursor);
+			return;
+		}
+	}
+	WT_SESSION* session = cursor->session;
+	cursor->close(cursor);
+	session->close(session, NULL);
+}
 /*
 WtContext::WtContext(const CompositeTable* tab) : DbContext(tab) {
 	wtSession = NULL;
@@ -1,10 +1,42 @@
 #pragma once
 
 #include <terark/db/db_table.hpp>
+#include <tbb/mutex.h>
 #include <wiredtiger.h>
 
 namespace terark { namespace db { namespace wt {
 
+// Cursors, each of which has its own WT_SESSION(which is not thread safe).
+// A caller pops a cursor, uses it and pushes it back, so concurrent calls
+// do not serialize on one session, the mutex is held just for pop/push.
+// Number of cursors grows to the max concurrency, idle cursors more than
+// MaxIdle are closed.
+class TERARK_DB_DLL WtCursorPool : boost::noncopyable {
+	enum { MaxIdle = 64 };
+	WT_CONNECTION* m_conn;
+	std::string    m_uri;
+	std::string    m_config;
+	tbb::mutex     m_mutex;
+	valvec<WT_CURSOR*> m_idle;
+public:
+	WtCursorPool();
+	~WtCursorPool();
+	void init(WT_CONNECTION*, const std::string& uri, const char* config);
+	WT_CONNECTION* conn() const { return m_conn; }
+	WT_CURSOR* pop();
+	void push(WT_CURSOR*); // cursor will be reset
+
+	class Guard : boost::noncopyable {
+		WtCursorPool* m_pool;
+		WT_CURSOR*    m_cursor;
+	public:
+		explicit Guard(WtCursorPool& pool) : m_pool(&pool), m_cursor(pool.pop()) {}
+		~Guard() { m_pool->push(m_cursor); }
+		operator WT_CURSOR*() const { return m_cursor; }
+		WT_CURSOR* operator->() const { return m_cursor; }
+	};
+};
+
 /*
 class TERARK_DB_DLL WtContext : public DbContext {
 public:
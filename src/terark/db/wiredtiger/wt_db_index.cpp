@@ -23,21 +23,7 @@ protected:
 	MyIndexIterBase(const WtWritableIndex* owner) {
 		m_isUniqueInSchema = owner->m_schema->m_isUnique;
 		m_index.reset(const_cast<WtWritableIndex*>(owner));
-		WT_CONNECTION* conn = m_index->m_wtSession->connection;
-		WT_SESSION* session; // WT_SESSION is not thread safe
-		int err = conn->open_session(conn, NULL, NULL, &session);
-		if (err) {
-			THROW_STD(invalid_argument
-				, "FATAL: wiredtiger open session(dir=%s) = %s"
-				, conn->get_home(conn), wiredtiger_strerror(err)
-				);
-		}
-		const std::string& uri = m_index->m_uri;
-		err = session->open_cursor(session, uri.c_str(), NULL, NULL, &m_iter);
-		if (err) {
-			session->close(session, NULL);
-			THROW_STD(logic_error, "open_cursor failed: %s", wiredtiger_strerror(err));
-		}
+		m_iter = owner->m_replacePool.pop();
 		g_wtIndexIterLiveCnt++;
 		g_wtIndexIterCreatedCnt++;
 	#if !defined(NDEBUG)
@@ -46,9 +32,7 @@ protected:
 	#endif
 	}
 	~MyIndexIterBase() {
-		WT_SESSION* session = m_iter->session;
-		m_iter->close(m_iter);
-		session->close(session, NULL);
+		m_index->m_replacePool.push(m_iter);
 		g_wtIndexIterLiveCnt--;
 	}
 	void reset() override {
@@ -432,37 +416,23 @@ WtWritableIndex::WtWritableIndex(const Schema& schema, WT_CONNECTION* conn) {
 			, conn->get_home(conn), wiredtiger_strerror(err)
 			);
 	}
-	err = session->open_cursor(session,
-			m_uri.c_str(), NULL, "overwrite=true", &m_wtReplace);
-	if (err) {
-		session->close(session, NULL);
-		THROW_STD(logic_error, "open_cursor failed: %s", wiredtiger_strerror(err));
-	}
-	err = session->open_cursor(session,
-			m_uri.c_str(), NULL, "overwrite=false", &m_wtCursor);
-	if (err) {
-		m_wtReplace->close(m_wtReplace);
-		session->close(session, NULL);
-		THROW_STD(logic_error, "open_cursor failed: %s", wiredtiger_strerror(err));
-	}
-	this->m_wtSession = session;
+	session->close(session, NULL);
+	this->m_wtConn = conn;
+	this->m_insertPool.init(conn, m_uri, "overwrite=false");
+	this->m_replacePool.init(conn, m_uri, "overwrite=true");
+	this->m_indexStorageSize = 0;
 	this->m_isUnique = schema.m_isUnique;
 	this->m_schema = &schema;
 }
 
 WtWritableIndex::~WtWritableIndex() {
-	m_wtCursor->close(m_wtCursor);
-	m_wtReplace->close(m_wtReplace);
-	m_wtSession->close(m_wtSession, NULL);
 }
 
 IndexIterator* WtWritableIndex::createIndexIterForward(DbContext*) const {
-	tbb::mutex::scoped_lock lock(m_wtMutex);
 	return new MyIndexIterForward(this);
 }
 
 IndexIterator* WtWritableIndex::createIndexIterBackward(DbContext*) const {
-	tbb::mutex::scoped_lock lock(m_wtMutex);
 	return new MyIndexIterBackward(this);
 }
 
@@ -476,8 +446,7 @@ void WtWritableIndex::save(PathRef path1) const {
 }
 
 void WtWritableIndex::load(PathRef path1) {
-	WT_CONNECTION* conn = m_wtSession->connection;
-	boost::filesystem::path segDir = conn->get_home(conn);
+	boost::filesystem::path segDir = m_wtConn->get_home(m_wtConn);
 	auto fpath = segDir / m_uri.substr(6); // remove beginning "table:"
 	m_indexStorageSize = boost::filesystem::file_size(fpath);
 }
@@ -487,10 +456,10 @@ llong WtWritableIndex::indexStorageSize() const {
 }
 
 bool WtWritableIndex::insert(fstring key, llong id, DbContext* ctx) {
-	tbb::mutex::scoped_lock lock(m_wtMutex);
+	WtCursorPool::Guard cursor(m_insertPool);
 	WT_ITEM item;
-	setKeyVal(m_wtCursor, key, id, &item, &ctx->buf1);
-	int err = m_wtCursor->insert(m_wtCursor);
+	setKeyVal(cursor, key, id, &item, &ctx->buf1);
+	int err = cursor->insert(cursor);
 	if (err == WT_DUPLICATE_KEY) {
 	//	fprintf(stderr, "wiredtiger dupkey: %s\n", m_schema->toJsonStr(key).c_str());
 		return false;
@@ -498,7 +467,7 @@ bool WtWritableIndex::insert(fstring key, llong id, DbContext* ctx) {
 	if (err) {
 		THROW_STD(invalid_argument
 			, "FATAL: wiredtiger insert(dir=%s, uri=%s, key=%s) = %s"
-			, m_wtSession->connection->get_home(m_wtSession->connection)
+			, m_wtConn->get_home(m_wtConn)
 			, m_uri.c_str(), m_schema->toJsonStr(key).c_str()
 			, wiredtiger_strerror(err)
 			);
@@ -508,8 +477,7 @@ bool WtWritableIndex::insert(fstring key, llong id, DbContext* ctx) {
 }
 
 bool WtWritableIndex::replace(fstring key, llong oldId, llong newId, DbContext* ctx) {
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	WT_CURSOR* cursor = m_wtReplace;
+	WtCursorPool::Guard cursor(m_replacePool);
 	WT_ITEM item;
 	if (!m_isUnique) {
 		setKeyVal(cursor, key, oldId, &item, &ctx->buf1);
@@ -521,10 +489,9 @@ bool WtWritableIndex::replace(fstring key, llong oldId, llong newId, DbContext*
 		return false;
 	}
 	if (err) {
-		WT_CONNECTION* conn = m_wtSession->connection;
 		THROW_STD(invalid_argument
 			, "FATAL: wiredtiger replace(dir=%s, uri=%s, key=%s) = %s"
-			, conn->get_home(conn)
+			, m_wtConn->get_home(m_wtConn)
 			, m_uri.c_str(), m_schema->toJsonStr(key).c_str()
 			, wiredtiger_strerror(err)
 			);
@@ -607,10 +574,10 @@ const {
 }
 
 bool WtWritableIndex::remove(fstring key, llong id, DbContext* ctx) {
-	tbb::mutex::scoped_lock lock(m_wtMutex);
+	WtCursorPool::Guard cursor(m_insertPool);
 	WT_ITEM item;
-	setKeyVal(m_wtCursor, key, id, &item, &ctx->buf1);
-	int err = m_wtCursor->remove(m_wtCursor);
+	setKeyVal(cursor, key, id, &item, &ctx->buf1);
+	int err = cursor->remove(cursor);
 	if (WT_NOTFOUND == err) {
 		fprintf(stderr
 			, "WARN: wt_remove non-existing key = %s\n"
@@ -621,14 +588,21 @@ bool WtWritableIndex::remove(fstring key, llong id, DbContext* ctx) {
 	if (err) {
 		THROW_STD(logic_error, "remove failed: %s", wiredtiger_strerror(err));
 	}
-	m_wtCursor->reset(m_wtCursor);
 	m_indexStorageSize -= key.size() + sizeof(id); // estimate
 	return true;
 }
 
 void WtWritableIndex::clear() {
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	int err = m_wtSession->truncate(m_wtSession, m_uri.c_str(), NULL, NULL, NULL);
+	// truncate in a private session, pooled sessions have open cursors
+	WT_SESSION* session;
+	int err = m_wtConn->open_session(m_wtConn, NULL, NULL, &session);
+	if (err) {
+		THROW_STD(invalid_argument, "FATAL: wiredtiger open session(dir=%s) = %s"
+			, m_wtConn->get_home(m_wtConn), wiredtiger_strerror(err)
+			);
+	}
+	err = session->truncate(session, m_uri.c_str(), NULL, NULL, NULL);
+	session->close(session, NULL);
 	if (err != 0) {
 		THROW_STD(logic_error, "truncate failed: %s", wiredtiger_strerror(err));
 	}
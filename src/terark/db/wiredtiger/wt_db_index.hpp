@@ -1,10 +1,8 @@
 #pragma once
 
-#include <terark/db/db_table.hpp>
+#include "wt_db_context.hpp"
 #include <terark/util/fstrvec.hpp>
 #include <set>
-#include <wiredtiger.h>
-#include <tbb/mutex.h>
 
 namespace terark { namespace db { namespace wt {
 
@@ -21,13 +19,12 @@ class TERARK_DB_DLL WtWritableIndex : public ReadableIndex, public WritableIndex
 	class MyIndexIterForward;  friend class MyIndexIterForward;
 	class MyIndexIterBackward; friend class MyIndexIterBackward;
 
-	// brain dead wiredtiger api makes multi-thread code hard to write
-	// use mutex to protect wiredtiger objects
-	mutable tbb::mutex   m_wtMutex;
-	mutable WT_SESSION*  m_wtSession;
-	mutable WT_CURSOR*   m_wtCursor;
-	mutable WT_CURSOR*   m_wtReplace;
-	llong        m_indexStorageSize;
+	// WT_SESSION is not thread safe, each call uses a pooled cursor of
+	// a private session, index iterators also use pooled cursors
+	WT_CONNECTION*       m_wtConn;
+	mutable WtCursorPool m_insertPool;  // overwrite=false
+	mutable WtCursorPool m_replacePool; // overwrite=true
+	std::atomic<llong>   m_indexStorageSize;
 	size_t       m_indexId;
 	std::string  m_keyFmt;
 	std::string  m_uri;
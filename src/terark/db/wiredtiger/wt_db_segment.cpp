@@ -2,6 +2,8 @@
 #include "wt_db_index.hpp"
 #include "wt_db_store.hpp"
 #include "wt_db_context.hpp"
+#include <terark/db/write_ahead_log.hpp>
+#include <terark/io/FileStream.hpp>
 #include <boost/scope_exit.hpp>
 
 #undef min
@@ -17,6 +19,7 @@ WtWritableSegment::WtWritableSegment() {
 		m_cacheSize = (size_t)strtoull(env, NULL, 10) * 1024 * 1024;
 	}
 	m_hasLockFreePointSearch = false;
+	m_ownLog = true;
 }
 WtWritableSegment::~WtWritableSegment() {
 	m_indices.clear();
@@ -63,14 +66,44 @@ int DupableIndexKey_compare(WT_COLLATOR *collator,
 #endif
 
 void WtWritableSegment::init(PathRef segDir) {
+	namespace fs = boost::filesystem;
 	std::string strDir = segDir.string();
+	// new segments use shared WriteAheadLog if it is opened, old segments
+	// keep using the log they were created with
+	fs::path walMark = segDir / "TerarkWal";
+	if (fs::exists(walMark)) {
+		m_ownLog = false;
+		if (NULL == WriteAheadLog::global()) {
+			fprintf(stderr
+				, "WARN: wiredtiger segment %s uses shared write ahead log, "
+				  "which is not opened, data after last checkpoint is lost\n"
+				, strDir.c_str());
+		}
+	}
+	else if (WriteAheadLog::global() && !fs::exists(segDir / "WiredTiger")) {
+		m_ownLog = false;
+		FileStream markFile(walMark.string().c_str(), "w");
+	}
+	else {
+		m_ownLog = true;
+	}
 	char conf[512];
-	snprintf(conf, sizeof(conf)
-		, "create,cache_size=%zd,"
-		  "log=(enabled,recover=on),"
-		  "session_max=10000,"
-		  "checkpoint=(log_size=64MB,wait=60)"
-		, m_cacheSize);
+	if (m_ownLog) {
+		snprintf(conf, sizeof(conf)
+			, "create,cache_size=%zd,"
+			  "log=(enabled,recover=on),"
+			  "session_max=10000,"
+			  "checkpoint=(log_size=64MB,wait=60)"
+			, m_cacheSize);
+	}
+	else {
+		snprintf(conf, sizeof(conf)
+			, "create,cache_size=%zd,"
+			  "log=(enabled=false),"
+			  "session_max=10000,"
+			  "checkpoint=(wait=60)"
+			, m_cacheSize);
+	}
 	int err = wiredtiger_open(strDir.c_str(), NULL, conf, &m_wtConn);
 	if (err) {
 		THROW_STD(invalid_argument, "FATAL: wiredtiger_open(dir=%s,conf=%s) = %s"
@@ -124,7 +157,28 @@ void WtWritableSegment::save(PathRef path) const {
 	if (m_tobeDel) {
 		return; // not needed
 	}
-	m_wtConn->async_flush(m_wtConn);
+	if (m_ownLog) {
+		m_wtConn->async_flush(m_wtConn);
+		return;
+	}
+	// without wiredtiger log, a checkpoint is the only durable point,
+	// the shared log will be truncated after this
+	WT_SESSION* session = NULL;
+	int err = m_wtConn->open_session(m_wtConn, NULL, NULL, &session);
+	if (err) {
+		THROW_STD(invalid_argument, "FATAL: wiredtiger open session(dir=%s) = %s"
+			, path.string().c_str(), wiredtiger_strerror(err));
+	}
+	err = session->checkpoint(session, NULL);
+	session->close(session, NULL);
+	if (err) {
+		THROW_STD(invalid_argument, "FATAL: wiredtiger checkpoint(dir=%s) = %s"
+			, path.string().c_str(), wiredtiger_strerror(err));
+	}
+}
+
+bool WtWritableSegment::hasOwnLog() const {
+	return m_ownLog;
 }
 
 extern const char g_dataStoreUri[];
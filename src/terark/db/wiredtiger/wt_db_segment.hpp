@@ -14,6 +14,7 @@ public:
 	~WtWritableSegment();
 
 	void init(PathRef segDir);
+	bool hasOwnLog() const override;
 
 protected:
 	ReadableIndex* createIndex(const Schema&, PathRef path) const override;
@@ -27,6 +28,7 @@ public:
 	void save(PathRef path) const override;
 
 	size_t m_cacheSize;
+	bool   m_ownLog; // false if using shared WriteAheadLog
 };
 
 }}} // namespace terark::db::wt
@@ -17,25 +17,9 @@ std::atomic<size_t> g_wtStoreIterCreatedCnt;
 class WtWritableStoreIterBase : public StoreIterator {
 	WT_CURSOR* m_cursor;
 public:
-	WtWritableStoreIterBase(const WtWritableStore* store, WT_CONNECTION* conn) {
-		WT_SESSION* ses; // WT_SESSION is not thread safe
-		int err = conn->open_session(conn, NULL, NULL, &ses);
-		if (err) {
-			THROW_STD(invalid_argument
-				, "FATAL: wiredtiger open session(dir=%s) = %s"
-				, conn->get_home(conn), wiredtiger_strerror(err)
-				);
-		}
-		WT_CURSOR* cursor;
-		err = ses->open_cursor(ses, g_dataStoreUri, NULL, "overwrite=true", &cursor);
-		if (err) {
-			std::string msg = ses->strerror(ses, err);
-			ses->close(ses, NULL);
-			THROW_STD(invalid_argument,
-				"ERROR: wiredtiger store open forward cursor: %s", msg.c_str());
-		}
+	explicit WtWritableStoreIterBase(const WtWritableStore* store) {
+		m_cursor = store->m_replacePool.pop();
 		m_store.reset(const_cast<WtWritableStore*>(store));
-		m_cursor = cursor;
 		g_wtStoreIterLiveCnt++;
 		g_wtStoreIterCreatedCnt++;
 	#if !defined(NDEBUG)
@@ -44,9 +28,8 @@ public:
 	#endif
 	}
 	~WtWritableStoreIterBase() {
-		WT_SESSION* session = m_cursor->session;
-		m_cursor->close(m_cursor);
-		session->close(session, NULL);
+		auto store = static_cast<WtWritableStore*>(m_store.get());
+		store->m_replacePool.push(m_cursor);
 		g_wtStoreIterLiveCnt--;
 	}
 	virtual int advance(WT_CURSOR*) = 0;
@@ -106,16 +89,16 @@ public:
 	virtual int advance(WT_CURSOR* cursor) override {
 		return cursor->next(cursor);
 	}
-	WtWritableStoreIterForward(const WtWritableStore* store, WT_CONNECTION* conn)
-		: WtWritableStoreIterBase(store, conn) {}
+	explicit WtWritableStoreIterForward(const WtWritableStore* store)
+		: WtWritableStoreIterBase(store) {}
 };
 class WtWritableStoreIterBackward : public WtWritableStoreIterBase {
 public:
 	virtual int advance(WT_CURSOR* cursor) override {
 		return cursor->prev(cursor);
 	}
-	WtWritableStoreIterBackward(const WtWritableStore* store, WT_CONNECTION* conn)
-		: WtWritableStoreIterBase(store, conn) {}
+	explicit WtWritableStoreIterBackward(const WtWritableStore* store)
+		: WtWritableStoreIterBase(store) {}
 };
 
 WtWritableStore::WtWritableStore(WT_CONNECTION* conn) {
@@ -135,68 +118,47 @@ WtWritableStore::WtWritableStore(WT_CONNECTION* conn) {
 			, conn->get_home(conn), wiredtiger_strerror(err)
 			);
 	}
-	m_wtSession = session;
-	m_wtCursor = NULL;
-	m_wtAppend = NULL;
+	session->close(session, NULL);
+	m_wtConn = conn;
+	m_replacePool.init(conn, g_dataStoreUri, "overwrite=true");
+	m_appendPool.init(conn, g_dataStoreUri, "append");
 	m_dataSize = 0;
 	m_lastSyncedDataSize = 0;
 }
 WtWritableStore::~WtWritableStore() {
-	if (m_wtCursor)
-		m_wtCursor->close(m_wtCursor);
-	if (m_wtAppend)
-		m_wtAppend->close(m_wtAppend);
-	m_wtSession->close(m_wtSession, NULL);
 }
 
 void WtWritableStore::estimateIncDataSize(llong sizeDiff) {
 	if (std::abs(m_dataSize - m_lastSyncedDataSize) > 10*1024*1024) {
-		WT_CONNECTION* conn = m_wtSession->connection;
-		boost::filesystem::path fpath = conn->get_home(conn);
+		boost::filesystem::path fpath = m_wtConn->get_home(m_wtConn);
 		fpath /= "__BlobStore__.wt";
 		m_dataSize = boost::filesystem::file_size(fpath);
-		m_lastSyncedDataSize = m_dataSize;
+		m_lastSyncedDataSize = m_dataSize.load();
 	}
 	else {
 		m_dataSize += sizeDiff;
 	}
 }
 
-WT_CURSOR* WtWritableStore::getReplaceCursor() const {
-	if (NULL == m_wtCursor) {
-		int err = m_wtSession->open_cursor(m_wtSession, g_dataStoreUri, NULL, NULL, &m_wtCursor);
-		if (err) {
-			auto msg = m_wtSession->strerror(m_wtSession, err);
-			THROW_STD(invalid_argument,
-				"ERROR: wiredtiger store open_cursor for replace: %s", msg);
-		}
-	}
-	return m_wtCursor;
-}
-
-WT_CURSOR* WtWritableStore::getAppendCursor() const {
-	if (NULL == m_wtAppend) {
-		int err = m_wtSession->open_cursor(m_wtSession, g_dataStoreUri, NULL, "append", &m_wtAppend);
-		if (err) {
-			auto msg = m_wtSession->strerror(m_wtSession, err);
-			THROW_STD(invalid_argument,
-				"ERROR: wiredtiger store open_cursor for append: %s", msg);
-		}
-	}
-	return m_wtAppend;
-}
-
 void WtWritableStore::save(PathRef path1) const {
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	m_wtSession->checkpoint(m_wtSession, NULL);
+	// checkpoint in a private session, pooled sessions have open cursors
+	WT_SESSION* session;
+	int err = m_wtConn->open_session(m_wtConn, NULL, NULL, &session);
+	if (err) {
+		THROW_STD(invalid_argument
+			, "FATAL: wiredtiger open session(dir=%s) = %s"
+			, m_wtConn->get_home(m_wtConn), wiredtiger_strerror(err)
+			);
+	}
+	session->checkpoint(session, NULL);
+	session->close(session, NULL);
 }
 
 void WtWritableStore::load(PathRef path1) {
-	WT_CONNECTION* conn = m_wtSession->connection;
-	boost::filesystem::path segDir = conn->get_home(conn);
+	boost::filesystem::path segDir = m_wtConn->get_home(m_wtConn);
 	auto dataFile = segDir / "__BlobStore__.wt";
 	m_dataSize = boost::filesystem::file_size(dataFile);
-	m_lastSyncedDataSize = m_dataSize;
+	m_lastSyncedDataSize = m_dataSize.load();
 }
 
 llong WtWritableStore::dataStorageSize() const {
@@ -208,8 +170,7 @@ llong WtWritableStore::dataInflateSize() const {
 }
 
 llong WtWritableStore::numDataRows() const {
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	WT_CURSOR* cursor = getReplaceCursor();
+	WtCursorPool::Guard cursor(m_replacePool);
 	cursor->set_key(cursor, LLONG_MAX);
 	int cmp;
 	int err = cursor->search_near(cursor, &cmp);
@@ -217,12 +178,12 @@ llong WtWritableStore::numDataRows() const {
 		return 0;
 	}
 	if (err) {
+		WT_SESSION* ses = cursor->session;
 		THROW_STD(invalid_argument, "wiredtiger search near failed: %s"
-			, m_wtSession->strerror(m_wtSession, err));
+			, ses->strerror(ses, err));
 	}
 	llong recno;
 	cursor->get_key(cursor, &recno);
-	cursor->reset(cursor);
 	return recno; // max recno is the rows
 }
 
@@ -232,8 +193,7 @@ const {
 //	WtContext* ctx = dynamic_cast<WtContext*>(ctx0);
 //	TERARK_RT_assert(NULL != ctx, std::invalid_argument);
 	llong recno = id + 1;
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	auto cursor = getReplaceCursor();
+	WtCursorPool::Guard cursor(m_replacePool);
 	auto ses = cursor->session;
 	auto conn = ses->connection;
 	cursor->set_key(cursor, recno);
@@ -252,22 +212,20 @@ const {
 	WT_ITEM item;
 	cursor->get_value(cursor, &item);
 	val->append((const byte*)item.data, item.size);
-	cursor->reset(cursor);
 }
 
 StoreIterator* WtWritableStore::createStoreIterForward(DbContext*) const {
-	return new WtWritableStoreIterForward(this, m_wtSession->connection);
+	return new WtWritableStoreIterForward(this);
 }
 
 StoreIterator* WtWritableStore::createStoreIterBackward(DbContext*) const {
-	return new WtWritableStoreIterBackward(this, m_wtSession->connection);
+	return new WtWritableStoreIterBackward(this);
 }
 
 llong WtWritableStore::append(fstring row, DbContext* ctx0) {
 //	WtContext* ctx = dynamic_cast<WtContext*>(ctx0);
 //	TERARK_RT_assert(NULL != ctx, std::invalid_argument);
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	auto cursor = getAppendCursor();
+	WtCursorPool::Guard cursor(m_appendPool);
 	WT_ITEM item;
 	memset(&item, 0, sizeof(item));
 	item.data = row.data();
@@ -275,9 +233,10 @@ llong WtWritableStore::append(fstring row, DbContext* ctx0) {
 	cursor->set_value(cursor, &item);
 	int err = cursor->insert(cursor);
 	if (err) {
+		WT_SESSION* ses = cursor->session;
 		THROW_STD(invalid_argument
 			, "wiredtiger append failed, err=%s, row=%s"
-			, m_wtSession->strerror(m_wtSession, err)
+			, ses->strerror(ses, err)
 			, ctx0->m_tab->rowSchema().toJsonStr(row).c_str()
 			);
 	}
@@ -292,8 +251,7 @@ void WtWritableStore::update(llong id, fstring row, DbContext* ctx0) {
 //	WtContext* ctx = dynamic_cast<WtContext*>(ctx0);
 //	TERARK_RT_assert(NULL != ctx, std::invalid_argument);
 	llong recno = id + 1;
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	auto cursor = getReplaceCursor();
+	WtCursorPool::Guard cursor(m_replacePool);
 	WT_ITEM item;
 	memset(&item, 0, sizeof(item));
 	item.data = row.data();
@@ -302,9 +260,10 @@ void WtWritableStore::update(llong id, fstring row, DbContext* ctx0) {
 	cursor->set_value(cursor, &item);
 	int err = cursor->insert(cursor);
 	if (err) {
+		WT_SESSION* ses = cursor->session;
 		THROW_STD(invalid_argument
 			, "wiredtiger replace failed, err=%s, row=%s"
-			, m_wtSession->strerror(m_wtSession, err)
+			, ses->strerror(ses, err)
 			, ctx0->m_tab->rowSchema().toJsonStr(row).c_str()
 			);
 	}
@@ -320,21 +279,20 @@ void WtWritableStore::remove(llong id, DbContext* ctx0) {
 	update(id, emptyValue, ctx0);
 #else
 	llong recno = id + 1;
-	tbb::mutex::scoped_lock lock(m_wtMutex);
-	auto cursor = getReplaceCursor();
+	WtCursorPool::Guard cursor(m_replacePool);
 	cursor->set_key(cursor, recno);
 	int err = cursor->remove(cursor);
 	if (err) {
 		if (WT_NOTFOUND != err) {
+			WT_SESSION* ses = cursor->session;
 			THROW_STD(invalid_argument
 				, "wiredtiger remove failed, err=%s"
-				, m_wtSession->strerror(m_wtSession, err)
+				, ses->strerror(ses, err)
 				);
 		} else {
 			fprintf(stderr, "WARN: WtWritableStore::remove: recno=%lld not found", recno);
 		}
 	}
-	cursor->reset(cursor);
 #endif
 }
 
@@ -343,7 +301,6 @@ void WtWritableStore::shrinkToFit() {
 }
 /*
 void WtWritableStore::clear() {
-	tbb::mutex::scoped_lock lock(m_wtMutex);
 	m_wtSession->truncate(m_wtSession, g_dataStoreUri, NULL, NULL, NULL);
 }
 */
@@ -1,26 +1,22 @@
 #pragma once
 
-#include <terark/db/db_table.hpp>
+#include "wt_db_context.hpp"
 #include <terark/util/fstrvec.hpp>
 #include <set>
-#include <tbb/mutex.h>
-#include <wiredtiger.h>
 
 namespace terark { namespace db { namespace wt {
 
 class TERARK_DB_DLL WtWritableStore : public ReadableStore, public WritableStore {
 
-	// brain dead wiredtiger api makes multi-thread code hard to write
-	// use mutex to protect wiredtiger objects
-	mutable tbb::mutex   m_wtMutex;
-	mutable WT_SESSION*  m_wtSession;
-	mutable WT_CURSOR*   m_wtCursor;
-	mutable WT_CURSOR*   m_wtAppend;
-	llong m_lastSyncedDataSize;
-	llong m_dataSize;
-
-	WT_CURSOR* getReplaceCursor() const;
-	WT_CURSOR* getAppendCursor() const;
+	// WT_SESSION is not thread safe, each call uses a pooled cursor of
+	// a private session, store iterators(which are cached by DbContext
+	// for point search of the writable segment) also use pooled cursors
+	friend class WtWritableStoreIterBase;
+	WT_CONNECTION*       m_wtConn;
+	mutable WtCursorPool m_replacePool;
+	mutable WtCursorPool m_appendPool;
+	std::atomic<llong> m_lastSyncedDataSize;
+	std::atomic<llong> m_dataSize;
 
 public:
 	WtWritableStore(WT_CONNECTION* conn);
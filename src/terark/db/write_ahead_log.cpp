@@ -0,0 +1,590 @@
+#include "write_ahead_log.hpp"
+#include <terark/io/FileStream.hpp>
+#include <terark/io/var_int.hpp>
+#include <terark/util/profiling.hpp>
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <random>
+#include "json.hpp"
+
+#if defined(_MSC_VER)
+	#include <io.h>
+	#define fsync _commit
+#else
+	#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef O_BINARY
+	#define O_BINARY 0
+#endif
+
+namespace terark { namespace db {
+
+namespace fs = boost::filesystem;
+
+static profiling g_walpf;
+
+// record: uint32 payloadLen, uint32 crc32c(payload), payload
+// payload: byte type, uint64 lsn, uint64 segUid, ops(RecTxn only)
+// RecAbort : lsn is the aborted RecTxn, segUid is 0
+// RecDetach: segUid is saved or dropped, its older records are obsolete
+enum { RecTxn = 1, RecAbort = 2, RecDetach = 3 };
+static const size_t RecHeaderLen = 8;
+static const size_t RecPayloadMin = 17;
+
+static uint32_t crc32c(const byte* p, size_t n) {
+	static uint32_t table[256];
+	static bool inited = [] {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+			table[i] = c;
+		}
+		return true;
+	}();
+	(void)inited;
+	uint32_t c = 0xFFFFFFFF;
+	for (size_t i = 0; i < n; ++i)
+		c = table[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+	return ~c;
+}
+
+WriteAheadLog::Options::Options() {
+	syncMode = SyncPerCommit;
+	syncIntervalMs = 100;
+	maxFileSize = 64 << 20;
+}
+
+WriteAheadLog::Options WriteAheadLog::Options::fromEnv() {
+	Options opt;
+	if (const char* env = getenv("TerarkDB_WalSyncMode")) {
+		if (strcasecmp(env, "commit") == 0)
+			opt.syncMode = SyncPerCommit;
+		else if (strcasecmp(env, "interval") == 0)
+			opt.syncMode = SyncInterval;
+		else if (strcasecmp(env, "none") == 0)
+			opt.syncMode = SyncNone;
+		else
+			fprintf(stderr, "WARN: TerarkDB_WalSyncMode=%s is invalid, use commit\n", env);
+	}
+	if (const char* env = getenv("TerarkDB_WalSyncIntervalMs")) {
+		opt.syncIntervalMs = std::max(atoi(env), 1);
+	}
+	if (const char* env = getenv("TerarkDB_WalFileSize")) {
+		opt.maxFileSize = std::max<llong>(atoll(env), 1 << 20);
+	}
+	return opt;
+}
+
+static std::mutex     g_walMutex;
+static WriteAheadLog* g_wal = NULL;
+
+void WriteAheadLog::openGlobal(PathRef dir, const Options& opt) {
+	std::lock_guard<std::mutex> lock(g_walMutex);
+	if (g_wal) {
+		THROW_STD(invalid_argument, "global WriteAheadLog is already opened: %s"
+			, g_wal->m_dir.c_str());
+	}
+	g_wal = new WriteAheadLog(dir, opt);
+}
+void WriteAheadLog::closeGlobal() {
+	std::lock_guard<std::mutex> lock(g_walMutex);
+	delete g_wal;
+	g_wal = NULL;
+}
+WriteAheadLog* WriteAheadLog::global() {
+	return g_wal;
+}
+
+WriteAheadLog::WriteAheadLog(PathRef dir, const Options& opt) {
+	m_dir = dir.string();
+	m_opt = opt;
+	m_appendedLsn = 0;
+	m_writtenLsn = 0;
+	m_syncedLsn = 0;
+	m_appendedPos = 0;
+	m_writtenPos = 0;
+	m_syncedPos = 0;
+	m_leaderActive = false;
+	m_stop = false;
+	m_fd = -1;
+	m_curFileNo = 0;
+	m_minFileNo = 0;
+	m_fileBytes = 0;
+	m_commitCnt = 0;
+	m_writeCnt = 0;
+	m_syncCnt = 0;
+	m_bytesWritten = 0;
+	m_syncMs = 0;
+	m_replayedOps = 0;
+	fs::create_directories(dir);
+	scanOldFiles();
+	m_firstNewFileNo = m_curFileNo;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		openNewFileInLock();
+		purgeFilesInLock();
+	}
+	if (SyncPerCommit != m_opt.syncMode) {
+		m_syncThread = std::thread(&WriteAheadLog::syncThreadProc, this);
+	}
+	fprintf(stderr, "INFO: WriteAheadLog(%s): syncMode=%d, lsn=%llu, files=[%lld, %lld]\n"
+		, m_dir.c_str(), m_opt.syncMode, (unsigned long long)m_appendedLsn
+		, m_minFileNo, m_curFileNo);
+}
+
+WriteAheadLog::~WriteAheadLog() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		m_cond.notify_all();
+	}
+	if (m_syncThread.joinable())
+		m_syncThread.join();
+	try {
+		sync();
+	}
+	catch (const std::exception& ex) {
+		fprintf(stderr, "ERROR: ~WriteAheadLog(%s): sync: %s\n"
+			, m_dir.c_str(), ex.what());
+	}
+	::close(m_fd);
+}
+
+std::string WriteAheadLog::getFilePath(llong fileNo) const {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "/wal-%08lld.log", fileNo);
+	return m_dir + buf;
+}
+
+static void readWholeFile(const std::string& fpath, valvec<byte>* data) {
+	FileStream fp(fpath.c_str(), "rb");
+	fp.disbuf();
+	data->resize_no_init(fp.size());
+	fp.ensureRead(data->data(), data->size());
+}
+
+// calls fn(type, lsn, segUid, ops) for each valid record
+template<class OnRecord>
+static size_t parseRecords(const valvec<byte>& data, OnRecord fn) {
+	size_t pos = 0;
+	while (pos + RecHeaderLen <= data.size()) {
+		uint32_t len = unaligned_load<uint32_t>(data.data() + pos);
+		uint32_t crc = unaligned_load<uint32_t>(data.data() + pos + 4);
+		const byte* payload = data.data() + pos + RecHeaderLen;
+		if (len < RecPayloadMin || pos + RecHeaderLen + len > data.size())
+			break;
+		if (crc32c(payload, len) != crc)
+			break;
+		byte type = payload[0];
+		uint64_t lsn = unaligned_load<uint64_t>(payload + 1);
+		uint64_t segUid = unaligned_load<uint64_t>(payload + 9);
+		fn(type, lsn, segUid, fstring(payload + RecPayloadMin, len - RecPayloadMin));
+		pos += RecHeaderLen + len;
+	}
+	return pos;
+}
+
+void WriteAheadLog::scanOldFiles() {
+	valvec<llong> fileNoVec;
+	for (auto& ent : fs::directory_iterator(m_dir)) {
+		std::string fname = ent.path().filename().string();
+		llong fileNo = -1;
+		if (sscanf(fname.c_str(), "wal-%lld.log", &fileNo) == 1 && fileNo >= 0)
+			fileNoVec.push_back(fileNo);
+	}
+	std::sort(fileNoVec.begin(), fileNoVec.end());
+	valvec<byte> data;
+	for (llong fileNo : fileNoVec) {
+		std::string fpath = getFilePath(fileNo);
+		readWholeFile(fpath, &data);
+		size_t valid = parseRecords(data,
+			[&](byte type, uint64_t lsn, uint64_t segUid, fstring) {
+				if (RecTxn == type) {
+					auto ib = m_segs.insert(std::make_pair(segUid, SegInfo()));
+					if (ib.second) {
+						ib.first->second.firstFileNo = fileNo;
+						ib.first->second.attached = false;
+					}
+				}
+				else if (RecAbort == type) {
+					m_aborted.insert(lsn);
+				}
+				else if (RecDetach == type) {
+					m_segs.erase(segUid);
+				}
+				m_appendedLsn = std::max(m_appendedLsn, lsn);
+			});
+		if (valid != data.size()) {
+			fprintf(stderr
+				, "WARN: WriteAheadLog: %s: ignore broken tail at %zd, file size = %zd\n"
+				, fpath.c_str(), valid, data.size());
+		}
+	}
+	if (!fileNoVec.empty()) {
+		m_minFileNo = fileNoVec[0];
+		m_curFileNo = fileNoVec.back() + 1;
+	}
+	m_writtenLsn = m_syncedLsn = m_appendedLsn;
+}
+
+void WriteAheadLog::openNewFileInLock() {
+	std::string fpath = getFilePath(m_curFileNo);
+	m_fd = ::open(fpath.c_str(), O_WRONLY|O_CREAT|O_APPEND|O_BINARY, 0644);
+	if (m_fd < 0) {
+		THROW_STD(runtime_error, "FATAL: open(%s) = %s", fpath.c_str(), strerror(errno));
+	}
+	m_fileBytes = 0;
+}
+
+void WriteAheadLog::purgeFilesInLock() {
+	llong minPinned = m_curFileNo;
+	for (auto& kv : m_segs) {
+		if (kv.second.firstFileNo >= 0)
+			minPinned = std::min(minPinned, kv.second.firstFileNo);
+	}
+	for (; m_minFileNo < minPinned; ++m_minFileNo) {
+		std::string fpath = getFilePath(m_minFileNo);
+		boost::system::error_code ec;
+		fs::remove(fpath, ec);
+		if (ec) {
+			fprintf(stderr, "WARN: WriteAheadLog: remove(%s) = %s\n"
+				, fpath.c_str(), ec.message().c_str());
+		}
+	}
+}
+
+void WriteAheadLog::encodePut(valvec<byte>* ops, llong subId, fstring row) {
+	byte* p = ops->grow_no_init(1 + 10 + 10);
+	p[0] = OpPut;
+	p = save_var_uint64(p + 1, uint64_t(subId));
+	p = save_var_uint64(p, row.size());
+	ops->risk_set_size(p - ops->data());
+	ops->append(row.udata(), row.size());
+}
+
+void WriteAheadLog::encodeRemove(valvec<byte>* ops, llong subId) {
+	byte* p = ops->grow_no_init(1 + 10);
+	p[0] = OpRemove;
+	p = save_var_uint64(p + 1, uint64_t(subId));
+	ops->risk_set_size(p - ops->data());
+}
+
+static void fsyncPath(const std::string& fpath, bool isDir) {
+#if defined(_MSC_VER)
+	if (isDir)
+		return; // can not open a dir on windows
+	int fd = ::_open(fpath.c_str(), _O_RDWR|_O_BINARY);
+#else
+	int fd = ::open(fpath.c_str(), isDir ? O_RDONLY : O_RDWR);
+#endif
+	if (fd < 0) {
+		THROW_STD(runtime_error, "FATAL: open(%s) = %s", fpath.c_str(), strerror(errno));
+	}
+	int err = ::fsync(fd) == 0 ? 0 : errno;
+	::close(fd);
+	if (err) {
+		THROW_STD(runtime_error, "FATAL: fsync(%s) = %s", fpath.c_str(), strerror(err));
+	}
+}
+
+static void fsyncParentDir(PathRef fpath) {
+	fs::path parent = fpath.parent_path();
+	fsyncPath(parent.empty() ? "." : parent.string(), true);
+}
+
+void WriteAheadLog::syncDir(PathRef dir) {
+	for (auto& ent : fs::recursive_directory_iterator(dir)) {
+		fsyncPath(ent.path().string(), fs::is_directory(ent.status()));
+	}
+	fsyncPath(dir.string(), true);
+	fsyncParentDir(dir); // for rename into parent
+}
+
+// if segDir/WalSegUid is lost by a crash, logged ops of the segment can
+// not be found, so it must be durable before any op is logged
+uint64_t WriteAheadLog::getSegmentUid(PathRef segDir) {
+	std::string fpath = (segDir / "WalSegUid").string();
+	uint64_t uid = 0;
+	if (fs::exists(fpath)) {
+		FileStream fp(fpath.c_str(), "rb");
+		fp.ensureRead(&uid, sizeof(uid));
+	}
+	else {
+		std::random_device rd;
+		uid = (uint64_t(rd()) << 32 | rd())
+			^ uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+		uid += !uid; // 0 is reserved
+		{
+			FileStream fp(fpath.c_str(), "wb");
+			fp.ensureWrite(&uid, sizeof(uid));
+		}
+		fsyncPath(fpath, false);
+		fsyncPath(segDir.string(), true);
+		fsyncParentDir(segDir);
+	}
+	return uid;
+}
+
+void WriteAheadLog::attachSegment(uint64_t segUid) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto ib = m_segs.insert(std::make_pair(segUid, SegInfo()));
+	if (ib.second) {
+		ib.first->second.firstFileNo = -1;
+	}
+	ib.first->second.attached = true;
+}
+
+void WriteAheadLog::detachSegment(uint64_t segUid) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto iter = m_segs.find(segUid);
+	if (m_segs.end() == iter)
+		return;
+	if (iter->second.firstFileNo >= 0)
+		appendRecordInLock(RecDetach, m_appendedLsn, segUid, fstring());
+	m_segs.erase(iter);
+	purgeFilesInLock();
+}
+
+void WriteAheadLog::appendRecordInLock(byte type, uint64_t lsn,
+									   uint64_t segUid, fstring ops) {
+	size_t len = RecPayloadMin + ops.size();
+	size_t oldsize = m_buf.size();
+	byte* p = m_buf.grow_no_init(RecHeaderLen + len);
+	byte* payload = p + RecHeaderLen;
+	payload[0] = type;
+	unaligned_save<uint64_t>(payload + 1, lsn);
+	unaligned_save<uint64_t>(payload + 9, segUid);
+	memcpy(payload + RecPayloadMin, ops.data(), ops.size());
+	unaligned_save<uint32_t>(p, uint32_t(len));
+	unaligned_save<uint32_t>(p + 4, crc32c(payload, len));
+	m_fileBytes += m_buf.size() - oldsize;
+	m_appendedPos += m_buf.size() - oldsize;
+}
+
+uint64_t WriteAheadLog::append(uint64_t segUid, fstring ops) {
+	assert(0 != segUid);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	uint64_t lsn = ++m_appendedLsn;
+	appendRecordInLock(RecTxn, lsn, segUid, ops);
+	SegInfo& seg = m_segs[segUid];
+	if (seg.firstFileNo < 0)
+		seg.firstFileNo = m_curFileNo;
+	m_commitCnt++;
+	return lsn;
+}
+
+// the abort mark must be as durable as a commit before the failure is
+// reported, else a crash could replay the failed transaction
+void WriteAheadLog::abort(uint64_t lsn) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	appendRecordInLock(RecAbort, lsn, 0, fstring());
+	const uint64_t pos = m_appendedPos;
+	while (durablePosInLock() < pos) {
+		if (m_leaderActive)
+			m_cond.wait(lock);
+		else
+			flushAsLeader(lock, SyncPerCommit == m_opt.syncMode);
+	}
+}
+
+uint64_t WriteAheadLog::durableLsnInLock() const {
+	switch (m_opt.syncMode) {
+	default:
+	case SyncPerCommit: return m_syncedLsn;
+	case SyncInterval : return m_writtenLsn;
+	case SyncNone     : return m_appendedLsn;
+	}
+}
+
+// abort and detach records have no lsn of their own, they are tracked
+// by their end position in the byte stream of the log
+uint64_t WriteAheadLog::durablePosInLock() const {
+	switch (m_opt.syncMode) {
+	default:
+	case SyncPerCommit: return m_syncedPos;
+	case SyncInterval : return m_writtenPos;
+	case SyncNone     : return m_appendedPos;
+	}
+}
+
+static void writeAll(int fd, const byte* p, size_t n) {
+	while (n) {
+		auto len = ::write(fd, p, n);
+		if (len < 0) {
+			if (EINTR == errno)
+				continue;
+			THROW_STD(runtime_error, "FATAL: WriteAheadLog write = %s", strerror(errno));
+		}
+		p += len;
+		n -= len;
+	}
+}
+
+// the leader writes(and fsyncs) the buffer out of the lock, followers
+// append to the new buffer and wait for the next batch
+void WriteAheadLog::flushAsLeader(std::unique_lock<std::mutex>& lock, bool doSync) {
+	assert(!m_leaderActive);
+	m_leaderActive = true;
+	try {
+		for (;;) {
+			m_spare.erase_all();
+			m_spare.swap(m_buf);
+			const uint64_t upto = m_appendedLsn;
+			const uint64_t uptoPos = m_appendedPos;
+			const int fd = m_fd;
+			lock.unlock();
+			llong t0 = g_walpf.now();
+			writeAll(fd, m_spare.data(), m_spare.size());
+			if (doSync && ::fsync(fd) != 0) {
+				THROW_STD(runtime_error, "FATAL: WriteAheadLog fsync = %s", strerror(errno));
+			}
+			llong t1 = g_walpf.now();
+			lock.lock();
+			m_writtenLsn = upto;
+			m_writtenPos = uptoPos;
+			m_writeCnt++;
+			m_bytesWritten += m_spare.size();
+			if (doSync) {
+				m_syncedLsn = upto;
+				m_syncedPos = uptoPos;
+				m_syncCnt++;
+				m_syncMs += g_walpf.mf(t0, t1);
+			}
+			if (m_fileBytes < m_opt.maxFileSize)
+				break;
+			// records in m_buf belong to current file, write them before
+			// switching to the new file
+			if (m_buf.empty()) {
+				if (!doSync && SyncNone != m_opt.syncMode)
+					::fsync(m_fd);
+				::close(m_fd);
+				m_curFileNo++;
+				openNewFileInLock();
+				purgeFilesInLock();
+				break;
+			}
+		}
+	}
+	catch (const std::exception&) {
+		if (!lock.owns_lock())
+			lock.lock();
+		m_leaderActive = false;
+		m_cond.notify_all();
+		throw;
+	}
+	m_leaderActive = false;
+	m_cond.notify_all();
+}
+
+void WriteAheadLog::waitDurable(uint64_t lsn) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (durableLsnInLock() < lsn) {
+		if (m_leaderActive)
+			m_cond.wait(lock);
+		else
+			flushAsLeader(lock, SyncPerCommit == m_opt.syncMode);
+	}
+}
+
+void WriteAheadLog::appendAndWait(uint64_t segUid, fstring ops) {
+	waitDurable(append(segUid, ops));
+}
+
+void WriteAheadLog::sync() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	// abort and detach records do not advance m_appendedLsn
+	while (m_syncedLsn < m_appendedLsn || !m_buf.empty()) {
+		if (m_leaderActive)
+			m_cond.wait(lock);
+		else
+			flushAsLeader(lock, true);
+	}
+}
+
+void WriteAheadLog::syncThreadProc() {
+	const bool doSync = SyncInterval == m_opt.syncMode;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_stop) {
+		m_cond.wait_for(lock, std::chrono::milliseconds(m_opt.syncIntervalMs));
+		uint64_t done = doSync ? m_syncedLsn : m_writtenLsn;
+		if (m_stop || m_leaderActive || done >= m_appendedLsn)
+			continue;
+		try {
+			flushAsLeader(lock, doSync);
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "ERROR: WriteAheadLog sync thread: %s\n", ex.what());
+		}
+	}
+}
+
+size_t WriteAheadLog::replay(uint64_t segUid,
+		const std::function<void(OpType, llong subId, fstring row)>& fn)
+const {
+	llong firstFileNo;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto iter = m_segs.find(segUid);
+		if (m_segs.end() == iter || iter->second.firstFileNo < 0)
+			return 0;
+		firstFileNo = iter->second.firstFileNo;
+	}
+	size_t opNum = 0;
+	valvec<byte> data;
+	// records appended in this process are applied already
+	for (llong fileNo = firstFileNo; fileNo < m_firstNewFileNo; ++fileNo) {
+		std::string fpath = getFilePath(fileNo);
+		if (!fs::exists(fpath))
+			continue;
+		readWholeFile(fpath, &data);
+		parseRecords(data,
+			[&](byte type, uint64_t lsn, uint64_t uid, fstring ops) {
+				if (RecTxn != type || uid != segUid || m_aborted.count(lsn))
+					return;
+				const byte* p = ops.udata();
+				const byte* end = p + ops.size();
+				while (p < end) {
+					OpType op = OpType(*p++);
+					llong subId = llong(load_var_uint64(p, &p));
+					if (OpPut == op) {
+						size_t len = size_t(load_var_uint64(p, &p));
+						fn(op, subId, fstring(p, len));
+						p += len;
+					}
+					else {
+						fn(op, subId, fstring());
+					}
+					opNum++;
+				}
+			});
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const_cast<WriteAheadLog*>(this)->m_replayedOps += opNum;
+	return opNum;
+}
+
+std::string WriteAheadLog::getStatsJson() const {
+	static const char* modeNames[] = { "commit", "interval", "none" };
+	std::lock_guard<std::mutex> lock(m_mutex);
+	json js;
+	js["dir"] = m_dir;
+	js["syncMode"] = modeNames[m_opt.syncMode];
+	js["commits"] = m_commitCnt;
+	js["writes"] = m_writeCnt;
+	js["syncs"] = m_syncCnt;
+	js["commitsPerWrite"] = m_writeCnt ? double(m_commitCnt) / m_writeCnt : 0.0;
+	js["avgSyncMs"] = m_syncCnt ? m_syncMs / m_syncCnt : 0.0;
+	js["bytesWritten"] = m_bytesWritten;
+	js["appendedLsn"] = m_appendedLsn;
+	js["syncedLsn"] = m_syncedLsn;
+	js["files"] = m_curFileNo - m_minFileNo + 1;
+	js["segments"] = m_segs.size();
+	js["replayedOps"] = m_replayedOps;
+	return js.dump();
+}
+
+} } // namespace terark::db
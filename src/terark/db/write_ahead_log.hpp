@@ -0,0 +1,133 @@
+#ifndef __terark_db_write_ahead_log_hpp__
+#define __terark_db_write_ahead_log_hpp__
+
+#include "db_store.hpp"
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+
+namespace terark { namespace db {
+
+// Process wide write ahead log shared by writable segments of all tables.
+//
+// A record is the row level ops(put/remove of subId) of one committed
+// DbTransaction, tagged by the uid of the writable segment(persisted in
+// segDir/WalSegUid, so it survives segment renaming by merge). Replaying
+// ops is idempotent, a segment replays all its records on load.
+//
+// Group commit: committers append records to a memory buffer, the first
+// one which needs durability becomes the leader, it writes and fsyncs
+// the whole buffer for all followers waiting on the same batch.
+//
+// Sync modes(env TerarkDB_WalSyncMode):
+//   commit  : commit returns after fsync(default)
+//   interval: commit returns after write(2), fsync every SyncIntervalMs
+//   none    : commit returns immediately, buffer is written every
+//             SyncIntervalMs and is never fsync'ed
+//
+// A log file is deleted when all segments which have records in it are
+// detached, that is, they have been converted to readonly or saved.
+class TERARK_DB_DLL WriteAheadLog : boost::noncopyable {
+public:
+	enum SyncMode { SyncPerCommit, SyncInterval, SyncNone };
+	enum OpType { OpPut = 1, OpRemove = 2 };
+	struct Options {
+		SyncMode syncMode;
+		uint32_t syncIntervalMs;
+		size_t   maxFileSize;
+		Options();
+		static Options fromEnv();
+	};
+
+	///@{ the global instance is owned by engine, NULL if not opened
+	static void openGlobal(PathRef dir, const Options&);
+	static void closeGlobal();
+	static WriteAheadLog* global();
+	///@}
+
+	WriteAheadLog(PathRef dir, const Options&);
+	~WriteAheadLog();
+
+	static void encodePut(valvec<byte>* ops, llong subId, fstring row);
+	static void encodeRemove(valvec<byte>* ops, llong subId);
+
+	// read or create segDir/WalSegUid, a created one is fsync'ed
+	static uint64_t getSegmentUid(PathRef segDir);
+
+	// fsync files in dir(recursive), dir and its parent dir, must be
+	// called before detachSegment when the segment data is saved to dir
+	static void syncDir(PathRef dir);
+
+	void attachSegment(uint64_t segUid);
+	void detachSegment(uint64_t segUid);
+
+	///@returns lsn of the record
+	uint64_t append(uint64_t segUid, fstring ops);
+	// the transaction of lsn failed after append, replay will skip it,
+	// returns when the abort mark is durable(as waitDurable)
+	void abort(uint64_t lsn);
+	void waitDurable(uint64_t lsn);
+	// append and wait, for writes out of transaction
+	void appendAndWait(uint64_t segUid, fstring ops);
+	// write and fsync all appended records
+	void sync();
+
+	///@returns number of replayed ops
+	size_t replay(uint64_t segUid,
+			const std::function<void(OpType, llong subId, fstring row)>&) const;
+
+	std::string getStatsJson() const;
+
+private:
+	struct SegInfo {
+		llong firstFileNo; // -1 if no records
+		bool  attached;
+	};
+	std::string getFilePath(llong fileNo) const;
+	void scanOldFiles();
+	void openNewFileInLock();
+	void appendRecordInLock(byte type, uint64_t lsn, uint64_t segUid, fstring ops);
+	uint64_t durableLsnInLock() const;
+	uint64_t durablePosInLock() const;
+	void flushAsLeader(std::unique_lock<std::mutex>&, bool doSync);
+	void purgeFilesInLock();
+	void syncThreadProc();
+
+	std::string  m_dir;
+	Options      m_opt;
+	mutable std::mutex m_mutex;
+	std::condition_variable m_cond;
+	valvec<byte> m_buf;     // appended, not yet written
+	valvec<byte> m_spare;   // swapped with m_buf by leader
+	uint64_t     m_appendedLsn;
+	uint64_t     m_writtenLsn;
+	uint64_t     m_syncedLsn;
+	uint64_t     m_appendedPos; // bytes ever appended, for abort marks
+	uint64_t     m_writtenPos;
+	uint64_t     m_syncedPos;
+	bool         m_leaderActive;
+	bool         m_stop;
+	int          m_fd;
+	llong        m_curFileNo;
+	llong        m_minFileNo; // oldest existing file
+	llong        m_firstNewFileNo; // first file of this process
+	size_t       m_fileBytes; // appended to current file
+	std::map<uint64_t, SegInfo> m_segs;
+	std::set<uint64_t>          m_aborted; // lsn of aborted records in old files
+	std::thread  m_syncThread;
+
+	// stats
+	unsigned long long m_commitCnt;
+	unsigned long long m_writeCnt;
+	unsigned long long m_syncCnt;
+	unsigned long long m_bytesWritten;
+	double             m_syncMs;
+	size_t             m_replayedOps;
+};
+
+} } // namespace terark::db
+
+#endif // __terark_db_write_ahead_log_hpp__
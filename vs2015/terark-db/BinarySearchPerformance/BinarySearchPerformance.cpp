@@ -3,6 +3,81 @@
 
 #include "stdafx.h"
 #include <terark/util/profiling.cpp>
+#include <terark/db/seg_locator.cpp>
+#include <terark/db/parallel_sort.cpp>
+#include <algorithm>
+
+// SegLocator vs upper_bound_a on rowNumVec, as CompositeTable locates segments
+static void benchSegLocator(size_t segNum, size_t loop) {
+	using namespace terark;
+	using terark::db::SegLocator;
+	valvec<llong> rowNumVec(segNum + 1, valvec_no_init());
+	llong baseId = 0;
+	for (size_t i = 0; i < segNum; ++i) {
+		rowNumVec[i] = baseId;
+		baseId += 1 + rand() % 100000;
+	}
+	rowNumVec[segNum] = baseId;
+	SegLocator loc;
+	loc.build(rowNumVec.data(), segNum);
+	valvec<llong> ids(4096, valvec_no_init());
+	for (size_t i = 0; i < ids.size(); ++i) {
+		ids[i] = llong((rand() * 65536LL + rand()) % baseId);
+		size_t upp = loc.upper_bound(ids[i]);
+		if (upp != upper_bound_a(rowNumVec, ids[i])) {
+			fprintf(stderr, "ERROR: SegLocator mismatch, segNum = %zd\n", segNum);
+			abort();
+		}
+	}
+	profiling pf;
+	size_t sum1 = 0, sum2 = 0;
+	long long t0 = pf.now();
+	for (size_t i = 0; i < loop; ++i) {
+		sum1 += upper_bound_a(rowNumVec, ids[i % ids.size()]);
+	}
+	long long t1 = pf.now();
+	for (size_t i = 0; i < loop; ++i) {
+		sum2 += loc.upper_bound(ids[i % ids.size()]);
+	}
+	long long t2 = pf.now();
+	if (sum1 != sum2) {
+		abort(); // also ensure compiler really do the search
+	}
+	printf("segNum = %5zd: upper_bound_a avgTime = %f'ns, SegLocator avgTime = %f'ns\n"
+		, segNum, pf.nf(t0,t1)/loop, pf.nf(t1,t2)/loop);
+}
+
+// sort of FixedLenKeyIndex::build: std::sort as before vs parallelSortFixedLen
+// with 1 thread and with getParallelSortThreadNum threads
+static void benchIndexSort(const char* name, const terark::valvec<terark::byte>& keys,
+						   size_t fixlen) {
+	using namespace terark;
+	const size_t rows = keys.size() / fixlen;
+	const byte* data = keys.data();
+	valvec<uint32_t> ids0(rows, valvec_no_init());
+	valvec<uint32_t> ids1(rows, valvec_no_init());
+	valvec<uint32_t> idsN(rows, valvec_no_init());
+	for (size_t i = 0; i < rows; ++i) ids0[i] = ids1[i] = idsN[i] = uint32_t(i);
+	const size_t thrNum = db::getParallelSortThreadNum(rows);
+	profiling pf;
+	long long t0 = pf.now();
+	std::sort(ids0.begin(), ids0.end(), [data,fixlen](uint32_t x, uint32_t y) {
+		int ret = memcmp(data + fixlen * x, data + fixlen * y, fixlen);
+		return ret ? ret < 0 : x < y;
+	});
+	long long t1 = pf.now();
+	db::parallelSortFixedLen(data, fixlen, ids1.data(), rows, 1);
+	long long t2 = pf.now();
+	db::parallelSortFixedLen(data, fixlen, idsN.data(), rows, thrNum);
+	long long t3 = pf.now();
+	if (!std::equal(ids0.begin(), ids0.end(), ids1.begin()) ||
+		!std::equal(ids0.begin(), ids0.end(), idsN.begin())) {
+		fprintf(stderr, "ERROR: parallelSortFixedLen mismatch, %s\n", name);
+		abort();
+	}
+	printf("index sort %s rows = %zd: std::sort = %f'ms, radix 1 thread = %f'ms, radix %zd threads = %f'ms\n"
+		, name, rows, pf.mf(t0,t1), pf.mf(t1,t2), thrNum, pf.mf(t2,t3));
+}
 
 int main(int argc, char* argv[]) {
 	using namespace terark;
@@ -34,6 +109,34 @@ int main(int argc, char* argv[]) {
 	long long t2 = pf.now();
 	printf("terark: %f seconds, avgTime = %f'ns, QPS = %f'M\n", pf.sf(t0,t1), pf.nf(t0,t1)/loop, loop/pf.uf(t0,t1));
 	printf("std : %f seconds, avgTime = %f'ns, QPS = %f'M\n", pf.sf(t1,t2), pf.nf(t1,t2)/loop, loop/pf.uf(t1,t2));
+
+	{
+		db::SegLocator empty;
+		empty.build(NULL, 0); // must not wrap m_num
+		if (empty.upper_bound(0) != 1) {
+			abort();
+		}
+	}
+	size_t segNums[] = { 1, 2, 8, 32, 33, 100, 1000, 10000 };
+	for (size_t segNum : segNums) {
+		benchSegLocator(segNum, loop);
+	}
+
+	// keys of an index build: big endian uint64 ids, and "%08zd" strings
+	// which share a long common prefix, like the "fix" column of db-test
+	const size_t rows = 4 << 20;
+	valvec<byte> idKeys(rows * 8, valvec_no_init());
+	valvec<byte> strKeys(rows * 9, valvec_no_init());
+	for (size_t i = 0; i < rows; ++i) {
+		uint64_t id = uint64_t(rand()) << 32 | rand();
+		for (size_t j = 0; j < 8; ++j)
+			idKeys[8*i + j] = byte(id >> (56 - 8*j));
+		char buf[16];
+		sprintf(buf, "%08zd", size_t(rand()) % rows);
+		memcpy(&strKeys[9*i], buf, 9);
+	}
+	benchIndexSort("uint64", idKeys, 8);
+	benchIndexSort("str9", strKeys, 9);
     return 0;
 }
 
@@ -0,0 +1,215 @@
+// SchemaPerformance.cpp : Schema parseRow, index key select and compare on a
+// 20 column schema, compiled column runs vs the per column interpreter.
+// compareData always uses the interpreter, its numbers are the baseline
+//
+
+#include "stdafx.h"
+#include <terark/db/db_conf.hpp>
+#include <terark/util/profiling.hpp>
+#include <algorithm>
+#include <string>
+
+using namespace terark;
+using namespace terark::db;
+
+static void setRunsEnv(bool enabled) {
+#if defined(_MSC_VER)
+	_putenv_s("TerarkDB_SchemaCompileRuns", enabled ? "1" : "0");
+#else
+	setenv("TerarkDB_SchemaCompileRuns", enabled ? "1" : "0", 1);
+#endif
+}
+
+static void addColumn(Schema* schema, const char* name, ColumnType type,
+					  size_t fixlen = 0) {
+	ColumnMeta cm(type);
+	if (fixlen)
+		cm.fixedLen = uint32_t(fixlen);
+	schema->m_columnsMeta.insert_i(name, cm);
+}
+
+// a typical wide row: mostly fixed len columns, some strings and a blob
+static SchemaPtr makeRowSchema() {
+	SchemaPtr schema(new Schema());
+	addColumn(schema.get(), "id"     , ColumnType::Uint64);
+	addColumn(schema.get(), "ts"     , ColumnType::Sint64);
+	addColumn(schema.get(), "uid"    , ColumnType::Uint32);
+	addColumn(schema.get(), "status" , ColumnType::Uint08);
+	addColumn(schema.get(), "flags"  , ColumnType::Uint16);
+	addColumn(schema.get(), "score"  , ColumnType::Float64);
+	addColumn(schema.get(), "price"  , ColumnType::Float32);
+	addColumn(schema.get(), "qty"    , ColumnType::Sint32);
+	addColumn(schema.get(), "region" , ColumnType::Fixed, 4);
+	addColumn(schema.get(), "uuid"   , ColumnType::Uuid);
+	addColumn(schema.get(), "name"   , ColumnType::StrZero);
+	addColumn(schema.get(), "email"  , ColumnType::StrZero);
+	addColumn(schema.get(), "cat"    , ColumnType::Sint16);
+	addColumn(schema.get(), "sub"    , ColumnType::Uint32);
+	addColumn(schema.get(), "lat"    , ColumnType::Float64);
+	addColumn(schema.get(), "lng"    , ColumnType::Float64);
+	addColumn(schema.get(), "ver"    , ColumnType::Uint32);
+	addColumn(schema.get(), "country", ColumnType::Fixed, 2);
+	addColumn(schema.get(), "tags"   , ColumnType::StrZero);
+	addColumn(schema.get(), "note"   , ColumnType::Binary);
+	schema->compile();
+	return schema;
+}
+
+static SchemaPtr makeIndexSchema(const Schema& rowSchema, const char* cols) {
+	SchemaPtr schema(new Schema());
+	std::string names(cols);
+	size_t beg = 0;
+	while (beg < names.size()) {
+		size_t end = names.find(',', beg);
+		if (std::string::npos == end)
+			end = names.size();
+		fstring name(names.data() + beg, end - beg);
+		size_t colId = rowSchema.m_columnsMeta.find_i(name);
+		assert(colId < rowSchema.columnNum());
+		schema->m_columnsMeta.insert_i(name, rowSchema.m_columnsMeta.val(colId));
+		beg = end + 1;
+	}
+	schema->compile(&rowSchema);
+	return schema;
+}
+
+template<class T>
+static void appendNum(valvec<byte>* row, T x) {
+	row->append((const byte*)&x, sizeof(T));
+}
+
+static void makeRow(valvec<byte>* row) {
+	row->erase_all();
+	appendNum(row, uint64_t(rand()) << 32 | rand());
+	appendNum(row, int64_t(rand() % 1000000) - 500000);
+	appendNum(row, uint32_t(rand() % 1000));
+	appendNum(row, uint8_t(rand() % 4));
+	appendNum(row, uint16_t(rand()));
+	appendNum(row, rand() / 1000.0);
+	appendNum(row, float(rand() % 10000) / 100);
+	appendNum(row, int32_t(rand() % 200) - 100);
+	row->append((const byte*)(rand() % 2 ? "east" : "west"), 4);
+	for (size_t i = 0; i < 16; ++i) row->push_back(byte(rand()));
+	char buf[64];
+	row->append((const byte*)buf, sprintf(buf, "user%d", rand() % 100000) + 1);
+	row->append((const byte*)buf, sprintf(buf, "u%d@example.com", rand()) + 1);
+	appendNum(row, int16_t(rand() % 50));
+	appendNum(row, uint32_t(rand() % 500));
+	appendNum(row, rand() / 3000.0 - 90);
+	appendNum(row, rand() / 1500.0 - 180);
+	appendNum(row, uint32_t(rand() % 3));
+	row->append((const byte*)(rand() % 2 ? "cn" : "us"), 2);
+	row->append((const byte*)buf, sprintf(buf, "t%d,t%d", rand() % 9, rand() % 9) + 1);
+	size_t noteLen = rand() % 64;
+	for (size_t i = 0; i < noteLen; ++i) row->push_back(byte('a' + rand() % 26));
+}
+
+struct SchemaBench {
+	SchemaPtr rowSchema;
+	SchemaPtr adjIndex; // columns adjacent in row: fused projection
+	SchemaPtr mixIndex; // columns not adjacent, with a string column
+	SchemaBench(bool enableRuns) {
+		setRunsEnv(enableRuns);
+		rowSchema = makeRowSchema();
+		adjIndex = makeIndexSchema(*rowSchema, "ts,uid,status,flags,score");
+		mixIndex = makeIndexSchema(*rowSchema, "cat,name,ts");
+	}
+};
+
+struct BenchResult {
+	double parseNs, selectAdjNs, selectMixNs, cmpAdjNs, cmpMixNs;
+	valvec<byte> adjKeys, mixKeys; // concatenated, to check results agree
+	valvec<int>  cmpSigns;
+};
+
+static int sign(int x) { return x < 0 ? -1 : x > 0 ? 1 : 0; }
+
+static void run(const SchemaBench& sb, const valvec<valvec<byte> >& rows,
+				size_t loop, BenchResult* res) {
+	const size_t n = rows.size();
+	profiling pf;
+	ColumnVec cols;
+	size_t sum = 0;
+	long long t0 = pf.now();
+	for (size_t k = 0; k < loop; ++k) {
+		for (size_t i = 0; i < n; ++i) {
+			sb.rowSchema->parseRow(rows[i], &cols);
+			sum += cols.m_cols[19].pos;
+		}
+	}
+	long long t1 = pf.now();
+	res->parseNs = pf.nf(t0, t1) / (loop * n);
+
+	valvec<ColumnVec> parsed(n);
+	for (size_t i = 0; i < n; ++i)
+		sb.rowSchema->parseRow(rows[i], &parsed[i]);
+	valvec<valvec<byte> > adjKeys(n), mixKeys(n);
+	valvec<byte> key;
+	const Schema* indexSchemas[2] = { sb.adjIndex.get(), sb.mixIndex.get() };
+	valvec<valvec<byte> >* indexKeys[2] = { &adjKeys, &mixKeys };
+	double* selectNs[2] = { &res->selectAdjNs, &res->selectMixNs };
+	double* cmpNs[2] = { &res->cmpAdjNs, &res->cmpMixNs };
+	for (size_t x = 0; x < 2; ++x) {
+		t0 = pf.now();
+		for (size_t k = 0; k < loop; ++k) {
+			for (size_t i = 0; i < n; ++i) {
+				indexSchemas[x]->selectParent(parsed[i], &key);
+				sum += key.size();
+			}
+		}
+		t1 = pf.now();
+		*selectNs[x] = pf.nf(t0, t1) / (loop * n);
+		for (size_t i = 0; i < n; ++i)
+			indexSchemas[x]->selectParent(parsed[i], &(*indexKeys[x])[i]);
+	}
+	for (size_t x = 0; x < 2; ++x) {
+		const valvec<valvec<byte> >& keys = *indexKeys[x];
+		int cmpSum = 0;
+		t0 = pf.now();
+		for (size_t k = 0; k < loop; ++k) {
+			for (size_t i = 0; i + 1 < n; ++i) {
+				cmpSum += indexSchemas[x]->compareData(keys[i], keys[i+1]);
+			}
+		}
+		t1 = pf.now();
+		*cmpNs[x] = pf.nf(t0, t1) / (loop * (n - 1));
+		sum += cmpSum;
+		for (size_t i = 0; i + 1 < n; ++i) {
+			res->cmpSigns.push_back(sign(indexSchemas[x]->compareData(keys[i], keys[i+1])));
+		}
+	}
+	for (size_t i = 0; i < n; ++i) {
+		res->adjKeys.append(adjKeys[i]);
+		res->mixKeys.append(mixKeys[i]);
+	}
+	if (0 == sum) {
+		printf("sum = 0\n"); // ensure compiler really do the work
+	}
+}
+
+int main(int argc, char* argv[]) {
+	size_t rowNum = argc >= 2 ? (size_t)strtoull(argv[1], NULL, 10) : 100000;
+	size_t loop = argc >= 3 ? (size_t)strtoull(argv[2], NULL, 10) : 10;
+	valvec<valvec<byte> > rows(rowNum);
+	for (size_t i = 0; i < rowNum; ++i) {
+		makeRow(&rows[i]);
+	}
+	SchemaBench interp(false), compiled(true);
+	BenchResult r0, r1, warmup;
+	run(interp, rows, 1, &warmup);
+	run(compiled, rows, 1, &warmup);
+	run(interp, rows, loop, &r0);
+	run(compiled, rows, loop, &r1);
+	if (r0.adjKeys != r1.adjKeys || r0.mixKeys != r1.mixKeys ||
+		r0.cmpSigns != r1.cmpSigns) {
+		fprintf(stderr, "ERROR: compiled runs and interpreter mismatch\n");
+		return 1;
+	}
+	printf("rows = %zd, loop = %zd, avg ns per op: interpreter / compiled\n", rowNum, loop);
+	printf("parseRow                      : %8.2f / %8.2f\n", r0.parseNs, r1.parseNs);
+	printf("selectParent(ts,uid,status,..): %8.2f / %8.2f\n", r0.selectAdjNs, r1.selectAdjNs);
+	printf("selectParent(cat,name,ts)     : %8.2f / %8.2f\n", r0.selectMixNs, r1.selectMixNs);
+	printf("compareData(ts,uid,status,..) : %8.2f / %8.2f\n", r0.cmpAdjNs, r1.cmpAdjNs);
+	printf("compareData(cat,name,ts)      : %8.2f / %8.2f\n", r0.cmpMixNs, r1.cmpMixNs);
+	return 0;
+}
@@ -3,10 +3,31 @@
 
 #include "stdafx.h"
 #include <terark/db/db_table.hpp>
+#include <terark/db/db_segment.hpp>
+#include <terark/db/bg_scheduler.hpp>
+#include <terark/db/merge_policy.hpp>
+#include <terark/db/parallel_sort.hpp>
+#include <terark/db/write_ahead_log.hpp>
+#include <terark/db/row_cache.hpp>
+#include <terark/db/table_stats.hpp>
+#include <terark/db/json.hpp>
+#include <terark/util/sortable_strvec.hpp>
+#include <terark/util/linebuf.hpp>
 #include <terark/io/DataIO.hpp>
+#include <terark/io/FileStream.hpp>
 #include <terark/io/MemStream.hpp>
 #include <terark/io/RangeStream.hpp>
 #include <terark/num_to_str.hpp>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#if !defined(_MSC_VER)
+	#include <sys/wait.h>
+	#include <unistd.h>
+#endif
 
 struct TestRow {
 	uint64_t id;
@@ -33,6 +54,122 @@ struct TestRow {
 
 using namespace terark::db;
 
+// batched search must return the same as searching keys one by one
+void testIndexSearchExactBatch(CompositeTable* tab, DbContext* ctx, size_t maxRowNum) {
+	using namespace terark;
+	printf("test indexSearchExactBatch ...\n");
+	size_t idIndexId = tab->getIndexId("id");
+	size_t fixIndexId = tab->getIndexId("fix");
+	valvec<uint64_t> ids;
+	valvec<Schema::Fixed<9> > fixes;
+	for (size_t i = 0; i < 256; ++i) {
+		uint64_t id = rand() % (maxRowNum * 11 / 10) + 1; // some are missing
+		Schema::Fixed<9> fix;
+		memset(fix.data, 0, sizeof(fix.data));
+		sprintf(fix.data, "%06lld", (long long)id);
+		ids.push_back(id);
+		fixes.push_back(fix);
+	}
+	ids.push_back(ids[0]); // duplicate key
+	fixes.push_back(fixes[0]);
+	valvec<fstring> idKeys, fixKeys;
+	for (size_t i = 0; i < ids.size(); ++i) {
+		idKeys.push_back(Schema::fstringOf(&ids[i]));
+		fixKeys.push_back(fstring(fixes[i].data, sizeof(fixes[i].data)));
+	}
+	valvec<valvec<llong> > batchResult;
+	valvec<llong> oneResult;
+	size_t found = 0;
+	for (int k = 0; k < 2; ++k) {
+		size_t indexId = 0 == k ? idIndexId : fixIndexId;
+		const valvec<fstring>& keys = 0 == k ? idKeys : fixKeys;
+		ctx->indexSearchExactBatch(indexId, keys.data(), keys.size(), &batchResult);
+		assert(batchResult.size() == keys.size());
+		for (size_t i = 0; i < keys.size(); ++i) {
+			ctx->indexSearchExact(indexId, keys[i], &oneResult);
+			std::sort(oneResult.begin(), oneResult.end());
+			valvec<llong>& b = batchResult[i];
+			std::sort(b.begin(), b.end());
+			assert(b.size() == oneResult.size());
+			assert(std::equal(b.begin(), b.end(), oneResult.begin()));
+			found += b.size();
+		}
+	}
+	// projection of the newest match
+	size_t colsId[] = { tab->getColumnId("id") };
+	valvec<valvec<byte> > colsData;
+	ctx->indexSearchExactBatch(idIndexId, idKeys.data(), idKeys.size(),
+							   colsId, 1, &batchResult, &colsData);
+	for (size_t i = 0; i < idKeys.size(); ++i) {
+		if (batchResult[i].empty()) {
+			assert(colsData[i].empty());
+		} else {
+			assert(colsData[i].size() == sizeof(uint64_t));
+			assert(unaligned_load<uint64_t>(colsData[i].data()) == ids[i]);
+		}
+	}
+	printf("test indexSearchExactBatch passed, keys=%zd, found=%zd\n",
+		idKeys.size(), found);
+}
+
+// projection iterators must give the same ids and column data as
+// selectColumns on each row of the table iterator, in both directions.
+// selectColumns must not grow ctx->cols1 on each call
+void testProjectIter(CompositeTable* tab, DbContext* ctx) {
+	using namespace terark;
+	printf("test createProjectIterForward/Backward ...\n");
+	valvec<size_t> cols;
+	cols.push_back(tab->getColumnId("str1"));
+	cols.push_back(tab->getColumnId("id"));
+	cols.push_back(tab->getColumnId("fix2"));
+	valvec<llong> ids;
+	valvec<valvec<byte> > expected;
+	{
+		StoreIteratorPtr iter = ctx->createTableIterForward();
+		llong recId;
+		valvec<byte> val;
+		while (iter->increment(&recId, &val)) {
+			ids.push_back(recId);
+			expected.emplace_back();
+			ctx->selectColumns(recId, cols, &expected.back());
+			TERARK_RT_assert(ctx->cols1.size() <= tab->rowSchema().columnNum(),
+							 std::logic_error);
+		}
+	}
+	llong recId;
+	valvec<byte> val;
+	size_t n = 0;
+	StoreIteratorPtr fwd = ctx->createProjectIterForward(cols);
+	while (fwd->increment(&recId, &val)) {
+		TERARK_RT_assert(n < ids.size(), std::logic_error);
+		TERARK_RT_assert(recId == ids[n], std::logic_error);
+		TERARK_RT_assert(val == expected[n], std::logic_error);
+		n++;
+	}
+	TERARK_RT_assert(n == ids.size(), std::logic_error);
+	StoreIteratorPtr bwd = ctx->createProjectIterBackward(cols);
+	for (int pass = 0; pass < 2; ++pass) {
+		n = ids.size();
+		while (bwd->increment(&recId, &val)) {
+			TERARK_RT_assert(n > 0, std::logic_error);
+			n--;
+			TERARK_RT_assert(recId == ids[n], std::logic_error);
+			TERARK_RT_assert(val == expected[n], std::logic_error);
+		}
+		TERARK_RT_assert(0 == n, std::logic_error);
+		bwd->reset();
+	}
+	for (size_t i = 0; i < ids.size(); i += 7) {
+		TERARK_RT_assert(fwd->seekExact(ids[i], &val), std::logic_error);
+		TERARK_RT_assert(val == expected[i], std::logic_error);
+		if (i + 1 < ids.size()) {
+			TERARK_RT_assert(fwd->increment(&recId, &val), std::logic_error);
+			TERARK_RT_assert(recId == ids[i+1], std::logic_error);
+		}
+	}
+	printf("test createProjectIterForward/Backward passed, rows=%zd\n", ids.size());
+}
+
 void doTest(const char* tableDir, size_t maxRowNum) {
 	using namespace terark;
 	CompositeTablePtr tab = CompositeTable::open(tableDir);
@@ -247,10 +384,1322 @@ void doTest(const char* tableDir, size_t maxRowNum) {
 			iterRows, insertedRows);
 	}
 
+	testIndexSearchExactBatch(tab.get(), ctx.get(), maxRowNum);
+	testProjectIter(tab.get(), ctx.get());
+
 	// last writable segment will put to compressing queue
 	tab->syncFinishWriting();
+	CompositeTable::safeStopAndWaitForCompress();
+
+	// now rows are in readonly segments
+	testIndexSearchExactBatch(tab.get(), ctx.get(), maxRowNum);
+	testProjectIter(tab.get(), ctx.get());
+
+	// fix2 is inplace updatable, a row read before updateColumn must not
+	// be served from RowCache after it
+	{
+		printf("test updateColumn with RowCache ...\n");
+		RowCache& cache = RowCache::instance();
+		const size_t oldCapacity = cache.capacity();
+		cache.setCapacity(RowCache::ShardNum * 64 * 1024);
+		StoreIteratorPtr storeIter = ctx->createTableIterForward();
+		llong recId;
+		valvec<byte> val;
+		size_t updated = 0;
+		while (storeIter->increment(&recId, &val) && updated < 100) {
+			ctx->getValue(recId, &val);
+			char fix2[10];
+			memset(fix2, 0, sizeof(fix2));
+			sprintf(fix2, "U2.%06lld", recId % 1000000);
+			tab->updateColumn(recId, "fix2", fstring(fix2, sizeof(fix2)), ctx.get());
+			ctx->getValue(recId, &val);
+			TERARK_RT_assert(std::search(val.begin(), val.end(), fix2, fix2 + 9)
+							!= val.end(), std::logic_error);
+			updated++;
+		}
+		cache.setCapacity(oldCapacity);
+		printf("test updateColumn with RowCache passed, updated=%zd\n", updated);
+	}
+}
+
+template<class T>
+static int cmpNum(T x, T y) { return x < y ? -1 : y < x ? 1 : 0; }
+
+// compiled fixed column runs(parse, compare, byteLex) must give the same
+// result as comparing the columns one by one
+void testSchemaFixedRuns() {
+	using namespace terark;
+	printf("test Schema fixed column runs ...\n");
+	SchemaPtr schema(new Schema());
+	auto add = [&](const char* name, ColumnType type, size_t fixlen) {
+		ColumnMeta cm(type);
+		if (fixlen)
+			cm.fixedLen = uint32_t(fixlen);
+		schema->m_columnsMeta.insert_i(name, cm);
+	};
+	// run: a b c d e, then var len f, then run: g h
+	add("a", ColumnType::Sint32 , 0);
+	add("b", ColumnType::Uint64 , 0);
+	add("c", ColumnType::Fixed  , 3);
+	add("d", ColumnType::Uint08 , 0);
+	add("e", ColumnType::Float64, 0);
+	add("f", ColumnType::StrZero, 0);
+	add("g", ColumnType::Sint16 , 0);
+	add("h", ColumnType::Fixed  , 2);
+	schema->compile();
+	// b c d e are adjacent in parent: projected by one append
+	SchemaPtr index(new Schema());
+	for (const char* name : {"b", "c", "d", "e", "g"}) {
+		size_t colId = schema->m_columnsMeta.find_i(name);
+		index->m_columnsMeta.insert_i(name, schema->m_columnsMeta.val(colId));
+	}
+	index->compile(schema.get());
+	struct Row {
+		int32_t a; uint64_t b; char c[3]; uint8_t d; double e;
+		std::string f; int16_t g; char h[2];
+	};
+	auto randRow = [](Row* r) {
+		r->a = rand() % 7 - 3;
+		r->b = rand() % 5;
+		for (int i = 0; i < 3; ++i) r->c[i] = 'a' + rand() % 2;
+		r->d = uint8_t(rand() % 3 * 100);
+		// byteLex of float only flips the sign bit, so keep it non-negative
+		r->e = (rand() % 5) * 0.5;
+		r->f.assign(rand() % 3, 'x' + rand() % 2);
+		r->g = int16_t(rand() % 5 - 2);
+		for (int i = 0; i < 2; ++i) r->h[i] = 'a' + rand() % 2;
+	};
+	auto encode = [](const Row& r, valvec<byte>* buf) {
+		buf->erase_all();
+		buf->append((const byte*)&r.a, 4);
+		buf->append((const byte*)&r.b, 8);
+		buf->append((const byte*)r.c, 3);
+		buf->append((const byte*)&r.d, 1);
+		buf->append((const byte*)&r.e, 8);
+		buf->append((const byte*)r.f.c_str(), r.f.size() + 1);
+		buf->append((const byte*)&r.g, 2);
+		buf->append((const byte*)r.h, 2);
+	};
+	auto refCompare = [](const Row& x, const Row& y) {
+		int r;
+		if ((r = cmpNum(x.a, y.a)) != 0) return r;
+		if ((r = cmpNum(x.b, y.b)) != 0) return r;
+		if ((r = memcmp(x.c, y.c, 3)) != 0) return r;
+		if ((r = cmpNum(x.d, y.d)) != 0) return r;
+		if ((r = cmpNum(x.e, y.e)) != 0) return r;
+		if ((r = x.f.compare(y.f)) != 0) return r;
+		if ((r = cmpNum(x.g, y.g)) != 0) return r;
+		return memcmp(x.h, y.h, 2);
+	};
+	auto sign = [](int r) { return r < 0 ? -1 : r > 0 ? 1 : 0; };
+	valvec<byte> xbuf, ybuf, key, refKey;
+	ColumnVec cols;
+	for (int i = 0; i < 10000; ++i) {
+		Row x, y;
+		randRow(&x);
+		randRow(&y);
+		encode(x, &xbuf);
+		encode(y, &ybuf);
+		schema->parseRow(xbuf, &cols);
+		TERARK_RT_assert(cols.size() == 8, std::logic_error);
+		TERARK_RT_assert(cols.getNumber<int32_t>(0) == x.a, std::logic_error);
+		TERARK_RT_assert(cols.getNumber<uint64_t>(1) == x.b, std::logic_error);
+		TERARK_RT_assert(cols[2] == fstring(x.c, 3), std::logic_error);
+		TERARK_RT_assert(cols.getNumber<double>(4) == x.e, std::logic_error);
+		TERARK_RT_assert(cols[5] == fstring(x.f), std::logic_error);
+		TERARK_RT_assert(cols.getNumber<int16_t>(6) == x.g, std::logic_error);
+		TERARK_RT_assert(cols[7] == fstring(x.h, 2), std::logic_error);
+		index->selectParent(cols, &key);
+		refKey.erase_all();
+		refKey.append(xbuf.data() + 4, 8 + 3 + 1 + 8);
+		refKey.append((const byte*)&x.g, 2);
+		TERARK_RT_assert(key == refKey, std::logic_error);
+		int r = sign(schema->compareData(xbuf, ybuf));
+		TERARK_RT_assert(r == sign(refCompare(x, y)), std::logic_error);
+		if (schema->m_canEncodeToLexByteComparable) {
+			valvec<byte> xlex(xbuf), ylex(ybuf);
+			schema->byteLexEncode(xlex);
+			schema->byteLexEncode(ylex);
+			int lr = sign(std::string(xlex.begin(), xlex.end())
+						 .compare(std::string(ylex.begin(), ylex.end())));
+			TERARK_RT_assert(lr == r, std::logic_error);
+			schema->byteLexDecode(xlex);
+			TERARK_RT_assert(fstring(xlex) == fstring(xbuf), std::logic_error);
+		}
+	}
+	printf("test Schema fixed column runs passed\n");
+}
+
+// batch lex convert of fixed len keys(SSSE3 chunks when enabled) must be
+// same as converting keys one by one, keys are from 1 to 38 bytes
+void testSchemaLexBatch() {
+	using namespace terark;
+	printf("test Schema byteLex fixed batch ...\n");
+	static const ColumnType types[] = {
+		ColumnType::Sint64, ColumnType::Uint32, ColumnType::Fixed,
+		ColumnType::Sint08, ColumnType::Float32, ColumnType::Uint16,
+		ColumnType::Sint16, ColumnType::Uint64,
+	};
+	static const size_t lens[] = { 8, 4, 7, 1, 4, 2, 2, 8 };
+	static const size_t numCols[] = { 1, 2, 3, 4, 8 };
+	for (size_t firstCol : { size_t(3), size_t(0) }) {
+	for (size_t colnum : numCols) {
+		SchemaPtr schema(new Schema());
+		size_t fixlen = 0;
+		for (size_t i = firstCol; i < firstCol + colnum && i < 8; ++i) {
+			ColumnMeta cm(types[i]);
+			if (ColumnType::Fixed == types[i])
+				cm.fixedLen = uint32_t(lens[i]);
+			char name[8];
+			sprintf(name, "c%zd", i);
+			schema->m_columnsMeta.insert_i(name, cm);
+			fixlen += lens[i];
+		}
+		schema->compile();
+		TERARK_RT_assert(schema->getFixedRowLen() == fixlen, std::logic_error);
+		for (size_t rows : { size_t(1), size_t(2), size_t(3), size_t(1000) }) {
+			valvec<byte> batch(fixlen * rows, valvec_no_init());
+			for (size_t i = 0; i < batch.size(); ++i)
+				batch[i] = byte(rand());
+			valvec<byte> orig(batch);
+			valvec<byte> scalar(batch);
+			for (size_t i = 0; i < rows; ++i)
+				schema->byteLexEncode(scalar.data() + fixlen * i, fixlen);
+			schema->byteLexEncodeFixedBatch(batch.data(), rows);
+			TERARK_RT_assert(fstring(batch) == fstring(scalar), std::logic_error);
+			schema->byteLexDecodeFixedBatch(batch.data(), rows);
+			TERARK_RT_assert(fstring(batch) == fstring(orig), std::logic_error);
+		}
+	}
+	}
+	printf("test Schema byteLex fixed batch passed\n");
+}
+
+// parallel radix sort must give the order of SortableStrVec::sort with
+// equal keys in seq_id order, for 1 thread and for the reused thread team
+void testParallelSort() {
+	using namespace terark;
+	printf("test parallelSortStrVec ...\n");
+	SortableStrVec strVec;
+	std::string key;
+	for (size_t i = 0; i < 300000; ++i) {
+		// long common prefix and many dup keys
+		key.assign(rand() % 3 ? 20 : 0, 'p');
+		size_t len = rand() % 6;
+		for (size_t j = 0; j < len; ++j)
+			key.push_back(char('a' + rand() % 4));
+		strVec.push_back(key);
+	}
+	const byte* pool = strVec.m_strpool.data();
+	valvec<SortableStrVec::SEntry> expected(strVec.m_index);
+	std::stable_sort(expected.begin(), expected.end(),
+		[pool](const SortableStrVec::SEntry& x, const SortableStrVec::SEntry& y) {
+			return fstring(pool + x.offset, x.length) <
+				   fstring(pool + y.offset, y.length);
+		});
+	for (size_t thrNum : { size_t(1), size_t(4) }) {
+		SortableStrVec sorted;
+		sorted.m_strpool = strVec.m_strpool;
+		sorted.m_index = strVec.m_index;
+		parallelSortStrVec(sorted, thrNum);
+		for (size_t i = 0; i < expected.size(); ++i) {
+			TERARK_RT_assert(sorted.m_index[i].seq_id == expected[i].seq_id,
+				std::logic_error);
+		}
+	}
+	const size_t fixlen = 3, rows = 200000;
+	valvec<byte> keys(fixlen * rows, valvec_no_init());
+	for (size_t i = 0; i < keys.size(); ++i)
+		keys[i] = byte(i % fixlen ? rand() % 3 : 0);
+	valvec<uint32_t> ids(rows, valvec_no_init());
+	for (size_t i = 0; i < rows; ++i) ids[i] = uint32_t(i);
+	parallelSortFixedLen(keys.data(), fixlen, ids.data(), rows, 4);
+	for (size_t i = 1; i < rows; ++i) {
+		int r = memcmp(keys.data() + fixlen * ids[i-1],
+					   keys.data() + fixlen * ids[i], fixlen);
+		TERARK_RT_assert(r < 0 || (r == 0 && ids[i-1] < ids[i]),
+			std::logic_error);
+	}
+	printf("test parallelSortStrVec passed\n");
+}
+
+static void makeTestRow(TestRow* recRow, uint64_t id, size_t seq) {
+	memset(recRow->fix.data, 0, sizeof(recRow->fix.data));
+	memset(recRow->fix2.data, 0, sizeof(recRow->fix2.data));
+	recRow->id = id;
+	sprintf(recRow->fix.data, "%06lld", (long long)id);
+	sprintf(recRow->fix2.data, "F2.%06lld", (long long)id);
+	recRow->str0 = std::string("s0:") + recRow->fix.data;
+	recRow->str1 = std::string("s1:") + recRow->fix.data;
+	recRow->str2 = std::string("s2:") + recRow->fix.data;
+	recRow->str3 = std::string("s3:") + recRow->fix.data;
+	char szSeq[32];
+	sprintf(szSeq, ":%zd", seq);
+	recRow->str4 = std::string("s4:") + recRow->fix.data + szSeq;
+}
+
+// rows are external sorted by the unique index, duplicate keys keep the last
+// row, loaded rows replace existing rows, segments are cut by index keys
+void testBulkLoad(const char* metaDir, size_t maxRowNum) {
+	using namespace terark;
+	namespace fs = boost::filesystem;
+	printf("test TableBulkLoader ...\n");
+	const char* tableDir = "bulkdb";
+	fs::remove_all(tableDir);
+	fs::create_directories(tableDir);
+	fs::copy_file(fs::path(metaDir) / "dbmeta.json",
+				  fs::path(tableDir) / "dbmeta.json");
+	CompositeTablePtr tab = CompositeTable::open(tableDir);
+	DbContextPtr ctx = tab->createDbContext();
+	NativeDataOutput<AutoGrownMemIO> rowBuilder;
+	TestRow recRow;
+	// existing row, will be replaced by the loaded row of the same key
+	makeTestRow(&recRow, 1, size_t(-1));
+	rowBuilder.rewind();
+	rowBuilder << recRow;
+	llong oldRecId = ctx->insertRow(rowBuilder.written());
+	TERARK_RT_assert(oldRecId >= 0, std::logic_error);
+
+	const size_t keyNum = maxRowNum / 2 + 1;
+	valvec<size_t> lastSeq(keyNum + 1, size_t(-1));
+	size_t distinct = 0;
+	{
+		TableBulkLoader loader(tab.get(), 4096); // many runs
+		for (size_t seq = 0; seq < maxRowNum; ++seq) {
+			uint64_t id = rand() % keyNum + 1;
+			if (size_t(-1) == lastSeq[id])
+				distinct++;
+			lastSeq[id] = seq;
+			makeTestRow(&recRow, id, seq);
+			rowBuilder.rewind();
+			rowBuilder << recRow;
+			loader.insertRow(rowBuilder.written());
+		}
+		llong rows = loader.finish();
+		TERARK_RT_assert(size_t(rows) == distinct, std::logic_error);
+		size_t replaced = size_t(-1) == lastSeq[1] ? 0 : 1;
+		TERARK_RT_assert(size_t(loader.numDupRows()) == maxRowNum - distinct + replaced, std::logic_error);
+		printf("bulk loaded %lld rows into %zd segments, dup rows = %lld\n"
+			, rows, loader.numSegments(), loader.numDupRows());
+	}
+	if (size_t(-1) != lastSeq[1]) {
+		TERARK_RT_assert(!tab->exists(oldRecId), std::logic_error);
+	}
+	valvec<llong> recIdvec;
+	valvec<byte>  recBuf;
+	for (uint64_t id = 1; id <= keyNum; ++id) {
+		ctx->indexSearchExact(0, Schema::fstringOf(&id), &recIdvec);
+		if (size_t(-1) == lastSeq[id]) {
+			TERARK_RT_assert(id == 1 ? recIdvec.size() == 1 : recIdvec.empty(), std::logic_error);
+			continue;
+		}
+		TERARK_RT_assert(recIdvec.size() == 1, std::logic_error);
+		ctx->getValue(recIdvec[0], &recBuf);
+		TestRow expected;
+		makeTestRow(&expected, id, lastSeq[id]);
+		rowBuilder.rewind();
+		rowBuilder << expected;
+		TERARK_RT_assert(fstring(recBuf) == fstring(rowBuilder.written()), std::logic_error);
+	}
+	// the sort key is ascending in record id order
+	{
+		StoreIteratorPtr storeIter = ctx->createTableIterForward();
+		size_t idColumnId = tab->getColumnId("id");
+		llong recId;
+		uint64_t prevId = 0;
+		while (storeIter->increment(&recId, &recBuf)) {
+			if (recId == oldRecId)
+				continue;
+			ctx->selectOneColumn(recId, idColumnId, &recBuf);
+			uint64_t id = unaligned_load<uint64_t>(recBuf.data());
+			TERARK_RT_assert(prevId < id, std::logic_error);
+			prevId = id;
+		}
+	}
+	tab = nullptr;
+	printf("test TableBulkLoader passed\n");
+}
+
+static void copyMetaWithSegClass(const char* metaDir, const char* tableDir,
+								 const char* wrSegClass) {
+	using namespace terark;
+	namespace fs = boost::filesystem;
+	std::string json;
+	{
+		FileStream fp((fs::path(metaDir) / "dbmeta.json").string().c_str(), "r");
+		LineBuf line;
+		while (line.getline(fp.fp()) > 0)
+			json.append(line.p, line.n);
+	}
+	size_t pos = json.find("\"RowSchema\"");
+	TERARK_RT_assert(std::string::npos != pos, std::logic_error);
+	json.insert(pos, std::string("\"WritableSegmentClass\" : \"")
+					 + wrSegClass + "\",\n\t");
+	FileStream fp((fs::path(tableDir) / "dbmeta.json").string().c_str(), "w");
+	fp.ensureWrite(json.data(), json.size());
+}
+
+// "mem" writable segment requires the write ahead log, and it is reopened as
+// "mem" even if WritableSegmentClass in dbmeta.json has been changed
+void testMemSegment(const char* metaDir, size_t maxRowNum) {
+	using namespace terark;
+	namespace fs = boost::filesystem;
+	printf("test mem writable segment ...\n");
+	const char* tableDir = "memdb";
+	const char* walDir = "memdb-wal";
+	fs::remove_all(tableDir);
+	fs::remove_all(walDir);
+	fs::create_directories(tableDir);
+	copyMetaWithSegClass(metaDir, tableDir, "mem");
+	NativeDataOutput<AutoGrownMemIO> rowBuilder;
+	TestRow recRow;
+	makeTestRow(&recRow, 1, 0);
+	rowBuilder << recRow;
+	bool refused = false;
+	try {
+		CompositeTablePtr tab = CompositeTable::open(tableDir);
+		DbContextPtr ctx = tab->createDbContext();
+		ctx->insertRow(rowBuilder.written());
+	}
+	catch (const std::invalid_argument& ex) {
+		printf("without write ahead log: %s\n", ex.what());
+		refused = true;
+	}
+	TERARK_RT_assert(refused, std::logic_error);
+	fs::remove_all(tableDir);
+	fs::create_directories(tableDir);
+	copyMetaWithSegClass(metaDir, tableDir, "mem");
+
+	WriteAheadLog::openGlobal(walDir, WriteAheadLog::Options());
+	const size_t rows = std::min<size_t>(maxRowNum, 100);
+	{
+		CompositeTablePtr tab = CompositeTable::open(tableDir);
+		DbContextPtr ctx = tab->createDbContext();
+		for (size_t id = 1; id <= rows; ++id) {
+			makeTestRow(&recRow, id, 0);
+			rowBuilder.rewind();
+			rowBuilder << recRow;
+			TERARK_RT_assert(ctx->insertRow(rowBuilder.written()) >= 0, std::logic_error);
+		}
+	}
+	copyMetaWithSegClass(metaDir, tableDir, "wt");
+	{
+		CompositeTablePtr tab = CompositeTable::open(tableDir);
+		DbContextPtr ctx = tab->createDbContext();
+		valvec<llong> recIdvec;
+		valvec<byte>  recBuf;
+		for (uint64_t id = 1; id <= rows; ++id) {
+			ctx->indexSearchExact(0, Schema::fstringOf(&id), &recIdvec);
+			TERARK_RT_assert(recIdvec.size() == 1, std::logic_error);
+			ctx->getValue(recIdvec[0], &recBuf);
+			makeTestRow(&recRow, id, 0);
+			rowBuilder.rewind();
+			rowBuilder << recRow;
+			TERARK_RT_assert(fstring(recBuf) == fstring(rowBuilder.written()), std::logic_error);
+		}
+		size_t memSegNum = 0;
+		for (auto& entry : fs::recursive_directory_iterator(tableDir)) {
+			if (entry.path().filename() == "WrSegClass") {
+				LineBuf line;
+				FileStream fp(entry.path().string().c_str(), "r");
+				line.getline(fp.fp());
+				TERARK_RT_assert(fstring(line.p, line.n) == "mem", std::logic_error);
+				memSegNum++;
+			}
+		}
+		TERARK_RT_assert(memSegNum > 0, std::logic_error);
+	}
+	WriteAheadLog::closeGlobal();
+	printf("test mem writable segment passed\n");
+}
+
+// RowCache: rows are found until evicted or erased, CLOCK keeps a hot set
+// under a stream of rows read once
+void testRowCache() {
+	using namespace terark;
+	printf("test RowCache ...\n");
+	RowCache& cache = RowCache::instance();
+	const size_t oldCapacity = cache.capacity();
+	cache.setCapacity(RowCache::ShardNum * 64 * 1024);
+	TERARK_RT_assert(cache.enabled(), std::logic_error);
+	auto makeRow = [](uint64_t segId, size_t physicId) {
+		char buf[64];
+		int len = sprintf(buf, "row-%llu-%zd-", (unsigned long long)segId, physicId);
+		return std::string(buf, len) + std::string(physicId % 100, 'x');
+	};
+	valvec<byte> val;
+	uint64_t seg1 = cache.newSegmentId();
+	uint64_t seg2 = cache.newSegmentId();
+	TERARK_RT_assert(seg1 != seg2, std::logic_error);
+	for (size_t i = 0; i < 1000; ++i) {
+		cache.insert(seg1, i, makeRow(seg1, i));
+		cache.insert(seg2, i, makeRow(seg2, i));
+	}
+	for (size_t i = 0; i < 1000; ++i) {
+		TERARK_RT_assert(cache.lookup(seg1, i, &val), std::logic_error);
+		TERARK_RT_assert(fstring(val) == makeRow(seg1, i), std::logic_error);
+	}
+	TERARK_RT_assert(!cache.lookup(seg1, 1000, &val), std::logic_error);
+	RowCache::Stats st0 = cache.getStats();
+	cache.eraseSegment(seg1);
+	RowCache::Stats st1 = cache.getStats();
+	TERARK_RT_assert(st1.invalidated - st0.invalidated == 1000, std::logic_error);
+	for (size_t i = 0; i < 1000; ++i) {
+		TERARK_RT_assert(!cache.lookup(seg1, i, &val), std::logic_error);
+		TERARK_RT_assert(cache.lookup(seg2, i, &val), std::logic_error);
+	}
+	cache.eraseSegment(seg2);
+	TERARK_RT_assert(0 == cache.getStats().entries, std::logic_error);
+
+	// hot rows are read again and again, cold rows are read once, cold
+	// rows are 10x of the capacity
+	uint64_t hotSeg = cache.newSegmentId();
+	uint64_t coldSeg = cache.newSegmentId();
+	const size_t hotNum = 2000;
+	for (size_t i = 0; i < hotNum; ++i)
+		cache.insert(hotSeg, i, makeRow(hotSeg, i));
+	size_t hotHits = 0, hotReads = 0;
+	for (size_t i = 0; i < 400000; ++i) {
+		size_t h = i % hotNum;
+		hotReads++;
+		if (cache.lookup(hotSeg, h, &val))
+			hotHits++;
+		else
+			cache.insert(hotSeg, h, makeRow(hotSeg, h));
+		cache.insert(coldSeg, i, makeRow(coldSeg, i));
+	}
+	printf("RowCache hot hit ratio = %f, stats = %s\n"
+		, double(hotHits) / hotReads, cache.getStatsJson().c_str());
+	TERARK_RT_assert(hotHits > hotReads * 9 / 10, std::logic_error);
+	TERARK_RT_assert(cache.getStats().usedBytes <= cache.capacity(), std::logic_error);
+	cache.eraseSegment(hotSeg);
+	cache.eraseSegment(coldSeg);
+	cache.setCapacity(0);
+	TERARK_RT_assert(!cache.enabled(), std::logic_error);
+	TERARK_RT_assert(0 == cache.getStats().usedBytes, std::logic_error);
+	cache.setCapacity(oldCapacity);
+	printf("test RowCache passed\n");
+}
+
+// wiredtiger writable store and index are used by many threads at once,
+// each call takes a pooled cursor, contexts reuse idle sessions
+void testWtConcurrentAccess(const char* metaDir, size_t maxRowNum) {
+	using namespace terark;
+	namespace fs = boost::filesystem;
+	printf("test concurrent access of wiredtiger segment ...\n");
+	const char* tableDir = "wtconcdb";
+	fs::remove_all(tableDir);
+	fs::create_directories(tableDir);
+	copyMetaWithSegClass(metaDir, tableDir, "wt");
+	CompositeTablePtr tab = CompositeTable::open(tableDir);
+	const size_t thrNum = 8;
+	const size_t rowsPerThread = std::max<size_t>(maxRowNum / thrNum, 10);
+	std::atomic<size_t> failed(0);
+	auto writer = [&](size_t tid) {
+		NativeDataOutput<AutoGrownMemIO> rowBuilder;
+		valvec<llong> recIdvec;
+		valvec<byte>  recBuf;
+		TestRow recRow;
+		for (size_t i = 0; i < rowsPerThread; ++i) {
+			// short lived contexts take idle sessions back from the pool
+			DbContextPtr ctx = tab->createDbContext();
+			uint64_t id = tid * rowsPerThread + i + 1;
+			makeTestRow(&recRow, id, tid);
+			rowBuilder.rewind();
+			rowBuilder << recRow;
+			llong recId = ctx->insertRow(rowBuilder.written());
+			if (recId < 0) { failed++; continue; }
+			ctx->getValue(recId, &recBuf);
+			if (fstring(recBuf) != fstring(rowBuilder.written())) failed++;
+			// read rows written by other threads
+			uint64_t other = rand() % (thrNum * rowsPerThread) + 1;
+			ctx->indexSearchExact(0, Schema::fstringOf(&other), &recIdvec);
+			if (recIdvec.size() > 1) failed++;
+			for (llong otherRecId : recIdvec) {
+				ctx->getValue(otherRecId, &recBuf);
+				if (recBuf.empty()) failed++;
+			}
+		}
+	};
+	std::vector<std::thread> threads;
+	for (size_t tid = 0; tid < thrNum; ++tid)
+		threads.emplace_back(writer, tid);
+	for (auto& t : threads)
+		t.join();
+	TERARK_RT_assert(0 == failed, std::logic_error);
+	DbContextPtr ctx = tab->createDbContext();
+	valvec<llong> recIdvec;
+	valvec<byte>  recBuf;
+	NativeDataOutput<AutoGrownMemIO> rowBuilder;
+	TestRow recRow;
+	for (uint64_t id = 1; id <= thrNum * rowsPerThread; ++id) {
+		ctx->indexSearchExact(0, Schema::fstringOf(&id), &recIdvec);
+		TERARK_RT_assert(recIdvec.size() == 1, std::logic_error);
+		ctx->getValue(recIdvec[0], &recBuf);
+		makeTestRow(&recRow, id, (id - 1) / rowsPerThread);
+		rowBuilder.rewind();
+		rowBuilder << recRow;
+		TERARK_RT_assert(fstring(recBuf) == fstring(rowBuilder.written()), std::logic_error);
+	}
+	TERARK_RT_assert(tab->numDataRows() == llong(thrNum * rowsPerThread), std::logic_error);
+	printf("test concurrent access of wiredtiger segment passed\n");
+}
+
+// value == NULL removes name
+static void setTestEnv(const char* name, const char* value) {
+#if defined(_MSC_VER)
+	_putenv_s(name, value ? value : "");
+#else
+	if (value)
+		setenv(name, value, 1);
+	else
+		unsetenv(name);
+#endif
+}
+
+// rows of id in [1, rows], rows whose id is a multiple of 7 are removed,
+// all segments are readonly when it returns if finishWriting is true,
+// else the table has readonly(or being converted) segments and a
+// writable segment
+static CompositeTablePtr
+createTestTable(const char* metaDir, const char* tableDir, size_t rows,
+				bool finishWriting = true) {
+	using namespace terark;
+	namespace fs = boost::filesystem;
+	fs::remove_all(tableDir);
+	fs::create_directories(tableDir);
+	fs::copy_file(fs::path(metaDir) / "dbmeta.json",
+				  fs::path(tableDir) / "dbmeta.json");
+	CompositeTablePtr tab = CompositeTable::open(tableDir);
+	DbContextPtr ctx = tab->createDbContext();
+	NativeDataOutput<AutoGrownMemIO> rowBuilder;
+	TestRow recRow;
+	valvec<llong> recIds;
+	for (size_t id = 1; id <= rows; ++id) {
+		makeTestRow(&recRow, id, 0);
+		rowBuilder.rewind();
+		rowBuilder << recRow;
+		llong recId = ctx->insertRow(rowBuilder.written());
+		TERARK_RT_assert(recId >= 0, std::logic_error);
+		if (id % 7 == 0)
+			recIds.push_back(recId);
+	}
+	for (llong recId : recIds)
+		ctx->removeRow(recId);
+	if (finishWriting)
+		tab->syncFinishWriting();
+	return tab;
 }
 
+struct TableDump {
+	std::vector<std::pair<terark::llong, std::string> > rows;
+	std::vector<std::vector<std::pair<terark::llong, std::string> > > indices;
+};
+
+static void dumpTable(CompositeTable* tab, TableDump* d) {
+	using namespace terark;
+	DbContextPtr ctx = tab->createDbContext();
+	llong recId;
+	valvec<byte> val;
+	d->rows.clear();
+	StoreIteratorPtr storeIter = ctx->createTableIterForward();
+	while (storeIter->increment(&recId, &val))
+		d->rows.emplace_back(recId, std::string((char*)val.data(), val.size()));
+	d->indices.resize(tab->getIndexNum());
+	for (size_t indexId = 0; indexId < tab->getIndexNum(); ++indexId) {
+		auto& entries = d->indices[indexId];
+		entries.clear();
+		IndexIteratorPtr indexIter = tab->createIndexIterForward(indexId);
+		while (indexIter->increment(&recId, &val))
+			entries.emplace_back(recId, std::string((char*)val.data(), val.size()));
+	}
+}
+
+// indices and colgroups of a segment built in parallel by convFrom must be
+// the same as built one by one
+void testParallelBuild(const char* metaDir, size_t maxRowNum) {
+	printf("test parallel build of readonly segment ...\n");
+	const size_t rows = std::max<size_t>(maxRowNum, 1000);
+	TableDump serial, parallel;
+	setTestEnv("TerarkDB_ParallelBuildThreads", "1");
+	{
+		CompositeTablePtr tab = createTestTable(metaDir, "pbuild-serial", rows);
+		dumpTable(tab.get(), &serial);
+	}
+	setTestEnv("TerarkDB_ParallelBuildThreads", NULL);
+	{
+		CompositeTablePtr tab = createTestTable(metaDir, "pbuild-parallel", rows);
+		dumpTable(tab.get(), &parallel);
+	}
+	TERARK_RT_assert(serial.rows.size() == rows - rows / 7, std::logic_error);
+	TERARK_RT_assert(serial.rows == parallel.rows, std::logic_error);
+	TERARK_RT_assert(serial.indices == parallel.indices, std::logic_error);
+	for (auto& entries : serial.indices) {
+		TERARK_RT_assert(entries.size() == serial.rows.size(), std::logic_error);
+	}
+	printf("test parallel build of readonly segment passed\n");
+}
+
+// loser tree merge of TableIndexIter over several segments: forward is
+// strictly ascending(keys are distinct) and has all live rows, backward is
+// reversed forward, indexScanParallel ranges concatenated are forward
+void testIndexIterMerge(const char* metaDir, size_t maxRowNum) {
+	using namespace terark;
+	printf("test index iterator merge and indexScanParallel ...\n");
+	const size_t rows = std::max<size_t>(maxRowNum, 1000);
+	CompositeTablePtr tab = createTestTable(metaDir, "idxmergedb", rows, false);
+	TERARK_RT_assert(tab->getSegNum() > 1, std::logic_error);
+	DbContextPtr ctx = tab->createDbContext();
+	std::set<llong> liveIds;
+	{
+		StoreIteratorPtr storeIter = ctx->createTableIterForward();
+		llong recId;
+		valvec<byte> val;
+		while (storeIter->increment(&recId, &val))
+			liveIds.insert(recId);
+	}
+	TERARK_RT_assert(liveIds.size() == rows - rows / 7, std::logic_error);
+	typedef std::vector<std::pair<llong, std::string> > Entries;
+	for (size_t indexId = 0; indexId < tab->getIndexNum(); ++indexId) {
+		const Schema& schema = tab->getIndexSchema(indexId);
+		llong recId;
+		valvec<byte> key;
+		Entries fwd, bwd;
+		IndexIteratorPtr iter = tab->createIndexIterForward(indexId);
+		while (iter->increment(&recId, &key))
+			fwd.emplace_back(recId, std::string((char*)key.data(), key.size()));
+		iter = tab->createIndexIterBackward(indexId);
+		while (iter->increment(&recId, &key))
+			bwd.emplace_back(recId, std::string((char*)key.data(), key.size()));
+		TERARK_RT_assert(fwd.size() == liveIds.size(), std::logic_error);
+		std::set<llong> fwdIds;
+		valvec<llong> recIdvec;
+		for (size_t i = 0; i < fwd.size(); ++i) {
+			if (i > 0) {
+				TERARK_RT_assert(schema.compareData(fwd[i-1].second, fwd[i].second) < 0,
+								 std::logic_error);
+			}
+			fwdIds.insert(fwd[i].first);
+			ctx->indexSearchExact(indexId, fwd[i].second, &recIdvec);
+			TERARK_RT_assert(std::find(recIdvec.begin(), recIdvec.end(), fwd[i].first)
+							 != recIdvec.end(), std::logic_error);
+		}
+		TERARK_RT_assert(fwdIds == liveIds, std::logic_error);
+		std::reverse(bwd.begin(), bwd.end());
+		TERARK_RT_assert(bwd == fwd, std::logic_error);
+
+		// the first bound is the min key, range 0 is empty
+		std::string b[4] = {
+			fwd[0].second,
+			fwd[fwd.size() / 4].second,
+			fwd[fwd.size() / 2].second,
+			fwd[fwd.size() * 3 / 4].second,
+		};
+		fstring bounds[4] = { b[0], b[1], b[2], b[3] };
+		std::vector<Entries> ranges(5);
+		tab->indexScanParallel(indexId, bounds, 4,
+			[&](size_t rangeIdx, llong id, fstring k) {
+				// a range is scanned by one thread
+				ranges[rangeIdx].emplace_back(id, k.str());
+				return true;
+			});
+		TERARK_RT_assert(ranges[0].empty(), std::logic_error);
+		Entries all;
+		for (size_t r = 0; r < ranges.size(); ++r) {
+			for (auto& e : ranges[r]) {
+				if (r > 0) {
+					TERARK_RT_assert(schema.compareData(bounds[r-1], e.second) <= 0,
+									 std::logic_error);
+				}
+				if (r < 4) {
+					TERARK_RT_assert(schema.compareData(e.second, bounds[r]) < 0,
+									 std::logic_error);
+				}
+			}
+			all.insert(all.end(), ranges[r].begin(), ranges[r].end());
+		}
+		TERARK_RT_assert(all == fwd, std::logic_error);
+	}
+	tab->syncFinishWriting();
+	printf("test index iterator merge and indexScanParallel passed\n");
+}
+
+// getStoreScanRanges covers all record ids of readonly and writable
+// segments exactly once, storeScanParallel gets the same rows as
+// createStoreIterForward
+void testStoreScanParallel(const char* metaDir, size_t maxRowNum) {
+	using namespace terark;
+	printf("test partitioned store scan ...\n");
+	const size_t rows = std::max<size_t>(maxRowNum, 1000);
+	CompositeTablePtr tab = createTestTable(metaDir, "storescandb", rows, false);
+	DbContextPtr ctx = tab->createDbContext();
+	std::map<llong, std::string> expected;
+	{
+		StoreIteratorPtr storeIter = ctx->createTableIterForward();
+		llong recId;
+		valvec<byte> val;
+		while (storeIter->increment(&recId, &val))
+			expected[recId] = std::string((char*)val.data(), val.size());
+	}
+	TERARK_RT_assert(expected.size() == rows - rows / 7, std::logic_error);
+	TERARK_RT_assert(tab->getSegNum() > 1, std::logic_error);
+
+	auto ranges = tab->getStoreScanRanges(64);
+	TERARK_RT_assert(!ranges.empty(), std::logic_error);
+	TERARK_RT_assert(ranges[0].first == 0, std::logic_error);
+	TERARK_RT_assert(ranges.back().second == tab->numDataRows(), std::logic_error);
+	std::map<llong, std::string> scanned;
+	for (size_t i = 0; i < ranges.size(); ++i) {
+		auto r = ranges[i];
+		TERARK_RT_assert(r.first < r.second, std::logic_error);
+		TERARK_RT_assert(i == 0 || ranges[i-1].second == r.first, std::logic_error);
+		// throws if the range is not in one segment
+		StoreIteratorPtr iter(tab->createStoreIterRange(r.first, r.second, ctx.get()));
+		llong recId;
+		valvec<byte> val;
+		while (iter->increment(&recId, &val)) {
+			TERARK_RT_assert(r.first <= recId && recId < r.second, std::logic_error);
+			bool isNew = scanned.insert(std::make_pair(recId,
+				std::string((char*)val.data(), val.size()))).second;
+			TERARK_RT_assert(isNew, std::logic_error);
+		}
+	}
+	TERARK_RT_assert(scanned == expected, std::logic_error);
+
+	std::mutex mtx;
+	scanned.clear();
+	size_t dupNum = 0;
+	tab->storeScanParallel(4, [&](size_t, llong recId, fstring row) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!scanned.insert(std::make_pair(recId, row.str())).second)
+			dupNum++;
+		return true;
+	});
+	TERARK_RT_assert(0 == dupNum, std::logic_error);
+	TERARK_RT_assert(scanned == expected, std::logic_error);
+	tab->syncFinishWriting();
+	printf("test partitioned store scan passed\n");
+}
+
+// acquireMem blocks while the budget is held by others, a request larger
+// than the budget is capped and granted when nothing else is held
+void testBgMemBudget() {
+	printf("test BgScheduler memory budget ...\n");
+	BgScheduler sched; // not the global instance, no thread is started
+	sched.setMemBudget(1000);
+	TERARK_RT_assert(sched.capWorkMem(5000) == 1000, std::logic_error);
+	TERARK_RT_assert(sched.capWorkMem(10) == 10, std::logic_error);
+	size_t a = sched.acquireMem(600);
+	TERARK_RT_assert(600 == a, std::logic_error);
+	std::atomic<bool> acquired(false);
+	size_t b = 0;
+	std::thread waiter([&]() {
+		b = sched.acquireMem(600);
+		acquired = true;
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	TERARK_RT_assert(!acquired, std::logic_error);
+	TERARK_RT_assert(sched.getStats().memUsed == 600, std::logic_error);
+	sched.releaseMem(a);
+	waiter.join();
+	TERARK_RT_assert(acquired && 600 == b, std::logic_error);
+	TERARK_RT_assert(sched.getStats().memWaits == 1, std::logic_error);
+	sched.releaseMem(b);
+	size_t c = sched.acquireMem(5000); // larger than budget, nothing held
+	TERARK_RT_assert(1000 == c, std::logic_error);
+	sched.releaseMem(c);
+	TERARK_RT_assert(sched.getStats().memUsed == 0, std::logic_error);
+	sched.setMemBudget(0); // unlimited
+	c = sched.acquireMem(5000);
+	TERARK_RT_assert(5000 == c, std::logic_error);
+	sched.releaseMem(c);
+	printf("test BgScheduler memory budget passed\n");
+}
+
+// TableStats: counters summed over shards, histogram percentiles are the
+// upper bound of the bucket holding the rank, getStatsJson of a table
+// counts each exact lookup once and each probed segment once
+void testTableStats(const char* metaDir, size_t maxRowNum) {
+	using namespace terark;
+	printf("test table stats ...\n");
+	setTestEnv("TerarkDB_LatencySampleRate", "1");
+	{
+		TableStats st;
+		st.addExactLookup(0, 3);
+		st.addExactLookup(5, 10, 4);
+		st.addSegHit(1, 2);
+		st.addSegHit(2, 100); // shares the last slot
+		// bucket b holds [2^(b-1), 2^b) ns
+		for (size_t i = 0; i < 990; ++i)
+			st.addLatency(i % TableStats::ShardNum, TableStats::IndexSeek, 1000);
+		for (size_t i = 0; i < 9; ++i)
+			st.addLatency(i % TableStats::ShardNum, TableStats::IndexSeek, 100000);
+		st.addLatency(3, TableStats::IndexSeek, 10000000);
+		st.addLatency(0, TableStats::ValueFetch, 0);
+		st.addBgOp(TableStats::Merge, 2.5);
+		st.addBgOp(TableStats::Merge, 1.5);
+		json js = json::parse(st.toJson());
+		TERARK_RT_assert(js["exactLookups"].get<double>() == 5, std::logic_error);
+		TERARK_RT_assert(js["segProbes"].get<double>() == 13, std::logic_error);
+		TERARK_RT_assert(js["avgSegProbes"].get<double>() == 13.0 / 5, std::logic_error);
+		TERARK_RT_assert(js["bytesDecompressed"].get<double>() == 0, std::logic_error);
+		TERARK_RT_assert(js["latencySampleRate"].get<double>() == 1, std::logic_error);
+		const json& hits = js["segHits"];
+		TERARK_RT_assert(hits.is_array(), std::logic_error);
+		TERARK_RT_assert(hits.size() == TableStats::SegSlotNum, std::logic_error);
+		TERARK_RT_assert(hits[2].get<double>() == 1 && hits[1].get<double>() == 0, std::logic_error);
+		TERARK_RT_assert(hits[TableStats::SegSlotNum-1].get<double>() == 1, std::logic_error);
+		const json& seek = js["indexSeek"];
+		TERARK_RT_assert(seek["samples"].get<double>() == 1000, std::logic_error);
+		TERARK_RT_assert(std::abs(seek["avgUs"].get<double>() - 11.89) < 1e-9, std::logic_error);
+		TERARK_RT_assert(seek["p50Us"].get<double>() == 1.024, std::logic_error);
+		TERARK_RT_assert(seek["p99Us"].get<double>() == 131.072, std::logic_error);
+		TERARK_RT_assert(seek["p999Us"].get<double>() == 16777.216, std::logic_error);
+		const json& fetch = js["valueFetch"];
+		TERARK_RT_assert(fetch["samples"].get<double>() == 1, std::logic_error);
+		TERARK_RT_assert(fetch["p50Us"].get<double>() == 0.001, std::logic_error);
+		const json& merge = js["merge"];
+		TERARK_RT_assert(merge["count"].get<double>() == 2, std::logic_error);
+		TERARK_RT_assert(merge["sumMs"].get<double>() == 4.0, std::logic_error);
+		TERARK_RT_assert(merge["avgMs"].get<double>() == 2.0, std::logic_error);
+		TERARK_RT_assert(merge["maxMs"].get<double>() == 2.5, std::logic_error);
+		TERARK_RT_assert(js["flush"]["count"].get<double>() == 0, std::logic_error);
+		TERARK_RT_assert(js["convert"]["count"].get<double>() == 0, std::logic_error);
+	}
+	{
+		TableStats st;
+		json js = json::parse(st.toJson());
+		TERARK_RT_assert(js["avgSegProbes"].get<double>() == 0.0, std::logic_error);
+		TERARK_RT_assert(js["segHits"].is_array(), std::logic_error);
+		TERARK_RT_assert(js["segHits"].empty(), std::logic_error);
+		TERARK_RT_assert(js["indexSeek"]["p99Us"].get<double>() == 0.0, std::logic_error);
+	}
+	const size_t rows = std::max<size_t>(maxRowNum, 1000);
+	CompositeTablePtr tab = createTestTable(metaDir, "statsdb", rows, false);
+	const size_t segNum = tab->getSegNum();
+	TERARK_RT_assert(segNum > 1, std::logic_error);
+	DbContextPtr ctx = tab->createDbContext();
+	json before = json::parse(tab->getStatsJson());
+	const size_t idIndexId = tab->getIndexId("id");
+	valvec<llong> recIds;
+	size_t found = 0;
+	for (uint64_t id = 1; id <= rows; ++id) {
+		ctx->indexSearchExact(idIndexId, Schema::fstringOf(&id), &recIds);
+		found += recIds.size();
+	}
+	TERARK_RT_assert(found == rows - rows / 7, std::logic_error);
+	json after = json::parse(tab->getStatsJson());
+	static const char* keys[] = {
+		"exactLookups", "segProbes", "avgSegProbes", "bytesDecompressed",
+		"segHits", "latencySampleRate", "indexSeek", "valueFetch",
+		"flush", "convert", "merge",
+	};
+	for (const char* key : keys) {
+		TERARK_RT_assert(after.count(key) == 1, std::logic_error);
+	}
+	TERARK_RT_assert(after.size() == sizeof(keys)/sizeof(keys[0]), std::logic_error);
+	for (const char* key : { "indexSeek", "valueFetch" }) {
+		for (const char* sub : { "samples", "avgUs", "p50Us", "p99Us", "p999Us" })
+			TERARK_RT_assert(after[key].count(sub) == 1, std::logic_error);
+	}
+	for (const char* key : { "flush", "convert", "merge" }) {
+		for (const char* sub : { "count", "sumMs", "avgMs", "maxMs" })
+			TERARK_RT_assert(after[key].count(sub) == 1, std::logic_error);
+	}
+	auto delta = [&](const char* key) {
+		return after[key].get<unsigned long long>() -
+			  before[key].get<unsigned long long>();
+	};
+	unsigned long long lookups = delta("exactLookups");
+	unsigned long long probes = delta("segProbes");
+	TERARK_RT_assert(lookups == rows, std::logic_error);
+	TERARK_RT_assert(probes >= lookups, std::logic_error);
+	TERARK_RT_assert(probes <= lookups * segNum, std::logic_error);
+	unsigned long long hits = 0;
+	for (auto& h : after["segHits"]) hits += h.get<unsigned long long>();
+	for (auto& h : before["segHits"]) hits -= h.get<unsigned long long>();
+	TERARK_RT_assert(hits == found, std::logic_error);
+	TERARK_RT_assert(after["indexSeek"]["samples"].get<unsigned long long>() -
+		before["indexSeek"]["samples"].get<unsigned long long>() == rows,
+		std::logic_error);
+	setTestEnv("TerarkDB_LatencySampleRate", NULL);
+	printf("test table stats passed, lookups=%llu, probes=%llu\n", lookups, probes);
+}
+
+static terark::valvec<MergeSegInfo>
+makeMergeSegs(std::initializer_list<terark::llong> sizes) {
+	terark::valvec<MergeSegInfo> segs;
+	for (terark::llong size : sizes) {
+		MergeSegInfo si;
+		si.rows = size;
+		si.delcnt = 0;
+		si.dataSize = size;
+		segs.push_back(si);
+	}
+	return segs;
+}
+
+static bool
+pickMerge(const char* policyName, const SchemaConfig& conf,
+		  const terark::valvec<MergeSegInfo>& segs, bool force, MergePlan* plan) {
+	MergePolicyPtr policy = MergePolicy::create(policyName);
+	*plan = MergePlan();
+	return policy->pickMerge(conf, segs, force, plan);
+}
+
+#define CHECK_PLAN(policy, conf, segs, force, Beg, Num) do { \
+	MergePlan plan; \
+	TERARK_RT_assert(pickMerge(policy, conf, segs, force, &plan), std::logic_error); \
+	TERARK_RT_assert(plan.beg == Beg && plan.num == Num, std::logic_error); \
+} while (0)
+#define CHECK_NO_PLAN(policy, conf, segs, force) do { \
+	MergePlan plan; \
+	TERARK_RT_assert(!pickMerge(policy, conf, segs, force, &plan), std::logic_error); \
+} while (0)
+
+// which segments each merge policy picks, MaxMergeSegNum and
+// MaxReadonlySegNum are off by default and Default never uses them
+void testMergePolicy() {
+	using namespace terark;
+	printf("test merge policy ...\n");
+	SchemaConfig defaultConf;
+	TERARK_RT_assert(0 == defaultConf.m_maxMergeSegNum, std::logic_error);
+	TERARK_RT_assert(0 == defaultConf.m_maxReadonlySegNum, std::logic_error);
+	SchemaConfig conf;
+	auto resetConf = [&]() {
+		conf.m_minMergeSegNum = 2;
+		conf.m_maxMergeSegNum = 0;
+		conf.m_maxReadonlySegNum = 0;
+		conf.m_mergeSizeRatio = 4;
+	};
+	resetConf();
+
+	// Default: longest run of segs with rows <= avg*7/4(avg*3 for force)
+	CHECK_NO_PLAN("Default", conf, makeMergeSegs({100}), false);
+	CHECK_PLAN("Default", conf, makeMergeSegs({100,100,100,500,100,100}), false, 0, 3);
+	CHECK_PLAN("Default", conf, makeMergeSegs({500,100,100,500,100,100,100}), false, 4, 3);
+	CHECK_PLAN("Default", conf, makeMergeSegs({100,100,400,100}), false, 0, 2);
+	CHECK_PLAN("Default", conf, makeMergeSegs({100,100,400,100}), true, 0, 4);
+	CHECK_NO_PLAN("Default", conf, makeMergeSegs({100,1000,100,1000}), false);
+	{
+		conf.m_minMergeSegNum = 4;
+		CHECK_NO_PLAN("Default", conf, makeMergeSegs({100,100,100,500,100,100}), false);
+		conf.m_minMergeSegNum = 2;
+		conf.m_maxMergeSegNum = 2;    // not a cap of Default
+		conf.m_maxReadonlySegNum = 2; // no readAmp fallback of Default
+		CHECK_PLAN("Default", conf, makeMergeSegs({100,100,100,500,100,100}), false, 0, 3);
+		CHECK_NO_PLAN("Default", conf, makeMergeSegs({100,1000,100,1000}), false);
+		resetConf();
+	}
+
+	// Tiered: run of similar sizes with max benefit per rewritten byte
+	CHECK_PLAN("Tiered", conf, makeMergeSegs({1000,100,110,120,1000}), false, 1, 3);
+	CHECK_NO_PLAN("Tiered", conf, makeMergeSegs({1000,100}), false);
+	{
+		conf.m_maxMergeSegNum = 2;
+		CHECK_PLAN("Tiered", conf, makeMergeSegs({1000,100,110,120,1000}), false, 1, 2);
+		conf.m_maxMergeSegNum = 0;
+		conf.m_maxReadonlySegNum = 2;
+		CHECK_PLAN("Tiered", conf, makeMergeSegs({1000,100}), false, 0, 2);
+		conf.m_maxReadonlySegNum = 3;
+		CHECK_NO_PLAN("Tiered", conf, makeMergeSegs({1000,100}), false);
+		resetConf();
+	}
+	CHECK_PLAN("Tiered", conf, makeMergeSegs({1000,100}), true, 0, 2);
+
+	// Leveled: newer segs are merged into the oldest seg j whose size is
+	// reached by ratio * sum of segs after j
+	CHECK_PLAN("Leveled", conf, makeMergeSegs({1000,100,60,40}), false, 1, 3);
+	CHECK_PLAN("Leveled", conf, makeMergeSegs({1000,100,60,40,50}), false, 0, 5);
+	CHECK_NO_PLAN("Leveled", conf, makeMergeSegs({1000,100}), false);
+	{
+		conf.m_maxMergeSegNum = 3;
+		CHECK_PLAN("Leveled", conf, makeMergeSegs({1000,100,60,40,50}), false, 2, 3);
+		resetConf();
+	}
+	printf("test merge policy passed\n");
+}
+
+static std::string readTextFile(const std::string& fpath) {
+	using namespace terark;
+	std::string text;
+	FileStream fp(fpath.c_str(), "r");
+	LineBuf line;
+	while (line.getline(fp.fp()) > 0)
+		text.append(line.p, line.n);
+	return text;
+}
+
+static void replaceAll(std::string* s, const std::string& from, const std::string& to) {
+	for (size_t pos = 0; (pos = s->find(from, pos)) != std::string::npos; pos += to.size())
+		s->replace(pos, from.size(), to);
+}
+
+// merge with purge builds one store for colgroup str34, by each path of
+// mergeAndPurgeColgroup:
+//   stream : rows exceed CompressingWorkMemSize, streamed to dictZip
+//   memory : rows fit in CompressingWorkMemSize
+//   noDict : dictZip disabled, rows are loaded to memory even if they
+//            exceed the memory budget
+void testMergePurgeColgroup(const char* metaDir, size_t maxRowNum) {
+	using namespace terark;
+	namespace fs = boost::filesystem;
+	printf("test merge and purge colgroup ...\n");
+	const std::string meta = readTextFile((fs::path(metaDir) / "dbmeta.json").string());
+	const size_t rows = std::max<size_t>(maxRowNum, 1000);
+	const char* variants[] = { "stream", "memory", "noDict" };
+	for (const char* variant : variants) {
+		std::string json = meta;
+		long long oldBudget = BgScheduler::instance().getMemBudget();
+		if (strcmp(variant, "memory") == 0) {
+			replaceAll(&json, "\"CompressingWorkMemSize\" : \"10K\"",
+							  "\"CompressingWorkMemSize\" : \"64M\"");
+		}
+		else if (strcmp(variant, "noDict") == 0) {
+			replaceAll(&json, "\"dictZipSampleRatio\": 0.0",
+							  "\"dictZipSampleRatio\": -1.0");
+			BgScheduler::instance().setMemBudget(4096);
+		}
+		TERARK_RT_assert(json != meta || strcmp(variant, "stream") == 0, std::logic_error);
+		std::string variantMetaDir = std::string("mergepurge-meta-") + variant;
+		fs::remove_all(variantMetaDir);
+		fs::create_directories(variantMetaDir);
+		{
+			FileStream fp((fs::path(variantMetaDir) / "dbmeta.json").string().c_str(), "w");
+			fp.ensureWrite(json.data(), json.size());
+		}
+		std::string tableDir = std::string("mergepurgedb-") + variant;
+		CompositeTablePtr tab = createTestTable(variantMetaDir.c_str(), tableDir.c_str(), rows, false);
+		auto readonlyNum = [&]() {
+			size_t n = 0;
+			for (size_t i = 0; i < tab->getSegNum(); ++i)
+				n += tab->getSegmentPtr(i)->getReadonlySegment() ? 1 : 0;
+			return n;
+		};
+		for (size_t i = 0; i < 8 && readonlyNum() != 1; ++i)
+			tab->compact(); // force merge and purge
+		tab->syncFinishWriting();
+		BgScheduler::instance().setMemBudget(oldBudget);
+		TERARK_RT_assert(tab->getSegNum() == 1 && readonlyNum() == 1, std::logic_error);
+		const ReadonlySegment* seg = tab->getSegmentPtr(0)->getReadonlySegment();
+		const size_t cgId = tab->getColgroupId("str34");
+		TERARK_RT_assert(cgId < tab->getColgroupNum(), std::logic_error);
+		TERARK_RT_assert(seg->m_isPurged.max_rank1() > 0, std::logic_error);
+		TERARK_RT_assert(dynamic_cast<const MultiPartStore*>(seg->m_colgroups[cgId].get())
+						 == nullptr, std::logic_error);
+		DbContextPtr ctx = tab->createDbContext();
+		NativeDataOutput<AutoGrownMemIO> rowBuilder;
+		TestRow recRow;
+		valvec<llong> recIdvec;
+		valvec<byte>  recBuf;
+		for (uint64_t id = 1; id <= rows; ++id) {
+			ctx->indexSearchExact(0, Schema::fstringOf(&id), &recIdvec);
+			if (id % 7 == 0) {
+				TERARK_RT_assert(recIdvec.empty(), std::logic_error);
+				continue;
+			}
+			TERARK_RT_assert(recIdvec.size() == 1, std::logic_error);
+			ctx->getValue(recIdvec[0], &recBuf);
+			makeTestRow(&recRow, id, 0);
+			rowBuilder.rewind();
+			rowBuilder << recRow;
+			TERARK_RT_assert(fstring(recBuf) == fstring(rowBuilder.written()), std::logic_error);
+		}
+		printf("merge and purge colgroup(%s) passed\n", variant);
+	}
+	printf("test merge and purge colgroup passed\n");
+}
+
+// WriteAheadLog: aborted records are skipped, a broken tail is ignored,
+// records of a detached segment are not replayed
+void testWalReplay() {
+	using namespace terark;
+	namespace fs = boost::filesystem;
+	printf("test WriteAheadLog replay ...\n");
+	const char* walDir = "wal-test";
+	const char* segDir = "wal-test-seg";
+	fs::remove_all(walDir);
+	fs::remove_all(segDir);
+	fs::create_directories(segDir);
+	uint64_t segUid = WriteAheadLog::getSegmentUid(segDir);
+	TERARK_RT_assert(WriteAheadLog::getSegmentUid(segDir) == segUid, std::logic_error);
+	struct Op { int type; llong subId; std::string row; };
+	std::vector<Op> expected, replayed;
+	auto onReplay = [&](WriteAheadLog::OpType type, llong subId, fstring row) {
+		replayed.push_back(Op{type, subId, row.str()});
+	};
+	{
+		WriteAheadLog wal(walDir, WriteAheadLog::Options());
+		wal.attachSegment(segUid);
+		for (llong i = 0; i < 100; ++i) {
+			valvec<byte> ops;
+			std::string row = "row-" + std::to_string(i);
+			WriteAheadLog::encodePut(&ops, i, row);
+			if (i % 10 == 9)
+				WriteAheadLog::encodeRemove(&ops, i - 5);
+			uint64_t lsn = wal.append(segUid, ops);
+			if (i % 7 == 3) {
+				wal.abort(lsn); // this transaction is failed
+				continue;
+			}
+			wal.waitDurable(lsn);
+			expected.push_back(Op{WriteAheadLog::OpPut, i, row});
+			if (i % 10 == 9)
+				expected.push_back(Op{WriteAheadLog::OpRemove, i - 5, ""});
+		}
+		// records appended by this process are not replayed
+		TERARK_RT_assert(wal.replay(segUid, onReplay) == 0, std::logic_error);
+	} // crash: segment was not detached
+	{
+		// a torn write at the tail
+		std::string fpath;
+		for (auto& ent : fs::directory_iterator(walDir))
+			fpath = std::max(fpath, ent.path().string());
+		FileStream fp(fpath.c_str(), "ab");
+		fp.ensureWrite("\x40\0\0\0garbage", 11);
+	}
+	{
+		WriteAheadLog wal(walDir, WriteAheadLog::Options());
+		wal.attachSegment(segUid);
+		size_t opNum = wal.replay(segUid, onReplay);
+		TERARK_RT_assert(opNum == expected.size(), std::logic_error);
+		TERARK_RT_assert(replayed.size() == expected.size(), std::logic_error);
+		for (size_t i = 0; i < expected.size(); ++i) {
+			TERARK_RT_assert(replayed[i].type == expected[i].type, std::logic_error);
+			TERARK_RT_assert(replayed[i].subId == expected[i].subId, std::logic_error);
+			TERARK_RT_assert(replayed[i].row == expected[i].row, std::logic_error);
+		}
+		wal.detachSegment(segUid); // segment data is saved
+	}
+	{
+		WriteAheadLog wal(walDir, WriteAheadLog::Options());
+		replayed.clear();
+		TERARK_RT_assert(wal.replay(segUid, onReplay) == 0, std::logic_error);
+	}
+	// abort returns after the abort mark is on disk: a copy of the log
+	// files taken right after it is what a crash would leave behind
+	const char* crashDir = "wal-test-crash";
+	fs::remove_all(crashDir);
+	{
+		WriteAheadLog wal(walDir, WriteAheadLog::Options());
+		wal.attachSegment(segUid);
+		valvec<byte> ops;
+		WriteAheadLog::encodePut(&ops, 1, "failed");
+		uint64_t lsn = wal.append(segUid, ops);
+		wal.waitDurable(lsn); // as if written by a group commit
+		wal.abort(lsn);
+		fs::create_directories(crashDir);
+		for (auto& ent : fs::directory_iterator(walDir))
+			fs::copy_file(ent.path(), fs::path(crashDir) / ent.path().filename());
+	}
+	{
+		WriteAheadLog wal(crashDir, WriteAheadLog::Options());
+		wal.attachSegment(segUid);
+		replayed.clear();
+		TERARK_RT_assert(wal.replay(segUid, onReplay) == 0, std::logic_error);
+	}
+	fs::remove_all(crashDir);
+	fs::remove_all(walDir);
+	fs::remove_all(segDir);
+	printf("test WriteAheadLog replay passed\n");
+}
+
+#if !defined(_MSC_VER)
+// a child process writes through a mem segment and crashes without saving
+// anything, the table is recovered from the write ahead log, run.lock of
+// the dead child does not block opening, run.lock of a live table does.
+// it forks, so it must run before any background thread is started
+void testWalCrashRecovery(const char* metaDir, size_t maxRowNum) {
+	using namespace terark;
+	namespace fs = boost::filesystem;
+	printf("test crash recovery by WriteAheadLog ...\n");
+	const char* tableDir = "crashdb";
+	const char* walDir = "crashdb-wal";
+	fs::remove_all(tableDir);
+	fs::remove_all(walDir);
+	fs::create_directories(tableDir);
+	copyMetaWithSegClass(metaDir, tableDir, "mem");
+	const size_t rows = std::min<size_t>(maxRowNum, 50);
+	NativeDataOutput<AutoGrownMemIO> rowBuilder;
+	TestRow recRow;
+	auto makeRow = [&](uint64_t id, size_t seq) {
+		makeTestRow(&recRow, id, seq);
+		rowBuilder.rewind();
+		rowBuilder << recRow;
+		return fstring(rowBuilder.written());
+	};
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+	TERARK_RT_assert(pid >= 0, std::runtime_error);
+	if (0 == pid) {
+		try {
+			WriteAheadLog::openGlobal(walDir, WriteAheadLog::Options());
+			CompositeTablePtr tab = CompositeTable::open(tableDir);
+			DbContextPtr ctx = tab->createDbContext();
+			for (size_t id = 1; id <= rows; ++id) {
+				if (ctx->insertRow(makeRow(id, 0)) < 0)
+					_exit(2);
+			}
+			ctx->upsertRow(makeRow(1, 1));
+			valvec<llong> recIdvec;
+			uint64_t id2 = 2;
+			ctx->indexSearchExact(0, Schema::fstringOf(&id2), &recIdvec);
+			if (recIdvec.size() != 1)
+				_exit(3);
+			ctx->removeRow(recIdvec[0]);
+		}
+		catch (const std::exception& ex) {
+			fprintf(stderr, "ERROR: crash child: %s\n", ex.what());
+			_exit(1);
+		}
+		_exit(0); // crash: no segment is saved, no destructor is called
+	}
+	int status = 0;
+	TERARK_RT_assert(waitpid(pid, &status, 0) == pid, std::runtime_error);
+	TERARK_RT_assert(WIFEXITED(status) && 0 == WEXITSTATUS(status), std::logic_error);
+	TERARK_RT_assert(fs::exists(fs::path(tableDir) / "run.lock"), std::logic_error);
+	bool refused = false;
+	try {
+		CompositeTablePtr tab = CompositeTable::open(tableDir);
+	}
+	catch (const std::invalid_argument& ex) {
+		printf("open unclean table without write ahead log: %s\n", ex.what());
+		refused = true;
+	}
+	TERARK_RT_assert(refused, std::logic_error);
+
+	WriteAheadLog::openGlobal(walDir, WriteAheadLog::Options());
+	{
+		CompositeTablePtr tab = CompositeTable::open(tableDir);
+		refused = false;
+		try {
+			CompositeTablePtr tab2 = CompositeTable::open(tableDir);
+		}
+		catch (const std::invalid_argument& ex) {
+			printf("open table in using: %s\n", ex.what());
+			refused = true;
+		}
+		TERARK_RT_assert(refused, std::logic_error);
+		DbContextPtr ctx = tab->createDbContext();
+		valvec<llong> recIdvec;
+		valvec<byte>  recBuf;
+		for (uint64_t id = 1; id <= rows; ++id) {
+			ctx->indexSearchExact(0, Schema::fstringOf(&id), &recIdvec);
+			if (2 == id) {
+				TERARK_RT_assert(recIdvec.empty(), std::logic_error);
+				continue;
+			}
+			TERARK_RT_assert(recIdvec.size() == 1, std::logic_error);
+			ctx->getValue(recIdvec[0], &recBuf);
+			TERARK_RT_assert(fstring(recBuf) == makeRow(id, 1 == id ? 1 : 0), std::logic_error);
+		}
+	}
+	WriteAheadLog::closeGlobal();
+	printf("test crash recovery by WriteAheadLog passed\n");
+}
+#endif
+
 int main(int argc, char* argv[]) {
 	if (argc < 2) {
 		fprintf(stderr, "usage: %s maxRowNum\n", argv[0]);
@@ -258,8 +1707,25 @@ int main(int argc, char* argv[]) {
 	}
 	size_t maxRowNum = (size_t)strtoull(argv[1], NULL, 10);
 //	doTest("MockDbTable", "db1", maxRowNum);
+	testSchemaFixedRuns();
+	testSchemaLexBatch();
+	testParallelSort();
+	testWalReplay();
+	testRowCache();
+#if !defined(_MSC_VER)
+	testWalCrashRecovery("dfadb", maxRowNum);
+#endif
+	testBulkLoad("dfadb", maxRowNum);
+	testMemSegment("dfadb", maxRowNum);
+	testWtConcurrentAccess("dfadb", maxRowNum);
+	testParallelBuild("dfadb", maxRowNum);
+	testIndexIterMerge("dfadb", maxRowNum);
+	testStoreScanParallel("dfadb", maxRowNum);
+	testTableStats("dfadb", maxRowNum);
+	testMergePolicy();
+	testBgMemBudget();
+	testMergePurgeColgroup("dfadb", maxRowNum);
 	doTest("dfadb", maxRowNum);
-	CompositeTable::safeStopAndWaitForCompress();
     return 0;
 }
 
@@ -7,17 +7,22 @@
 
 void usage(const char* prog) {
 	fprintf(stderr, "usage: %s options db-dir input-data-files...\n", prog);
+	fprintf(stderr, "  -B bulk load, build readonly segments directly\n");
 }
 
 int main(int argc, char* argv[]) {
 	int inputFormat = 't';
 	int compressionThreadsNum = 1;
 	size_t rowsLimit = 10000000;
+	bool bulkLoad = false;
 	for (;;) {
-		int opt = getopt(argc, argv, "tjL:T:");
+		int opt = getopt(argc, argv, "BtjL:T:");
 		switch (opt) {
 		case -1:
 			goto GetoptDone;
+		case 'B':
+			bulkLoad = true;
+			break;
 		case 'j':
 		case 't':
 			inputFormat = opt;
@@ -39,6 +44,10 @@ GetoptDone:
 	terark::db::CompositeTablePtr tab = terark::db::CompositeTable::open(dbdir);
 	terark::db::DbContextPtr ctx = tab->createDbContext();
 	ctx->syncIndex = false;
+	std::unique_ptr<terark::db::TableBulkLoader> loader;
+	if (bulkLoad) {
+		loader.reset(new terark::db::TableBulkLoader(tab.get()));
+	}
 	terark::LineBuf line;
 	terark::valvec<unsigned char> row;
 	size_t existedRows = tab->numDataRows();
@@ -66,13 +75,19 @@ GetoptDone:
 			line.chomp();
 			size_t parsed = tab->rowSchema().parseDelimText('\t', line, &row);
 			if (parsed == colnum) {
-				ctx->insertRow(row);
+				if (loader)
+					loader->insertRow(row);
+				else
+					ctx->insertRow(row);
 				rows++;
 				if (lines % TERARK_IF_DEBUG(10000, 1000000) == 0) {
 					printf("lines=%zd rows=%zd bytes=%zd currRow: %s\n",
 						lines, rows, bytes,
 						tab->rowSchema().toJsonStr(row).c_str());
-					if (tab->getWritableSegNum() > 3) {
+					if (loader) {
+						// readonly segments are built in insertRow and finish
+					}
+					else if (tab->getWritableSegNum() > 3) {
 						printf("Waiting 10 seconds for compact thread catching up...\n");
 						std::this_thread::sleep_for(std::chrono::seconds(10));
 					}
@@ -84,6 +99,12 @@ GetoptDone:
 			lines++;
 		}
 	}
+	if (loader) {
+		loader->finish();
+		printf("bulk loaded %zd rows into %zd segments, %zd duplicate rows replaced\n",
+			size_t(loader->numRows()), loader->numSegments(),
+			size_t(loader->numDupRows()));
+	}
 	printf("waiting for compact thread complete...\n");
 	terark::db::CompositeTable::safeStopAndWaitForCompress();
 	printf("done!\n");